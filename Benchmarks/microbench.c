@@ -0,0 +1,408 @@
+#include "../NamingServer/nm.h"
+#include "../StorageServers/server.h"
+
+#include <fcntl.h>
+#include <sys/resource.h>
+
+/***************************************************/
+/*   Microbenchmarks of the NM and SS internals    */
+/***************************************************/
+
+static atomic_llong heap_allocs;                                   // malloc, calloc and realloc calls so far
+static atomic_llong heap_bytes;                                    // Bytes they asked for
+static volatile long long sink = 0;                                // Keeps the lookups from being optimized out
+static unsigned long long micro_rng = 0x9e3779b97f4a7c15ULL;       // State of the shuffles
+
+// The allocator of glibc under its own names, so every allocation of the
+// process, those made inside libc included, goes through the counters below
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+void* malloc(size_t size) {
+    atomic_fetch_add_explicit(&heap_allocs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&heap_bytes, size, memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+    atomic_fetch_add_explicit(&heap_allocs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&heap_bytes, count * size, memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    atomic_fetch_add_explicit(&heap_allocs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&heap_bytes, size, memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+
+/**
+ * @brief Highest resident set size of the process in KB since the last
+ * reset_peak_rss, or since it started where the kernel cannot reset it.
+ */
+static long peak_rss_kb() {
+    FILE* fp = fopen("/proc/self/status", "r");
+    if (fp != NULL) {
+        char line[256];
+        long kb = -1;
+        while (fgets(line, sizeof(line), fp) != NULL && sscanf(line, "VmHWM: %ld kB", &kb) != 1);
+        fclose(fp);
+        if (kb >= 0) {
+            return kb;
+        }
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static void reset_peak_rss() {
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd >= 0) {
+        if (write(fd, "5", 1) != 1) {
+            // Older kernels keep the peak since the start
+        }
+        close(fd);
+    }
+}
+
+static void micro_begin(MicroResult* result, const char* name) {
+    snprintf(result->name, MICRO_NAME_LEN, "%s", name);
+    reset_peak_rss();
+    result->allocs = atomic_load(&heap_allocs);
+    result->bytes = atomic_load(&heap_bytes);
+    result->ns = statsClock();
+}
+
+static void micro_end(MicroResult* result, long long ops) {
+    result->ns = statsClock() - result->ns;
+    result->ops = ops;
+    result->allocs = atomic_load(&heap_allocs) - result->allocs;
+    result->bytes = atomic_load(&heap_bytes) - result->bytes;
+    result->peak_rss_kb = peak_rss_kb();
+}
+
+static unsigned long long micro_random() {
+    micro_rng ^= micro_rng >> 12;
+    micro_rng ^= micro_rng << 25;
+    micro_rng ^= micro_rng >> 27;
+    return micro_rng * 0x2545f4914f6cdd1dULL;
+}
+
+/**
+ * @brief A random order of 0 .. count - 1.
+ */
+static int* shuffled(int count) {
+    int* order = (int*) malloc(count * sizeof(int));
+    for (int i = 0; i < count; i++) {
+        order[i] = i;
+    }
+    for (int i = count - 1; i > 0; i--) {
+        int j = (int) (micro_random() % (i + 1));
+        int swap = order[i];
+        order[i] = order[j];
+        order[j] = swap;
+    }
+    return order;
+}
+
+/**
+ * @brief Path number index of a synthetic namespace: depth levels of
+ * fanout directories, each directory of the last level holding fanout
+ * files, like "/d0_3/d1_15/d2_7/file_12.txt".
+ *
+ * @param file : Name of the file, "file" for the paths that exist.
+ */
+static void synthetic_path(char* path, size_t size, long index, int depth, int fanout, const char* file) {
+    int digits[MAX_PATH_LEN];
+    for (int level = depth; level >= 0; level--) {
+        digits[level] = index % fanout;
+        index /= fanout;
+    }
+
+    size_t len = 0;
+    for (int level = 0; level < depth && len < size; level++) {
+        len += snprintf(path + len, size - len, "/d%d_%d", level, digits[level]);
+    }
+    if (len < size) {
+        snprintf(path + len, size - len, "/%s_%d.txt", file, digits[depth]);
+    }
+}
+
+/**
+ * @brief Paths in a tree of the given shape, fanout^(depth + 1).
+ */
+static long tree_paths(int depth, int fanout) {
+    long count = 1;
+    for (int level = 0; level <= depth && count <= MICRO_MAX_PATHS; level++) {
+        count *= fanout;
+    }
+    return count;
+}
+
+/**
+ * @brief Creates the directory tree a storage server scans, in the
+ * current directory.
+ */
+static bool make_tree(int level, int depth, int fanout) {
+    char name[64];
+    for (int i = 0; i < fanout; i++) {
+        if (level == depth) {
+            snprintf(name, sizeof(name), "file_%d.txt", i);
+            int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) {
+                return false;
+            }
+            close(fd);
+            continue;
+        }
+
+        snprintf(name, sizeof(name), "d%d_%d", level, i);
+        if (mkdir(name, 0755) < 0 || chdir(name) < 0) {
+            return false;
+        }
+        bool made = make_tree(level + 1, depth, fanout);
+        if (chdir("..") < 0 || !made) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void remove_tree(const char* path) {
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        char child[MAX_PATH_LEN];
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+        if (entry->d_type == DT_DIR) {
+            remove_tree(child);
+        } else {
+            unlink(child);
+        }
+    }
+    closedir(dir);
+    rmdir(path);
+}
+
+/**
+ * @brief Benchmarks the namespace index: inserting every path of the
+ * synthetic namespace in random order, looking up paths that exist and
+ * paths that do not, through the trie and through the location cache,
+ * and deleting every path again.
+ *
+ * @return Results written to results.
+ */
+static int bench_namespace(MicroResult* results, int depth, int fanout, long lookups) {
+    long count = tree_paths(depth, fanout);
+
+    // Paths that exist, and paths in the same directories that do not
+    char (*paths)[MAX_ARG_LEN] = malloc(count * MAX_ARG_LEN);
+    char (*missing)[MAX_ARG_LEN] = malloc(count * MAX_ARG_LEN);
+    if (paths == NULL || missing == NULL) {
+        perror("Error allocating the paths");
+        exit(EXIT_FAILURE);
+    }
+    for (long i = 0; i < count; i++) {
+        synthetic_path(paths[i], MAX_ARG_LEN, i, depth, fanout, "file");
+        synthetic_path(missing[i], MAX_ARG_LEN, i, depth, fanout, "missing");
+    }
+    int* order = shuffled(count);
+
+    trienode* root = NULL;
+    LocationCache cache;
+    if (!initLocationCache(&cache, 2 * count)) {
+        perror("Error allocating the location cache");
+        exit(EXIT_FAILURE);
+    }
+    unsigned int replicas;
+    int n = 0;
+
+    micro_begin(&results[n], "trie_insert");
+    for (long i = 0; i < count; i++) {
+        trieinsert(&root, paths[order[i]], order[i] % MAX_SERVERS);
+    }
+    micro_end(&results[n++], count);
+
+    micro_begin(&results[n], "search_trie_hit");
+    for (long i = 0; i < lookups; i++) {
+        sink += search_trie(root, paths[order[i % count]], &replicas);
+    }
+    micro_end(&results[n++], lookups);
+
+    micro_begin(&results[n], "search_trie_miss");
+    for (long i = 0; i < lookups; i++) {
+        sink += search_trie(root, missing[order[i % count]], &replicas);
+    }
+    micro_end(&results[n++], lookups);
+
+    // Every path is cached before the hits are timed
+    for (long i = 0; i < count; i++) {
+        findStorageServer(paths[i], root, &cache, &replicas);
+    }
+    micro_begin(&results[n], "find_server_hit");
+    for (long i = 0; i < lookups; i++) {
+        sink += findStorageServer(paths[order[i % count]], root, &cache, &replicas);
+    }
+    micro_end(&results[n++], lookups);
+
+    micro_begin(&results[n], "find_server_miss");
+    for (long i = 0; i < lookups; i++) {
+        sink += findStorageServer(missing[order[i % count]], root, &cache, &replicas);
+    }
+    micro_end(&results[n++], lookups);
+
+    micro_begin(&results[n], "trie_delete");
+    for (long i = 0; i < count; i++) {
+        delete_from_trie(&root, paths[order[count - 1 - i]]);
+    }
+    micro_end(&results[n++], count);
+
+    free(paths);
+    free(missing);
+    free(order);
+    return n;
+}
+
+/**
+ * @brief Benchmarks the scan a storage server registers with, over a
+ * directory tree of the given shape in a temporary directory.
+ *
+ * @return Results written to results.
+ */
+static int bench_scan(MicroResult* results, int depth, int fanout, int scans) {
+    char tree[] = "/tmp/microbench.XXXXXX";
+    char cwd[MAX_PATH_LEN];
+    ServerDetails* details = (ServerDetails*) malloc(sizeof(ServerDetails));
+    if (details == NULL || getcwd(cwd, sizeof(cwd)) == NULL || mkdtemp(tree) == NULL || chdir(tree) < 0) {
+        perror("Error creating the directory tree");
+        exit(EXIT_FAILURE);
+    }
+    if (!make_tree(0, depth, fanout)) {
+        perror("Error creating the directory tree");
+        if (chdir(cwd) == 0) {
+            remove_tree(tree);
+        }
+        exit(EXIT_FAILURE);
+    }
+
+    micro_begin(&results[0], "scan_directory_tree");
+    for (int i = 0; i < scans; i++) {
+        details->num_paths = 0;
+        listFilesAndEmptyFolders(".", details);
+    }
+    micro_end(&results[0], scans);
+
+    if (chdir(cwd) < 0) {
+        perror("Error leaving the directory tree");
+    }
+    remove_tree(tree);
+    free(details);
+    return 1;
+}
+
+/**
+ * @brief Finds a benchmark in a baseline written by an earlier run.
+ *
+ * @return Its ns/op, -1 if the baseline does not have it.
+ */
+static double baseline_ns(const char* file, const char* name) {
+    FILE* fp = (file != NULL) ? fopen(file, "r") : NULL;
+    if (fp == NULL) {
+        return -1;
+    }
+
+    char line[256];
+    char found[MICRO_NAME_LEN];
+    long long ops;
+    double ns = -1;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (line[0] != '#' && sscanf(line, "%31s %lld %lf", found, &ops, &ns) == 3 && strcmp(found, name) == 0) {
+            break;
+        }
+        ns = -1;
+    }
+    fclose(fp);
+    return ns;
+}
+
+/**
+ * @brief Prints the results as whitespace separated columns under a
+ * header, the format a baseline is read back in.
+ */
+static void print_results(MicroResult* results, int count, const char* baseline) {
+    printf("%-20s %10s %12s %14s %14s %12s", "benchmark", "ops", "ns_per_op", "allocs_per_op", "bytes_per_op", "peak_rss_kb");
+    printf((baseline != NULL) ? " %12s %8s\n" : "\n", "baseline_ns", "change");
+
+    for (int i = 0; i < count; i++) {
+        MicroResult* result = &results[i];
+        double ns = (double) result->ns / result->ops;
+        printf("%-20s %10lld %12.1f %14.3f %14.1f %12ld", result->name, result->ops, ns,
+               (double) result->allocs / result->ops, (double) result->bytes / result->ops, result->peak_rss_kb);
+
+        if (baseline != NULL) {
+            double before = baseline_ns(baseline, result->name);
+            if (before > 0) {
+                printf(" %12.1f %+7.1f%%", before, 100.0 * (ns - before) / before);
+            } else {
+                printf(" %12s %8s", "-", "-");
+            }
+        }
+        printf("\n");
+    }
+}
+
+static void usage(const char* program) {
+    fprintf(stderr, "Usage: %s [-d depth] [-f fanout] [-l lookups] [-D scan_depth] [-F scan_fanout] [-s scans] [-b baseline]\n", program);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int depth = MICRO_DEPTH, fanout = MICRO_FANOUT;
+    int scan_depth = MICRO_SCAN_DEPTH, scan_fanout = MICRO_SCAN_FANOUT;
+    long lookups = MICRO_LOOKUPS;
+    int scans = MICRO_SCANS;
+    const char* baseline = NULL;
+
+    int option;
+    while ((option = getopt(argc, argv, "d:f:l:D:F:s:b:")) != -1) {
+        switch (option) {
+            case 'd': depth = atoi(optarg); break;
+            case 'f': fanout = atoi(optarg); break;
+            case 'l': lookups = atol(optarg); break;
+            case 'D': scan_depth = atoi(optarg); break;
+            case 'F': scan_fanout = atoi(optarg); break;
+            case 's': scans = atoi(optarg); break;
+            case 'b': baseline = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind != argc || depth < 0 || depth > 8 || fanout <= 0 || lookups <= 0 ||
+        scan_depth < 0 || scan_depth > 8 || scan_fanout <= 0 || scans <= 0) {
+        usage(argv[0]);
+    }
+
+    // A storage server holds at most MAX_PATHS paths
+    long paths = tree_paths(depth, fanout), scan_paths = tree_paths(scan_depth, scan_fanout);
+    if (paths > MICRO_MAX_PATHS || scan_paths > MAX_PATHS) {
+        fprintf(stderr, "At most %d namespace paths and %d scanned paths\n", MICRO_MAX_PATHS, MAX_PATHS);
+        exit(EXIT_FAILURE);
+    }
+
+    MicroResult results[8];
+    int count = bench_namespace(results, depth, fanout, lookups);
+    count += bench_scan(results + count, scan_depth, scan_fanout, scans);
+
+    printf("# microbench: %ld paths (depth %d, fanout %d), %ld lookups, %ld scanned paths (depth %d, fanout %d)\n",
+           paths, depth, fanout, lookups, scan_paths, scan_depth, scan_fanout);
+    print_results(results, count, baseline);
+    return 0;
+}
@@ -0,0 +1,236 @@
+#include "../NamingServer/nm.h"
+
+#include <malloc.h>
+
+/***************************************************/
+/*  The radix tree against the old per-char trie   */
+/***************************************************/
+
+/**
+ * @brief Node of the trie the NM used before the radix tree, one child
+ * pointer per byte value.
+ */
+typedef struct OldTrieNode {
+    struct OldTrieNode* children[TRIECMP_OLD_CHARS];
+    int storage_server;
+    bool isFile;
+    bool isEndOfWord;
+} OldTrieNode;
+
+static volatile long long sink = 0;                                // Keeps the lookups from being optimized out
+
+// The old trie as it was in NamingServer/nm_helper.c before the radix
+// tree, less a printf of a newline on every lookup.
+
+static OldTrieNode* old_createnode() {
+    OldTrieNode* node = (OldTrieNode*) malloc(sizeof(OldTrieNode));
+    if (node == NULL) {
+        perror("Error allocating old trie node");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < TRIECMP_OLD_CHARS; i++) {
+        node->children[i] = NULL;
+    }
+    node->storage_server = -1;
+    node->isFile = false;
+    node->isEndOfWord = false;
+    return node;
+}
+
+static void old_trieinsert(OldTrieNode** root, char* signedtext, int serverID) {
+    if (*root == NULL) {
+        *root = old_createnode();
+    }
+
+    unsigned char* text = (unsigned char*) signedtext;
+    OldTrieNode* curr = *root;
+    int length = strlen(signedtext);
+
+    for (int i = 0; i < length; i++) {
+        if (curr->children[text[i]] == NULL) {
+            curr->children[text[i]] = old_createnode();
+        }
+
+        curr = curr->children[text[i]];
+        if (text[i] == '/') {
+            curr->isFile = false;
+            curr->storage_server = serverID;
+            curr->isEndOfWord = true;
+        }
+    }
+
+    if (text[length - 1] != '/') {
+        curr->isFile = true;
+        curr->isEndOfWord = true;
+        curr->storage_server = serverID;
+    }
+}
+
+static int old_search_trie(OldTrieNode* root, char* signedtext) {
+    if (root == NULL) {
+        return -1;
+    }
+
+    unsigned char* text = (unsigned char*) signedtext;
+    OldTrieNode* curr = root;
+    int length = strlen(signedtext);
+    for (int i = 0; i < length; i++) {
+        if (curr->children[text[i]] == NULL) {
+            return -1;
+        }
+        curr = curr->children[text[i]];
+
+        if (curr->isEndOfWord && curr->storage_server == -1) {
+            return -1;
+        }
+    }
+
+    return (curr->isEndOfWord) ? curr->storage_server : -1;
+}
+
+/**
+ * @brief Bytes the heap has handed out and not got back, mapped chunks
+ * included.
+ */
+static long long heap_in_use() {
+    struct mallinfo2 info = mallinfo2();
+    return (long long) (info.uordblks + info.hblkhd);
+}
+
+/**
+ * @brief Writes path number index of the synthetic namespace: files in
+ * /projNN/dirNNN/subN/, and one in every TRIECMP_EMPTY_EVERY an empty
+ * directory /projNN/dirNNN/emptyN/.
+ */
+static void synthetic_path(char* path, size_t size, long index) {
+    if (index % TRIECMP_EMPTY_EVERY == 0) {
+        snprintf(path, size, "/proj%02ld/dir%03ld/empty%ld/", index % 37, (index / 37) % 211, index);
+    } else {
+        snprintf(path, size, "/proj%02ld/dir%03ld/sub%ld/file_%07ld.txt", index % 37, (index / 37) % 211, index % 7, index);
+    }
+}
+
+/**
+ * @brief Indices of the paths to look up, at random among those stored.
+ * Both tries are timed on the same sequence.
+ */
+static long* random_lookups(long count, long lookups) {
+    long* order = (long*) malloc(lookups * sizeof(long));
+    if (order == NULL) {
+        perror("Error allocating the lookups");
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned long long state = 0x9e3779b97f4a7c15ULL;
+    for (long i = 0; i < lookups; i++) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        order[i] = (long) ((state >> 33) % count);
+    }
+    return order;
+}
+
+/**
+ * @brief Builds both tries over count paths, or only the radix tree past
+ * TRIECMP_OLD_MAX_PATHS, and prints one row of the comparison: memory in
+ * bytes and bytes per path, then ns per lookup. The radix tree takes its
+ * nodes from arenas that outlive it, so a process measures one count.
+ *
+ * @return Number of lookups on which the two disagreed.
+ */
+static long compare(long count, long lookups) {
+    char (*paths)[MAX_ARG_LEN] = malloc(count * MAX_ARG_LEN);
+    if (paths == NULL) {
+        perror("Error allocating the paths");
+        exit(EXIT_FAILURE);
+    }
+    for (long i = 0; i < count; i++) {
+        synthetic_path(paths[i], MAX_ARG_LEN, i);
+    }
+    long* order = random_lookups(count, lookups);
+    bool with_old = (count <= TRIECMP_OLD_MAX_PATHS);
+    unsigned int replicas;
+
+    long long before = heap_in_use();
+    OldTrieNode* old_root = NULL;
+    if (with_old) {
+        for (long i = 0; i < count; i++) {
+            old_trieinsert(&old_root, paths[i], i % MAX_SERVERS);
+        }
+    }
+    long long old_bytes = heap_in_use() - before;
+
+    before = heap_in_use();
+    trienode* root = NULL;
+    for (long i = 0; i < count; i++) {
+        trieinsert(&root, paths[i], i % MAX_SERVERS);
+    }
+    long long radix_bytes = heap_in_use() - before;
+
+    double old_ns = -1;
+    if (with_old) {
+        long long started = statsClock();
+        for (long i = 0; i < lookups; i++) {
+            sink += old_search_trie(old_root, paths[order[i]]);
+        }
+        old_ns = (double) (statsClock() - started) / lookups;
+    }
+
+    long long started = statsClock();
+    for (long i = 0; i < lookups; i++) {
+        sink += search_trie(root, paths[order[i]], &replicas);
+    }
+    double radix_ns = (double) (statsClock() - started) / lookups;
+
+    // Both must find every path on the server it was stored with
+    long mismatches = 0;
+    for (long i = 0; with_old && i < count; i++) {
+        if (old_search_trie(old_root, paths[i]) != search_trie(root, paths[i], &replicas)) {
+            mismatches++;
+        }
+    }
+
+    if (with_old) {
+        printf("%10ld %14lld %8.0f %14lld %8.0f %10.1f %10.1f\n", count, old_bytes, (double) old_bytes / count,
+               radix_bytes, (double) radix_bytes / count, old_ns, radix_ns);
+    } else {
+        printf("%10ld %14s %8s %14lld %8.0f %10s %10.1f\n", count, "-", "-",
+               radix_bytes, (double) radix_bytes / count, "-", radix_ns);
+    }
+
+    // Both tries are left to the end of the process
+    free(paths);
+    free(order);
+    return mismatches;
+}
+
+static void usage(const char* program) {
+    fprintf(stderr, "Usage: %s [-l lookups] paths\n", program);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    long lookups = MICRO_LOOKUPS;
+
+    int option;
+    while ((option = getopt(argc, argv, "l:")) != -1) {
+        switch (option) {
+            case 'l': lookups = atol(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    long count = (optind == argc - 1) ? atol(argv[optind]) : 0;
+    if (count <= 0 || count > MICRO_MAX_PATHS || lookups <= 0) {
+        usage(argv[0]);
+    }
+
+    printf("# triecompare: %ld random lookups of stored paths, old trie up to %d paths\n", lookups, TRIECMP_OLD_MAX_PATHS);
+    printf("%10s %14s %8s %14s %8s %10s %10s\n", "paths", "old_bytes", "old_B/p", "radix_bytes", "radix_B/p", "old_ns", "radix_ns");
+    long mismatches = compare(count, lookups);
+
+    if (mismatches > 0) {
+        fprintf(stderr, "The tries disagreed on %ld paths\n", mismatches);
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
@@ -37,6 +37,21 @@ void trimWhitespace(char *str) {
     str[end - start + 1] = '\0';
 } 
 
+/**
+ * @brief Parse a count of bytes, an offset or a length into a file.
+ *
+ * @param str The decimal count.
+ * @param count Set to the count.
+ *
+ * @return true if str is a whole non-negative number
+ */
+static bool parseByteCount(const char *str, long long *count) {
+    char *end;
+    errno = 0;
+    *count = strtoll(str, &end, 10);
+    return isdigit((unsigned char)str[0]) && *end == '\0' && errno == 0;
+}
+
 /**
  * @brief Check if the user request of the correct format
  * 
@@ -47,7 +62,7 @@ void trimWhitespace(char *str) {
  */
 bool isValidRequest(char *request, ClientRequest *clientRequest) {
     // Tokenize the string by space
-    char *token = strtok(request, " ");
+    char *token = strtok(request, " \n");
 
     // Set the RequestType to the first token
     if (strcmp(token, CREATEDIR) == 0) {
@@ -66,12 +81,17 @@ bool isValidRequest(char *request, ClientRequest *clientRequest) {
         clientRequest->requestType = GET_FILE_INFO; // GET_FILE_INFO
     } else if (strcmp(token, LISTALL) == 0) {
         clientRequest->requestType = LIST_ALL; // DELETE_DIR
+    } else if (strcmp(token, HOTPATHS) == 0) {
+        clientRequest->requestType = HOT_PATHS; // HOT_PATHS
+    } else if (strcmp(token, GETSTATS) == 0) {
+        clientRequest->requestType = GET_STATS; // GET_STATS
     } else {
         return false;
     }
 
     // Set the number of arguments
     clientRequest->num_args = 0;
+    char arg3[MAX_ARG_LEN] = "";
 
     // Set the arguments
     while (token != NULL) {
@@ -83,6 +103,9 @@ bool isValidRequest(char *request, ClientRequest *clientRequest) {
             } else if (clientRequest->num_args == 1) {
                 strcpy(clientRequest->arg2, token);
                 trimWhitespace(clientRequest->arg2);
+            } else if (clientRequest->num_args == 2) {
+                snprintf(arg3, MAX_ARG_LEN, "%s", token);
+                trimWhitespace(arg3);
             } else {
                 return false;
             }
@@ -90,13 +113,55 @@ bool isValidRequest(char *request, ClientRequest *clientRequest) {
         }
     }
 
+    // LIST_ALL takes an optional prefix and page size
+    if (clientRequest->requestType == LIST_ALL) {
+        if (clientRequest->num_args == 2) {
+            clientRequest->limit = atoi(clientRequest->arg2);
+        }
+        return clientRequest->num_args <= 2;
+    }
+
+    // HOT_PATHS takes an optional number of paths
+    if (clientRequest->requestType == HOT_PATHS) {
+        if (clientRequest->num_args == 1) {
+            clientRequest->limit = atoi(clientRequest->arg1);
+        }
+        return clientRequest->num_args <= 1;
+    }
+
+    // READ_FILE takes an optional offset, and a length after it
+    clientRequest->offset = 0;
+    clientRequest->length = 0;
+    if (clientRequest->requestType == READ_FILE) {
+        bool valid = (clientRequest->num_args >= 1 && clientRequest->num_args <= 3);
+        if (clientRequest->num_args >= 2) {
+            valid = valid && parseByteCount(clientRequest->arg2, &clientRequest->offset);
+        }
+        if (clientRequest->num_args == 3) {
+            valid = valid && parseByteCount(arg3, &clientRequest->length) && clientRequest->length > 0;
+        }
+        return valid;
+    }
+
+    // STATS asks the NM, or with a path the storage server holding it
+    if (clientRequest->requestType == GET_STATS) {
+        return clientRequest->num_args <= 1;
+    }
+
     // Return true if the number of arguments is valid
     return (clientRequest->num_args == 2 || clientRequest->num_args == 1);
 
 }
 
 
-int main() {
+int main(int argc, char *argv[]) {
+    if (argc > 2) {
+        fprintf(stderr, "Usage: %s [hedge_percentile]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    initHedging((argc > 1) ? atoi(argv[1]) : DEFAULT_HEDGE_PERCENTILE);
+    initTracing("client");
+
     // Create a socket
     int sock_fd = socket(SOCKET_FAMILY, SOCKET_TYPE, SOCKET_PROTOCOL);
     if (sock_fd < 0) {
@@ -108,8 +173,8 @@ int main() {
     struct sockaddr_in server_addr;
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = SOCKET_FAMILY;
-    server_addr.sin_port = htons(NM_CLT_PORT);
-    server_addr.sin_addr.s_addr = inet_addr(NM_IP);
+    server_addr.sin_port = htons(nmClientPort());
+    server_addr.sin_addr.s_addr = inet_addr(nmIP());
 
     // Connect to the server
     if (connect(sock_fd, (struct sockaddr*) &server_addr, sizeof(server_addr)) < 0) {
@@ -149,6 +214,10 @@ int main() {
         // Add the client details
         clientRequest.clientDetails.clientID = -1;
 
+        // Every process the request goes through traces it under this ID
+        clientRequest.traceID = newTraceID();
+        long long started_us = traceClock();
+
         // Validate the request syntax
         if (!isValidRequest(request, &clientRequest)) {
             perror("Invalid request syntax\n");
@@ -157,85 +226,184 @@ int main() {
         }
         printf("\nThe request is valid\n");
 
-        /* Handle Server bt */
-        // Send the request to the server
-        if (send(sock_fd, &clientRequest, sizeof(clientRequest), 0) < 0) {
-            perror("Error sending request to server\n");
+        // Apply what the NM invalidated since the last request
+        if (!drainLeaseInvalidations(sock_fd)) {
+            printf("Lost the connection to the naming server\n");
             close(sock_fd);
             exit(EXIT_FAILURE);
         }
 
-        printf("Sent the client request to NM\n");
+        // READ, WRITE and GET_INFO go straight to the storage
+        // server while the NM lease on the path holds
+        bool locationRequest = (
+            clientRequest.requestType == READ_FILE ||
+            clientRequest.requestType == WRITE_FILE ||
+            clientRequest.requestType == GET_FILE_INFO
+        );
 
-        // Receive the AckPacket from server
-        AckPacket ack;
-        if (recv(sock_fd, &ack, sizeof(ack), 0) < 0) {
-            perror("Error receiving ack from server\n");
-            close(sock_fd);
-            exit(EXIT_FAILURE);
-        }
+        bool retry;
+        do {
+            retry = false;
 
-        printf("Received ack from server : %d : %d\n", ack.ack, ack.errorCode);
+            ServerEndpoint server;
+            bool leased = locationRequest && leaseLookup(clientRequest.arg1, &server);
+            AckPacket ack;
 
-        // Check if you got a FAILURE_ACK
-        // Inform the error on stdout
-        if (ack.ack == FAILURE_ACK) {
-            /* Make use of the error codes written */
-            printf("There was an error\n");
-            close(sock_fd);
-            exit(EXIT_FAILURE);
-        }
+            if (leased) {
+                printf("Using the leased location of %s\n", clientRequest.arg1);
+            } else {
+                /* Handle Server bt */
+                // Send the request to the server
+                long long asked_ms = leaseClock();
+                long long asked_us = traceClock();
+                if (send(sock_fd, &clientRequest, sizeof(clientRequest), 0) < 0) {
+                    perror("Error sending request to server\n");
+                    close(sock_fd);
+                    exit(EXIT_FAILURE);
+                }
 
-        // Now, since the ack is not FAILURE
-        // Check if we need to connect to the server next
-        // will the NM serve our request on it'sown
-        if (ack.ack == INIT_ACK) { // NM will server our request
-            printf("Waiting for NM to reply with status\n");
-            // Receive the Job Status from NM
-            if (recv(sock_fd, &ack, sizeof(ack), 0) < 0) {
-                printf("Error receiving ack from server\n");
-                close(sock_fd);
-                exit(EXIT_FAILURE);
-            }
+                printf("Sent the client request to NM\n");
 
-            if (clientRequest.requestType == LIST_ALL) {
-                // Expect to receive strings back to back
-                FilePacket packet;
-                packet.lastChunk = false;
+                // Receive the AckPacket from server
+                if (!recvNMAck(sock_fd, &ack)) {
+                    perror("Error receiving ack from server\n");
+                    close(sock_fd);
+                    exit(EXIT_FAILURE);
+                }
 
-                // Keep receiving until over
-                do {
-                    // Receive the packet
-                    if (recv(sock_fd, &packet, sizeof(packet), 0) < 0) {
-                        printf("Error receiving packet from server\n");
-                        close(sock_fd);
-                        exit(EXIT_FAILURE);
+                printf("Received ack from server : %d : %d\n", ack.ack, ack.errorCode);
+
+                // Check if you got a FAILURE_ACK
+                // Inform the error on stdout
+                if (ack.ack == FAILURE_ACK) {
+                    /* Make use of the error codes written */
+                    printf("There was an error\n");
+                    close(sock_fd);
+                    exit(EXIT_FAILURE);
+                }
+
+                // Now, since the ack is not FAILURE
+                // Check if we need to connect to the server next
+                // will the NM serve our request on it'sown
+                if (ack.ack == INIT_ACK) { // NM will server our request
+                    if (clientRequest.requestType == LIST_ALL) {
+                        // One page per request, the last path of a page
+                        // is the cursor for the next one
+                        while (true) {
+                            // Expect packets of newline separated paths
+                            FilePacket packet;
+                            packet.lastChunk = false;
+
+                            // Keep receiving until over
+                            do {
+                                // Receive the packet
+                                if (recv(sock_fd, &packet, sizeof(packet), MSG_WAITALL) <= 0) {
+                                    printf("Error receiving packet from server\n");
+                                    close(sock_fd);
+                                    exit(EXIT_FAILURE);
+                                }
+
+                                // Print the packet
+                                packet.chunk[MAX_CHUNK_SIZE] = '\0';
+                                printf("%s", packet.chunk);
+
+                                size_t len = strlen(packet.chunk);
+                                if (len > 0) {
+                                    packet.chunk[len - 1] = '\0';
+                                    char* last = strrchr(packet.chunk, '\n');
+                                    strcpy(clientRequest.cursor, (last == NULL) ? packet.chunk : last + 1);
+                                }
+                            } while (!packet.lastChunk);
+
+                            // Receive the Job Status from NM
+                            if (recv(sock_fd, &ack, sizeof(ack), MSG_WAITALL) <= 0) {
+                                printf("Error receiving ack from server\n");
+                                close(sock_fd);
+                                exit(EXIT_FAILURE);
+                            }
+
+                            if (ack.ack != SUCCESS_ACK || !ack.extraInfo[0]) {
+                                break;
+                            }
+
+                            printf("More paths left, press Enter for the next page or q to stop: ");
+                            char answer[16];
+                            if (fgets(answer, sizeof(answer), stdin) == NULL || answer[0] == 'q') {
+                                break;
+                            }
+
+                            // Ask for the page after the cursor
+                            if (send(sock_fd, &clientRequest, sizeof(clientRequest), 0) < 0) {
+                                perror("Error sending request to server\n");
+                                close(sock_fd);
+                                exit(EXIT_FAILURE);
+                            }
+                            if (!recvNMAck(sock_fd, &ack) || ack.ack != INIT_ACK) {
+                                printf("Error receiving ack from server\n");
+                                close(sock_fd);
+                                exit(EXIT_FAILURE);
+                            }
+                        }
+                    } else if (clientRequest.requestType == HOT_PATHS || clientRequest.requestType == GET_STATS) {
+                        // Lines of "accesses path", hottest first, or
+                        // a line of stats per request type
+                        FilePacket packet;
+                        do {
+                            if (recv(sock_fd, &packet, sizeof(packet), MSG_WAITALL) <= 0) {
+                                printf("Error receiving packet from server\n");
+                                close(sock_fd);
+                                exit(EXIT_FAILURE);
+                            }
+                            packet.chunk[MAX_CHUNK_SIZE] = '\0';
+                            printf("%s", packet.chunk);
+                        } while (!packet.lastChunk);
+
+                        if (recv(sock_fd, &ack, sizeof(ack), MSG_WAITALL) <= 0) {
+                            printf("Error receiving ack from server\n");
+                            close(sock_fd);
+                            exit(EXIT_FAILURE);
+                        }
+                    } else {
+                        printf("Waiting for NM to reply with status\n");
+                        // Receive the Job Status from NM
+                        if (recv(sock_fd, &ack, sizeof(ack), MSG_WAITALL) <= 0) {
+                            printf("Error receiving ack from server\n");
+                            close(sock_fd);
+                            exit(EXIT_FAILURE);
+                        }
                     }
 
-                    // Print the packet
-                    printf("%s\n", packet.chunk);
-                } while (!packet.lastChunk);
-            }
+                    traceSpan(clientRequest.traceID, "naming server", asked_us, traceClock(), TRACE_FLOW_NONE);
 
-            // Print the Job Status on stdout to inform the user
-            if (ack.ack == SUCCESS_ACK) {
-                printf("SS completed your job\n");
-            } else {
-                printf("Job failed to complete\n");
-            }
-        } else if (ack.ack == CNNCT_TO_SRV_ACK) { // We must connect to the server
-            printf("CNNCT_TO_SRV_ACK received\n");
-            // Receive the server details from NM
-            ServerDetails server;
-            if (recv(sock_fd, &server, sizeof(server), 0) < 0) {
-                printf("Error receiving server details from naming server\n");
-                close(sock_fd);
-                exit(EXIT_FAILURE);
+                    // Print the Job Status on stdout to inform the user
+                    if (ack.ack == SUCCESS_ACK) {
+                        printf("SS completed your job\n");
+                    } else {
+                        printf("Job failed to complete\n");
+                    }
+                    continue;
+                } else if (ack.ack != CNNCT_TO_SRV_ACK) {
+                    continue;
+                }
+
+                // We must connect to the server
+                printf("CNNCT_TO_SRV_ACK received\n");
+                // Receive the server details from NM
+                if (!recvServerEndpoint(sock_fd, &server)) {
+                    printf("Error receiving server details from naming server\n");
+                    close(sock_fd);
+                    exit(EXIT_FAILURE);
+                }
+
+                // Keep the location for as long as the NM leased it
+                leaseStore(clientRequest.arg1, &server, asked_ms);
+                traceSpan(clientRequest.traceID, "naming server", asked_us, traceClock(), TRACE_FLOW_NONE);
             }
+            long long connecting_us = traceClock();
 
             // Print the server details
             printf("\nServer ID: %d\n", server.serverID);
-            printf("Server port_nm: %d\n", server.port_nm);
+            printf("Server IP: %s\n", server.serverIP);
             printf("Server port_client: %d\n", server.port_client);
             printf("Server online: %d\n", server.online);
 
@@ -258,12 +426,30 @@ int main() {
             // connect() to the server on given IP and port
             // Connect to the server
             if (connect(clt_srv_fd, (struct sockaddr*) &storage_server_addr, sizeof(storage_server_addr)) < 0) {
+                close(clt_srv_fd);
+                leaseDropPath(clientRequest.arg1);
+
+                // The server may have gone away since the lease was
+                // granted, ask the NM where the path is now
+                if (leased) {
+                    printf("Leased storage server unreachable, asking the naming server\n");
+                    retry = true;
+                    continue;
+                }
+
                 printf("Error connecting to server\n");
                 close(sock_fd);
-                close(clt_srv_fd);
                 exit(EXIT_FAILURE);
             }
 
+            // A write goes to the head of the chain, which passes it on
+            // to the other replicas in turn
+            clientRequest.chain_len = 0;
+            if (clientRequest.requestType == WRITE_FILE && server.chain_len > 1) {
+                clientRequest.chain_len = server.chain_len - 1;
+                memcpy(clientRequest.chain, &server.chain[1], clientRequest.chain_len * sizeof(ChainHop));
+            }
+
             // send() the request
             if (send(clt_srv_fd, &clientRequest, sizeof(clientRequest), 0) < 0) {
                 printf("Error sending client request to storage server\n");
@@ -274,7 +460,9 @@ int main() {
 
             // Check the request type
             if (clientRequest.requestType == READ_FILE) {
-                if (!get_file_data_from_ss(&clt_srv_fd)) {
+                // Another replica is asked too if this one is slow
+                clt_srv_fd = hedgedRead(clt_srv_fd, &clientRequest, &server);
+                if (clt_srv_fd < 0 || !get_file_data_from_ss(&clt_srv_fd)) {
                     printf("Error reading file from storage server\n");
                     close(sock_fd);
                     close(clt_srv_fd);
@@ -288,6 +476,19 @@ int main() {
                     close(clt_srv_fd);
                     exit(EXIT_FAILURE);
                 }
+            } else if (clientRequest.requestType == GET_STATS) {
+                // A line of stats per request type the server has served
+                FilePacket packet;
+                do {
+                    if (recv(clt_srv_fd, &packet, sizeof(packet), MSG_WAITALL) <= 0) {
+                        printf("Error receiving stats from storage server\n");
+                        close(sock_fd);
+                        close(clt_srv_fd);
+                        exit(EXIT_FAILURE);
+                    }
+                    packet.chunk[MAX_CHUNK_SIZE] = '\0';
+                    printf("%s", packet.chunk);
+                } while (!packet.lastChunk);
             } else if (clientRequest.requestType == GET_FILE_INFO) {
                 printf("Get file info ig\n");
                 if (!receiveFileInformation(&clt_srv_fd)) {
@@ -310,16 +511,16 @@ int main() {
             if (ack.ack == SUCCESS_ACK) {
                 printf("Success!\n");
             } else {
+                // The next attempt should not trust the lease
+                leaseDropPath(clientRequest.arg1);
                 printf("Error!\n");
             }
 
             close(clt_srv_fd);
+            traceSpan(clientRequest.traceID, "storage server", connecting_us, traceClock(), TRACE_FLOW_NONE);
+        } while (retry);
 
-            printf("Only 1 interactive process allowed with a Storage Server\n");
-
-            // exit(EXIT_SUCCESS);
-            break;
-        }
+        traceSpan(clientRequest.traceID, "request", started_us, traceClock(), TRACE_FLOW_ORIGIN);
     }
 
     // Close the socket
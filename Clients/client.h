@@ -6,6 +6,10 @@
 #include "../utils/logging.h"
 #include "../utils/constants.h"
 #include "../utils/structs.h"
+#include "../utils/wire.h"
+#include "../utils/trace.h"
+#include "../utils/endpoints.h"
+#include "../utils/hash.h"
 
 bool get_file_data_from_ss(int* clt_srv_fd);
 
@@ -13,4 +17,17 @@ bool send_file_data_to_ss(int* clt_srv_fd, const char* filePath);
 
 bool receiveFileInformation(int* serverSocket);
 
+// Storage server locations leased from the NM
+long long leaseClock();
+bool leaseLookup(const char* path, ServerEndpoint* endpoint);
+void leaseStore(const char* path, const ServerEndpoint* endpoint, long long asked_ms);
+void leaseDrop(int leaseID);
+void leaseDropPath(const char* path);
+bool drainLeaseInvalidations(int nmSocket);
+bool recvNMAck(int nmSocket, AckPacket* ack);
+
+// Reads hedged across the replicas of a file
+void initHedging(int percentile);
+int hedgedRead(int primarySocket, ClientRequest* clientRequest, const ServerEndpoint* server);
+
 #endif
\ No newline at end of file
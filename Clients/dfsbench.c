@@ -0,0 +1,627 @@
+#include "client.h"
+#include "../utils/stats.h"
+
+#include <math.h>
+
+/***************************************************/
+/*      Load generator: synthetic DFS clients      */
+/***************************************************/
+
+static BenchConfig config;                                         // What the run does
+static double* zipf_cdf = NULL;                                    // Popularity of the files, cumulative
+static char* write_data;                                           // What every frame written holds
+static pthread_barrier_t setup_done;                               // Clients wait here before and after the start
+static long long run_started_ns = 0;                               // statsClock when the measured run started
+static long long run_ends_ns = 0;                                  // statsClock when it ends
+
+/**
+ * @brief Next random number of a client, xorshift64*.
+ */
+static unsigned long long bench_random(BenchClient* client) {
+    client->rng ^= client->rng >> 12;
+    client->rng ^= client->rng << 25;
+    client->rng ^= client->rng >> 27;
+    return client->rng * 0x2545f4914f6cdd1dULL;
+}
+
+/**
+ * @brief Uniform random number in [0, 1).
+ */
+static double bench_uniform(BenchClient* client) {
+    return (bench_random(client) >> 11) * 0x1.0p-53;
+}
+
+/**
+ * @brief Precomputes the popularity of the files: the file of rank i is
+ * picked with a probability proportional to 1 / (i + 1)^theta.
+ *
+ * @return false if out of memory.
+ */
+static bool init_zipf() {
+    zipf_cdf = (double*) malloc(config.files * sizeof(double));
+    if (zipf_cdf == NULL) {
+        return false;
+    }
+
+    double sum = 0;
+    for (int i = 0; i < config.files; i++) {
+        sum += 1.0 / pow(i + 1, config.zipf_theta);
+        zipf_cdf[i] = sum;
+    }
+    for (int i = 0; i < config.files; i++) {
+        zipf_cdf[i] /= sum;
+    }
+    return true;
+}
+
+/**
+ * @brief Picks a file by popularity.
+ */
+static int bench_pick_file(BenchClient* client) {
+    double u = bench_uniform(client);
+    int low = 0, high = config.files - 1;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (zipf_cdf[mid] < u) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/**
+ * @brief Picks the size of a write from the size distribution.
+ */
+static long bench_pick_size(BenchClient* client) {
+    if (config.size_dist == BENCH_SIZE_UNIFORM) {
+        return config.size_a + (long) (bench_uniform(client) * (config.size_b - config.size_a + 1));
+    } else if (config.size_dist == BENCH_SIZE_EXP) {
+        return (long) (-config.size_a * log(1 - bench_uniform(client)));
+    }
+    return config.size_a;
+}
+
+/**
+ * @brief Picks the request type of the next request from the mix.
+ */
+static RequestType bench_pick_request(BenchClient* client) {
+    int pick = (int) (bench_uniform(client) * config.total_weight);
+    RequestType type = READ_FILE;
+    for (int i = 0; i < NUM_REQUEST_TYPES; i++) {
+        pick -= config.weights[i];
+        if (pick < 0) {
+            type = (RequestType) i;
+            break;
+        }
+    }
+
+    // The files of the mix are churned oldest first, at most
+    // BENCH_MAX_CHURN of a client exist at a time
+    if (type == CREATE_FILE && client->created - client->deleted >= BENCH_MAX_CHURN) {
+        type = DELETE_FILE;
+    } else if (type == DELETE_FILE && client->created == client->deleted) {
+        type = CREATE_FILE;
+    }
+    return type;
+}
+
+/**
+ * @brief Paths of the working set and of the churned files. The
+ * directory is at most MAX_ARG_LEN / 2 long, so they always fit.
+ */
+static void bench_file_path(char* path, int file) {
+    snprintf(path, MAX_ARG_LEN, "%.127sfile_%d.txt", config.dir, file);
+}
+
+static void bench_churn_path(char* path, BenchClient* client, int number) {
+    snprintf(path, MAX_ARG_LEN, "%.127schurn_%d_%d.txt", config.dir, client->id, number);
+}
+
+/**
+ * @brief Opens a connection to a server.
+ *
+ * @return The socket, -1 on failure.
+ */
+static int bench_connect(const char* ip, int port) {
+    int fd = socket(SOCKET_FAMILY, SOCKET_TYPE, SOCKET_PROTOCOL);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = SOCKET_FAMILY;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr(ip);
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Receives an ack from the NM, skipping the lease invalidations it
+ * pushes. The load generator keeps no leases, every request asks the NM.
+ */
+static bool bench_recv_ack(int nmSocket, AckPacket* ack) {
+    do {
+        if (!recvAll(nmSocket, ack, sizeof(AckPacket))) {
+            return false;
+        }
+    } while (ack->ack == INVALIDATE_ACK);
+    return true;
+}
+
+/**
+ * @brief Sends a request to the NM and receives its first ack. Acks left
+ * over from an earlier request, like the second FAILURE_ACK the NM sends
+ * when a server is offline, are dropped first.
+ */
+static bool bench_ask_nm(BenchClient* client, ClientRequest* request, AckPacket* ack) {
+    struct pollfd pfd = { .fd = client->nmSocket, .events = POLLIN };
+    while (poll(&pfd, 1, 0) > 0) {
+        if (!(pfd.revents & POLLIN) || !recvAll(client->nmSocket, ack, sizeof(AckPacket))) {
+            return false;
+        }
+    }
+    return sendAll(client->nmSocket, request, sizeof(ClientRequest)) && bench_recv_ack(client->nmSocket, ack);
+}
+
+/**
+ * @brief A request the NM forwards to the storage servers itself:
+ * CREATE_DIR, CREATE_FILE, DELETE_DIR and DELETE_FILE.
+ *
+ * @return true if it succeeded, false otherwise
+ */
+static bool bench_forwarded(BenchClient* client, ClientRequest* request) {
+    AckPacket ack;
+    if (!bench_ask_nm(client, request, &ack)) {
+        return false;
+    }
+    if (ack.ack == INIT_ACK && !bench_recv_ack(client->nmSocket, &ack)) {
+        return false;
+    }
+    return ack.ack == SUCCESS_ACK;
+}
+
+/**
+ * @brief LIST_ALL of the bench directory, the first page only.
+ *
+ * @return true if it succeeded, false otherwise
+ */
+static bool bench_list(BenchClient* client, ClientRequest* request) {
+    AckPacket ack;
+    if (!bench_ask_nm(client, request, &ack) || ack.ack != INIT_ACK) {
+        return false;
+    }
+
+    FilePacket packet;
+    do {
+        if (!recvAll(client->nmSocket, &packet, sizeof(FilePacket))) {
+            return false;
+        }
+    } while (!packet.lastChunk);
+    return bench_recv_ack(client->nmSocket, &ack) && ack.ack == SUCCESS_ACK;
+}
+
+/**
+ * @brief READ_FILE or WRITE_FILE: asks the NM for the storage server,
+ * then reads the file from it or writes a file of the given size down
+ * its chain.
+ *
+ * @return true if it succeeded, false otherwise
+ */
+static bool bench_transfer(BenchClient* client, ClientRequest* request, long size) {
+    AckPacket ack;
+    ServerEndpoint server;
+    if (!bench_ask_nm(client, request, &ack) || ack.ack != CNNCT_TO_SRV_ACK ||
+        !recvServerEndpoint(client->nmSocket, &server)) {
+        return false;
+    }
+
+    int fd = bench_connect(server.serverIP, server.port_client);
+    if (fd < 0) {
+        return false;
+    }
+
+    request->chain_len = 0;
+    if (request->requestType == WRITE_FILE && server.chain_len > 1) {
+        request->chain_len = server.chain_len - 1;
+        memcpy(request->chain, &server.chain[1], request->chain_len * sizeof(ChainHop));
+    }
+
+    bool ok = sendAll(fd, request, sizeof(ClientRequest));
+    long long file_size;
+    if (ok && request->requestType == READ_FILE) {
+        ok = recvFileHeader(fd, &file_size) && file_size >= 0 && recvFileData(fd, file_size, NULL);
+        if (ok) {
+            client->bytes_read += file_size;
+        }
+    } else if (ok) {
+        ok = sendDataStart(fd, config.frame_size);
+        long left = size;
+        while (ok && left > 0) {
+            size_t len = ((size_t) left < config.frame_size) ? (size_t) left : config.frame_size;
+            ok = sendDataFrame(fd, write_data, len);
+            left -= len;
+        }
+        ok = ok && sendDataFrame(fd, write_data, 0);
+        if (ok) {
+            client->bytes_written += size;
+        }
+    }
+
+    ok = ok && recvAll(fd, &ack, sizeof(AckPacket)) && ack.ack == SUCCESS_ACK;
+    close(fd);
+    return ok;
+}
+
+/**
+ * @brief Runs one request of the given type.
+ *
+ * @return true if it succeeded, false otherwise
+ */
+static bool bench_request(BenchClient* client, RequestType type) {
+    ClientRequest request;
+    memset(&request, 0, sizeof(request));
+    request.clientDetails.clientID = -1;
+    request.requestType = type;
+    request.num_args = 1;
+    request.traceID = newTraceID();
+    long long started_us = traceClock();
+
+    bool ok;
+    if (type == CREATE_FILE) {
+        bench_churn_path(request.arg1, client, client->created);
+        ok = bench_forwarded(client, &request);
+        if (ok) {
+            client->created++;
+        }
+    } else if (type == DELETE_FILE) {
+        bench_churn_path(request.arg1, client, client->deleted++);
+        ok = bench_forwarded(client, &request);
+    } else if (type == LIST_ALL) {
+        strcpy(request.arg1, config.dir);
+        ok = bench_list(client, &request);
+    } else {
+        bench_file_path(request.arg1, bench_pick_file(client));
+        if (type == READ_FILE && config.read_length > 0) {
+            long below = bench_pick_size(client) - config.read_length;
+            request.offset = (below > 0) ? (long long) (bench_uniform(client) * (below + 1)) : 0;
+            request.length = config.read_length;
+        }
+        ok = bench_transfer(client, &request, (type == WRITE_FILE) ? bench_pick_size(client) : 0);
+    }
+
+    traceSpan(request.traceID, "request", started_us, traceClock(), TRACE_FLOW_ORIGIN);
+    return ok;
+}
+
+/**
+ * @brief Creates and writes a file of the working set.
+ */
+static bool bench_setup_file(BenchClient* client, int file) {
+    ClientRequest request;
+    memset(&request, 0, sizeof(request));
+    request.clientDetails.clientID = -1;
+    request.requestType = CREATE_FILE;
+    request.num_args = 1;
+    request.traceID = newTraceID();
+    bench_file_path(request.arg1, file);
+    if (!bench_forwarded(client, &request)) {
+        return false;
+    }
+
+    request.requestType = WRITE_FILE;
+    request.traceID = newTraceID();
+    return bench_transfer(client, &request, bench_pick_size(client));
+}
+
+/**
+ * @brief Deletes a file of the bench directory, the way it was created.
+ */
+static bool bench_delete(BenchClient* client, const char* path) {
+    ClientRequest request;
+    memset(&request, 0, sizeof(request));
+    request.clientDetails.clientID = -1;
+    request.requestType = DELETE_FILE;
+    request.num_args = 1;
+    request.traceID = newTraceID();
+    strcpy(request.arg1, path);
+    return bench_forwarded(client, &request);
+}
+
+/**
+ * @brief Sleeps until a statsClock time.
+ */
+static void bench_sleep_until(long long ns) {
+    struct timespec until = { .tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000 };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR);
+}
+
+/**
+ * @brief A synthetic client. It writes its share of the working set,
+ * waits for the others, then runs the mix until the run ends: closed
+ * loop, the next request as soon as the last one is answered, or open
+ * loop, requests arriving at random at config.rate / config.clients per
+ * second. In the open loop a request's latency counts from when it was
+ * due, so the time it waited behind a slow one is not lost.
+ */
+static void* bench_client_thread(void* arg) {
+    BenchClient* client = (BenchClient*) arg;
+    char path[MAX_ARG_LEN];
+
+    for (int file = client->id; file < config.files; file += config.clients) {
+        if (!bench_setup_file(client, file)) {
+            bench_file_path(path, file);
+            fprintf(stderr, "Error setting up %s\n", path);
+        }
+    }
+    client->bytes_written = 0;
+
+    pthread_barrier_wait(&setup_done);
+    pthread_barrier_wait(&setup_done);
+
+    double mean_gap_ns = (config.rate > 0) ? 1e9 * config.clients / config.rate : 0;
+    long long due_ns = run_started_ns;
+    while (true) {
+        long long started_ns;
+        if (config.rate > 0) {
+            due_ns += (long long) (-mean_gap_ns * log(1 - bench_uniform(client)));
+            if (due_ns >= run_ends_ns) {
+                break;
+            }
+            bench_sleep_until(due_ns);
+            started_ns = due_ns;
+        } else {
+            started_ns = statsClock();
+            if (started_ns >= run_ends_ns) {
+                break;
+            }
+        }
+
+        RequestType type = bench_pick_request(client);
+        bool ok = bench_request(client, type);
+        recordRequest(type, started_ns, ok);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Deletes the files a client created, its share of the working set
+ * and what is left of its churn.
+ */
+static void* bench_cleanup_thread(void* arg) {
+    BenchClient* client = (BenchClient*) arg;
+    char path[MAX_ARG_LEN];
+
+    for (int number = client->deleted; number < client->created; number++) {
+        bench_churn_path(path, client, number);
+        bench_delete(client, path);
+    }
+    for (int file = client->id; file < config.files; file += config.clients) {
+        bench_file_path(path, file);
+        bench_delete(client, path);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Parses a mix like "read=70,write=20,create=4,delete=4,list=2"
+ * into config.weights.
+ *
+ * @return true if valid syntax
+ */
+static bool parse_mix(char* mix) {
+    static const struct { const char* name; RequestType type; } names[] = {
+        {"create", CREATE_FILE}, {"read", READ_FILE}, {"write", WRITE_FILE},
+        {"delete", DELETE_FILE}, {"list", LIST_ALL},
+    };
+
+    memset(config.weights, 0, sizeof(config.weights));
+    config.total_weight = 0;
+    for (char* token = strtok(mix, ","); token != NULL; token = strtok(NULL, ",")) {
+        char* value = strchr(token, '=');
+        if (value == NULL || atoi(value + 1) < 0) {
+            return false;
+        }
+        *value++ = '\0';
+
+        int i = 0;
+        while (i < (int) (sizeof(names) / sizeof(names[0])) && strcmp(token, names[i].name) != 0) {
+            i++;
+        }
+        if (i == (int) (sizeof(names) / sizeof(names[0]))) {
+            return false;
+        }
+        config.weights[names[i].type] = atoi(value);
+        config.total_weight += atoi(value);
+    }
+    return config.total_weight > 0;
+}
+
+/**
+ * @brief Parses a size distribution: "fixed:N", "uniform:A:B" or
+ * "exp:MEAN", in bytes.
+ *
+ * @return true if valid syntax
+ */
+static bool parse_sizes(const char* sizes) {
+    config.size_b = 0;
+    if (sscanf(sizes, "fixed:%ld", &config.size_a) == 1) {
+        config.size_dist = BENCH_SIZE_FIXED;
+    } else if (sscanf(sizes, "uniform:%ld:%ld", &config.size_a, &config.size_b) == 2) {
+        config.size_dist = BENCH_SIZE_UNIFORM;
+        return config.size_a >= 0 && config.size_b >= config.size_a;
+    } else if (sscanf(sizes, "exp:%ld", &config.size_a) == 1) {
+        config.size_dist = BENCH_SIZE_EXP;
+    } else {
+        return false;
+    }
+    return config.size_a >= 0;
+}
+
+static void usage(const char* program) {
+    fprintf(stderr, "Usage: %s [-c clients] [-d seconds] [-r rate] [-n files] [-z zipf_theta]\n"
+                    "       [-m mix] [-s sizes] [-b frame_size] [-l read_length] [-p dir] [-k]\n"
+                    "  -r  requests per second over all clients, 0 to run closed loop (default)\n"
+                    "  -m  weights of the request types (default %s)\n"
+                    "  -s  sizes written, fixed:N, uniform:A:B or exp:MEAN bytes (default %s)\n"
+                    "  -b  largest data frame of a write, %d to %d bytes (default %d)\n"
+                    "  -l  bytes each read asks for at a random offset, 0 for whole files (default)\n"
+                    "  -k  keep the files after the run\n",
+            program, BENCH_MIX, BENCH_SIZES, DATA_FRAME_MIN_SIZE, DATA_FRAME_MAX_SIZE, DATA_FRAME_SIZE);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    config.clients = BENCH_CLIENTS;
+    config.duration_s = BENCH_DURATION_S;
+    config.rate = 0;
+    config.files = BENCH_FILES;
+    config.zipf_theta = BENCH_ZIPF_THETA;
+    config.frame_size = DATA_FRAME_SIZE;
+    config.read_length = 0;
+    strcpy(config.dir, BENCH_DIR);
+    config.keep = false;
+    char mix[MAX_REQUEST_SIZE] = BENCH_MIX;
+    const char* sizes = BENCH_SIZES;
+
+    int option;
+    while ((option = getopt(argc, argv, "c:d:r:n:z:m:s:b:l:p:k")) != -1) {
+        switch (option) {
+            case 'c': config.clients = atoi(optarg); break;
+            case 'd': config.duration_s = atoi(optarg); break;
+            case 'r': config.rate = atof(optarg); break;
+            case 'n': config.files = atoi(optarg); break;
+            case 'z': config.zipf_theta = atof(optarg); break;
+            case 'm': snprintf(mix, sizeof(mix), "%s", optarg); break;
+            case 's': sizes = optarg; break;
+            case 'b': config.frame_size = atol(optarg); break;
+            case 'l': config.read_length = atol(optarg); break;
+            case 'p': snprintf(config.dir, MAX_ARG_LEN / 2, "%s", optarg); break;
+            case 'k': config.keep = true; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind != argc || config.clients <= 0 || config.duration_s <= 0 || config.rate < 0 ||
+        config.files <= 0 || config.zipf_theta < 0 || config.dir[0] != '/' ||
+        config.frame_size < DATA_FRAME_MIN_SIZE || config.frame_size > DATA_FRAME_MAX_SIZE ||
+        config.read_length < 0 ||
+        !parse_mix(mix) || !parse_sizes(sizes)) {
+        usage(argv[0]);
+    }
+    if (config.dir[strlen(config.dir) - 1] != '/') {
+        strcat(config.dir, "/");
+    }
+
+    // A storage server holds at most MAX_PATHS paths
+    if (config.files + config.clients * BENCH_MAX_CHURN + 1 > MAX_PATHS) {
+        fprintf(stderr, "At most %d files and churned files, a storage server holds %d paths\n",
+                MAX_PATHS - 1, MAX_PATHS);
+        exit(EXIT_FAILURE);
+    }
+
+    write_data = (char*) malloc(config.frame_size);
+    if (!init_zipf() || write_data == NULL) {
+        perror("Error allocating the file popularity and the written data");
+        exit(EXIT_FAILURE);
+    }
+    // Every byte value, NUL included, goes through the write path
+    for (size_t i = 0; i < config.frame_size; i++) {
+        write_data[i] = (char) (i % 251);
+    }
+    initTracing("dfsbench");
+
+    BenchClient* clients = (BenchClient*) calloc(config.clients, sizeof(BenchClient));
+    pthread_t* threads = (pthread_t*) calloc(config.clients, sizeof(pthread_t));
+    if (clients == NULL || threads == NULL) {
+        perror("Error allocating the clients");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < config.clients; i++) {
+        clients[i].id = i;
+        clients[i].rng = newTraceID();
+        clients[i].nmSocket = bench_connect(nmIP(), nmClientPort());
+        if (clients[i].nmSocket < 0) {
+            perror("Error connecting to the naming server");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // The directory may be left over from a run with -k
+    ClientRequest request;
+    memset(&request, 0, sizeof(request));
+    request.clientDetails.clientID = -1;
+    request.requestType = CREATE_DIR;
+    request.num_args = 1;
+    request.traceID = newTraceID();
+    strcpy(request.arg1, config.dir);
+    if (!bench_forwarded(&clients[0], &request)) {
+        printf("Could not create %s, using it as it is\n", config.dir);
+    }
+
+    printf("dfsbench: %d clients, %s, %d s, %d files, zipf %.2f, sizes %s\n", config.clients,
+           (config.rate > 0) ? "open loop" : "closed loop", config.duration_s, config.files,
+           config.zipf_theta, sizes);
+    if (config.rate > 0) {
+        printf("Arrivals: %.1f requests per second\n", config.rate);
+    }
+
+    pthread_barrier_init(&setup_done, NULL, config.clients + 1);
+    long long setup_ns = statsClock();
+    for (int i = 0; i < config.clients; i++) {
+        if (pthread_create(&threads[i], NULL, bench_client_thread, &clients[i]) != 0) {
+            perror("Error creating client thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Only the requests of the run are counted, not those of the setup
+    pthread_barrier_wait(&setup_done);
+    printf("Wrote %d files in %.2f s\n", config.files, (statsClock() - setup_ns) / 1e9);
+    startStats(NULL);
+    run_started_ns = statsClock();
+    run_ends_ns = run_started_ns + (long long) config.duration_s * 1000000000;
+    pthread_barrier_wait(&setup_done);
+
+    for (int i = 0; i < config.clients; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    printf("\nLatencies in us\n");
+    printStats(stdout);
+
+    long long bytes_read = 0, bytes_written = 0;
+    for (int i = 0; i < config.clients; i++) {
+        bytes_read += clients[i].bytes_read;
+        bytes_written += clients[i].bytes_written;
+    }
+    printf("Read %.2f MB/s, wrote %.2f MB/s\n", bytes_read / 1e6 / config.duration_s,
+           bytes_written / 1e6 / config.duration_s);
+
+    if (!config.keep) {
+        for (int i = 0; i < config.clients; i++) {
+            pthread_create(&threads[i], NULL, bench_cleanup_thread, &clients[i]);
+        }
+        for (int i = 0; i < config.clients; i++) {
+            pthread_join(threads[i], NULL);
+        }
+
+        request.requestType = DELETE_DIR;
+        request.traceID = newTraceID();
+        if (!bench_forwarded(&clients[0], &request)) {
+            printf("Could not delete %s\n", config.dir);
+        }
+    }
+
+    for (int i = 0; i < config.clients; i++) {
+        close(clients[i].nmSocket);
+    }
+    free(clients);
+    free(threads);
+    free(zipf_cdf);
+    return 0;
+}
@@ -0,0 +1,170 @@
+#include "client.h"
+
+#include "../utils/logging.h"
+#include "../utils/headers.h"
+#include "../utils/constants.h"
+#include "../utils/structs.h"
+
+#include <netinet/tcp.h>
+
+/***************************************************/
+/*      Hedged reads across replicas of a file     */
+/***************************************************/
+
+static long long latency_samples[HEDGE_SAMPLES];                   // Recent waits for the first reply to a read, in us
+static int num_samples = 0;                                        // Entries in latency_samples
+static int next_sample = 0;                                        // Entry the next wait overwrites
+static int hedge_percentile = DEFAULT_HEDGE_PERCENTILE;            // Percentile of the waits a read may take before it is hedged
+
+static long long hedge_clock_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int compare_samples(const void* a, const void* b) {
+    long long x = *(const long long*) a;
+    long long y = *(const long long*) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Sets the percentile of recent read latencies after which a read
+ * is also sent to a second replica.
+ *
+ * @param percentile : Between 1 and 99, 0 turns hedging off.
+ */
+void initHedging(int percentile) {
+    hedge_percentile = percentile;
+}
+
+/**
+ * @brief How long a read waits for its first reply before it is hedged:
+ * the hedge percentile of the recent waits, HEDGE_DEFAULT_DELAY_MS until
+ * enough reads were seen.
+ */
+static long long hedge_delay_us() {
+    if (num_samples < HEDGE_MIN_SAMPLES) {
+        return (long long) HEDGE_DEFAULT_DELAY_MS * 1000;
+    }
+
+    long long sorted[HEDGE_SAMPLES];
+    memcpy(sorted, latency_samples, num_samples * sizeof(long long));
+    qsort(sorted, num_samples, sizeof(long long), compare_samples);
+    long long delay = sorted[(num_samples - 1) * hedge_percentile / 100];
+    return (delay > HEDGE_MIN_DELAY_US) ? delay : HEDGE_MIN_DELAY_US;
+}
+
+static void record_latency(long long latency_us) {
+    latency_samples[next_sample] = latency_us;
+    next_sample = (next_sample + 1) % HEDGE_SAMPLES;
+    if (num_samples < HEDGE_SAMPLES) {
+        num_samples++;
+    }
+}
+
+/**
+ * @brief Sends a read to another replica of the file than the one it
+ * went to first.
+ *
+ * @return The socket, -1 if the file has no other live replica or it
+ *         could not be reached.
+ */
+static int send_backup_read(ClientRequest* clientRequest, const ServerEndpoint* server) {
+    for (int i = 0; i < server->chain_len; i++) {
+        const ChainHop* hop = &server->chain[i];
+        if (hop->port_client == server->port_client && strcmp(hop->serverIP, server->serverIP) == 0) {
+            continue;
+        }
+
+        int backupSocket = socket(SOCKET_FAMILY, SOCKET_TYPE, SOCKET_PROTOCOL);
+        if (backupSocket < 0) {
+            return -1;
+        }
+        int nodelay = 1;
+        setsockopt(backupSocket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+        struct sockaddr_in backup_addr;
+        memset(&backup_addr, 0, sizeof(backup_addr));
+        backup_addr.sin_family = SOCKET_FAMILY;
+        backup_addr.sin_port = htons(hop->port_client);
+        backup_addr.sin_addr.s_addr = inet_addr(hop->serverIP);
+
+        if (connect(backupSocket, (struct sockaddr*) &backup_addr, sizeof(backup_addr)) < 0 ||
+            !sendAll(backupSocket, clientRequest, sizeof(ClientRequest))) {
+            close(backupSocket);
+            continue;
+        }
+        return backupSocket;
+    }
+    return -1;
+}
+
+/**
+ * @brief Waits for the storage server to start answering a read. If it
+ * takes longer than the hedge percentile of recent reads, the read is
+ * also sent to another live replica, and whichever answers first is
+ * used. The other request is cancelled by closing its connection. Reads
+ * stuck behind a slow server then take about as long as on the healthy
+ * ones.
+ *
+ * @param primarySocket : Connection to the server the read was sent to.
+ * @param clientRequest : The read request.
+ * @param server : The server, with the live replicas of the file.
+ *
+ * @return The socket the reply is to be read from, -1 if no server answered.
+ */
+int hedgedRead(int primarySocket, ClientRequest* clientRequest, const ServerEndpoint* server) {
+    long long sent_us = hedge_clock_us();
+    struct pollfd fds[2] = {
+        { .fd = primarySocket, .events = POLLIN },
+        { .fd = -1, .events = POLLIN },
+    };
+
+    if (hedge_percentile > 0 && server->chain_len > 1) {
+        int delay_ms = (int) ((hedge_delay_us() + 999) / 1000);
+        if (poll(fds, 1, delay_ms) == 0) {
+            fds[1].fd = send_backup_read(clientRequest, server);
+            if (fds[1].fd >= 0) {
+                printf("Read is slow, also asking another replica\n");
+            }
+        }
+    }
+
+    // A server that hangs up is dropped, the other may still answer
+    int winner = -1;
+    while (winner < 0 && (fds[0].fd >= 0 || fds[1].fd >= 0)) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (int i = 0; i < 2 && winner < 0; i++) {
+            if (fds[i].fd < 0 || fds[i].revents == 0) {
+                continue;
+            }
+            if (fds[i].revents & POLLIN) {
+                winner = i;
+            } else {
+                close(fds[i].fd);
+                fds[i].fd = -1;
+            }
+        }
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (i != winner && fds[i].fd >= 0) {
+            close(fds[i].fd);
+        }
+    }
+    if (winner < 0) {
+        return -1;
+    }
+
+    record_latency(hedge_clock_us() - sent_us);
+    if (winner == 1) {
+        printf("Read answered by the other replica\n");
+    }
+    return fds[winner].fd;
+}
@@ -0,0 +1,156 @@
+#include "client.h"
+
+#include "../utils/logging.h"
+#include "../utils/headers.h"
+#include "../utils/constants.h"
+#include "../utils/structs.h"
+
+/***************************************************/
+/*     Storage server locations leased from NM     */
+/***************************************************/
+
+static LeaseEntry lease_cache[CLIENT_LEASE_CACHE_SIZE];     // Direct mapped on the hash of the path
+
+/**
+ * @brief Current monotonic time in milliseconds.
+ */
+long long leaseClock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Slot of a path in the lease cache.
+ */
+static LeaseEntry* lease_slot(const char* path) {
+    return &lease_cache[hash_path(path) % CLIENT_LEASE_CACHE_SIZE];
+}
+
+/**
+ * @brief Looks up the leased location of a path.
+ *
+ * @param path : The path.
+ * @param endpoint : Set to the storage server holding the path.
+ *
+ * @return true if a lease that has not run out covers the path.
+ */
+bool leaseLookup(const char* path, ServerEndpoint* endpoint) {
+    LeaseEntry* entry = lease_slot(path);
+    if (!entry->used || strcmp(entry->path, path) != 0) {
+        return false;
+    }
+    if (entry->expiry_ms <= leaseClock()) {
+        entry->used = false;
+        return false;
+    }
+    *endpoint = entry->endpoint;
+    return true;
+}
+
+/**
+ * @brief Caches the location of a path under the lease the NM granted.
+ * The lease is counted from when the request was sent, so it never
+ * outlives the one the NM keeps.
+ *
+ * @param path : The path.
+ * @param endpoint : Storage server holding the path, with the lease.
+ * @param asked_ms : leaseClock() when the request was sent to the NM.
+ */
+void leaseStore(const char* path, const ServerEndpoint* endpoint, long long asked_ms) {
+    if (endpoint->lease_id < 0 || endpoint->lease_ms <= 0 || strlen(path) >= MAX_ARG_LEN) {
+        return;
+    }
+
+    LeaseEntry* entry = lease_slot(path);
+    strcpy(entry->path, path);
+    entry->endpoint = *endpoint;
+    entry->expiry_ms = asked_ms + endpoint->lease_ms;
+    entry->used = true;
+}
+
+/**
+ * @brief Forgets the lease with the given ID, if it is cached.
+ *
+ * @param leaseID : Lease the NM revoked.
+ */
+void leaseDrop(int leaseID) {
+    for (int i = 0; i < CLIENT_LEASE_CACHE_SIZE; i++) {
+        if (lease_cache[i].used && lease_cache[i].endpoint.lease_id == leaseID) {
+            lease_cache[i].used = false;
+        }
+    }
+}
+
+/**
+ * @brief Forgets the lease on a path, used when its server turned out
+ * to be unreachable or no longer had the path.
+ *
+ * @param path : The path.
+ */
+void leaseDropPath(const char* path) {
+    LeaseEntry* entry = lease_slot(path);
+    if (entry->used && strcmp(entry->path, path) == 0) {
+        entry->used = false;
+    }
+}
+
+/**
+ * @brief Drops the leases named in an INVALIDATE_ACK.
+ */
+static void apply_invalidation(AckPacket* ack) {
+    int count = ack->extraInfo[0];
+    if (count < 0 || count > MAX_ACK_EXTRA_INFO - 1) {
+        return;
+    }
+    for (int i = 1; i <= count; i++) {
+        leaseDrop(ack->extraInfo[i]);
+    }
+}
+
+/**
+ * @brief Applies every invalidation the NM pushed since the last request,
+ * without blocking.
+ *
+ * @param nmSocket : Socket connected to the NM.
+ *
+ * @return false if the connection to the NM broke.
+ */
+bool drainLeaseInvalidations(int nmSocket) {
+    struct pollfd pfd = { .fd = nmSocket, .events = POLLIN };
+    while (poll(&pfd, 1, 0) > 0) {
+        if (!(pfd.revents & POLLIN)) {
+            return false;
+        }
+
+        AckPacket ack;
+        if (recv(nmSocket, &ack, sizeof(ack), MSG_WAITALL) != sizeof(ack)) {
+            return false;
+        }
+        if (ack.ack == INVALIDATE_ACK) {
+            apply_invalidation(&ack);
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Receives the ack answering a request, applying the invalidations
+ * the NM pushed before it.
+ *
+ * @param nmSocket : Socket connected to the NM.
+ * @param ack : Filled with the ack.
+ *
+ * @return false if nothing could be received.
+ */
+bool recvNMAck(int nmSocket, AckPacket* ack) {
+    while (true) {
+        if (recv(nmSocket, ack, sizeof(AckPacket), MSG_WAITALL) != sizeof(AckPacket)) {
+            return false;
+        }
+        if (ack->ack != INVALIDATE_ACK) {
+            return true;
+        }
+        apply_invalidation(ack);
+    }
+}
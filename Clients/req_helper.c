@@ -7,37 +7,26 @@
 
 /**
  * @brief Retrieve file data from the storage server and print it to stdout.
+ * The server sends the size of the file, then its bytes. A file it could
+ * not open has no bytes, and the ack that follows tells why.
  * 
  * @param clt_srv_fd : Client-Server socket file descriptor.
  * 
  * @return true if the operation is successful, false otherwise.
  */
 bool get_file_data_from_ss(int* clt_srv_fd) {
-    FilePacket packet;
-
-    while (true) {
-        // Receive file data packet from the server
-        ssize_t bytesRead = recv(*clt_srv_fd, &packet, sizeof(FilePacket), 0);
-
-        if (bytesRead < 0) {
-            perror("Error reading from storage server");
-            return false;
-        }
-
-        if (bytesRead == 0) {
-            // Connection closed by the server
-            break;
-        }
-
-        // Print the received data to stdout
-        // fwrite(packet.chunk, 1, bytesRead, stdout);
-        printf("%s", packet.chunk);
+    long long size;
+    if (!recvFileHeader(*clt_srv_fd, &size)) {
+        perror("Error reading from storage server");
+        return false;
+    }
+    if (size < 0) {
+        return true;
+    }
 
-        if (packet.lastChunk) {
-            // Last chunk received, exit the loop
-            printf("This is infact the last chunk\n");
-            break;
-        }
+    if (!recvFileData(*clt_srv_fd, size, stdout)) {
+        perror("Error reading from storage server");
+        return false;
     }
 
     printf("\n");
@@ -100,37 +89,34 @@ bool send_file_data_to_ss(int* clt_srv_fd, const char* filePath) {
         }
 
         printf("Made the file in client.\n");
-        // Send the file data to the server
-        FilePacket packet;
-        size_t bytesRead;
-
-        while (true) {
-            // Read a chunk from the file
-            bytesRead = fread(packet.chunk, 1, MAX_CHUNK_SIZE, tempFile);
-            packet.chunk[bytesRead] = '\0';
+        // Send the file data to the server, as data frames
+        char *frame = (char*) malloc(DATA_FRAME_SIZE);
+        if (frame == NULL || !sendDataStart(*clt_srv_fd, DATA_FRAME_SIZE)) {
+            perror("Error starting the data stream to server");
+            free(frame);
+            fclose(tempFile);
+            return false;
+        }
 
-            printf("Made the file in client : %s\n", packet.chunk);
-            
+        size_t bytesRead;
+        do {
+            // Read a frame from the file, the empty frame at the end ends the stream
+            bytesRead = fread(frame, 1, DATA_FRAME_SIZE, tempFile);
             if (ferror(tempFile)) {
                 perror("Error reading from temp_buffer.txt");
+                free(frame);
                 fclose(tempFile);
                 return false;
             }
 
-            // Set the lastChunk flag
-            packet.lastChunk = (feof(tempFile) != 0);
-
-            // Send the chunk to the server
-            if (send(*clt_srv_fd, &packet, sizeof(FilePacket), 0) < 0) {
-                perror("Error sending file packet to server");
+            if (!sendDataFrame(*clt_srv_fd, frame, bytesRead)) {
+                perror("Error sending data frame to server");
+                free(frame);
                 fclose(tempFile);
                 return false;
             }
-
-            if (packet.lastChunk) {
-                break; // No need to continue if it's the last chunk
-            }
-        }
+        } while (bytesRead > 0);
+        free(frame);
 
         // Close the temporary file
         fclose(tempFile);
@@ -0,0 +1,232 @@
+#include "nm.h"
+
+#include "../utils/headers.h"
+#include "../utils/logging.h"
+#include "../utils/constants.h"
+#include "../utils/structs.h"
+
+/***************************************************/
+/*        Arenas for the namespace trie nodes      */
+/***************************************************/
+
+static Arena arenas[NUM_ARENAS];        // One arena per storage server, one for shared directories, one scratch
+static ArenaBlock* free_blocks = NULL;  // Blocks handed back by resets, reused by any arena
+static size_t pooled_bytes = 0;         // Bytes sitting in free_blocks
+static ArenaLimbo* limbo = NULL;        // Reset blocks that readers may still be walking
+static size_t limbo_bytes = 0;          // Bytes sitting in limbo
+static long num_resets = 0;             // Arena resets so far
+static long num_compactions = 0;        // Arena compactions so far
+
+/**
+ * @brief Rounds size up to the alignment of every arena allocation.
+ */
+static size_t arena_align(size_t size) {
+    return (size + 7) & ~((size_t) 7);
+}
+
+/**
+ * @brief Moves the blocks of every limbo entry that no reader can see
+ * anymore to the free pool.
+ */
+static void arena_reclaim_limbo() {
+    ArenaLimbo** link = &limbo;
+    while (*link != NULL) {
+        ArenaLimbo* entry = *link;
+        if (!epoch_passed(entry->epoch)) {
+            link = &entry->next;
+            continue;
+        }
+
+        size_t large_bytes = 0;
+        while (entry->large != NULL) {
+            ArenaBlock* next = entry->large->next;
+            large_bytes += entry->large->size;
+            free(entry->large);
+            entry->large = next;
+        }
+
+        if (entry->head != NULL) {
+            entry->tail->next = free_blocks;
+            free_blocks = entry->head;
+            pooled_bytes += entry->bytes - large_bytes;
+        }
+
+        limbo_bytes -= entry->bytes;
+        *link = entry->next;
+        free(entry);
+    }
+}
+
+/**
+ * @brief Gets a block with at least size bytes of room, from the free
+ * pool when it is a standard block, from malloc otherwise.
+ *
+ * @param size: Bytes needed in the block.
+ *
+ * @return The new (empty) block.
+ */
+static ArenaBlock* arena_new_block(size_t size) {
+    ArenaBlock* block;
+    if (size <= ARENA_BLOCK_SIZE && free_blocks == NULL && limbo != NULL) {
+        arena_reclaim_limbo();
+    }
+
+    if (size <= ARENA_BLOCK_SIZE && free_blocks != NULL) {
+        block = free_blocks;
+        free_blocks = block->next;
+        pooled_bytes -= block->size;
+    } else {
+        size_t block_size = (size <= ARENA_BLOCK_SIZE) ? ARENA_BLOCK_SIZE : size;
+        block = (ArenaBlock*) malloc(sizeof(ArenaBlock) + block_size);
+        if (block == NULL) {
+            LOG("Error allocating arena block", false);
+            exit(EXIT_FAILURE);
+        }
+        block->size = block_size;
+    }
+    block->used = 0;
+    block->next = NULL;
+    return block;
+}
+
+/**
+ * @brief Allocates size bytes from the arena of owner. The memory is only
+ * given back in bulk, by arena_reset.
+ *
+ * @param owner: Arena to allocate from.
+ * @param size: Number of bytes.
+ * @param isNode: Whether the memory is for a trie node.
+ *
+ * @return Pointer to the allocated memory.
+ */
+void* arena_alloc(int owner, size_t size, bool isNode) {
+    Arena* arena = &arenas[owner];
+    size = arena_align(size);
+    if (isNode) {
+        arena->live_nodes++;
+    }
+
+    if (size > ARENA_BLOCK_SIZE) {
+        // Oversized allocations (huge child maps) get a block of their own
+        ArenaBlock* block = arena_new_block(size);
+        block->used = size;
+        block->next = arena->large;
+        arena->large = block;
+        arena->reserved_bytes += block->size;
+        arena->live_bytes += size;
+        return block->data;
+    }
+
+    if (arena->head == NULL || arena->head->size - arena->head->used < size) {
+        ArenaBlock* block = arena_new_block(size);
+        block->next = arena->head;
+        arena->head = block;
+        if (arena->tail == NULL) {
+            arena->tail = block;
+        }
+        arena->reserved_bytes += block->size;
+    }
+
+    void* memory = arena->head->data + arena->head->used;
+    arena->head->used += size;
+    arena->live_bytes += size;
+    return memory;
+}
+
+/**
+ * @brief Marks memory allocated from an arena as garbage. Nothing is
+ * freed here, the bytes are reclaimed by the next reset of the arena.
+ *
+ * @param owner: Arena the memory came from.
+ * @param size: Number of bytes that were allocated.
+ * @param isNode: Whether the memory was a trie node.
+ */
+void arena_release(int owner, size_t size, bool isNode) {
+    Arena* arena = &arenas[owner];
+    size = arena_align(size);
+
+    arena->live_bytes -= size;
+    arena->garbage_bytes += size;
+    if (isNode) {
+        arena->live_nodes--;
+        arena->garbage_nodes++;
+    }
+}
+
+/**
+ * @brief Releases everything allocated from an arena at once. The block
+ * chain is parked in limbo until no reader can be inside it anymore, and
+ * then spliced onto the free pool, so the cost does not depend on how
+ * much was allocated. The caller must have unlinked the arena's nodes.
+ *
+ * @param owner: Arena to reset.
+ */
+void arena_reset(int owner) {
+    Arena* arena = &arenas[owner];
+
+    if (arena->head != NULL || arena->large != NULL) {
+        ArenaLimbo* entry = (ArenaLimbo*) malloc(sizeof(ArenaLimbo));
+        entry->head = arena->head;
+        entry->tail = arena->tail;
+        entry->large = arena->large;
+        entry->bytes = arena->reserved_bytes;
+        entry->epoch = epoch_retire();
+        entry->next = limbo;
+        limbo = entry;
+        limbo_bytes += entry->bytes;
+    }
+
+    memset(arena, 0, sizeof(Arena));
+    num_resets++;
+
+    arena_reclaim_limbo();
+}
+
+/**
+ * @brief Finishes a compaction: resets the arena of owner and hands it
+ * the live copies that were built in the arena from.
+ *
+ * @param owner: Arena being compacted.
+ * @param from: Arena holding the copies, left empty.
+ */
+void arena_adopt(int owner, int from) {
+    arena_reset(owner);
+    arenas[owner] = arenas[from];
+    memset(&arenas[from], 0, sizeof(Arena));
+    num_compactions++;
+}
+
+/**
+ * @brief Whether an arena holds enough garbage to be worth compacting.
+ *
+ * @param owner: Arena to check.
+ *
+ * @return true if garbage outweighs live data and passes ARENA_COMPACT_MIN_GARBAGE.
+ */
+bool arena_needs_compaction(int owner) {
+    Arena* arena = &arenas[owner];
+    return arena->garbage_bytes > ARENA_COMPACT_MIN_GARBAGE && arena->garbage_bytes > arena->live_bytes;
+}
+
+/**
+ * @brief Sums the statistics of every arena in use by the namespace.
+ *
+ * @param stats: Filled with the totals.
+ */
+void getNamespaceStats(NamespaceStats* stats) {
+    memset(stats, 0, sizeof(NamespaceStats));
+    for (int i = 0; i < NUM_ARENAS; i++) {
+        if (i == SCRATCH_ARENA) {
+            continue;
+        }
+        stats->live_nodes += arenas[i].live_nodes;
+        stats->garbage_nodes += arenas[i].garbage_nodes;
+        stats->live_bytes += arenas[i].live_bytes;
+        stats->garbage_bytes += arenas[i].garbage_bytes;
+        stats->reserved_bytes += arenas[i].reserved_bytes;
+    }
+    stats->pooled_bytes = pooled_bytes;
+    stats->limbo_bytes = limbo_bytes;
+    stats->resets = num_resets;
+    stats->compactions = num_compactions;
+}
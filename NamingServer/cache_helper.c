@@ -0,0 +1,312 @@
+#include "nm.h"
+
+#include "../utils/headers.h"
+#include "../utils/logging.h"
+#include "../utils/constants.h"
+#include "../utils/structs.h"
+
+/***************************************************/
+/*        Path -> storage server location cache    */
+/***************************************************/
+
+/**
+ * @brief Shard responsible for a hash. The top bits pick the shard, the
+ * low bits pick the bucket inside it.
+ */
+static CacheShard* shard_of(LocationCache* cache, unsigned long long hash) {
+    return &cache->shards[(hash >> 56) % CACHE_SHARDS];
+}
+
+/**
+ * @brief Finds the entry for path in a shard, the caller holds the shard lock.
+ *
+ * @param prev: If not NULL, set to the entry before it in the bucket chain (-1 for the head).
+ *
+ * @return Index of the entry, -1 if it is not cached.
+ */
+static int shard_find(CacheShard* shard, const char* path, unsigned long long hash, int* prev) {
+    int before = -1;
+    for (int i = shard->buckets[hash & (shard->num_buckets - 1)]; i >= 0; i = shard->entries[i].next) {
+        // Equal hashes are not enough, the full path has to match
+        if (shard->entries[i].hash == hash && strcmp(shard->entries[i].path, path) == 0) {
+            if (prev != NULL) *prev = before;
+            return i;
+        }
+        before = i;
+    }
+    return -1;
+}
+
+/**
+ * @brief Unlinks entry idx from its bucket and puts it on the free list,
+ * the caller holds the shard lock.
+ */
+static void shard_remove(CacheShard* shard, int idx, int prev) {
+    CacheEntry* entry = &shard->entries[idx];
+    if (prev < 0) {
+        shard->buckets[entry->hash & (shard->num_buckets - 1)] = entry->next;
+    } else {
+        shard->entries[prev].next = entry->next;
+    }
+
+    free(entry->path);
+    entry->path = NULL;
+    entry->used = false;
+    entry->next = shard->free_head;
+    shard->free_head = idx;
+    shard->size--;
+}
+
+/**
+ * @brief Picks the entry to reuse for an insert: a free one if there is
+ * any, otherwise the first one the CLOCK hand finds without its
+ * reference bit. The caller holds the shard lock.
+ */
+static int shard_take_slot(CacheShard* shard) {
+    if (shard->free_head < 0) {
+        while (true) {
+            CacheEntry* entry = &shard->entries[shard->hand];
+            if (entry->used && !entry->referenced) {
+                int prev;
+                shard_find(shard, entry->path, entry->hash, &prev);
+                shard_remove(shard, shard->hand, prev);
+                shard->evictions++;
+                shard->hand = (shard->hand + 1) % shard->capacity;
+                break;
+            }
+            entry->referenced = false;
+            shard->hand = (shard->hand + 1) % shard->capacity;
+        }
+    }
+
+    int idx = shard->free_head;
+    shard->free_head = shard->entries[idx].next;
+    return idx;
+}
+
+/**
+ * @brief Initializes the location cache.
+ *
+ * @param cache: The cache to initialize.
+ * @param capacity: Total number of paths to keep, split over CACHE_SHARDS shards.
+ *
+ * @return true on success, false if memory could not be allocated.
+ */
+bool initLocationCache(LocationCache* cache, int capacity) {
+    int per_shard = (capacity + CACHE_SHARDS - 1) / CACHE_SHARDS;
+    if (per_shard < 1) {
+        per_shard = 1;
+    }
+
+    int num_buckets = 1;
+    while (num_buckets < per_shard) {
+        num_buckets <<= 1;
+    }
+
+    for (int s = 0; s < CACHE_SHARDS; s++) {
+        CacheShard* shard = &cache->shards[s];
+        memset(shard, 0, sizeof(CacheShard));
+        pthread_mutex_init(&shard->lock, NULL);
+
+        shard->capacity = per_shard;
+        shard->num_buckets = num_buckets;
+        shard->entries = (CacheEntry*) calloc(per_shard, sizeof(CacheEntry));
+        shard->buckets = (int*) malloc(num_buckets * sizeof(int));
+        if (shard->entries == NULL || shard->buckets == NULL) {
+            LOG("Error allocating the location cache", false);
+            return false;
+        }
+
+        for (int i = 0; i < num_buckets; i++) {
+            shard->buckets[i] = -1;
+        }
+        for (int i = 0; i < per_shard; i++) {
+            shard->entries[i].next = (i + 1 < per_shard) ? i + 1 : -1;
+        }
+        shard->free_head = 0;
+    }
+    return true;
+}
+
+/**
+ * @brief Looks a path up in the cache.
+ *
+ * @param cache: The location cache.
+ * @param path: Path to look for.
+ * @param hash: hash_path(path).
+ * @param generation: Set to the invalidation generation of the shard, to be
+ *                    handed to cache_insert after a miss.
+ * @param replicas: Set to the cached replica set on a hit.
+ *
+ * @return The cached storage server ID, -1 on a miss.
+ */
+int cache_lookup(LocationCache* cache, const char* path, unsigned long long hash, long* generation, unsigned int* replicas) {
+    CacheShard* shard = shard_of(cache, hash);
+    int serverID = -1;
+
+    pthread_mutex_lock(&shard->lock);
+        int idx = shard_find(shard, path, hash, NULL);
+        if (idx >= 0) {
+            shard->entries[idx].referenced = true;
+            serverID = shard->entries[idx].serverID;
+            *replicas = shard->entries[idx].replicas;
+            shard->hits++;
+        } else {
+            shard->misses++;
+        }
+        *generation = shard->generation;
+    pthread_mutex_unlock(&shard->lock);
+
+    return serverID;
+}
+
+/**
+ * @brief Caches the storage server of a path, evicting if the shard is full.
+ * Nothing is cached if the shard saw an invalidation since the lookup, as
+ * the answer may already be stale.
+ *
+ * @param cache: The location cache.
+ * @param path: Path that was looked up.
+ * @param hash: hash_path(path).
+ * @param serverID: Storage server holding the path.
+ * @param replicas: Every storage server holding the path.
+ * @param generation: Generation returned by the cache_lookup that missed.
+ */
+void cache_insert(LocationCache* cache, const char* path, unsigned long long hash, int serverID, unsigned int replicas, long generation) {
+    CacheShard* shard = shard_of(cache, hash);
+
+    pthread_mutex_lock(&shard->lock);
+        if (shard->generation != generation) {
+            pthread_mutex_unlock(&shard->lock);
+            return;
+        }
+
+        int idx = shard_find(shard, path, hash, NULL);
+        if (idx < 0) {
+            idx = shard_take_slot(shard);
+            CacheEntry* entry = &shard->entries[idx];
+            entry->path = strdup(path);
+            entry->hash = hash;
+            entry->used = true;
+
+            int bucket = hash & (shard->num_buckets - 1);
+            entry->next = shard->buckets[bucket];
+            shard->buckets[bucket] = idx;
+            shard->size++;
+        }
+        shard->entries[idx].serverID = serverID;
+        shard->entries[idx].replicas = replicas;
+        shard->entries[idx].referenced = false;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * @brief Drops a path from the cache.
+ *
+ * @param cache: The location cache.
+ * @param path: Path that changed.
+ */
+void cache_invalidate(LocationCache* cache, const char* path) {
+    unsigned long long hash = hash_path(path);
+    CacheShard* shard = shard_of(cache, hash);
+
+    pthread_mutex_lock(&shard->lock);
+        int prev;
+        int idx = shard_find(shard, path, hash, &prev);
+        if (idx >= 0) {
+            shard_remove(shard, idx, prev);
+            shard->invalidations++;
+        }
+        shard->generation++;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * @brief Drops every path starting with prefix from the cache. Needs a
+ * scan of all entries, so it is meant for directory deletes only.
+ *
+ * @param cache: The location cache.
+ * @param prefix: Prefix of the paths that changed, empty to drop everything.
+ */
+void cache_invalidate_prefix(LocationCache* cache, const char* prefix) {
+    size_t len = strlen(prefix);
+
+    for (int s = 0; s < CACHE_SHARDS; s++) {
+        CacheShard* shard = &cache->shards[s];
+        pthread_mutex_lock(&shard->lock);
+            for (int i = 0; i < shard->capacity; i++) {
+                CacheEntry* entry = &shard->entries[i];
+                if (entry->used && strncmp(entry->path, prefix, len) == 0) {
+                    int prev;
+                    shard_find(shard, entry->path, entry->hash, &prev);
+                    shard_remove(shard, i, prev);
+                    shard->invalidations++;
+                }
+            }
+            shard->generation++;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+/**
+ * @brief Drops every path a storage server holds from the cache, as its
+ * primary or as one of the replicas. Needs a scan of all entries, so it
+ * is meant for a server that registers with a changed set of paths.
+ *
+ * @param cache: The location cache.
+ * @param serverID: The storage server.
+ */
+void cache_invalidate_server(LocationCache* cache, int serverID) {
+    for (int s = 0; s < CACHE_SHARDS; s++) {
+        CacheShard* shard = &cache->shards[s];
+        pthread_mutex_lock(&shard->lock);
+            for (int i = 0; i < shard->capacity; i++) {
+                CacheEntry* entry = &shard->entries[i];
+                if (entry->used && (entry->serverID == serverID || (entry->replicas & (1u << serverID)))) {
+                    int prev;
+                    shard_find(shard, entry->path, entry->hash, &prev);
+                    shard_remove(shard, i, prev);
+                    shard->invalidations++;
+                }
+            }
+            shard->generation++;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+/**
+ * @brief Sums the counters of all shards.
+ *
+ * @param cache: The location cache.
+ * @param stats: Filled with the totals.
+ */
+void getCacheStats(LocationCache* cache, CacheStats* stats) {
+    memset(stats, 0, sizeof(CacheStats));
+    for (int s = 0; s < CACHE_SHARDS; s++) {
+        CacheShard* shard = &cache->shards[s];
+        pthread_mutex_lock(&shard->lock);
+            stats->hits += shard->hits;
+            stats->misses += shard->misses;
+            stats->evictions += shard->evictions;
+            stats->invalidations += shard->invalidations;
+            stats->size += shard->size;
+            stats->capacity += shard->capacity;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+/**
+ * @brief Logs the hit/miss/eviction counters of the location cache.
+ *
+ * @param cache: The location cache.
+ */
+void logCacheStats(LocationCache* cache) {
+    CacheStats stats;
+    getCacheStats(cache, &stats);
+
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer),
+        "Location cache: %d/%d paths, %ld hits, %ld misses, %ld evictions, %ld invalidations",
+        stats.size, stats.capacity, stats.hits, stats.misses, stats.evictions, stats.invalidations);
+    LOG(buffer, true);
+}
@@ -0,0 +1,165 @@
+#include "nm.h"
+
+#include "../utils/headers.h"
+#include "../utils/logging.h"
+#include "../utils/constants.h"
+#include "../utils/structs.h"
+
+/***************************************************/
+/*     Namespace deltas from the storage servers   */
+/***************************************************/
+
+static pthread_mutex_t delta_locks[MAX_SERVERS];    // Orders the deltas and resyncs of each server
+static pthread_once_t delta_locks_once = PTHREAD_ONCE_INIT;
+
+static void init_delta_locks(void) {
+    for (int i = 0; i < MAX_SERVERS; i++) {
+        pthread_mutex_init(&delta_locks[i], NULL);
+    }
+}
+
+/**
+ * @brief Applies one change of a delta to the trie and the location cache.
+ */
+static void applyDeltaChange(DeltaChange* change, int ss_num, trienode** root, LocationCache* cache) {
+    change->path[MAX_PATH_LEN - 1] = '\0';
+    int len = strlen(change->path);
+    if (len == 0) {
+        return;
+    }
+
+    if (change->op == DELTA_ADD) {
+        trieinsert(root, change->path, ss_num);
+        journalRecord(JOURNAL_ADD, ss_num, 0, change->path);
+        cache_invalidate(cache, change->path);
+        revokePathLeases(change->path);
+    } else if (change->op == DELTA_REMOVE) {
+        // Only this server's copy goes, the other replicas keep the path
+        remove_trie_replica(root, change->path, ss_num);
+        journalRecord(JOURNAL_REMOVE, ss_num, 0, change->path);
+
+        // Everything below a deleted directory goes with it
+        if (change->path[len - 1] == '/') {
+            cache_invalidate_prefix(cache, change->path);
+            revokePrefixLeases(change->path);
+        } else {
+            cache_invalidate(cache, change->path);
+            revokePathLeases(change->path);
+        }
+    } else if (change->op == DELTA_UNMARK) {
+        unmark_trie_path(root, change->path);
+        journalRecord(JOURNAL_UNMARK, ss_num, 0, change->path);
+    }
+}
+
+/**
+ * @brief Applies a namespace delta from a storage server, if it is the
+ * next one in sequence. Deltas already covered by a resync are dropped.
+ * 
+ * @param ss_num : Storage server the delta came from.
+ * @param delta : The delta.
+ * @param servers : Pointer to an array of ServerDetails structs containing server details.
+ * @param root : Root of the path trie.
+ * @param cache : Location cache, invalidated for the changed paths.
+ * 
+ * @return false if a delta is missing and the server has to be resynced.
+ */
+bool applyPathDelta(int ss_num, PathDelta* delta, ServerDetails* servers, trienode** root, LocationCache* cache) {
+    pthread_once(&delta_locks_once, init_delta_locks);
+
+    pthread_mutex_lock(&delta_locks[ss_num]);
+        long expected = servers[ss_num].seq + 1;
+        if (delta->seq < expected) {
+            pthread_mutex_unlock(&delta_locks[ss_num]);
+            return true;
+        } else if (delta->seq > expected || delta->num_changes > MAX_DELTA_CHANGES) {
+            char inform_log[128];
+            snprintf(inform_log, sizeof(inform_log), "Storage server %d sent delta %ld, expected %ld", ss_num, delta->seq, expected);
+            LOG(inform_log, false);
+            pthread_mutex_unlock(&delta_locks[ss_num]);
+            return false;
+        }
+
+        for (int i = 0; i < delta->num_changes; i++) {
+            applyDeltaChange(&delta->changes[i], ss_num, root, cache);
+        }
+        servers[ss_num].seq = delta->seq;
+        journalRecord(JOURNAL_SEQ, ss_num, delta->seq, NULL);
+        journalCommit();
+    pthread_mutex_unlock(&delta_locks[ss_num]);
+
+    LOG("Applied namespace delta from storage server", true);
+    logNamespaceStats();
+    return true;
+}
+
+/**
+ * @brief Rebuilds the paths of a storage server from scratch, when its
+ * deltas can no longer be applied in order. The server sends its whole
+ * namespace, like at registration.
+ * 
+ * @param ss_num : Storage server to resync.
+ * @param servers : Pointer to an array of ServerDetails structs containing server details.
+ * @param root : Root of the path trie.
+ * @param cache : Location cache, emptied afterwards.
+ * 
+ * @return true on success, false on failure
+ */
+bool resyncServer(int ss_num, ServerDetails* servers, trienode** root, LocationCache* cache) {
+    pthread_once(&delta_locks_once, init_delta_locks);
+
+    ServerDetails* details = (ServerDetails*) malloc(sizeof(ServerDetails));
+    if (details == NULL) {
+        LOG("Error allocating server details for resync", false);
+        return false;
+    }
+
+    pthread_mutex_lock(&delta_locks[ss_num]);
+        int storage_fd;
+        if (!connectToStorageServer(&storage_fd, ss_num, servers)) {
+            pthread_mutex_unlock(&delta_locks[ss_num]);
+            free(details);
+            return false;
+        }
+
+        // On a connection of its own, the pooled one may be waiting on this
+        StorageRequest request;
+        memset(&request, 0, sizeof(StorageRequest));
+        request.request.requestType = RESYNC;
+        request.request.traceID = newTraceID();
+
+        StorageReply reply;
+        if (!sendAll(storage_fd, &request, sizeof(StorageRequest)) ||
+            !recvAll(storage_fd, &reply, sizeof(StorageReply)) ||
+            !recvServerDetails(storage_fd, details)) {
+            LOG("Error resyncing storage server", false);
+            close(storage_fd);
+            pthread_mutex_unlock(&delta_locks[ss_num]);
+            free(details);
+            return false;
+        }
+        close(storage_fd);
+
+        release_server_paths(root, ss_num);
+        journalRecord(JOURNAL_RELEASE, ss_num, 0, NULL);
+        for (int i = 0; i < details->num_paths && i < MAX_PATHS; i++) {
+            details->accessible_paths[i][MAX_PATH_LEN - 1] = '\0';
+            trieinsert(root, details->accessible_paths[i], ss_num);
+            journalRecord(JOURNAL_ADD, ss_num, 0, details->accessible_paths[i]);
+        }
+        servers[ss_num].num_paths = details->num_paths;
+        servers[ss_num].seq = details->seq;
+        journalRecord(JOURNAL_SEQ, ss_num, details->seq, NULL);
+        journalCommit();
+    pthread_mutex_unlock(&delta_locks[ss_num]);
+
+    free(details);
+
+    // Paths of the server may have moved anywhere
+    cache_invalidate_prefix(cache, "");
+    revokeServerLeases(ss_num);
+
+    LOG("Resynced storage server", true);
+    logNamespaceStats();
+    return true;
+}
@@ -0,0 +1,103 @@
+#include "nm.h"
+
+#include "../utils/headers.h"
+#include "../utils/logging.h"
+#include "../utils/constants.h"
+#include "../utils/structs.h"
+
+/***************************************************/
+/*      Epoch based reclamation for trie readers   */
+/***************************************************/
+
+static EpochSlot epoch_slots[EPOCH_MAX_THREADS];    // One slot per reader thread, 0 while outside a lookup
+static atomic_int num_epoch_slots = 0;              // Slots ever handed out, bounds the scans
+static atomic_ulong global_epoch = 1;               // Advanced every time memory is retired
+static __thread int my_slot = -1;                   // Slot of the calling thread
+static pthread_key_t slot_key;                      // Gives the slot back when the thread exits
+static pthread_once_t slot_key_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Destructor of slot_key, frees the slot of an exiting thread.
+ */
+static void release_epoch_slot(void* arg) {
+    int slot = (int) (intptr_t) arg - 1;
+    atomic_store(&epoch_slots[slot].epoch, 0);
+    atomic_store(&epoch_slots[slot].in_use, false);
+}
+
+static void create_slot_key(void) {
+    pthread_key_create(&slot_key, release_epoch_slot);
+}
+
+/**
+ * @brief Claims a free reader slot for the calling thread.
+ *
+ * @return Index of the slot.
+ */
+static int acquire_epoch_slot(void) {
+    pthread_once(&slot_key_once, create_slot_key);
+
+    for (int i = 0; i < EPOCH_MAX_THREADS; i++) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&epoch_slots[i].in_use, &expected, true)) {
+            int used = atomic_load(&num_epoch_slots);
+            while (used < i + 1 && !atomic_compare_exchange_weak(&num_epoch_slots, &used, i + 1));
+
+            pthread_setspecific(slot_key, (void*) (intptr_t) (i + 1));
+            return i;
+        }
+    }
+
+    LOG("Out of epoch reader slots", false);
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * @brief Marks the start of a lock-free read of the trie. Memory retired
+ * after this point is not reused until the matching epoch_exit.
+ */
+void epoch_enter(void) {
+    if (my_slot < 0) {
+        my_slot = acquire_epoch_slot();
+    }
+    atomic_store(&epoch_slots[my_slot].epoch, atomic_load(&global_epoch));
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+/**
+ * @brief Marks the end of a lock-free read of the trie.
+ */
+void epoch_exit(void) {
+    atomic_store_explicit(&epoch_slots[my_slot].epoch, 0, memory_order_release);
+}
+
+/**
+ * @brief Called by a writer after unlinking memory from the trie.
+ *
+ * @return The epoch to pass to epoch_passed before reusing that memory.
+ */
+unsigned long epoch_retire(void) {
+    atomic_thread_fence(memory_order_seq_cst);
+    return atomic_fetch_add(&global_epoch, 1);
+}
+
+/**
+ * @brief Whether every reader that could still see memory retired at the
+ * given epoch has left the trie.
+ *
+ * @param retired: Value returned by epoch_retire.
+ *
+ * @return true if the memory can be reused.
+ */
+bool epoch_passed(unsigned long retired) {
+    atomic_thread_fence(memory_order_seq_cst);
+
+    int used = atomic_load(&num_epoch_slots);
+    for (int i = 0; i < used; i++) {
+        unsigned long epoch = atomic_load(&epoch_slots[i].epoch);
+        if (epoch != 0 && epoch <= retired) {
+            return false;
+        }
+    }
+    return true;
+}
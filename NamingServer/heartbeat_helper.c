@@ -0,0 +1,296 @@
+#include "nm.h"
+
+#include "../utils/headers.h"
+#include "../utils/logging.h"
+#include "../utils/constants.h"
+#include "../utils/structs.h"
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+
+/***************************************************/
+/*    Heartbeats and failure detection of the SS   */
+/***************************************************/
+
+static HeartbeatWatch* wheel[HEARTBEAT_WHEEL_SLOTS];              // Watches by the slot of their expiry tick
+static HeartbeatWatch* watches[MAX_SERVERS];                       // Watch of each online server
+static ServerLoad server_loads[MAX_SERVERS];                       // Last load each server reported
+static long current_tick = 0;                                      // Last tick the wheel went past
+static long long start_ms = 0;                                     // Time of tick 0
+static int miss_threshold = HEARTBEAT_MISS_THRESHOLD;              // Beats missed before a server is offline
+static int monitor_fd = -1;                                        // epoll instance of the monitor
+static ServerDetails* heartbeat_servers = NULL;                    // Server table of the NM
+static pthread_mutex_t heartbeat_lock = PTHREAD_MUTEX_INITIALIZER; // Protects everything above
+
+static long long monotonic_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Ticks a server may stay silent for before it is declared offline.
+ */
+static long timeout_ticks() {
+    return ((long) HEARTBEAT_INTERVAL_MS * miss_threshold + HEARTBEAT_TICK_MS - 1) / HEARTBEAT_TICK_MS;
+}
+
+/**
+ * @brief Takes a watch off the wheel. The caller holds heartbeat_lock.
+ */
+static void wheel_unlink(HeartbeatWatch* watch) {
+    if (watch->prev != NULL) {
+        watch->prev->next = watch->next;
+    } else {
+        wheel[watch->expire_tick & (HEARTBEAT_WHEEL_SLOTS - 1)] = watch->next;
+    }
+    if (watch->next != NULL) {
+        watch->next->prev = watch->prev;
+    }
+    watch->prev = watch->next = NULL;
+}
+
+/**
+ * @brief Puts a watch on the wheel to expire ticks from now. Deadlines
+ * further away than the wheel is long share a slot with nearer ones and
+ * are skipped until their round comes. The caller holds heartbeat_lock.
+ */
+static void wheel_schedule(HeartbeatWatch* watch, long ticks) {
+    watch->expire_tick = current_tick + ((ticks > 0) ? ticks : 1);
+    HeartbeatWatch** slot = &wheel[watch->expire_tick & (HEARTBEAT_WHEEL_SLOTS - 1)];
+    watch->prev = NULL;
+    watch->next = *slot;
+    if (*slot != NULL) {
+        (*slot)->prev = watch;
+    }
+    *slot = watch;
+}
+
+/**
+ * @brief Declares a server offline and stops watching it. Its paths stay
+ * in the namespace so it can confirm them when it registers again. The
+ * rest is left to settle_offline, once heartbeat_lock is let go. The
+ * caller holds heartbeat_lock.
+ *
+ * @param watch : Watch of the server, freed here.
+ * @param reason : Logged with the server ID.
+ * @param down : The server ID is added here.
+ * @param num_down : Number of IDs in down.
+ */
+static void declare_offline(HeartbeatWatch* watch, const char* reason, int* down, int* num_down) {
+    int serverID = watch->serverID;
+
+    epoll_ctl(monitor_fd, EPOLL_CTL_DEL, watch->socket, NULL);
+    close(watch->socket);
+    wheel_unlink(watch);
+    watches[serverID] = NULL;
+    free(watch);
+
+    heartbeat_servers[serverID].online = false;
+    down[(*num_down)++] = serverID;
+
+    char inform_log[128];
+    snprintf(inform_log, sizeof(inform_log), "Storage server %d is offline: %s", serverID, reason);
+    LOG(inform_log, false);
+}
+
+/**
+ * @brief Finishes taking down a server declared offline: requests in
+ * flight to it fail and clients lose their leases on it. Dropping its
+ * connection may wait on a connect to it, so this runs without
+ * heartbeat_lock, which every redirect and beat needs.
+ *
+ * @param serverID : The server.
+ */
+static void settle_offline(int serverID) {
+    awaitServerReturn(serverID);
+    dropStorageConnection(serverID);
+    revokeServerLeases(serverID);
+}
+
+/**
+ * @brief Reads the beats a server sent. Every complete beat records the
+ * load it reports and pushes the server's deadline back. A partial beat
+ * is kept for the next event. The caller holds heartbeat_lock.
+ *
+ * @return false if the connection is gone or the server sent garbage.
+ */
+static bool read_beats(HeartbeatWatch* watch) {
+    while (1) {
+        char* buffer = (char*) &watch->packet;
+        ssize_t got = recv(watch->socket, buffer + watch->received, sizeof(HeartbeatPacket) - watch->received, 0);
+        if (got == 0) {
+            return false;
+        }
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+
+        watch->received += got;
+        if (watch->received < sizeof(HeartbeatPacket)) {
+            continue;
+        }
+        watch->received = 0;
+
+        if (watch->packet.serverID != watch->serverID) {
+            return false;
+        }
+        server_loads[watch->serverID] = watch->packet.load;
+        server_loads[watch->serverID].updated_ms = monotonic_ms();
+
+        wheel_unlink(watch);
+        wheel_schedule(watch, timeout_ticks());
+    }
+}
+
+/**
+ * @brief Moves the wheel up to the present, declaring offline every
+ * server whose deadline went by. Only the slots of the ticks passed are
+ * looked at, so the cost does not grow with the number of servers that
+ * are fine. The caller holds heartbeat_lock.
+ *
+ * @param down : IDs of the servers declared offline are added here.
+ * @param num_down : Number of IDs in down.
+ */
+static void advance_wheel(int* down, int* num_down) {
+    long now_tick = (monotonic_ms() - start_ms) / HEARTBEAT_TICK_MS;
+    while (current_tick < now_tick) {
+        current_tick++;
+        HeartbeatWatch* watch = wheel[current_tick & (HEARTBEAT_WHEEL_SLOTS - 1)];
+        while (watch != NULL) {
+            HeartbeatWatch* next = watch->next;
+            if (watch->expire_tick <= current_tick) {
+                declare_offline(watch, "missed its heartbeats", down, num_down);
+            }
+            watch = next;
+        }
+    }
+}
+
+/**
+ * @brief Runs the monitor: reads beats as they come, and turns the wheel
+ * every HEARTBEAT_TICK_MS.
+ */
+static void* monitor_thread(void* arg) {
+    struct epoll_event events[MAX_SERVERS];
+    int down[MAX_SERVERS];
+
+    while (1) {
+        int ready = epoll_wait(monitor_fd, events, MAX_SERVERS, HEARTBEAT_TICK_MS);
+        if (ready < 0 && errno != EINTR) {
+            LOG("Error waiting for heartbeats", false);
+        }
+
+        int num_down = 0;
+        pthread_mutex_lock(&heartbeat_lock);
+            for (int i = 0; i < ready; i++) {
+                HeartbeatWatch* watch = (HeartbeatWatch*) events[i].data.ptr;
+                if (!read_beats(watch)) {
+                    declare_offline(watch, "lost its connection", down, &num_down);
+                }
+            }
+            advance_wheel(down, &num_down);
+        pthread_mutex_unlock(&heartbeat_lock);
+
+        for (int i = 0; i < num_down; i++) {
+            settle_offline(down[i]);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Starts the thread that watches over the storage servers. A
+ * server that stays silent for missThreshold heartbeat intervals, or whose
+ * registration connection drops, is declared offline within a tick of it.
+ *
+ * @param servers : Pointer to an array of ServerDetails structs containing server details.
+ * @param missThreshold : Beats a server may miss in a row.
+ */
+void startHeartbeatMonitor(ServerDetails* servers, int missThreshold) {
+    heartbeat_servers = servers;
+    miss_threshold = missThreshold;
+    start_ms = monotonic_ms();
+
+    monitor_fd = epoll_create1(0);
+    if (monitor_fd < 0) {
+        LOG("Error creating heartbeat monitor", false);
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_t monitorThreadId;
+    if (pthread_create(&monitorThreadId, NULL, monitor_thread, NULL) != 0) {
+        LOG("Error creating heartbeat monitor thread", false);
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(monitorThreadId);
+}
+
+/**
+ * @brief Starts watching a server that just registered. Its beats arrive
+ * on the connection it registered on, which the monitor now owns.
+ *
+ * @param serverID : The server.
+ * @param socket : Its registration connection.
+ *
+ * @return false if the server could not be watched.
+ */
+bool watchServer(int serverID, int socket) {
+    int flags = fcntl(socket, F_GETFL, 0);
+    HeartbeatWatch* watch = (HeartbeatWatch*) malloc(sizeof(HeartbeatWatch));
+    if (flags < 0 || fcntl(socket, F_SETFL, flags | O_NONBLOCK) < 0 || watch == NULL) {
+        LOG("Error setting up heartbeat watch", false);
+        free(watch);
+        return false;
+    }
+    watch->serverID = serverID;
+    watch->socket = socket;
+    watch->received = 0;
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLRDHUP;
+    event.data.ptr = watch;
+
+    pthread_mutex_lock(&heartbeat_lock);
+        memset(&server_loads[serverID], 0, sizeof(ServerLoad));
+        wheel_schedule(watch, timeout_ticks());
+        watches[serverID] = watch;
+        bool added = (epoll_ctl(monitor_fd, EPOLL_CTL_ADD, socket, &event) == 0);
+        if (!added) {
+            wheel_unlink(watch);
+            watches[serverID] = NULL;
+            free(watch);
+        }
+    pthread_mutex_unlock(&heartbeat_lock);
+
+    if (!added) {
+        LOG("Error adding server to the heartbeat monitor", false);
+    }
+    return added;
+}
+
+/**
+ * @brief Gives the load a server reported in its last heartbeat.
+ *
+ * @param serverID : The server.
+ * @param load : Set to the load, updated_ms is 0 if no beat came yet.
+ *
+ * @return false if the server is not being watched.
+ */
+bool getServerLoad(int serverID, ServerLoad* load) {
+    if (serverID < 0 || serverID >= MAX_SERVERS) {
+        return false;
+    }
+
+    pthread_mutex_lock(&heartbeat_lock);
+        bool watched = (watches[serverID] != NULL);
+        if (watched) {
+            *load = server_loads[serverID];
+        }
+    pthread_mutex_unlock(&heartbeat_lock);
+    return watched;
+}
@@ -0,0 +1,700 @@
+#include "nm.h"
+
+#include "../utils/headers.h"
+#include "../utils/logging.h"
+#include "../utils/constants.h"
+#include "../utils/structs.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+
+/***************************************************/
+/*     Journal and snapshot of the NM namespace    */
+/***************************************************/
+
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;   // Protects the journal file and buffer
+static int journal_fd = -1;                                         // Journal being appended to
+static long long journal_generation = 0;                            // Its generation
+static size_t journal_bytes = 0;                                    // Bytes written to it so far
+static char journal_buffer[JOURNAL_BUFFER_SIZE];                    // Records not written yet
+static size_t journal_buffered = 0;                                 // Bytes in journal_buffer
+static atomic_bool snapshot_running = false;                        // Only one compaction at a time
+static bool recovered_servers[MAX_SERVERS];                         // Known from the journal, not confirmed yet
+static ServerDetails* journal_servers = NULL;                       // Server table of the NM
+static trienode** journal_root = NULL;                              // Namespace trie of the NM
+
+/**
+ * @brief Folds bytes into the checksum of the snapshot, eight at a time.
+ * Data hashed in several calls gives the same result as in one, as long
+ * as every call but the last passes a multiple of eight bytes.
+ */
+static unsigned long long snapshot_checksum(unsigned long long hash, const void* data, size_t len) {
+    const unsigned char* bytes = (const unsigned char*) data;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        unsigned long long word;
+        memcpy(&word, bytes + i, 8);
+        hash = (hash ^ word) * HASH_PRIME;
+        hash ^= hash >> 29;
+    }
+    return hash_update(hash, bytes + i, len - i);
+}
+
+/**
+ * @brief Checksum of a journal record, computed with its checksum field at 0.
+ */
+static unsigned int record_checksum(JournalRecord record, const char* path) {
+    record.checksum = 0;
+    unsigned long long hash = hash_update(HASH_SEED, &record, sizeof(JournalRecord));
+    hash = hash_update(hash, path, record.length);
+    return (unsigned int) (hash ^ (hash >> 32));
+}
+
+/**
+ * @brief File name of the journal of a generation.
+ */
+static void journal_name(char* name, size_t size, long long generation) {
+    snprintf(name, size, "%s.%lld", JOURNAL_FILE, generation);
+}
+
+/**
+ * @brief Removes the journals of every generation before the given one,
+ * which a snapshot already covers. Compactions that failed or died
+ * halfway can leave several behind.
+ */
+static void remove_journals_before(long long generation) {
+    DIR* dir = opendir(".");
+    if (dir == NULL) {
+        return;
+    }
+
+    const char* base = strrchr(JOURNAL_FILE, '/') + 1;
+    size_t base_len = strlen(base);
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char* end;
+        if (strncmp(entry->d_name, base, base_len) != 0 || entry->d_name[base_len] != '.') {
+            continue;
+        }
+        long long old = strtoll(entry->d_name + base_len + 1, &end, 10);
+        if (*end == '\0' && end != entry->d_name + base_len + 1 && old < generation) {
+            char name[256];
+            journal_name(name, sizeof(name), old);
+            unlink(name);
+        }
+    }
+    closedir(dir);
+}
+
+/**
+ * @brief Writes out the buffered records. The caller holds journal_lock.
+ */
+static bool journal_flush_locked() {
+    size_t written = 0;
+    while (written < journal_buffered) {
+        ssize_t n = write(journal_fd, journal_buffer + written, journal_buffered - written);
+        if (n < 0) {
+            LOG("Error writing the journal", false);
+            journal_buffered = 0;
+            return false;
+        }
+        written += n;
+    }
+    journal_bytes += journal_buffered;
+    journal_buffered = 0;
+
+    if (JOURNAL_FSYNC) {
+        fdatasync(journal_fd);
+    }
+    return true;
+}
+
+/**
+ * @brief Appends a record to the journal. It is only buffered, the caller
+ * ends each change of the namespace with journalCommit.
+ *
+ * @param op : What happened.
+ * @param serverID : Storage server it happened on.
+ * @param seq : Sequence number, for JOURNAL_SEQ.
+ * @param path : The path, NULL if the record has none.
+ */
+void journalRecord(JournalOp op, int serverID, long seq, const char* path) {
+    JournalRecord record;
+    memset(&record, 0, sizeof(JournalRecord));
+    record.op = op;
+    record.serverID = serverID;
+    record.seq = seq;
+    record.length = (path == NULL) ? 0 : strnlen(path, MAX_PATH_LEN - 1);
+    if (path == NULL) {
+        path = "";
+    }
+    record.checksum = record_checksum(record, path);
+
+    pthread_mutex_lock(&journal_lock);
+        if (journal_fd >= 0) {
+            if (journal_buffered + sizeof(JournalRecord) + record.length > JOURNAL_BUFFER_SIZE) {
+                journal_flush_locked();
+            }
+            memcpy(journal_buffer + journal_buffered, &record, sizeof(JournalRecord));
+            memcpy(journal_buffer + journal_buffered + sizeof(JournalRecord), path, record.length);
+            journal_buffered += sizeof(JournalRecord) + record.length;
+        }
+    pthread_mutex_unlock(&journal_lock);
+}
+
+/**
+ * @brief Appends the registration of a storage server to the journal.
+ *
+ * @param server : Details of the server.
+ */
+void journalServer(const ServerDetails* server) {
+    JournalRecord record;
+    memset(&record, 0, sizeof(JournalRecord));
+    record.op = JOURNAL_SERVER;
+    record.serverID = server->serverID;
+    record.seq = server->seq;
+    record.port_nm = server->port_nm;
+    record.port_client = server->port_client;
+    record.length = strnlen(server->serverIP, IP_LEN - 1);
+    record.checksum = record_checksum(record, server->serverIP);
+
+    pthread_mutex_lock(&journal_lock);
+        if (journal_fd >= 0) {
+            if (journal_buffered + sizeof(JournalRecord) + record.length > JOURNAL_BUFFER_SIZE) {
+                journal_flush_locked();
+            }
+            memcpy(journal_buffer + journal_buffered, &record, sizeof(JournalRecord));
+            memcpy(journal_buffer + journal_buffered + sizeof(JournalRecord), server->serverIP, record.length);
+            journal_buffered += sizeof(JournalRecord) + record.length;
+        }
+    pthread_mutex_unlock(&journal_lock);
+}
+
+/**
+ * @brief Applies one record of the journal to the namespace.
+ */
+static void apply_record(JournalRecord* record, char* path) {
+    int id = record->serverID;
+    if (id < 0 || id >= MAX_SERVERS) {
+        return;
+    }
+
+    switch (record->op) {
+        case JOURNAL_ADD:
+            trieinsert(journal_root, path, id);
+            break;
+        case JOURNAL_REMOVE:
+            remove_trie_replica(journal_root, path, id);
+            break;
+        case JOURNAL_UNMARK:
+            unmark_trie_path(journal_root, path);
+            break;
+        case JOURNAL_RELEASE:
+            release_server_paths(journal_root, id);
+            break;
+        case JOURNAL_SERVER:
+            journal_servers[id].serverID = id;
+            strncpy(journal_servers[id].serverIP, path, IP_LEN - 1);
+            journal_servers[id].serverIP[IP_LEN - 1] = '\0';
+            journal_servers[id].port_nm = record->port_nm;
+            journal_servers[id].port_client = record->port_client;
+            journal_servers[id].seq = record->seq;
+            journal_servers[id].online = false;
+            recovered_servers[id] = true;
+            break;
+        case JOURNAL_SEQ:
+            journal_servers[id].seq = record->seq;
+            break;
+    }
+}
+
+/**
+ * @brief Replays the journal of a generation. A torn record at the end
+ * (the NM died halfway through a write) is cut off.
+ *
+ * @param generation : Generation of the journal.
+ * @param records : Incremented by the number of records applied.
+ *
+ * @return false if there is no journal of that generation.
+ */
+static bool replay_journal(long long generation, long* records) {
+    char name[256];
+    journal_name(name, sizeof(name), generation);
+
+    int fd = open(name, O_RDWR);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return true;
+    }
+
+    char* data = (char*) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        LOG("Error mapping the journal", false);
+        close(fd);
+        return true;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    size_t offset = 0;
+    char path[MAX_PATH_LEN];
+    while (offset + sizeof(JournalRecord) <= (size_t) st.st_size) {
+        JournalRecord record;
+        memcpy(&record, data + offset, sizeof(JournalRecord));
+        if (record.length >= MAX_PATH_LEN || offset + sizeof(JournalRecord) + record.length > (size_t) st.st_size) {
+            break;
+        }
+
+        memcpy(path, data + offset + sizeof(JournalRecord), record.length);
+        path[record.length] = '\0';
+        if (record_checksum(record, path) != record.checksum) {
+            break;
+        }
+
+        apply_record(&record, path);
+        offset += sizeof(JournalRecord) + record.length;
+        (*records)++;
+    }
+    munmap(data, st.st_size);
+
+    if (offset < (size_t) st.st_size) {
+        LOG("Journal ends in a torn record, cutting it off", false);
+        if (ftruncate(fd, offset) < 0) {
+            LOG("Error truncating the journal", false);
+        }
+    }
+    close(fd);
+    return true;
+}
+
+/**
+ * @brief Loads the snapshot by mapping it and bulk loading its paths,
+ * which are in strcmp order, into the trie.
+ *
+ * @param generation : Set to the first journal generation to replay.
+ * @param paths : Set to the number of paths loaded.
+ *
+ * @return false if there is no valid snapshot.
+ */
+static bool load_snapshot(long long* generation, long* paths) {
+    int fd = open(SNAPSHOT_FILE, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(SnapshotHeader)) {
+        close(fd);
+        return false;
+    }
+
+    char* data = (char*) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        LOG("Error mapping the snapshot", false);
+        return false;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    SnapshotHeader header;
+    memcpy(&header, data, sizeof(SnapshotHeader));
+    size_t size = st.st_size;
+    if (header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION || header.size != size ||
+        header.num_servers < 0 || header.num_servers > MAX_SERVERS ||
+        snapshot_checksum(HASH_SEED, data + sizeof(SnapshotHeader), size - sizeof(SnapshotHeader)) != header.checksum) {
+        LOG("Snapshot is damaged, ignoring it", false);
+        munmap(data, st.st_size);
+        return false;
+    }
+
+    size_t offset = sizeof(SnapshotHeader);
+    for (int i = 0; i < header.num_servers && offset + sizeof(SnapshotServer) <= size; i++) {
+        SnapshotServer server;
+        memcpy(&server, data + offset, sizeof(SnapshotServer));
+        offset += sizeof(SnapshotServer);
+
+        if (server.serverID < 0 || server.serverID >= MAX_SERVERS) {
+            continue;
+        }
+        ServerDetails* details = &journal_servers[server.serverID];
+        details->serverID = server.serverID;
+        memcpy(details->serverIP, server.serverIP, IP_LEN);
+        details->serverIP[IP_LEN - 1] = '\0';
+        details->port_nm = server.port_nm;
+        details->port_client = server.port_client;
+        details->seq = server.seq;
+        details->online = false;
+        recovered_servers[server.serverID] = true;
+    }
+
+    // The paths are sorted, so each one is inserted starting from the
+    // route of the one before it
+    TrieLoader* loader = (TrieLoader*) malloc(sizeof(TrieLoader));
+    if (loader == NULL) {
+        LOG("Error allocating the snapshot loader", false);
+        munmap(data, st.st_size);
+        return false;
+    }
+    trie_load_begin(loader);
+
+    char path[MAX_PATH_LEN];
+    for (long long i = 0; i < header.num_paths && offset + sizeof(SnapshotPath) <= size; i++) {
+        SnapshotPath entry;
+        memcpy(&entry, data + offset, sizeof(SnapshotPath));
+        offset += sizeof(SnapshotPath);
+        if (entry.length >= MAX_PATH_LEN || offset + entry.length > size) {
+            break;
+        }
+
+        memcpy(path, data + offset, entry.length);
+        path[entry.length] = '\0';
+        offset += entry.length;
+
+        if (entry.serverID >= 0 && entry.serverID < MAX_SERVERS) {
+            trie_load(loader, journal_root, path, entry.serverID);
+            (*paths)++;
+        }
+    }
+
+    trie_load_end(loader, journal_root);
+    free(loader);
+
+    *generation = header.generation;
+    munmap(data, st.st_size);
+    return true;
+}
+
+/**
+ * @brief State of a snapshot being written.
+ */
+typedef struct SnapshotWriter {
+    FILE* file;
+    unsigned long long checksum;
+    long long num_paths;
+    bool failed;
+    size_t buffered;                            // Bytes in buffer
+    char buffer[JOURNAL_BUFFER_SIZE];           // Written and checksummed once full
+} SnapshotWriter;
+
+/**
+ * @brief Writes out and checksums the buffered bytes of the snapshot.
+ */
+static void snapshot_flush(SnapshotWriter* writer) {
+    if (fwrite(writer->buffer, 1, writer->buffered, writer->file) != writer->buffered) {
+        writer->failed = true;
+    }
+    writer->checksum = snapshot_checksum(writer->checksum, writer->buffer, writer->buffered);
+    writer->buffered = 0;
+}
+
+static void snapshot_write(SnapshotWriter* writer, const void* data, size_t len) {
+    const char* bytes = (const char*) data;
+    while (len > 0) {
+        size_t chunk = JOURNAL_BUFFER_SIZE - writer->buffered;
+        if (chunk > len) {
+            chunk = len;
+        }
+        memcpy(writer->buffer + writer->buffered, bytes, chunk);
+        writer->buffered += chunk;
+        bytes += chunk;
+        len -= chunk;
+
+        if (writer->buffered == JOURNAL_BUFFER_SIZE) {
+            snapshot_flush(writer);
+        }
+    }
+}
+
+/**
+ * @brief Appends one replica of a path to the snapshot.
+ */
+static void snapshot_entry(SnapshotWriter* writer, const char* path, int len, int serverID) {
+    SnapshotPath entry;
+    entry.length = len;
+    entry.serverID = serverID;
+    snapshot_write(writer, &entry, sizeof(SnapshotPath));
+    snapshot_write(writer, path, len);
+    writer->num_paths++;
+}
+
+/**
+ * @brief Visitor of walk_trie, appends a path to the snapshot, once for
+ * each of its replicas. The primary goes first, so it is the primary
+ * again once loaded.
+ */
+static void snapshot_path(const char* path, int len, int serverID, unsigned int replicas, void* arg) {
+    SnapshotWriter* writer = (SnapshotWriter*) arg;
+    if (serverID < 0 || serverID >= MAX_SERVERS) {
+        return;
+    }
+
+    snapshot_entry(writer, path, len, serverID);
+    for (int i = 0; i < MAX_SERVERS; i++) {
+        if (i != serverID && (replicas & (1u << i))) {
+            snapshot_entry(writer, path, len, i);
+        }
+    }
+}
+
+/**
+ * @brief Compacts the journal into a new snapshot. Appends move to a new
+ * journal first, and the trie is walked after that, so whatever the walk
+ * misses is in the new journal. The old journals are only removed once
+ * the snapshot is safely renamed in place.
+ *
+ * @return true on success, false on failure
+ */
+static bool write_snapshot() {
+    char new_name[256];
+
+    pthread_mutex_lock(&journal_lock);
+        journal_flush_locked();
+        long long old_generation = journal_generation;
+        journal_name(new_name, sizeof(new_name), old_generation + 1);
+        int fd = open(new_name, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0) {
+            pthread_mutex_unlock(&journal_lock);
+            LOG("Error opening a new journal", false);
+            return false;
+        }
+        close(journal_fd);
+        journal_fd = fd;
+        journal_generation = old_generation + 1;
+        journal_bytes = 0;
+    pthread_mutex_unlock(&journal_lock);
+
+    // Only one snapshot is written at a time
+    static SnapshotWriter writer;
+    writer.checksum = HASH_SEED;
+    writer.num_paths = 0;
+    writer.failed = false;
+    writer.buffered = 0;
+
+    char tmp_name[256];
+    snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", SNAPSHOT_FILE);
+    writer.file = fopen(tmp_name, "wb");
+    if (writer.file == NULL) {
+        LOG("Error creating the snapshot", false);
+        return false;
+    }
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(SnapshotHeader));
+    fwrite(&header, sizeof(SnapshotHeader), 1, writer.file);
+
+    for (int i = 0; i < MAX_SERVERS; i++) {
+        if (journal_servers[i].serverID != i) {
+            continue;
+        }
+        SnapshotServer server;
+        memset(&server, 0, sizeof(SnapshotServer));
+        server.serverID = i;
+        memcpy(server.serverIP, journal_servers[i].serverIP, IP_LEN);
+        server.port_nm = journal_servers[i].port_nm;
+        server.port_client = journal_servers[i].port_client;
+        server.seq = journal_servers[i].seq;
+        snapshot_write(&writer, &server, sizeof(SnapshotServer));
+        header.num_servers++;
+    }
+
+    walk_trie(*journal_root, snapshot_path, &writer);
+    snapshot_flush(&writer);
+
+    header.magic = SNAPSHOT_MAGIC;
+    header.version = SNAPSHOT_VERSION;
+    header.generation = old_generation + 1;
+    header.num_paths = writer.num_paths;
+    header.size = ftell(writer.file);
+    header.checksum = writer.checksum;
+
+    if (writer.failed || fseek(writer.file, 0, SEEK_SET) != 0 ||
+        fwrite(&header, sizeof(SnapshotHeader), 1, writer.file) != 1 ||
+        fflush(writer.file) != 0 || fsync(fileno(writer.file)) != 0) {
+        LOG("Error writing the snapshot", false);
+        fclose(writer.file);
+        unlink(tmp_name);
+        return false;
+    }
+    fclose(writer.file);
+
+    if (rename(tmp_name, SNAPSHOT_FILE) < 0) {
+        LOG("Error installing the snapshot", false);
+        unlink(tmp_name);
+        return false;
+    }
+
+    remove_journals_before(old_generation + 1);
+
+    char inform_log[256];
+    snprintf(inform_log, sizeof(inform_log), "Wrote snapshot generation %lld: %lld paths, %llu bytes",
+        header.generation, header.num_paths, header.size);
+    LOG(inform_log, true);
+    return true;
+}
+
+static void* snapshot_thread(void* arg) {
+    write_snapshot();
+    atomic_store(&snapshot_running, false);
+    return NULL;
+}
+
+/**
+ * @brief Starts compacting the journal in the background, unless a
+ * compaction is running already.
+ */
+static void start_snapshot() {
+    bool expected = false;
+    if (!atomic_compare_exchange_strong(&snapshot_running, &expected, true)) {
+        return;
+    }
+
+    pthread_t snapshotThreadId;
+    if (pthread_create(&snapshotThreadId, NULL, snapshot_thread, NULL) != 0) {
+        LOG("Error creating snapshot thread", false);
+        atomic_store(&snapshot_running, false);
+        return;
+    }
+    pthread_detach(snapshotThreadId);
+}
+
+/**
+ * @brief Ends a change of the namespace: writes out its records, and
+ * compacts the journal once it grows past JOURNAL_COMPACT_BYTES.
+ */
+void journalCommit() {
+    pthread_mutex_lock(&journal_lock);
+        if (journal_fd >= 0) {
+            journal_flush_locked();
+        }
+        bool compact = (journal_bytes > JOURNAL_COMPACT_BYTES);
+    pthread_mutex_unlock(&journal_lock);
+
+    if (compact) {
+        start_snapshot();
+    }
+}
+
+/**
+ * @brief Rebuilds the namespace from the snapshot and the journals written
+ * after it, then opens the journal for appending. Storage servers found
+ * this way are known but offline until they confirm their paths.
+ *
+ * @param servers : Array of ServerDetails, initialized.
+ * @param root : Root of the path trie.
+ *
+ * @return Number of storage servers recovered.
+ */
+int recoverNamespace(ServerDetails* servers, trienode** root) {
+    journal_servers = servers;
+    journal_root = root;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    long long generation = 0;
+    long paths = 0;
+    bool snapshot = load_snapshot(&generation, &paths);
+
+    // A compaction that died before removing the journals it replaced
+    // leaves them behind, the snapshot already covers them
+    char name[256];
+    if (snapshot) {
+        remove_journals_before(generation);
+    }
+
+    long records = 0;
+    long long last = generation;
+    while (replay_journal(last, &records)) {
+        last++;
+    }
+    journal_generation = (last > generation) ? last - 1 : generation;
+
+    journal_name(name, sizeof(name), journal_generation);
+    journal_fd = open(name, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (journal_fd < 0) {
+        LOG("Error opening the journal, changes will not survive a restart", false);
+    } else {
+        struct stat st;
+        journal_bytes = (fstat(journal_fd, &st) == 0) ? st.st_size : 0;
+    }
+
+    int num_servers = 0;
+    for (int i = 0; i < MAX_SERVERS; i++) {
+        num_servers += recovered_servers[i];
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    char inform_log[256];
+    snprintf(inform_log, sizeof(inform_log),
+        "Recovered %d servers: %ld paths from %s, %ld journal records, in %.1f ms",
+        num_servers, paths, snapshot ? "the snapshot" : "no snapshot", records,
+        (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1e6);
+    LOG(inform_log, true);
+
+    // The next restart should only have to map the snapshot
+    if (records > 0) {
+        start_snapshot();
+    }
+    return num_servers;
+}
+
+/**
+ * @brief Visitor of walk_trie, sums the fingerprint of one server's paths.
+ */
+typedef struct FingerprintSum {
+    int serverID;
+    int count;
+    unsigned long long fingerprint;
+} FingerprintSum;
+
+static void fingerprint_path(const char* path, int len, int serverID, unsigned int replicas, void* arg) {
+    FingerprintSum* sum = (FingerprintSum*) arg;
+    if (replicas & (1u << sum->serverID)) {
+        sum->fingerprint += hash_path(path);
+        sum->count++;
+    }
+}
+
+/**
+ * @brief Checks whether a registering storage server holds exactly the
+ * paths the journal has for it, by comparing the fingerprint it sent
+ * (pathsFingerprint) with the same sum over the trie.
+ *
+ * @param hello : Details the server registered with, without paths.
+ * @param fingerprint : Fingerprint of the server's paths.
+ *
+ * @return true if the recovered paths can be used as they are.
+ */
+bool confirmRecoveredServer(ServerDetails* hello, unsigned long long fingerprint) {
+    int id = hello->serverID;
+    if (journal_root == NULL || id < 0 || id >= MAX_SERVERS || !recovered_servers[id] || journal_servers[id].online) {
+        return false;
+    }
+    recovered_servers[id] = false;
+
+    FingerprintSum sum = { id, 0, 0 };
+    walk_trie(*journal_root, fingerprint_path, &sum);
+
+    bool confirmed = (sum.count == hello->num_paths && sum.fingerprint == fingerprint);
+    char inform_log[128];
+    snprintf(inform_log, sizeof(inform_log), "Storage server %d %s its %d recovered paths",
+        id, confirmed ? "confirmed" : "did not confirm", sum.count);
+    LOG(inform_log, confirmed);
+    return confirmed;
+}
+
+/**
+ * @brief Lets a server that went offline confirm the paths the NM still
+ * holds for it when it registers again, instead of sending them all.
+ *
+ * @param serverID : The server.
+ */
+void awaitServerReturn(int serverID) {
+    if (serverID >= 0 && serverID < MAX_SERVERS) {
+        recovered_servers[serverID] = true;
+    }
+}
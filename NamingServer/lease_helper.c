@@ -0,0 +1,390 @@
+#include "nm.h"
+
+#include "../utils/headers.h"
+#include "../utils/logging.h"
+#include "../utils/constants.h"
+#include "../utils/structs.h"
+
+/***************************************************/
+/*        Leases on path locations for clients     */
+/***************************************************/
+
+static pthread_mutex_t lease_lock = PTHREAD_MUTEX_INITIALIZER;     // Protects the lease table and pending lists
+static pthread_cond_t lease_cond = PTHREAD_COND_INITIALIZER;       // Signalled when invalidations are pending
+static Lease* lease_buckets[LEASE_BUCKETS];                         // Hash table of leases, chained
+static int num_leases = 0;                                          // Leases in the table
+static int next_lease_id = 0;                                       // ID of the next lease granted
+static LeaseClient lease_clients[MAX_CLIENTS];                      // One per client slot
+static int* pending_clients = NULL;                                 // Clients with pending invalidations
+static int num_pending_clients = 0;                                 // Entries in pending_clients
+static int pending_clients_capacity = 0;                            // Entries allocated for pending_clients
+static pthread_once_t lease_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Current monotonic time in milliseconds.
+ */
+static long long lease_now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Lists a client for the notifier to visit. The caller holds
+ * lease_lock.
+ *
+ * @return false if the list could not grow.
+ */
+static bool list_pending_client(int clientID) {
+    if (num_pending_clients == pending_clients_capacity) {
+        int capacity = (pending_clients_capacity == 0) ? 16 : 2 * pending_clients_capacity;
+        int* clients = (int*) realloc(pending_clients, capacity * sizeof(int));
+        if (clients == NULL) {
+            LOG("Error queueing lease invalidation", false);
+            return false;
+        }
+        pending_clients = clients;
+        pending_clients_capacity = capacity;
+    }
+    pending_clients[num_pending_clients++] = clientID;
+    return true;
+}
+
+/**
+ * @brief Queues the ID of a revoked lease for its client, if the lease
+ * is still running. The caller holds lease_lock.
+ */
+static void queue_invalidation(Lease* lease, long long now) {
+    if (lease->expiry_ms <= now) {
+        return;
+    }
+
+    LeaseClient* client = &lease_clients[lease->clientID];
+    if (!client->connected) {
+        return;
+    }
+
+    // The notifier only visits the clients listed here
+    if (client->num_pending == 0 && !list_pending_client(lease->clientID)) {
+        return;
+    }
+
+    if (client->num_pending == client->pending_capacity) {
+        int capacity = (client->pending_capacity == 0) ? 16 : 2 * client->pending_capacity;
+        int* pending = (int*) realloc(client->pending, capacity * sizeof(int));
+        if (pending == NULL) {
+            LOG("Error queueing lease invalidation", false);
+            return;
+        }
+        client->pending = pending;
+        client->pending_capacity = capacity;
+    }
+    client->pending[client->num_pending++] = lease->leaseID;
+}
+
+/**
+ * @brief Unlinks and frees a lease. The caller holds lease_lock.
+ */
+static void free_lease(Lease** link) {
+    Lease* lease = *link;
+    *link = lease->next;
+    free(lease->path);
+    free(lease);
+    num_leases--;
+}
+
+/**
+ * @brief Pushes pending invalidations to the clients that have some. Runs
+ * in its own thread, and only ever holds one send lock at a time, so a
+ * thread revoking leases while it answers a request never waits for it.
+ * The invalidations are queued on the client's connection like a reply,
+ * and sent by its reactor. A client that is being answered is skipped,
+ * endLeaseReply lists it again once its reply is queued, so no client
+ * waits on another one's reply.
+ */
+static void* lease_notifier(void* arg) {
+    int* clients = NULL;
+    while (true) {
+        // Takes the list of clients to visit, a client is listed again
+        // by the next invalidation queued for it after this
+        pthread_mutex_lock(&lease_lock);
+        while (num_pending_clients == 0) {
+            pthread_cond_wait(&lease_cond, &lease_lock);
+        }
+        free(clients);
+        clients = pending_clients;
+        int num_clients = num_pending_clients;
+        pending_clients = NULL;
+        num_pending_clients = 0;
+        pending_clients_capacity = 0;
+        pthread_mutex_unlock(&lease_lock);
+
+        for (int i = 0; i < num_clients; i++) {
+            LeaseClient* client = &lease_clients[clients[i]];
+
+            pthread_mutex_lock(&client->send_lock);
+            while (true) {
+                AckPacket ack;
+                memset(&ack, 0, sizeof(AckPacket));
+                ack.ack = INVALIDATE_ACK;
+                ack.errorCode = SUCCESS;
+
+                pthread_mutex_lock(&lease_lock);
+                    int count = (client->num_pending < MAX_ACK_EXTRA_INFO - 1) ? client->num_pending : MAX_ACK_EXTRA_INFO - 1;
+                    if (client->replying) {
+                        count = 0;
+                    }
+                    ack.extraInfo[0] = count;
+                    memcpy(&ack.extraInfo[1], client->pending, count * sizeof(int));
+                    client->num_pending -= count;
+                    memmove(client->pending, client->pending + count, client->num_pending * sizeof(int));
+                pthread_mutex_unlock(&lease_lock);
+
+                if (count == 0 || !client->connected) {
+                    break;
+                }
+                if (!queueClientReply(clients[i], &ack, sizeof(AckPacket))) {
+                    // The connection is going away, its reactor closes it
+                    LOG("Error pushing lease invalidation", false);
+                    pthread_mutex_lock(&lease_lock);
+                        client->num_pending = 0;
+                    pthread_mutex_unlock(&lease_lock);
+                    break;
+                }
+            }
+            pthread_mutex_unlock(&client->send_lock);
+        }
+    }
+    return NULL;
+}
+
+static void init_leases(void) {
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        pthread_mutex_init(&lease_clients[i].send_lock, NULL);
+        lease_clients[i].connected = false;
+    }
+
+    pthread_t notifier;
+    if (pthread_create(&notifier, NULL, lease_notifier, NULL) != 0) {
+        LOG("Error creating lease notifier thread", false);
+        return;
+    }
+    pthread_detach(notifier);
+}
+
+/**
+ * @brief Starts tracking a client that may be granted leases.
+ *
+ * @param clientID : Slot of the client, invalidations are queued on its connection.
+ */
+void registerLeaseClient(int clientID) {
+    pthread_once(&lease_once, init_leases);
+
+    LeaseClient* client = &lease_clients[clientID];
+    pthread_mutex_lock(&client->send_lock);
+    pthread_mutex_lock(&lease_lock);
+        client->connected = true;
+        client->replying = false;
+        client->num_pending = 0;
+    pthread_mutex_unlock(&lease_lock);
+    pthread_mutex_unlock(&client->send_lock);
+}
+
+/**
+ * @brief Drops every lease of a client that went away.
+ *
+ * @param clientID : Slot of the client.
+ */
+void unregisterLeaseClient(int clientID) {
+    pthread_once(&lease_once, init_leases);
+
+    LeaseClient* client = &lease_clients[clientID];
+    pthread_mutex_lock(&client->send_lock);
+    pthread_mutex_lock(&lease_lock);
+        client->connected = false;
+        client->num_pending = 0;
+
+        for (int b = 0; b < LEASE_BUCKETS; b++) {
+            Lease** link = &lease_buckets[b];
+            while (*link != NULL) {
+                if ((*link)->clientID == clientID) {
+                    free_lease(link);
+                } else {
+                    link = &(*link)->next;
+                }
+            }
+        }
+    pthread_mutex_unlock(&lease_lock);
+    pthread_mutex_unlock(&client->send_lock);
+}
+
+/**
+ * @brief Marks a client as being answered. Invalidations for it are held
+ * back from here on, so none is pushed before the reply granting the
+ * lease it revokes, and none lands in the middle of the reply. A push
+ * already under way is waited for, it is at most a few acks.
+ *
+ * @param clientID : Slot of the client.
+ */
+void beginLeaseReply(int clientID) {
+    pthread_once(&lease_once, init_leases);
+
+    LeaseClient* client = &lease_clients[clientID];
+    pthread_mutex_lock(&lease_lock);
+        client->replying = true;
+    pthread_mutex_unlock(&lease_lock);
+
+    pthread_mutex_lock(&client->send_lock);
+    pthread_mutex_unlock(&client->send_lock);
+}
+
+/**
+ * @brief Marks the reply to a client as queued, and hands the invalidations
+ * held back meanwhile to the notifier.
+ *
+ * @param clientID : Slot of the client.
+ */
+void endLeaseReply(int clientID) {
+    LeaseClient* client = &lease_clients[clientID];
+    pthread_mutex_lock(&lease_lock);
+        client->replying = false;
+        if (client->num_pending > 0 && list_pending_client(clientID)) {
+            pthread_cond_signal(&lease_cond);
+        }
+    pthread_mutex_unlock(&lease_lock);
+}
+
+/**
+ * @brief Grants a client a lease on the location of a path, or renews the
+ * one it holds. Leases are refused when the table is full.
+ *
+ * @param clientID : Slot of the client.
+ * @param path : The path.
+ * @param serverID : Storage server holding the path.
+ * @param lease_ms : Set to the duration of the lease.
+ *
+ * @return ID of the lease, -1 if none was granted.
+ */
+int grantLease(int clientID, const char* path, int serverID, int* lease_ms) {
+    pthread_once(&lease_once, init_leases);
+
+    unsigned long long hash = hash_path(path);
+    long long now = lease_now_ms();
+    int leaseID = -1;
+    *lease_ms = 0;
+
+    if (clientID < 0 || clientID >= MAX_CLIENTS) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&lease_lock);
+        Lease** link = &lease_buckets[hash % LEASE_BUCKETS];
+        Lease* found = NULL;
+        while (*link != NULL) {
+            Lease* lease = *link;
+            if (lease->expiry_ms <= now) {
+                // Expired leases are dropped whenever their bucket is visited
+                free_lease(link);
+                continue;
+            }
+            if (lease->hash == hash && lease->clientID == clientID && lease->serverID == serverID && strcmp(lease->path, path) == 0) {
+                found = lease;
+            }
+            link = &lease->next;
+        }
+
+        if (found == NULL && num_leases < MAX_LEASES) {
+            found = (Lease*) malloc(sizeof(Lease));
+            if (found != NULL && (found->path = strdup(path)) == NULL) {
+                free(found);
+                found = NULL;
+            }
+            if (found != NULL) {
+                found->hash = hash;
+                found->serverID = serverID;
+                found->clientID = clientID;
+                found->leaseID = next_lease_id++ & 0x7fffffff;
+                found->next = lease_buckets[hash % LEASE_BUCKETS];
+                lease_buckets[hash % LEASE_BUCKETS] = found;
+                num_leases++;
+            }
+        }
+
+        if (found != NULL) {
+            found->expiry_ms = now + LEASE_DURATION_MS;
+            leaseID = found->leaseID;
+            *lease_ms = LEASE_DURATION_MS;
+        }
+    pthread_mutex_unlock(&lease_lock);
+
+    return leaseID;
+}
+
+/**
+ * @brief Revokes the leases matching a condition and queues the
+ * invalidations for their clients.
+ *
+ * @param path : Path (or prefix) of the leases, NULL for any.
+ * @param prefix : Whether path is a prefix.
+ * @param serverID : Storage server of the leases, -1 for any.
+ */
+static void revoke_leases(const char* path, bool prefix, int serverID) {
+    pthread_once(&lease_once, init_leases);
+
+    long long now = lease_now_ms();
+    size_t len = (path == NULL) ? 0 : strlen(path);
+
+    pthread_mutex_lock(&lease_lock);
+        // A single path only lives in one bucket
+        int first = 0, last = LEASE_BUCKETS - 1;
+        if (path != NULL && !prefix) {
+            first = last = hash_path(path) % LEASE_BUCKETS;
+        }
+
+        for (int b = first; b <= last; b++) {
+            Lease** link = &lease_buckets[b];
+            while (*link != NULL) {
+                Lease* lease = *link;
+                bool matches = (serverID < 0 || lease->serverID == serverID) &&
+                               (path == NULL || (prefix ? strncmp(lease->path, path, len) == 0 : strcmp(lease->path, path) == 0));
+                if (matches) {
+                    queue_invalidation(lease, now);
+                    free_lease(link);
+                } else {
+                    link = &lease->next;
+                }
+            }
+        }
+
+        if (num_pending_clients > 0) {
+            pthread_cond_signal(&lease_cond);
+        }
+    pthread_mutex_unlock(&lease_lock);
+}
+
+/**
+ * @brief Revokes the leases on a path that moved or was deleted.
+ *
+ * @param path : The path.
+ */
+void revokePathLeases(const char* path) {
+    revoke_leases(path, false, -1);
+}
+
+/**
+ * @brief Revokes the leases on every path starting with prefix.
+ *
+ * @param prefix : The prefix, empty to revoke every lease.
+ */
+void revokePrefixLeases(const char* prefix) {
+    revoke_leases(prefix, true, -1);
+}
+
+/**
+ * @brief Revokes the leases pointing at a storage server.
+ *
+ * @param serverID : The storage server.
+ */
+void revokeServerLeases(int serverID) {
+    revoke_leases(NULL, false, serverID);
+}
@@ -5,6 +5,22 @@
 #include "../utils/constants.h"
 #include "../utils/structs.h"
 
+/**
+ * @brief Sends an acknowledgment packet to a registering storage server.
+ * 
+ * @param storageServerSocket : Socket of the storage server.
+ * @param ack : Pointer to AckPacket struct containing acknowledgment details.
+ * 
+ * @return false on error, true on success
+ */
+static bool sendAckToServer(int* storageServerSocket, AckPacket* ack) {
+    if (!sendAll(*storageServerSocket, ack, sizeof(AckPacket))) {
+        LOG("Error sending ACK", false);
+        return false;
+    }
+    return true;
+}
+
 /**
  * @brief Registers a new storage server with the naming server.
  * 
@@ -12,7 +28,7 @@
  * It checks if the server is already online and sends an acknowledgment accordingly.
  * If the server is not online, it registers the new server, sends a SUCCESS_ACK, and increments
  * the number of running servers. If all initial servers are running, it posts to the servers_initialized semaphore.
- * Additionally, it spawns an alive thread to monitor the new server's status.
+ * The heartbeat monitor then takes over the socket, the server beats on it from now on.
  * 
  * @param servers : Array of ServerDetails representing storage servers.
  * @param num_servers_running_mutex : Semaphore to control access to the number of running servers.
@@ -21,6 +37,8 @@
  * @param server_fds : Array of server sockets.
  * @param num_servers_running : Pointer to the number of running servers.
  * @param receivedServerDetails : Details of the new storage server.
+ * @param root : Root of the path trie.
+ * @param confirmed : Whether the server confirmed the paths recovered from the journal, instead of sending its own.
  * 
  * @return true if successful, false otherwise
  */ 
@@ -31,9 +49,9 @@ bool registerNewServer(
     int* storageServerSocket,
     int* server_fds,
     int* num_servers_running,
-    void * aliveThreadAsk,
     ServerDetails* receivedServerDetails,
-    trienode** root
+    trienode** root,
+    bool confirmed
 ) {
     // Extract server ID from received details
     int serverID = receivedServerDetails->serverID;
@@ -46,7 +64,7 @@ bool registerNewServer(
         AckPacket ack;
         ack.errorCode = SERVER_ALREADY_REGISTERED;
         ack.ack = FAILURE_ACK;
-        sendAckToClient(storageServerSocket, &ack);
+        sendAckToServer(storageServerSocket, &ack);
         LOG("Server was already registered11", false);
         return false;
     } else { 
@@ -56,17 +74,27 @@ bool registerNewServer(
             servers[serverID].online = true;
             server_fds[serverID] = *storageServerSocket;
 
-            // Populate the trie
-            for (int i = 0; i < servers[serverID].num_paths; i++) {
-                trieinsert(root, servers[serverID].accessible_paths[i], serverID);
+            // Drop whatever an earlier incarnation of this server left
+            // behind, then populate the trie. A confirmed server already
+            // has its paths in the trie, from the journal.
+            if (!confirmed) {
+                release_server_paths(root, serverID);
+                journalRecord(JOURNAL_RELEASE, serverID, 0, NULL);
+                for (int i = 0; i < servers[serverID].num_paths; i++) {
+                    trieinsert(root, servers[serverID].accessible_paths[i], serverID);
+                    journalRecord(JOURNAL_ADD, serverID, 0, servers[serverID].accessible_paths[i]);
+                }
             }
+            journalServer(&servers[serverID]);
+            journalCommit();
         sem_post(num_servers_running_mutex);
+        logNamespaceStats();
 
         // Send SUCCESS_ACK to the server
         AckPacket ack;
         ack.errorCode = SUCCESS;
         ack.ack = SUCCESS_ACK;
-        if (!sendAckToClient(storageServerSocket, &ack)) {
+        if (!sendAckToServer(storageServerSocket, &ack)) {
             return false;
         }
 
@@ -86,8 +114,8 @@ bool registerNewServer(
         LOG("Server registered", true);
         LOG_SERVER_DETAILS(receivedServerDetails);
 
-        // Spawn an alive thread
-        spawnAliveThread(aliveThreadAsk);
+        // The server beats on the connection it registered on
+        watchServer(serverID, *storageServerSocket);
     }
     return true;
 }
@@ -146,38 +174,43 @@ bool acceptNewConnection(int* storageServerSocket, int* serverSocket, struct soc
  * @brief Receives server details.
  * 
  * This function receives server details on the provided socket and stores them in the
- * receivedServerDetails structure.
+ * receivedServerDetails structure. The server first says hello with a fingerprint of its
+ * paths. If the journal already has the same paths for it, they are used as they are;
+ * otherwise the server is asked to upload them, in the compact encoding of sendServerDetails.
  * 
  * @param storageServerSocket : The socket from which to receive server details.
  * @param receivedServerDetails : Pointer to a ServerDetails struct to store received details.
+ * @param confirmed : Set to whether the recovered paths were confirmed, and nothing was uploaded.
  * 
  * @return true if server details were received, else false
  */ 
-bool receiveServerDetails(int* storageServerSocket, ServerDetails* receivedServerDetails) {
-    if (recv(*storageServerSocket, receivedServerDetails, sizeof(ServerDetails), 0) < 0) {
-        LOG("Error receiving server details", false);
+bool receiveServerDetails(int* storageServerSocket, ServerDetails* receivedServerDetails, bool* confirmed) {
+    unsigned long long fingerprint;
+    if (!recvServerHello(*storageServerSocket, receivedServerDetails, &fingerprint) ||
+        receivedServerDetails->serverID < 0 || receivedServerDetails->serverID >= MAX_SERVERS) {
+        LOG("Error receiving server hello", false);
         return false;
     }
-    LOG("Received server details", true);
-    return true;
-}
 
-/**
- * @brief Spawns an alive thread to perform server-alive checks.
- * 
- * This function creates a new thread using pthread_create to execute
- * the `aliveThreadAsk` function. The created thread is detached to avoid
- * memory leaks when it completes its execution.
- * 
- * @note The alive thread periodically sends "CHECK" packets to the server
- * and receives responses to ensure server-alive status.
- */
-void spawnAliveThread(void* aliveThreadAsk) {
-    pthread_t aliveThreadId;
-    if (pthread_create(&aliveThreadId, NULL, aliveThreadAsk, NULL) != 0) {
-        perror("Error creating aliveThread");
+    *confirmed = confirmRecoveredServer(receivedServerDetails, fingerprint);
+    if (*confirmed) {
+        // The paths stay in the trie only, none were sent
+        receivedServerDetails->num_paths = 0;
+        LOG("Received server details", true);
+        return true;
     }
 
-    // Detach the thread to avoid memory leaks
-    pthread_detach(aliveThreadId);
+    // Ask for the paths themselves
+    AckPacket ack;
+    memset(&ack, 0, sizeof(AckPacket));
+    ack.ack = UPLOAD_ACK;
+    ack.errorCode = SUCCESS;
+    if (!sendAckToServer(storageServerSocket, &ack) ||
+        !recvServerDetails(*storageServerSocket, receivedServerDetails) ||
+        receivedServerDetails->serverID < 0 || receivedServerDetails->serverID >= MAX_SERVERS) {
+        LOG("Error receiving server details", false);
+        return false;
+    }
+    LOG("Received server details", true);
+    return true;
 }
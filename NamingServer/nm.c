@@ -5,112 +5,116 @@
 #include "../utils/constants.h"
 #include "../utils/structs.h"
 
-int client_fds[MAX_CLIENTS];                    // Make a list of client fds
 int server_fds[MAX_SERVERS];                    // Make a list of server fds
-pthread_t clientThreads[MAX_CLIENTS];           // List of client threads
 pthread_t serverNMThreads[MAX_CLIENTS];         // List of client <-> NM interaction threads
 ServerDetails servers[MAX_SERVERS];             // List of servers
 sem_t servers_initialized;                      // Semaphore to wait for MIN_SERVERS to come alive before client requests begin
 trienode * root = NULL;                         // Global trie
-LRU lru[MAX_CACHE_SIZE];                        // LRU cache             
+LocationCache cache;                            // Path location cache
 
 int num_servers_running = 0;                    // Keep track of the number of servers running
 sem_t num_servers_running_mutex;                // Binary semaphore to lock the critical section    
 
 /**
- * @brief Handles communication with a client in a separate thread.
+ * @brief Handles one request of a client. Called by the reactor serving
+ * the client once the whole request has arrived, or by a worker for the
+ * requests that go on to the storage servers.
  * 
- * This function runs in a separate thread to handle communication with a client.
- * It receives client requests, identifies the appropriate storage server,
- * and delegates the request handling to the `handleClientRequest` function.
- * The client socket is used to communicate with the Network Manager (NM).
+ * It identifies the storage server holding the requested path, and
+ * delegates the request handling to the `handleClientRequest` function.
+ * The whole reply is put together first and then queued on the client's
+ * connection in one go.
  * 
- * @param arg : Pointer to an integer representing the client socket.
- *              The client socket is extracted from this pointer and used for communication.
- *              After completion, the client socket is closed, and the thread slot is marked as available.
- * 
- * @note The function runs in an infinite loop until an error occurs during client request reception.
+ * @param clientID : Slot of the client, leases are granted to it.
+ * @param clientRequest : The request.
  * 
+ * @return false if no reply could be queued and the client is to be dropped.
  */
-void* handleClientCommunication(void* arg) {
-    // Extract the client socket from this 
-    // We will use this exact socket to talk
-    // to the NM
-    int clientSocket = *((int*)arg);
-
-    LOG("Client communication started", true);
-
-    while (1) {
-        // Populate a ClientRequest struct by receiving
-        // in it from the client.
-        ClientRequest clientRequest;
-        if (recv(clientSocket, &clientRequest, sizeof(clientRequest), 0) < 0) {
-            LOG("Error receiving client request", false);
-            break;  // Exit the loop if there is an error
-        }
+bool handleClientMessage(int clientID, ClientRequest* clientRequest) {
+    long long started_ns = statsClock();
+    long long started_us = traceClock();
+    LOG("Received Client Request", true);
+
+    // Leases are granted to the connection, not to what the client claims
+    clientRequest->clientDetails.clientID = clientID;
+
+    // No invalidation may be queued in the middle of the reply, or ahead
+    // of the lease it revokes. Other clients' invalidations go on meanwhile.
+    beginLeaseReply(clientID);
+
+    // Search in the serverDetails to find
+    // which storage server has the requested
+    // path inside it. LIST_ALL takes a prefix, not a path, and
+    // HOT_PATHS none at all. STATS without a path is about the NM.
+    unsigned int replicas = 0;
+    bool global = (
+        clientRequest->requestType == LIST_ALL ||
+        clientRequest->requestType == HOT_PATHS ||
+        (clientRequest->requestType == GET_STATS && clientRequest->num_args == 0)
+    );
+    int ss_num = global ? -1 : findStorageServer(clientRequest->arg1, root, &cache, &replicas);
+    if (ss_num >= 0 && clientRequest->requestType != GET_STATS) {
+        recordPathAccess(clientRequest->arg1);
+    }
 
-        LOG("Received Client Request", true);
-
-        // Search in the serverDetails to find
-        // which storage server has the requested
-        // path inside it. Do this for all num_args
-        // number of arguments.
-        int ss_num = findStorageServer(clientRequest.arg1, root, lru);
-
-        // snprintf to add the ss_num found
-        char inform_log[1024];
-        snprintf(inform_log, 1024, "Found storage server %d for path %s", ss_num, clientRequest.arg1);
-        LOG(inform_log, true);
-
-        if ((ss_num < 0) || (!handleClientRequest(&clientSocket, &clientRequest, ss_num, servers, root))) {
-            LOG("Failed to process client request", false);
-            if (!sendConnectionAcknowledgment(&clientSocket, FAILURE_ACK, INVALID_INPUT_ERROR)) {
-                LOG("Connection acknowledgement failed", false);
-            } else {
-                LOG("Connection acknowledgement succeeded", true);
-            }
+    // A path that does not exist yet is placed on the servers
+    // holding its parent directory
+    if (ss_num < 0 && (clientRequest->requestType == CREATE_FILE || clientRequest->requestType == CREATE_DIR)) {
+        ss_num = placeNewPath(clientRequest->arg1, root, &cache, &replicas);
+    }
+    traceSpan(clientRequest->traceID, "lookup", started_us, traceClock(), TRACE_FLOW_NONE);
+
+    // snprintf to add the ss_num found
+    char inform_log[1024];
+    snprintf(inform_log, 1024, "Found storage server %d for path %s", ss_num, clientRequest->arg1);
+    LOG(inform_log, true);
+
+    WireBuffer reply = {0};
+    bool handled = (ss_num >= 0 || global) && handleClientRequest(&reply, clientRequest, ss_num, replicas, servers, root);
+    if (!handled) {
+        LOG("Failed to process client request", false);
+        if (!sendConnectionAcknowledgment(&reply, FAILURE_ACK, INVALID_INPUT_ERROR)) {
+            LOG("Connection acknowledgement failed", false);
+        } else {
+            LOG("Connection acknowledgement succeeded", true);
         }
     }
+    bool connected = !reply.failed && queueClientReply(clientID, reply.data, reply.size);
+    endLeaseReply(clientID);
+    free(reply.data);
 
-    // Close the client socket when communication is done
-    close(clientSocket);
-
-    // Mark the slot as available
-    *((int*)arg) = -1;
-
-    pthread_exit(NULL);
+    recordRequest(clientRequest->requestType, started_ns, handled);
+    traceSpan(clientRequest->traceID, "request", started_us, traceClock(), TRACE_FLOW_STEP);
+    return connected;
 }
 
 /**
- * @brief Performs server-alive checks in a separate thread.
- * 
- * This function is intended to run in a separate thread and perform
- * server-alive checks. It sends a "CHECK" packet to the server, receives
- * a "CHECK" packet along with the serverID, and repeats the process every
- * 10 seconds. The thread execution can be terminated by the server.
+ * @brief Tells the reactors which requests to hand to a worker: those
+ * that wait on the storage servers. Redirects, listings and stats are
+ * answered from memory and stay on the reactor.
  * 
- * @param arg : Unused parameter, required by the pthread_create function.
+ * @param clientRequest : The request.
  * 
- * @note The function runs in an infinite loop with a sleep of 10 seconds between iterations.
- * 
- * @return Always returns NULL.
+ * @return true if the request may block.
  */
-void* aliveThreadAsk(void* arg) {
-    // Placeholder implementation for aliveThread
-    while (1) {
-        // Send "CHECK" packet to the server
-        // Receive "CHECK" packet + serverID from the server
-        // Sleep for 10 seconds
-        // sleep(10);
-        break;
+bool requestCallsServers(ClientRequest* clientRequest) {
+    switch (clientRequest->requestType) {
+        case READ_FILE:
+        case WRITE_FILE:
+        case GET_FILE_INFO:
+        case GET_STATS:
+        case LIST_ALL:
+        case HOT_PATHS:
+            return false;
+        default:
+            return true;
     }
-    return NULL;
 }
 
 /**
  * @brief Listens to incoming storage server requests and handles server registration.
  * 
- * This function initializes server details, creates and configures the server socket, and enters
+ * This function creates and configures the server socket, and enters
  * an infinite loop to listen for incoming connections. Upon accepting a connection, it receives
  * server details and registers the new server using the `registerNewServer` function.
  * After processing, it closes the server socket.
@@ -121,8 +125,6 @@ void* aliveThreadAsk(void* arg) {
  * 
  */ 
 void* listenServerRequests(void* arg) {
-    initializeServerDetails(servers);
-
     // Make a socket fd for the Naming Server
     int serverSocket = socket(SOCKET_FAMILY, SOCKET_TYPE, SOCKET_PROTOCOL);
     if (serverSocket < 0) {
@@ -135,16 +137,20 @@ void* listenServerRequests(void* arg) {
     struct sockaddr_in serverAddr;
     memset(&serverAddr, 0, sizeof(serverAddr));
     serverAddr.sin_family = SOCKET_FAMILY;
-    serverAddr.sin_port = htons(NM_NEW_SRV_PORT);
+    serverAddr.sin_port = htons(nmServerPort());
     serverAddr.sin_addr.s_addr = INADDR_ANY;
 
+    // A restarted NM can bind while the old connections are in TIME_WAIT
+    int reuse = 1;
+    setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
     // Bind the socket fd to the port 
     if (bind(serverSocket, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
         LOG("Error binding socket", false);
         close(serverSocket);
         exit(EXIT_FAILURE);
     }
-    LOG("Naming Server is bound on the NM_NEW_SRV_PORT", true);
+    LOG("Naming Server is bound on the storage server port", true);
     
     // Start queuing everything that is listened to 
     if (listen(serverSocket, MAX_LISTEN_BACKLOG) < 0) {
@@ -174,13 +180,20 @@ void* listenServerRequests(void* arg) {
         // ServerDetails struct to be populated by 
         // receiving from the server.
         ServerDetails receivedServerDetails;
-        if (!receiveServerDetails(&storageServerSocket, &receivedServerDetails)) {
+        bool confirmed;
+        if (!receiveServerDetails(&storageServerSocket, &receivedServerDetails, &confirmed)) {
             close(storageServerSocket); // Since we failed to receive, close the socket
             continue; // Failed to receive server details
         }
         LOG("Received server details", true);
         printf("ONLINE : %d : %s\n", receivedServerDetails.serverID, ((receivedServerDetails.online) ? "YES" : "NO"));
 
+        // Where the clients reached this server before, leases hold on to it
+        int serverID = receivedServerDetails.serverID;
+        char previousIP[IP_LEN];
+        strcpy(previousIP, servers[serverID].serverIP);
+        int previousPort = servers[serverID].port_client;
+
         if (!registerNewServer(
             servers,
             &num_servers_running_mutex,
@@ -188,15 +201,31 @@ void* listenServerRequests(void* arg) {
             &storageServerSocket,
             server_fds,
             &num_servers_running,
-            aliveThreadAsk,
             &receivedServerDetails,  // Pass receivedServerDetails to the function,
-            &root
+            &root,
+            confirmed
         )) {
             // Failed to register
             close(storageServerSocket);
             continue;
         }
 
+        // The server may have moved, privileged requests reconnect to it
+        dropStorageConnection(receivedServerDetails.serverID);
+
+        // A server that confirmed its paths holds what the trie says, so
+        // only a move of its endpoint matters. Otherwise the paths it
+        // dropped and the ones it listed change their replica sets.
+        if (!confirmed) {
+            cache_invalidate_server(&cache, serverID);
+            for (int i = 0; i < receivedServerDetails.num_paths; i++) {
+                cache_invalidate(&cache, receivedServerDetails.accessible_paths[i]);
+            }
+        }
+        if (!confirmed || strcmp(previousIP, servers[serverID].serverIP) != 0 || previousPort != servers[serverID].port_client) {
+            revokeServerLeases(serverID);
+        }
+
     }
 
     closeServerSocket(&serverSocket);
@@ -205,15 +234,20 @@ void* listenServerRequests(void* arg) {
 }
 
 
+/**
+ * @brief Listens for clients and serves them.
+ * 
+ * This function creates and configures the client socket, and hands it to
+ * `serveClients`, which accepts the clients and serves their requests on a
+ * fixed set of epoll reactor threads, calling `handleClientMessage`.
+ * Requests for which `requestCallsServers` holds are served by workers.
+ * 
+ * @param arg : Unused parameter (required for pthread_create).
+ * 
+ * @note The function runs indefinitely.
+ * 
+ */
 void* listenClientRequests(void* arg) {
-    // Placeholder implementation for listening to client requests
-    // Initialize the client fds to -1
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        client_fds[i] = -1;
-    }
-
-    LOG("Initialized client fds", true);
-
     // Create and configure the server socket
     int serverSocket = socket(SOCKET_FAMILY, SOCKET_TYPE, SOCKET_PROTOCOL);
     if (serverSocket < 0) {
@@ -227,9 +261,12 @@ void* listenClientRequests(void* arg) {
     struct sockaddr_in serverAddr;
     memset(&serverAddr, 0, sizeof(serverAddr));
     serverAddr.sin_family = SOCKET_FAMILY;
-    serverAddr.sin_port = htons(NM_CLT_PORT);
+    serverAddr.sin_port = htons(nmClientPort());
     serverAddr.sin_addr.s_addr = INADDR_ANY;
 
+    int reuse = 1;
+    setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
     // Bind the socket to the address
     if (bind(serverSocket, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
         LOG("Error binding socket", false);
@@ -237,10 +274,10 @@ void* listenClientRequests(void* arg) {
         exit(EXIT_FAILURE);
     }
 
-    LOG("Bound Naming server socket on NM_CLT_PORT", true);
+    LOG("Bound Naming server socket on the client port", true);
 
     // Listen for incoming connections
-    if (listen(serverSocket, MAX_LISTEN_BACKLOG) < 0) {
+    if (listen(serverSocket, CLIENT_LISTEN_BACKLOG) < 0) {
         LOG("Error listening for connections", false);
         close(serverSocket);
         exit(EXIT_FAILURE);
@@ -249,57 +286,21 @@ void* listenClientRequests(void* arg) {
     // Log that the client listener has started to listen
     LOG("Naming Server is listening for CLIENT connections", true);
 
-    // Accept incoming connections and spawn a thread for each
-    while (1) {
-        struct sockaddr_in clientAddr;
-        socklen_t clientLen = sizeof(clientAddr);
-
-        // Find the first available slot in client_fds
-        int clientIndex = -1;
-        for (int i = 0; i < MAX_CLIENTS; i++) {
-            if (client_fds[i] < 0) {
-                clientIndex = i;
-                break;
-            }
-        }
-
-        if (clientIndex == -1) {
-            LOG("Available slot not found in client_fds", false);
-            continue;
-        } else {
-            LOG("Available slot found in client_fds", true);
-        }
-
-        // Accept a new connection
-        client_fds[clientIndex] = accept(serverSocket, (struct sockaddr*)&clientAddr, &clientLen);
+    // Accept clients and serve them, forever
+    serveClients(serverSocket, handleClientMessage, requestCallsServers);
 
-        if (client_fds[clientIndex] < 0) {
-            LOG("Error accepting client connection", false);
-            continue;
-        } else {
-            LOG("Accepted connection from server", true);
-        }
-
-        // Spawn a new thread to handle client communication
-        if (pthread_create(&clientThreads[clientIndex], NULL, handleClientCommunication, (void*)&client_fds[clientIndex]) != 0) {
-            LOG("Error creating client communication thread", false);
-            close(client_fds[clientIndex]);
-            // Mark the slot as available
-            client_fds[clientIndex] = -1;
-            continue;
-        }
-
-        // Detach the thread to avoid memory leaks
-        pthread_detach(clientThreads[clientIndex]);
-    }
-
-    // Close the server socket (this won't be reached in this simple example)
+    // Close the server socket (this won't be reached)
     close(serverSocket);
 
     return NULL;
 }
 
-int main() {
+int main(int argc, char *argv[]) {
+    if (argc > 4) {
+        fprintf(stderr, "Usage: %s [cache_capacity] [miss_threshold] [replication_factor]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
     // A semaphore will be initialized to 
     // minus(NUM_INIT_SERVERS). Every time 
     // a server is initialized in the listen server
@@ -310,15 +311,43 @@ int main() {
     sem_init(&num_servers_running_mutex, 0, 1);
 
     // Initialize the cache
-    for (int i = 0; i < MAX_CACHE_SIZE; i++) {
-        lru[i].rank = 1e9;
-        lru[i].serverID = -1;
-        lru[i].pathHash = 0;
+    int cache_capacity = (argc >= 2) ? atoi(argv[1]) : DEFAULT_CACHE_CAPACITY;
+    if (cache_capacity <= 0 || !initLocationCache(&cache, cache_capacity)) {
+        LOG("Error initializing the location cache", false);
+        exit(EXIT_FAILURE);
+    }
+
+    // Heartbeats a server may miss before it is declared offline
+    int miss_threshold = (argc >= 3) ? atoi(argv[2]) : HEARTBEAT_MISS_THRESHOLD;
+    if (miss_threshold <= 0) {
+        LOG("Invalid heartbeat miss threshold", false);
+        exit(EXIT_FAILURE);
+    }
+
+    // Storage servers each new path is created on
+    int replication_factor = (argc == 4) ? atoi(argv[3]) : DEFAULT_REPLICATION_FACTOR;
+    if (replication_factor <= 0 || replication_factor > MAX_SERVERS) {
+        LOG("Invalid replication factor", false);
+        exit(EXIT_FAILURE);
     }
 
     // Log that the NM file is running
     LOG("NM file is running", true);
 
+    // Bring back the namespace of the previous run, if there was one.
+    // Clients can be served right away, the recovered servers come
+    // online as they confirm their paths.
+    initializeServerDetails(servers);
+    initStoragePool(servers, &root, &cache);
+    startHeartbeatMonitor(servers, miss_threshold);
+    initPlacement(servers, replication_factor);
+    startHotPathTracking(&root, &cache);
+    startStats(NM_STATS_FILE);
+    initTracing("nm");
+    if (recoverNamespace(servers, &root) >= NUM_INIT_SERVERS) {
+        sem_post(&servers_initialized);
+    }
+
     // I will first spawn a thread to listen 
     // for incoming storage server requests
     pthread_t listenServerThreadId;
@@ -347,6 +376,9 @@ int main() {
     // Wait for user input to exit
     getchar();
 
+    logCacheStats(&cache);
+    logNamespaceStats();
+
     // Close threads and perform cleanup
     pthread_cancel(listenServerThreadId);
     pthread_cancel(listenClientThreadId);
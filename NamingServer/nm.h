@@ -6,33 +6,55 @@
 #include "../utils/logging.h"
 #include "../utils/constants.h"
 #include "../utils/structs.h"
+#include "../utils/wire.h"
+#include "../utils/stats.h"
+#include "../utils/trace.h"
+#include "../utils/endpoints.h"
+#include "../utils/hash.h"
 
 // Function to print server information
 void printServerInfo(ServerDetails server);
 
 // Function to send an acknowledgment packet to the client
-bool sendAckToClient(int* clientSocket, AckPacket *ack);
+bool sendAckToClient(WireBuffer* reply, AckPacket *ack);
 
 // Function to send server details to the client
-bool sendServerDetailsToClient(int* clientSocket, ServerDetails *serverDetails);
+bool sendServerDetailsToClient(WireBuffer* reply, ServerDetails *serverDetails, int leaseID, int lease_ms, ChainHop* chain, int chain_len);
 
 // Function to handle server offline scenario
-void handleServerOffline(int* clientSocket);
+void handleServerOffline(WireBuffer* reply);
 
 // Function to handle wrong path scenario
-void handleWrongPath(int* clientSocket);
+void handleWrongPath(WireBuffer* reply);
 
 // Function to send connection acknowledgment to the client
-bool sendConnectionAcknowledgment(int* clientSocket, AckBit ackType, ErrorCode errorCode);
+bool sendConnectionAcknowledgment(WireBuffer* reply, AckBit ackType, ErrorCode errorCode);
 
 // Function to forward client request to the storage server
-bool forwardClientRequestToServer(int* clientSocket, ClientRequest *clientRequest, int ss_num, ServerDetails *servers, trienode* root);
+bool forwardClientRequestToServer(WireBuffer* reply, ClientRequest *clientRequest, unsigned int replicas);
+
+// Pooled connections to the storage servers
+void initStoragePool(ServerDetails* servers, trienode** root, LocationCache* cache);
+bool sendStorageRequest(int ss_num, ClientRequest* request, PendingStorageRequest* pending);
+bool waitStorageReply(PendingStorageRequest* pending, struct timespec* deadline, AckPacket* ack);
+bool callStorageServer(int ss_num, ClientRequest* request, AckPacket* ack);
+void dropStorageConnection(int ss_num);
+
+// Functions to apply the namespace deltas of a storage server, or resync it
+bool applyPathDelta(int ss_num, PathDelta* delta, ServerDetails* servers, trienode** root, LocationCache* cache);
+bool resyncServer(int ss_num, ServerDetails* servers, trienode** root, LocationCache* cache);
 
 // Function to connect to the storage server
 bool connectToStorageServer(int* storage_fd, int ss_num, ServerDetails *servers);
 
+// Function to answer a LIST_ALL request from the trie
+bool listPaths(WireBuffer* reply, ClientRequest *clientRequest, ServerDetails *servers, trienode* root);
+
+// Function to answer a STATS request about the NM itself
+bool sendNamingServerStats(WireBuffer* reply);
+
 // Function to handle client request
-bool handleClientRequest(int* clientSocket, ClientRequest *clientRequest, int ss_num, ServerDetails *servers, trienode* root);
+bool handleClientRequest(WireBuffer* reply, ClientRequest *clientRequest, int ss_num, unsigned int replicas, ServerDetails *servers, trienode* root);
 
 // Function to register a new server
 bool registerNewServer(
@@ -42,9 +64,9 @@ bool registerNewServer(
     int* storageServerSocket,
     int* server_fds,
     int* num_servers_running,
-    void * aliveThreadAsk,
     ServerDetails* receivedServerDetails,
-    trienode** root
+    trienode** root,
+    bool confirmed
 );
 
 // Function to close the server socket
@@ -56,19 +78,92 @@ void initializeServerDetails(ServerDetails* servers);
 // Function to accept a new connection
 bool acceptNewConnection(int* storageServerSocket, int* serverSocket, struct sockaddr_in* clientAddr, socklen_t* clientLen);
 
-// Function to receive server details
-bool receiveServerDetails(int* storageServerSocket, ServerDetails* receivedServerDetails);
+// Function to receive server details, or only their confirmation
+bool receiveServerDetails(int* storageServerSocket, ServerDetails* receivedServerDetails, bool* confirmed);
+
+// Placement of replicas on the storage servers
+void initPlacement(ServerDetails* servers, int replicationFactor);
+unsigned int liveReplicas(unsigned int replicas);
+int pickReplica(unsigned int replicas);
+int placeNewPath(const char* path, trienode* root, LocationCache* cache, unsigned int* replicas);
+int replicaChain(unsigned int replicas, int primary, ChainHop* chain, int* head);
+bool replicateHotPath(const char* path, trienode* root, LocationCache* cache);
 
-// Function to spawn alive check thread
-void spawnAliveThread(void* aliveThreadAsk);
+// Access statistics and hot paths
+void startHotPathTracking(trienode** root, LocationCache* cache);
+void recordPathAccess(const char* path);
+bool sendHotPaths(WireBuffer* reply, ClientRequest* clientRequest);
 
 // Function to find the storage server corresponding to the given address
-int findStorageServer(char* address, trienode* root, LRU* lru);
+int findStorageServer(char* address, trienode* root, LocationCache* cache, unsigned int* replicas);
+
+// Path location cache
+bool initLocationCache(LocationCache* cache, int capacity);
+int cache_lookup(LocationCache* cache, const char* path, unsigned long long hash, long* generation, unsigned int* replicas);
+void cache_insert(LocationCache* cache, const char* path, unsigned long long hash, int serverID, unsigned int replicas, long generation);
+void cache_invalidate(LocationCache* cache, const char* path);
+void cache_invalidate_prefix(LocationCache* cache, const char* prefix);
+void cache_invalidate_server(LocationCache* cache, int serverID);
+void getCacheStats(LocationCache* cache, CacheStats* stats);
+void logCacheStats(LocationCache* cache);
+
+// Leases handed to clients on path locations
+void registerLeaseClient(int clientID);
+void unregisterLeaseClient(int clientID);
+void beginLeaseReply(int clientID);
+void endLeaseReply(int clientID);
+int grantLease(int clientID, const char* path, int serverID, int* lease_ms);
+void revokePathLeases(const char* path);
+void revokePrefixLeases(const char* prefix);
+void revokeServerLeases(int serverID);
+
+// Event loop serving the clients
+typedef bool (*ClientRequestHandler)(int clientID, ClientRequest* clientRequest);
+typedef bool (*ClientRequestFilter)(ClientRequest* clientRequest);
+void serveClients(int listenSocket, ClientRequestHandler handler, ClientRequestFilter blocking);
+bool queueClientReply(int clientID, const void* data, size_t len);
+
+// Heartbeats of the storage servers
+void startHeartbeatMonitor(ServerDetails* servers, int missThreshold);
+bool watchServer(int serverID, int socket);
+bool getServerLoad(int serverID, ServerLoad* load);
+
+// Journal and snapshot of the namespace
+int recoverNamespace(ServerDetails* servers, trienode** root);
+void journalRecord(JournalOp op, int serverID, long seq, const char* path);
+void journalServer(const ServerDetails* server);
+void journalCommit();
+void awaitServerReturn(int serverID);
+bool confirmRecoveredServer(ServerDetails* hello, unsigned long long fingerprint);
 
 // Helper and manager functions for the trie search
-trienode* createnode();
+trienode* createnode(const char* label, int len, int owner);
 void trieinsert(trienode** root, char* signedtext, int serverID);
-int search_trie(trienode* root, char* signedtext);
+void trie_load_begin(TrieLoader* loader);
+void trie_load(TrieLoader* loader, trienode** root, const char* signedtext, int serverID);
+void trie_load_end(TrieLoader* loader, trienode** root);
+int search_trie(trienode* root, char* signedtext, unsigned int* replicas);
 void delete_from_trie(trienode** root, char* signedtext);
+void remove_trie_replica(trienode** root, char* signedtext, int serverID);
+void unmark_trie_path(trienode** root, char* signedtext);
+void release_server_paths(trienode** root, int serverID);
+void list_trie(trienode* root, const char* prefix, const char* cursor, PathList* list);
+typedef void (*TrieVisitor)(const char* path, int len, int serverID, unsigned int replicas, void* arg);
+void walk_trie(trienode* root, TrieVisitor visit, void* arg);
+void logNamespaceStats();
+
+// Arena allocator for the trie nodes
+void* arena_alloc(int owner, size_t size, bool isNode);
+void arena_release(int owner, size_t size, bool isNode);
+void arena_reset(int owner);
+void arena_adopt(int owner, int from);
+bool arena_needs_compaction(int owner);
+void getNamespaceStats(NamespaceStats* stats);
+
+// Epoch based reclamation for lock-free trie lookups
+void epoch_enter(void);
+void epoch_exit(void);
+unsigned long epoch_retire(void);
+bool epoch_passed(unsigned long retired);
 
 #endif // NM_H
\ No newline at end of file
@@ -5,6 +5,8 @@
 #include "../utils/constants.h"
 #include "../utils/structs.h"
 
+#include <fcntl.h>
+
 /**
  * @brief Prints server information to the console.
  * 
@@ -18,15 +20,16 @@ void printServerInfo(ServerDetails server) {
 }
 
 /**
- * @brief Sends an acknowledgment packet to the client.
+ * @brief Adds an acknowledgment packet to the reply to the client.
  * 
- * @param clientSocket : Client socket file descriptor.
+ * @param reply : Reply to the client.
  * @param ack : Pointer to AckPacket struct containing acknowledgment details.
  * 
  * @return false on error, true on success
  */
-bool sendAckToClient(int* clientSocket, AckPacket* ack) {
-    if (send(*clientSocket, ack, sizeof(AckPacket), 0) < 0) {
+bool sendAckToClient(WireBuffer* reply, AckPacket* ack) {
+    appendBytes(reply, ack, sizeof(AckPacket));
+    if (reply->failed) {
         LOG("Error sending ACK", false);
         return false;
     }
@@ -34,16 +37,20 @@ bool sendAckToClient(int* clientSocket, AckPacket* ack) {
 }
 
 /**
- * @brief Sends server details to the client.
+ * @brief Adds the server details to the reply to the client. Only the
+ * endpoint is sent, the client has no use for the paths of the server.
  * 
- * @param clientSocket : Client socket file descriptor.
+ * @param reply : Reply to the client.
  * @param serverDetails : Pointer to ServerDetails struct containing server details.
+ * @param leaseID : Lease the client may cache the endpoint under, -1 for none.
+ * @param lease_ms : Duration of the lease.
+ * @param chain : Live replicas of the path, head first, for writes.
+ * @param chain_len : Number of replicas in chain.
  * 
  * @return true if server details was sent, false otherwise.
  */
-bool sendServerDetailsToClient(int* clientSocket, ServerDetails* serverDetails) {
-    printf("%d is the client socket\n", *clientSocket);
-    if (send(*clientSocket, serverDetails, sizeof(ServerDetails), 0) < 0) {
+bool sendServerDetailsToClient(WireBuffer* reply, ServerDetails* serverDetails, int leaseID, int lease_ms, ChainHop* chain, int chain_len) {
+    if (!appendServerEndpoint(reply, serverDetails, leaseID, lease_ms, chain, chain_len)) {
         LOG("Error sending server details to client", false);
         return false;
     }
@@ -53,111 +60,111 @@ bool sendServerDetailsToClient(int* clientSocket, ServerDetails* serverDetails)
 /**
  * @brief Handles the case when the server is offline.
  * 
- * @param clientSocket : Client socket file descriptor.
+ * @param reply : Reply to the client.
  */
-void handleServerOffline(int* clientSocket) {
+void handleServerOffline(WireBuffer* reply) {
     // The server is not online, send an error acknowledgment to the client
     AckPacket cltAck;
     cltAck.ack = FAILURE_ACK;
     cltAck.errorCode = SERVER_OFFLINE;
-    sendAckToClient(clientSocket, &cltAck);
-    close(*clientSocket);
+    sendAckToClient(reply, &cltAck);
 }
 
 /**
  * @brief Handles the case of an invalid server path.
  * 
- * @param clientSocket : Client socket file descriptor.
+ * @param reply : Reply to the client.
  */
-void handleWrongPath(int* clientSocket) {
+void handleWrongPath(WireBuffer* reply) {
     // Invalid ss_num, send an error acknowledgment to the client
     AckPacket cltAck;
     cltAck.ack = FAILURE_ACK;
     cltAck.errorCode = WRONG_PATH;
-    sendAckToClient(clientSocket, &cltAck);
-    close(*clientSocket);
+    sendAckToClient(reply, &cltAck);
 }
 
 /**
  * @brief Sends a connection acknowledgment to the client.
  * 
- * @param clientSocket : Client socket file descriptor.
+ * @param reply : Reply to the client.
  * @param ackType : Type of acknowledgment.
  * @param errorCode : Error code indicating the status of the operation.
  */
-bool sendConnectionAcknowledgment(int* clientSocket, AckBit ackType, ErrorCode errorCode) {
+bool sendConnectionAcknowledgment(WireBuffer* reply, AckBit ackType, ErrorCode errorCode) {
     LOG("Sending a connection acknowledgement", true);
     AckPacket cltAck;
     cltAck.ack = ackType;
     cltAck.errorCode = errorCode;
-    return sendAckToClient(clientSocket, &cltAck);
+    return sendAckToClient(reply, &cltAck);
 }
 
 /**
- * @brief Forwards a client request to the storage server.
+ * @brief Forwards a client request to every live replica of the path, on
+ * the pooled connections to them. The request goes out to all replicas
+ * before the first reply is waited for. The trie is updated from the
+ * delta in each reply before the reply comes back here. The client gets a
+ * success only if every replica succeeded, otherwise the first failure.
  * 
- * @param clientSocket : Client socket file descriptor.
+ * @param reply : Reply to the client.
  * @param clientRequest : Pointer to ClientRequest struct containing client request details.
- * @param ss_num : Storage server number.
- * @param servers : Pointer to an array of ServerDetails structs containing server details.
+ * @param replicas : Storage servers the request goes to.
  */
-bool forwardClientRequestToServer(int* clientSocket, ClientRequest* clientRequest, int ss_num, ServerDetails* servers, trienode* root) {
-    // Connect to the storage server
-    int storage_fd; connectToStorageServer(&storage_fd, ss_num, servers);
-    if (storage_fd < 0) {
-        return false;
+bool forwardClientRequestToServer(WireBuffer* reply, ClientRequest* clientRequest, unsigned int replicas) {
+    // Send the clientRequest to every storage server first, then gather
+    // the replies, so the replicas work on it at the same time
+    PendingStorageRequest pending[MAX_SERVERS];
+    unsigned int live = liveReplicas(replicas);
+    long long called_us = traceClock();
+    for (int ss_num = 0; ss_num < MAX_SERVERS; ss_num++) {
+        if (live & (1u << ss_num)) {
+            sendStorageRequest(ss_num, clientRequest, &pending[ss_num]);
+        }
     }
 
-    // Send the clientRequest to the storage server
-    if (send(storage_fd, clientRequest, sizeof(ClientRequest), 0) < 0) {
-        LOG("Can't send clientRequest to storage server", false);
-        close(storage_fd);
-        return false;
-    }
-    LOG("Sent ClientRequest to storage server successfully", true);
+    // One deadline for all of them, the slowest replica bounds the wait
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += MAX_NM_TO_SRV_TIMEOUT;
 
-    // Receive the acknowledgment from the storage server
     AckPacket nmAck;
-    if (recv(storage_fd, &nmAck, sizeof(AckPacket), 0) < 0) {
-        LOG("Error receiving acknowledgment from storage server", false);
-        close(storage_fd);
-        return false;
+    nmAck.errorCode = SERVER_OFFLINE;
+    nmAck.ack = FAILURE_ACK;
+    bool replied = false;
+    for (int ss_num = 0; ss_num < MAX_SERVERS; ss_num++) {
+        AckPacket replicaAck;
+        if (!(live & (1u << ss_num))) {
+            continue;
+        }
+        bool called = waitStorageReply(&pending[ss_num], &deadline, &replicaAck);
+        traceSpan(clientRequest->traceID, "storage server", called_us, traceClock(), TRACE_FLOW_NONE);
+        if (!called) {
+            LOG("Error receiving acknowledgment from storage server", false);
+            continue;
+        }
+        if (!replied || (nmAck.ack == SUCCESS_ACK && replicaAck.ack != SUCCESS_ACK)) {
+            nmAck = replicaAck;
+        }
+        replied = true;
     }
-    LOG("Received acknowledgement from storage server", true);
-
-    // Receive the new server details from the storage server
-    ServerDetails newServerDetails;
-    if (recv(storage_fd, &newServerDetails, sizeof(newServerDetails), 0) < 0) {
-        LOG("Error receiving new server details from storage server", false);
-        close(storage_fd);
+    if (!replied) {
         return false;
     }
-
-    // Update the server details in the servers[ss_num]
-    // call trieinsert on every path in the list
-    // This will handle trie update for new paths
-    servers[ss_num].num_paths = newServerDetails.num_paths;
-
-    // Overwrite the list of accessible paths with what was just obtained
-    for (int i = 0; i < newServerDetails.num_paths; i++) {
-        strcpy(servers[ss_num].accessible_paths[i], newServerDetails.accessible_paths[i]);
-        trieinsert(&root, servers[ss_num].accessible_paths[i], ss_num);
-    }
+    LOG("Received acknowledgement from storage server", true);
 
     // Forward the acknowledgment to the client
-    if (!sendAckToClient(clientSocket, &nmAck)) {
+    if (!sendAckToClient(reply, &nmAck)) {
         return false;
     }
 
     LOG("Forwarded acknowledgement from storage server to client", true);
 
-    close(storage_fd);
-
     return true;
 }
 
 /**
- * @brief Connects to the storage server.
+ * @brief Connects to the storage server, giving up after CONNECT_TIMEOUT_MS
+ * so a dead server the heartbeats have not caught yet does not hold the
+ * request up until the TCP timeout.
  * 
  * @param storage_fd : Socket to connect to storage server
  * @param ss_num : Storage server number.
@@ -181,8 +188,19 @@ bool connectToStorageServer(int* storage_fd, int ss_num, ServerDetails* servers)
     server_addr.sin_port = htons(servers[ss_num].port_nm);
     server_addr.sin_addr.s_addr = inet_addr(servers[ss_num].serverIP);
 
-    // Connect to the storage server
-    if (connect(*storage_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+    // Connect to the storage server without blocking, then wait for it
+    int flags = fcntl(*storage_fd, F_GETFL, 0);
+    bool connected = (flags >= 0 && fcntl(*storage_fd, F_SETFL, flags | O_NONBLOCK) == 0);
+    if (connected && connect(*storage_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        struct pollfd pending = { *storage_fd, POLLOUT, 0 };
+        int error = 0;
+        socklen_t error_len = sizeof(error);
+        connected = (errno == EINPROGRESS &&
+                     poll(&pending, 1, CONNECT_TIMEOUT_MS) == 1 &&
+                     getsockopt(*storage_fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == 0 &&
+                     error == 0);
+    }
+    if (!connected || fcntl(*storage_fd, F_SETFL, flags) < 0) {
         LOG("Can't connect to storage server", true);
         close(*storage_fd);
         return false;
@@ -193,109 +211,191 @@ bool connectToStorageServer(int* storage_fd, int ss_num, ServerDetails* servers)
     return true;
 }
 
+/**
+ * @brief Answers a LIST_ALL from the trie. Only the subtree under the
+ * prefix is walked, the paths are packed many to a FilePacket, and at
+ * most one page is sent per request. The final SUCCESS_ACK carries in
+ * extraInfo[0] whether more paths are left (the client asks for them with
+ * the last path it got as cursor) and in extraInfo[1] the number sent.
+ * 
+ * @param reply : Reply to the client.
+ * @param clientRequest : The LIST_ALL request, arg1 is the prefix.
+ * @param servers : Pointer to an array of ServerDetails structs containing server details.
+ * @param root : Root of the path trie.
+ * 
+ * @return true on success, false on failure
+ */
+bool listPaths(WireBuffer* reply, ClientRequest* clientRequest, ServerDetails* servers, trienode* root) {
+    LOG("Request Type : NON-PRIVILEDGED", true);
+
+    clientRequest->arg1[MAX_ARG_LEN - 1] = '\0';
+    clientRequest->cursor[MAX_PATH_LEN - 1] = '\0';
+
+    PathList list;
+    memset(&list, 0, sizeof(PathList));
+    list.limit = (clientRequest->limit > 0 && clientRequest->limit <= LIST_MAX_PAGE_SIZE) ? clientRequest->limit : LIST_PAGE_SIZE;
+    list.servers = servers;
+
+    // Collect the page first, the trie is not held while sending
+    list_trie(root, clientRequest->arg1, clientRequest->cursor, &list);
+
+    if (!sendConnectionAcknowledgment(reply, INIT_ACK, SUCCESS)) {
+        LOG("Connection acknowledgement failed", false);
+        free(list.names);
+        return false;
+    }
+
+    // Pack as many whole paths as fit into every packet
+    FilePacket packet;
+    size_t sent = 0;
+    do {
+        size_t len = 0;
+        while (sent + len < list.size) {
+            char* end = memchr(list.names + sent + len, '\n', list.size - sent - len);
+            size_t next = end - (list.names + sent) + 1;
+            if (next > MAX_CHUNK_SIZE) {
+                break;
+            }
+            len = next;
+        }
+
+        memcpy(packet.chunk, list.names + sent, len);
+        packet.chunk[len] = '\0';
+        sent += len;
+        packet.lastChunk = (sent == list.size);
+
+        appendBytes(reply, &packet, sizeof(FilePacket));
+    } while (!packet.lastChunk);
+    free(list.names);
+    if (reply->failed) {
+        LOG("Error sending paths to client", false);
+        return false;
+    }
+
+    char inform_log[128];
+    snprintf(inform_log, sizeof(inform_log), "Sent %d paths to client%s", list.count, list.more ? ", more left" : "");
+    LOG(inform_log, true);
+
+    AckPacket ack;
+    memset(&ack, 0, sizeof(AckPacket));
+    ack.ack = SUCCESS_ACK;
+    ack.errorCode = SUCCESS;
+    ack.extraInfo[0] = list.more;
+    ack.extraInfo[1] = list.count;
+    return sendAckToClient(reply, &ack);
+}
+
+/**
+ * @brief Answers a STATS without a path with the counters and latency
+ * percentiles of every request type the NM has served, one line each.
+ * 
+ * @param reply : Reply to the client.
+ * 
+ * @return true on success, false on failure
+ */
+bool sendNamingServerStats(WireBuffer* reply) {
+    LOG("Request Type : NON-PRIVILEDGED", true);
+
+    if (!sendConnectionAcknowledgment(reply, INIT_ACK, SUCCESS)) {
+        LOG("Connection acknowledgement failed", false);
+        return false;
+    }
+    if (!appendStats(reply)) {
+        return false;
+    }
+    return sendConnectionAcknowledgment(reply, SUCCESS_ACK, SUCCESS);
+}
+
 /**
  * @brief Handles a client request.
  * 
- * @param clientSocket : Client socket file descriptor.
+ * @param reply : Reply to the client.
  * @param clientRequest : Pointer to ClientRequest struct containing client request details.
- * @param ss_num : Storage server number.
+ * @param ss_num : Storage server number of the primary replica.
+ * @param replicas : Every storage server holding the path.
  * @param servers : Pointer to an array of ServerDetails structs containing server details.
+ * @param root : Root of the path trie.
  * 
  * @return  true on success, false on failure
  */
-bool handleClientRequest(int* clientSocket, ClientRequest* clientRequest, int ss_num, ServerDetails* servers, trienode* root) {
+bool handleClientRequest(WireBuffer* reply, ClientRequest* clientRequest, int ss_num, unsigned int replicas, ServerDetails* servers, trienode* root) {
     LOG_CLIENT_REQUEST(clientRequest);
 
+    // Listing does not belong to any one storage server
+    if (clientRequest->requestType == LIST_ALL) {
+        return listPaths(reply, clientRequest, servers, root);
+    }
+    if (clientRequest->requestType == HOT_PATHS) {
+        return sendHotPaths(reply, clientRequest);
+    }
+    if (clientRequest->requestType == GET_STATS && clientRequest->num_args == 0) {
+        return sendNamingServerStats(reply);
+    }
+
     // Check if ss_num is within the valid range
     if (ss_num >= 0 && ss_num < MAX_SERVERS) {
-        // Check if the server is online
-        if (servers[ss_num].online) {
+        // Reads go to the least loaded live replica, and writes to the
+        // head of the chain of live replicas, which passes them down the
+        // rest. Namespace changes go to every live replica.
+        replicas |= (1u << ss_num);
+        ChainHop chain[MAX_SERVERS];
+        int head;
+        int chain_len = replicaChain(replicas, ss_num, chain, &head);
+        bool isRead = (clientRequest->requestType == READ_FILE || clientRequest->requestType == GET_FILE_INFO);
+        if (isRead) {
+            ss_num = pickReplica(replicas);
+        } else if (clientRequest->requestType == WRITE_FILE) {
+            ss_num = head;
+        }
+
+        // Check if the server is online. STATS with a path is sent on to
+        // the primary of the path, to ask it for its own stats.
+        bool redirect = (isRead || clientRequest->requestType == WRITE_FILE || clientRequest->requestType == GET_STATS);
+        bool online = redirect ? (ss_num >= 0 && servers[ss_num].online) : (liveReplicas(replicas) != 0);
+        if (online) {
             // Check if the Request_type is one in which 
             // we need to send the client details of the SS
             if (
                 clientRequest->requestType == READ_FILE ||
                 clientRequest->requestType == WRITE_FILE ||
-                clientRequest->requestType == GET_FILE_INFO
+                clientRequest->requestType == GET_FILE_INFO ||
+                clientRequest->requestType == GET_STATS
             ) {
                 LOG("Request Type : NON-PRIVILEDGED", true);
-                if (!sendConnectionAcknowledgment(clientSocket, CNNCT_TO_SRV_ACK, SUCCESS)) {
+                if (!sendConnectionAcknowledgment(reply, CNNCT_TO_SRV_ACK, SUCCESS)) {
                     LOG("Connection acknowledgement failed", false);
                     return false;
                 } else {
                     LOG("Connection acknowledgement succeeded", true);
                 }
 
-                // Send the ServerDetails to the client
-                if (!sendServerDetailsToClient(clientSocket, &servers[ss_num])) {
+                // Send the ServerDetails to the client, with a lease so it
+                // can skip the naming server for this path until revoked
+                int lease_ms = 0;
+                int leaseID = -1;
+                if (clientRequest->requestType != GET_STATS) {
+                    leaseID = grantLease(clientRequest->clientDetails.clientID, clientRequest->arg1, servers[ss_num].serverID, &lease_ms);
+                }
+                if (!sendServerDetailsToClient(reply, &servers[ss_num], leaseID, lease_ms, chain, chain_len)) {
                     return false;
                 } else {
                     LOG("Server Details sent to client", true);
                 }
 
                 LOG("Forwarding NON-PRIVILEDGED request to client successful", true);
-                return true;
-            } else if (clientRequest->requestType == LIST_ALL) {
-                // Send the INIT_ACK to client
-                LOG("Request Type : NON-PRIVILEDGED", true);
-                if (!sendConnectionAcknowledgment(clientSocket, INIT_ACK, SUCCESS)) {
-                    LOG("Connection acknowledgement failed", false);
-                    return false;
-                }
-
-                // Iterate over all servers
-                for (int i = 0; i < MAX_SERVERS; i++) if (servers[i].online) {
-                    // Iterate over all their  accessible paths
-                    for (int j = 0; j < servers[i].num_paths; j++) {
-                        // Check if the path given is a prefix of this path
-                        if (strstr(servers[i].accessible_paths[j], clientRequest->arg1) != servers[i].accessible_paths[j]) {
-                            continue;
-                        }
-
-                        // Send the path to the client
-                        FilePacket packet;
-                        strcpy(packet.chunk, servers[i].accessible_paths[j]);
-
-                        // Check if this is last path to be sent
-                        packet.lastChunk = (
-                            (i == MAX_SERVERS - 1) &&
-                            (j == servers[i].num_paths - 1)
-                        );
-
-                        // Send the packet to the client
-                        if (send(*clientSocket, &packet, sizeof(FilePacket), 0) < 0) {
-                            LOG("Error sending path to client", false);
-                            return false;
-                        }
-
-                        LOG("Sent path to client", true);
-                    }
-                }
-
-                // Send the INIT_ACK to client
-                if (!sendConnectionAcknowledgment(clientSocket, SUCCESS_ACK, SUCCESS)) {
-                    LOG("Connection acknowledgement failed", false);
-                    return false;
-                }
-
                 return true;
             } else {
                 LOG("Request Type : PRIVILEDGED", true);
-                if (!sendConnectionAcknowledgment(clientSocket, INIT_ACK, SUCCESS)) {
+                if (!sendConnectionAcknowledgment(reply, INIT_ACK, SUCCESS)) {
                     LOG("Connection acknowledgement failed", false);
                     return false;
                 }
 
                 // Send the clientRequest to the storage server
-                if (!forwardClientRequestToServer(clientSocket, clientRequest, ss_num, servers, root)) {
+                // The trie is updated from the delta the server sends back
+                if (!forwardClientRequestToServer(reply, clientRequest, replicas)) {
                     LOG("Couldn't forward request to storage server", false);
                     return false;
-                } else {
-                    if (
-                        clientRequest->requestType == DELETE_DIR ||
-                        clientRequest->requestType == DELETE_FILE 
-                    ) {
-                        delete_from_trie(&root, clientRequest->arg1);
-                    }
                 }
 
                 LOG("Forwarding PRIVILEDGED request to storage server successful", true);
@@ -303,12 +403,12 @@ bool handleClientRequest(int* clientSocket, ClientRequest* clientRequest, int ss
             }
         } else {
             LOG("The storage server was offline", false);
-            handleServerOffline(clientSocket);
+            handleServerOffline(reply);
             return false;
         }
     } else {
         LOG("The path given by the client is invalid", false);
-        handleWrongPath(clientSocket);
+        handleWrongPath(reply);
         return false;
     }
     
@@ -322,155 +422,1221 @@ bool handleClientRequest(int* clientSocket, ClientRequest* clientRequest, int ss
  * @brief To find the storage server idx given the path
  * 
  * @param address The address we are looking for
- * @param servers The list of ServerDetail objects
+ * @param root The root of the trie
+ * @param cache The location cache in front of the trie
+ * @param replicas Set to every server holding the path, 0 if none does
  * 
- * @returns the server idx
+ * @returns the server idx of the primary replica
  */
-int findStorageServer(char* address, trienode* root, LRU* lru) {
-    // Calculate the hash of the address
-    unsigned long long hash = 0;
-    for (int i = 0; i < strlen(address); i++) {
-        hash = (hash * ROLLING_PRIME + (address[i] - 'a')) % ROLLING_MODULO;
+int findStorageServer(char* address, trienode* root, LocationCache* cache, unsigned int* replicas) {
+    unsigned long long hash = hash_path(address);
+    long generation;
+
+    int serverID = cache_lookup(cache, address, hash, &generation, replicas);
+    if (serverID >= 0) {
+        return serverID;
     }
 
-    // Decay the rank of each entry
-    for (int i = 0; i < MAX_CACHE_SIZE; i++) {
-        lru[i].rank++;
+    // Only paths that exist are cached, so a CREATE never has to
+    // invalidate a cached miss
+    serverID = search_trie(root, address, replicas);
+    if (serverID >= 0) {
+        cache_insert(cache, address, hash, serverID, *replicas, generation);
     }
-    
-    int maxRank = -1;
-    int maxRankIdx = -1;
-    // Check if the entry is in the LRU
-    for (int i = 0; i < MAX_CACHE_SIZE; i++) {
-        if (maxRank < lru[i].rank) {
-            maxRank = lru[i].rank;
-            maxRankIdx = i;
+
+    return serverID;
+}
+
+static pthread_mutex_t trie_lock = PTHREAD_MUTEX_INITIALIZER;   // Serializes updates, lookups never take it
+
+/**
+ * @brief Length of the first component of a path, including the '/'
+ * that terminates it (if any).
+ * 
+ * @param text: Path (or remainder of a path) to inspect.
+ * 
+ * @return Number of bytes in the first component.
+ */
+static int component_len(const char* text) {
+    const char* slash = strchr(text, '/');
+    return (slash == NULL) ? (int) strlen(text) : (int) (slash - text) + 1;
+}
+
+/**
+ * @brief Number of leading bytes of label and text that agree on
+ * whole components. A partial component never counts as a match.
+ * 
+ * @param label: Edge label of a trie node.
+ * @param text: Remainder of the path being looked up.
+ * 
+ * @return Length of the common component prefix.
+ */
+static int common_components(const char* label, const char* text) {
+    int matched = 0;
+    while (label[matched] != '\0' && text[matched] != '\0') {
+        int len = component_len(label + matched);
+        if (component_len(text + matched) != len || strncmp(label + matched, text + matched, len) != 0) {
+            break;
+        }
+        matched += len;
+    }
+    return matched;
+}
+
+/**
+ * @brief Child map of a node as currently published.
+ */
+static ChildMap* children_of(trienode* node) {
+    return atomic_load_explicit(&node->children, memory_order_acquire);
+}
+
+/**
+ * @brief Number of children in a child map, 0 for a leaf.
+ */
+static int count_of(ChildMap* map) {
+    return (map == NULL) ? 0 : atomic_load_explicit(&map->count, memory_order_acquire);
+}
+
+/**
+ * @brief Child at index i of a child map.
+ */
+static trienode* child_at(ChildMap* map, int i) {
+    return atomic_load_explicit(&map->nodes[i], memory_order_acquire);
+}
+
+/**
+ * @brief Compares the first component of a child's label with text[0..len),
+ * in the order the children of a node are kept in.
+ */
+static int compare_component(trienode* child, const char* text, int len) {
+    int label_len = component_len(child->label);
+    int cmp = memcmp(child->label, text, (label_len < len) ? label_len : len);
+    return (cmp == 0) ? label_len - len : cmp;
+}
+
+/**
+ * @brief Binary search the (sorted) children of a node for the one whose
+ * first component is text[0..len). Safe without locks: a hit is always a
+ * real child, and a miss is only trusted if no writer shifted the map
+ * while it was being searched.
+ * 
+ * @param node: Parent node.
+ * @param text: Remainder of the path being looked up.
+ * @param len: Length of the first component of text.
+ * @param pos: If not NULL, set to the index of the child, or to the index
+ *             where it would have to be inserted.
+ * 
+ * @return The matching child, NULL if there is none.
+ */
+static trienode* find_child(trienode* node, const char* text, int len, int* pos) {
+    ChildMap* map = children_of(node);
+    if (map == NULL) {
+        if (pos != NULL) *pos = 0;
+        return NULL;
+    }
+
+    while (true) {
+        unsigned int seq = atomic_load_explicit(&map->seq, memory_order_acquire);
+        int lo = 0, hi = count_of(map);
+
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            trienode* child = child_at(map, mid);
+            int cmp = compare_component(child, text, len);
+
+            if (cmp == 0) {
+                if (pos != NULL) *pos = mid;
+                return child;
+            } else if (cmp < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
         }
 
-        if (lru[i].pathHash == hash) {
-            lru[i].rank = 0;
-            return lru[i].serverID;
+        atomic_thread_fence(memory_order_acquire);
+        if ((seq & 1) == 0 && atomic_load_explicit(&map->seq, memory_order_relaxed) == seq) {
+            if (pos != NULL) *pos = lo;
+            return NULL;
         }
+        // A writer moved entries under us, search again
     }
+}
 
-    // Put the entry in the LRU
-    lru[maxRankIdx].pathHash = hash;
-    lru[maxRankIdx].rank = 0;
-    lru[maxRankIdx].serverID = search_trie(root, address);
+/**
+ * @brief Bytes taken by a node with a label of len bytes.
+ */
+static size_t node_size(int len) {
+    return sizeof(trienode) + len + 1;
+}
 
-   return lru[maxRankIdx].serverID;
+/**
+ * @brief Bytes taken by a child map with room for capacity children.
+ */
+static size_t map_size(int capacity) {
+    return sizeof(ChildMap) + capacity * sizeof(trienode*);
+}
+
+/**
+ * @brief Arena that paths of a storage server are allocated from.
+ */
+static int arena_of(int serverID) {
+    return (serverID >= 0 && serverID < MAX_SERVERS) ? serverID : SHARED_ARENA;
+}
+
+/**
+ * @brief Allocates an empty child map from the given arena.
+ */
+static ChildMap* new_map(int arena, int capacity) {
+    ChildMap* map = (ChildMap*) arena_alloc(arena, map_size(capacity), false);
+    atomic_init(&map->seq, 0);
+    atomic_init(&map->count, 0);
+    map->capacity = capacity;
+    return map;
+}
+
+/**
+ * @brief Inserts child into the children of node at index pos. A full map
+ * is replaced by a bigger copy (the old one becomes garbage in the arena),
+ * otherwise entries are shifted in place under the map's seq.
+ */
+static void add_child(trienode* node, trienode* child, int pos) {
+    ChildMap* map = children_of(node);
+    int count = count_of(map);
+
+    if (map == NULL || count == map->capacity) {
+        ChildMap* bigger = new_map(node->owner, (count == 0) ? 2 : 2 * count);
+        for (int i = 0; i < count; i++) {
+            atomic_init(&bigger->nodes[i + (i >= pos)], child_at(map, i));
+        }
+        atomic_init(&bigger->nodes[pos], child);
+        atomic_init(&bigger->count, count + 1);
+
+        atomic_store_explicit(&node->children, bigger, memory_order_release);
+        if (map != NULL) {
+            arena_release(node->owner, map_size(map->capacity), false);
+        }
+        return;
+    }
+
+    atomic_store_explicit(&map->seq, atomic_load(&map->seq) + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    // Grow by duplicating the last entry, then shift down, so every child
+    // stays in the map (in order) at every step
+    atomic_store_explicit(&map->nodes[count], (pos < count) ? child_at(map, count - 1) : child, memory_order_release);
+    atomic_store_explicit(&map->count, count + 1, memory_order_release);
+    for (int i = count - 1; i > pos; i--) {
+        atomic_store_explicit(&map->nodes[i], child_at(map, i - 1), memory_order_release);
+    }
+    if (pos < count) {
+        atomic_store_explicit(&map->nodes[pos], child, memory_order_release);
+    }
+
+    atomic_store_explicit(&map->seq, atomic_load(&map->seq) + 1, memory_order_release);
+}
+
+/**
+ * @brief Removes the child at index pos from the children of node.
+ */
+static void remove_child(trienode* node, int pos) {
+    ChildMap* map = children_of(node);
+    int count = count_of(map);
+
+    atomic_store_explicit(&map->seq, atomic_load(&map->seq) + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    for (int i = pos; i < count - 1; i++) {
+        atomic_store_explicit(&map->nodes[i], child_at(map, i + 1), memory_order_release);
+    }
+    atomic_store_explicit(&map->count, count - 1, memory_order_release);
+
+    atomic_store_explicit(&map->seq, atomic_load(&map->seq) + 1, memory_order_release);
+}
+
+/**
+ * @brief Swaps the child at pos for an equivalent node (same first
+ * component), which readers may see either of.
+ */
+static void replace_child(trienode* node, int pos, trienode* child) {
+    atomic_store_explicit(&children_of(node)->nodes[pos], child, memory_order_release);
+}
+
+/**
+ * @brief Hands a node along with everything below it back to the arenas.
+ */
+static void release_subtree(trienode* node) {
+    ChildMap* map = children_of(node);
+    for (int i = 0; i < count_of(map); i++) {
+        release_subtree(child_at(map, i));
+    }
+    if (map != NULL) {
+        arena_release(node->owner, map_size(map->capacity), false);
+    }
+    arena_release(node->owner, node_size(strlen(node->label)), true);
+}
+
+/**
+ * @brief Allocates a node from the given arena, with the fields of
+ * from and the given label. The node is not yet visible to readers.
+ */
+static trienode* clone_node(trienode* from, int arena, const char* label, int len) {
+    trienode* node = (trienode*) arena_alloc(arena, node_size(len), true);
+
+    atomic_init(&node->children, children_of(from));
+    atomic_init(&node->storage_server, atomic_load(&from->storage_server));
+    atomic_init(&node->replicas, atomic_load(&from->replicas));
+    atomic_init(&node->isEndOfWord, atomic_load(&from->isEndOfWord));
+    node->owner = from->owner;
+    node->isFile = from->isFile;
+    memcpy(node->label, label, len);
+    node->label[len] = '\0';
+    return node;
+}
+
+/**
+ * @brief Copies a node, with a child map of exactly the right size, into
+ * the given arena. The copy keeps the owner of the original.
+ */
+static trienode* copy_node(trienode* node, int arena) {
+    trienode* copy = clone_node(node, arena, node->label, strlen(node->label));
+
+    ChildMap* map = children_of(node);
+    int count = count_of(map);
+    if (count == 0) {
+        atomic_init(&copy->children, NULL);
+        return copy;
+    }
+
+    ChildMap* tight = new_map(arena, count);
+    for (int i = 0; i < count; i++) {
+        atomic_init(&tight->nodes[i], child_at(map, i));
+    }
+    atomic_init(&tight->count, count);
+    atomic_init(&copy->children, tight);
+    return copy;
+}
+
+/**
+ * @brief Replaces a node by a copy that drops the first skip bytes of its
+ * label, used when its edge is split.
+ */
+static trienode* relabel_node(trienode* node, int skip) {
+    int len = strlen(node->label);
+    trienode* copy = clone_node(node, node->owner, node->label + skip, len - skip);
+
+    arena_release(node->owner, node_size(len), true);
+    return copy;
+}
+
+/**
+ * @brief Moves the child at pos into the shared arena, because paths of
+ * more than one storage server now go through it.
+ */
+static trienode* promote_child(trienode* node, int pos) {
+    trienode* child = child_at(children_of(node), pos);
+    trienode* shared = copy_node(child, SHARED_ARENA);
+    shared->owner = SHARED_ARENA;
+
+    ChildMap* map = children_of(child);
+    if (map != NULL) {
+        arena_release(child->owner, map_size(map->capacity), false);
+    }
+    arena_release(child->owner, node_size(strlen(child->label)), true);
+
+    replace_child(node, pos, shared);
+    return shared;
+}
+
+/**
+ * @brief After something below the child at pos was removed, drops it if
+ * it is no longer needed and merges it with its only child if the chain no
+ * longer branches.
+ */
+static void collapse_child(trienode* node, int pos) {
+    trienode* child = child_at(children_of(node), pos);
+    ChildMap* map = children_of(child);
+    int count = count_of(map);
+    if (atomic_load(&child->isEndOfWord) || count > 1) {
+        return;
+    }
+
+    if (count == 0) {
+        remove_child(node, pos);
+        release_subtree(child);
+        return;
+    }
+
+    // Merge the only remaining grandchild back into this edge
+    trienode* grandchild = child_at(map, 0);
+    int label_len = strlen(child->label);
+    int grand_len = strlen(grandchild->label);
+
+    char label[label_len + grand_len + 1];
+    memcpy(label, child->label, label_len);
+    memcpy(label + label_len, grandchild->label, grand_len + 1);
+
+    // The merged node takes over the grandchild's child map
+    trienode* merged = clone_node(grandchild, grandchild->owner, label, label_len + grand_len);
+    replace_child(node, pos, merged);
+
+    arena_release(grandchild->owner, node_size(grand_len), true);
+    arena_release(child->owner, map_size(map->capacity), false);
+    arena_release(child->owner, node_size(label_len), true);
+}
+
+/**
+ * @brief Copies every node of owner below node into the scratch arena,
+ * leaving nodes of other arenas where they are.
+ */
+static trienode* compact_copy(trienode* node, int owner) {
+    trienode* copy = copy_node(node, SCRATCH_ARENA);
+    ChildMap* map = children_of(copy);
+    for (int i = 0; i < count_of(map); i++) {
+        trienode* child = child_at(map, i);
+        if (child->owner == owner) {
+            atomic_init(&map->nodes[i], compact_copy(child, owner));
+        }
+    }
+    return copy;
+}
+
+/**
+ * @brief Walks the shared nodes below node and replaces every subtree of
+ * owner hanging off them with its compacted copy.
+ */
+static void compact_below(trienode* node, int owner) {
+    ChildMap* map = children_of(node);
+    for (int i = 0; i < count_of(map); i++) {
+        trienode* child = child_at(map, i);
+        if (child->owner == owner) {
+            replace_child(node, i, compact_copy(child, owner));
+        } else if (child->owner == SHARED_ARENA) {
+            compact_below(child, owner);
+        }
+    }
+}
+
+/**
+ * @brief Copies the live nodes of an arena into a fresh one and resets the
+ * old one, so that memory under create/delete churn stays bounded. Readers
+ * still inside the old nodes keep them alive through the arena's limbo.
+ */
+static void compact_arena(trienode* root, int owner) {
+    if (owner == SHARED_ARENA) {
+        // The root is not in an arena, but its child map is
+        ChildMap* map = children_of(root);
+        int count = count_of(map);
+        ChildMap* copy = (count > 0) ? new_map(SCRATCH_ARENA, count) : NULL;
+        for (int i = 0; i < count; i++) {
+            trienode* child = child_at(map, i);
+            atomic_init(&copy->nodes[i], (child->owner == SHARED_ARENA) ? compact_copy(child, SHARED_ARENA) : child);
+        }
+        if (copy != NULL) {
+            atomic_init(&copy->count, count);
+        }
+        atomic_store_explicit(&root->children, copy, memory_order_release);
+    } else {
+        compact_below(root, owner);
+    }
+    arena_adopt(owner, SCRATCH_ARENA);
+}
+
+/**
+ * @brief Compacts every arena that has piled up enough garbage.
+ */
+static void compact_arenas(trienode* root) {
+    for (int i = 0; i < NUM_ARENAS; i++) {
+        if (i != SCRATCH_ARENA && arena_needs_compaction(i)) {
+            compact_arena(root, i);
+        }
+    }
 }
 
 /**
  * @brief Creates a new trie node and initializes its members.
  * 
+ * @param label: Edge label of the node, one or more path components.
+ * @param len: Number of bytes of label to copy.
+ * @param owner: Arena to allocate the node from.
+ * 
  * @return A pointer to the newly created trie node.
  */
-trienode* createnode() {
-    trienode* node = (trienode*) malloc(sizeof(trienode));
+trienode* createnode(const char* label, int len, int owner) {
+    trienode* node = (trienode*) arena_alloc(owner, node_size(len), true);
 
-    for(int i=0; i<NUM_CHARS; i++){
-        node->children[i] = NULL;
-    }
-    node->storage_server = -1;
+    memcpy(node->label, label, len);
+    node->label[len] = '\0';
+    atomic_init(&node->children, NULL);
+    atomic_init(&node->storage_server, -1);
+    atomic_init(&node->replicas, 0);
+    atomic_init(&node->isEndOfWord, false);
+    node->owner = owner;
     node->isFile = false;
-    node->isEndOfWord = false;
     return node;
 }
 
+/**
+ * @brief Adds a server to the replicas of a node. The server that held
+ * the node first stays its primary for as long as it holds it.
+ */
+static void add_replica(trienode* node, int serverID) {
+    if (serverID < 0 || serverID >= MAX_SERVERS) {
+        return;
+    }
+
+    unsigned int replicas = atomic_load(&node->replicas) | (1u << serverID);
+    atomic_store(&node->replicas, replicas);
+
+    int primary = atomic_load(&node->storage_server);
+    if (primary < 0 || !(replicas & (1u << primary))) {
+        atomic_store(&node->storage_server, serverID);
+    }
+}
+
+/**
+ * @brief Inserts a path, the caller holds trie_lock. With a loader, the
+ * walk starts below the nodes it kept, and records the route it takes.
+ */
+static void insert_path(trienode** root, const char* signedtext, int serverID, TrieLoader* loader) {
+    int length = strlen(signedtext);
+    if (length == 0) {
+        return;
+    }
+
+    int owner = arena_of(serverID);
+
+    if (*root == NULL) {
+        // The root never moves, so it lives outside the arenas
+        trienode* node = (trienode*) calloc(1, node_size(0));
+        atomic_init(&node->children, NULL);
+        atomic_init(&node->storage_server, -1);
+        atomic_init(&node->replicas, 0);
+        atomic_init(&node->isEndOfWord, false);
+        node->owner = SHARED_ARENA;
+        *root = node;
+    }
+
+    trienode* curr = *root;
+    const char* rest = signedtext;
+    if (loader != NULL && loader->depth > 0) {
+        curr = loader->nodes[loader->depth - 1];
+        rest = signedtext + loader->ends[loader->depth - 1];
+    }
+
+    while (*rest != '\0') {
+        int pos;
+        trienode* child = find_child(curr, rest, component_len(rest), &pos);
+
+        if (child == NULL) {
+            // Nothing shares this component, hang the whole remainder off one node
+            child = createnode(rest, strlen(rest), owner);
+            add_replica(child, serverID);
+            atomic_init(&child->isEndOfWord, true);
+            child->isFile = (signedtext[length - 1] != '/');
+            add_child(curr, child, pos);
+            if (loader != NULL && loader->depth < MAX_PATH_LEN) {
+                loader->nodes[loader->depth] = child;
+                loader->ends[loader->depth++] = length;
+            }
+            curr = NULL;
+            break;
+        }
+
+        int matched = common_components(child->label, rest);
+        if (child->label[matched] != '\0') {
+            // The path leaves this edge halfway, split it at the component boundary
+            trienode* split = createnode(child->label, matched, (child->owner == owner) ? owner : SHARED_ARENA);
+            atomic_init(&split->storage_server, atomic_load(&child->storage_server));
+            atomic_init(&split->replicas, atomic_load(&child->replicas));
+            add_child(split, relabel_node(child, matched), 0);
+            replace_child(curr, pos, split);
+            child = split;
+        } else if (child->owner != owner && child->owner != SHARED_ARENA) {
+            child = promote_child(curr, pos);
+        }
+
+        add_replica(child, serverID);
+        curr = child;
+        rest += matched;
+        if (loader != NULL && loader->depth < MAX_PATH_LEN) {
+            loader->nodes[loader->depth] = child;
+            loader->ends[loader->depth++] = rest - signedtext;
+        }
+    }
+
+    if (curr != NULL) {
+        curr->isFile = (signedtext[length - 1] != '/');
+        add_replica(curr, serverID);
+        atomic_store(&curr->isEndOfWord, true);
+    }
+}
+
 /**
  * @brief Inserts a path into the trie along with the corresponding storage server ID.
  * 
+ * The trie is a radix tree over '/'-separated components. A node's label
+ * holds one or more whole components, chains without branches are kept
+ * in a single node, and the children of a node are kept sorted by their
+ * first component. serverID is added to the replicas of the path and of
+ * every directory on the way to it. A path already held by other servers
+ * keeps its primary.
+ * 
+ * Nodes are allocated from the arena of serverID. A node that paths of
+ * more than one server go through is moved to the shared arena, so the
+ * paths of one server can always be dropped with release_server_paths.
+ * 
+ * Updates are serialized by trie_lock and publish every change with a
+ * single atomic store, so lookups can run alongside without any lock.
+ * 
  * @param root: Pointer to the root of the trie.
  * @param signedtext: Path to be inserted.
  * @param serverID: Storage server ID for the path.
  */
 void trieinsert (trienode** root, char* signedtext, int serverID) {
-    if (*root == NULL) {
-        *root = createnode();
+    pthread_mutex_lock(&trie_lock);
+
+    insert_path(root, signedtext, serverID, NULL);
+    compact_arenas(*root);
+
+    pthread_mutex_unlock(&trie_lock);
+}
+
+/**
+ * @brief Starts a bulk load of paths in strcmp order, like the paths of a
+ * snapshot. Updates from other threads wait until trie_load_end.
+ * 
+ * @param loader: Cursor to initialize.
+ */
+void trie_load_begin(TrieLoader* loader) {
+    loader->depth = 0;
+    loader->prev[0] = '\0';
+    pthread_mutex_lock(&trie_lock);
+}
+
+/**
+ * @brief Inserts the next path of a bulk load. Same result as trieinsert,
+ * but the walk down starts where the route of the previous path leaves
+ * off, so loading sorted paths costs little more than creating the nodes.
+ * 
+ * @param loader: Cursor from trie_load_begin.
+ * @param root: Pointer to the root of the trie.
+ * @param signedtext: Path to be inserted, sorting after the previous one.
+ * @param serverID: Storage server ID for the path.
+ */
+void trie_load(TrieLoader* loader, trienode** root, const char* signedtext, int serverID) {
+    int common = 0;
+    while (signedtext[common] != '\0' && signedtext[common] == loader->prev[common]) {
+        common++;
     }
 
-    unsigned char* text = (unsigned char*) signedtext;     // just in case we don't get negative indexes
-    trienode* curr = *root;
-    int length = strlen(signedtext);
+    // Keep the nodes whose whole path is shared and ends on a component
+    // boundary, and stop at the first one that would have to move arenas
+    int owner = arena_of(serverID);
+    int depth = 0;
+    while (depth < loader->depth) {
+        int end = loader->ends[depth];
+        trienode* node = loader->nodes[depth];
+        if (end > common || (signedtext[end - 1] != '/' && signedtext[end] != '\0') ||
+            (node->owner != owner && node->owner != SHARED_ARENA)) {
+            break;
+        }
+        add_replica(node, serverID);
+        depth++;
+    }
+    loader->depth = depth;
+
+    insert_path(root, signedtext, serverID, loader);
+    strncpy(loader->prev, signedtext, MAX_PATH_LEN - 1);
+    loader->prev[MAX_PATH_LEN - 1] = '\0';
+}
+
+/**
+ * @brief Ends a bulk load.
+ * 
+ * @param loader: Cursor from trie_load_begin.
+ * @param root: Pointer to the root of the trie.
+ */
+void trie_load_end(TrieLoader* loader, trienode** root) {
+    if (*root != NULL) {
+        compact_arenas(*root);
+    }
+    pthread_mutex_unlock(&trie_lock);
+}
+
+/**
+ * @brief Looks a path up without taking any lock, the caller is inside
+ * an epoch (or holds trie_lock). replicas, if given, is set to the
+ * servers holding the path.
+ */
+static int lookup_path(trienode* root, const char* signedtext, unsigned int* replicas) {
+    unsigned int unused;
+    if (replicas == NULL) {
+        replicas = &unused;
+    }
+    *replicas = 0;
+
+    if (root == NULL || signedtext[0] == '\0') {
+        return -1;
+    }
+
+    trienode* curr = root;
+    const char* rest = signedtext;
 
-    for (int i = 0 ; i < length ; i++) {
-        if(curr->children[text[i]] == NULL){
-            // create a node
-            curr->children[text[i]] = createnode();
+    while (*rest != '\0') {
+        trienode* child = find_child(curr, rest, component_len(rest), NULL);
+        if (child == NULL) {
+            return -1;
         }
 
-        curr = curr->children[text[i]];
-        if (text[i]=='/') {
-            curr->isFile = false;
-            curr->storage_server = serverID;
-            curr->isEndOfWord = true;
+        int matched = common_components(child->label, rest);
+        if (child->label[matched] != '\0') {
+            // Ending inside an edge is only fine for a directory prefix
+            if (rest[matched] != '\0') {
+                return -1;
+            }
+            *replicas = atomic_load(&child->replicas);
+            return atomic_load(&child->storage_server);
         }
+
+        curr = child;
+        rest += matched;
     }
 
-    if (text[length-1]!='/') {
-        curr->isFile = true;
-        curr->isEndOfWord = true;
-        curr->storage_server = serverID;
+    // Directories are found even when they were only ever seen as a prefix
+    bool isDir = (signedtext[strlen(signedtext) - 1] == '/');
+    if (!atomic_load(&curr->isEndOfWord) && !isDir) {
+        return -1; // -1 marks path nowhere
     }
+    *replicas = atomic_load(&curr->replicas);
+    return atomic_load(&curr->storage_server);
 }
 
 /**
  * @brief Searches for a path in the trie and returns the corresponding storage server ID.
+ * Takes no lock, it only announces itself to the epoch based reclamation.
  * 
  * @param root: Pointer to the root of the trie.
  * @param signedtext: Path to be searched.
+ * @param replicas: Set to every storage server holding the path.
  * 
- * @return The storage server ID if the path is found, -1 otherwise.
+ * @return The primary storage server ID if the path is found, -1 otherwise.
  */
-int search_trie (trienode* root, char* signedtext) {
-    if(root == NULL){
-        return -1;
+int search_trie (trienode* root, char* signedtext, unsigned int* replicas) {
+    epoch_enter();
+    int serverID = lookup_path(root, signedtext, replicas);
+    epoch_exit();
+    return serverID;
+}
+
+/**
+ * @brief Recursive helper for delete_from_trie. Unlinks the subtree for
+ * rest below node, and re-collapses any chain left without a branch.
+ * 
+ * @return true if something was removed.
+ */
+static bool remove_path(trienode* node, const char* rest) {
+    int pos;
+    trienode* child = find_child(node, rest, component_len(rest), &pos);
+    if (child == NULL) {
+        return false;
     }
 
-    // printf("Searching for the path : %s", signedtext);
+    int matched = common_components(child->label, rest);
+    if (rest[matched] == '\0') {
+        // Either the path itself or a directory ending inside this edge,
+        // in both cases everything below goes with it
+        remove_child(node, pos);
+        release_subtree(child);
+        return true;
+    }
 
-    unsigned char* text = (unsigned char*)signedtext;
-    trienode* curr = root;
-    int length = strlen(signedtext);
-    // printf("\nSearching:");
-    for(int i=0 ; i<length ; i++){
-        if(curr->children[text[i]] == NULL){
-            return -1;
+    if (child->label[matched] != '\0' || !remove_path(child, rest + matched)) {
+        return false;
+    }
+
+    collapse_child(node, pos);
+    return true;
+}
+
+/**
+ * @brief Deletes a path (and, for a directory, everything inside it) from the trie.
+ * 
+ * @param root: Pointer to the root of the trie.
+ * @param signedtext: Path to be deleted.
+ */
+void delete_from_trie(trienode** root, char* signedtext) {
+    pthread_mutex_lock(&trie_lock);
+
+    if (lookup_path(*root, signedtext, NULL) != -1) {
+        remove_path(*root, signedtext);
+        compact_arenas(*root);
+    }
+
+    pthread_mutex_unlock(&trie_lock);
+}
+
+/**
+ * @brief Takes serverID off the replicas of node, moving the primary to
+ * one of the servers left.
+ */
+static void drop_replica(trienode* node, int serverID) {
+    unsigned int replicas = atomic_load(&node->replicas) & ~(1u << serverID);
+    atomic_store(&node->replicas, replicas);
+    if (atomic_load(&node->storage_server) == serverID && replicas != 0) {
+        atomic_store(&node->storage_server, __builtin_ctz(replicas));
+    }
+}
+
+/**
+ * @brief Recursive helper for remove_trie_replica. Takes serverID off
+ * every node below node, and unlinks the ones no replica is left on.
+ */
+static void drop_replica_below(trienode* node, int serverID) {
+    for (int i = count_of(children_of(node)) - 1; i >= 0; i--) {
+        trienode* child = child_at(children_of(node), i);
+
+        if ((atomic_load(&child->replicas) & ~(1u << serverID)) == 0) {
+            remove_child(node, i);
+            release_subtree(child);
+            continue;
         }
-        // printf("%c", text[i]);
-        curr = curr->children[text[i]];
 
-        if(curr->isEndOfWord && curr ->storage_server == -1){
-            // the path/directory has been deleted
-            return -1;
+        drop_replica_below(child, serverID);
+        drop_replica(child, serverID);
+        collapse_child(node, i);
+    }
+}
+
+/**
+ * @brief Recursive helper for remove_trie_replica, the counterpart of
+ * remove_path for a path other replicas still hold.
+ *
+ * @return true if the path was found.
+ */
+static bool drop_path_replica(trienode* node, const char* rest, int serverID) {
+    int pos;
+    trienode* child = find_child(node, rest, component_len(rest), &pos);
+    if (child == NULL) {
+        return false;
+    }
+
+    int matched = common_components(child->label, rest);
+    if (rest[matched] == '\0') {
+        drop_replica_below(child, serverID);
+        drop_replica(child, serverID);
+    } else if (child->label[matched] != '\0' || !drop_path_replica(child, rest + matched, serverID)) {
+        return false;
+    }
+
+    collapse_child(node, pos);
+    return true;
+}
+
+/**
+ * @brief Deletes a path (and, for a directory, everything inside it) from
+ * one storage server. The path stays for the other replicas and is only
+ * unlinked once no server holds it any more.
+ *
+ * @param root: Pointer to the root of the trie.
+ * @param signedtext: Path to be deleted.
+ * @param serverID: Storage server that deleted it.
+ */
+void remove_trie_replica(trienode** root, char* signedtext, int serverID) {
+    pthread_mutex_lock(&trie_lock);
+
+    unsigned int replicas;
+    if (lookup_path(*root, signedtext, &replicas) != -1) {
+        if ((replicas & ~(1u << serverID)) == 0) {
+            remove_path(*root, signedtext);
+        } else {
+            drop_path_replica(*root, signedtext, serverID);
         }
+        compact_arenas(*root);
     }
-    printf("\n");
 
-    return ((curr->isEndOfWord) ? (curr->storage_server) : (-1)); // -1 marks path nowhere
+    pthread_mutex_unlock(&trie_lock);
 }
 
-void delete_from_trie(trienode** root, char* signedtext) {
-    if(*root == NULL){
-        return;
+/**
+ * @brief Stops a directory from being listed as a path of its own, once
+ * it is no longer empty. It keeps resolving as a prefix of its contents.
+ * 
+ * @param root: Pointer to the root of the trie.
+ * @param signedtext: Path of the directory, with the trailing '/'.
+ */
+void unmark_trie_path(trienode** root, char* signedtext) {
+    pthread_mutex_lock(&trie_lock);
+
+    trienode* curr = *root;
+    const char* rest = signedtext;
+    while (curr != NULL && *rest != '\0') {
+        trienode* child = find_child(curr, rest, component_len(rest), NULL);
+        if (child == NULL || child->label[common_components(child->label, rest)] != '\0') {
+            curr = NULL;
+            break;
+        }
+        rest += strlen(child->label);
+        curr = child;
+    }
+
+    // A marker without anything below it is the only trace of the directory
+    if (curr != NULL && curr != *root && count_of(children_of(curr)) > 0) {
+        atomic_store(&curr->isEndOfWord, false);
+    }
+
+    pthread_mutex_unlock(&trie_lock);
+}
+
+/**
+ * @brief Recursive helper for release_server_paths. Unlinks the nodes of
+ * serverID hanging off the shared nodes below node.
+ */
+static void detach_server(trienode* node, int serverID) {
+    for (int i = count_of(children_of(node)) - 1; i >= 0; i--) {
+        trienode* child = child_at(children_of(node), i);
+
+        if (child->owner == serverID) {
+            // Reclaimed by the reset of the arena, no need to walk it
+            remove_child(node, i);
+            continue;
+        } else if (child->owner != SHARED_ARENA) {
+            continue;
+        }
+
+        detach_server(child, serverID);
+
+        // Shared nodes must stop pointing at the departed server, a
+        // path that no other replica holds is gone
+        unsigned int replicas = atomic_load(&child->replicas) & ~(1u << serverID);
+        atomic_store(&child->replicas, replicas);
+        if (atomic_load(&child->storage_server) == serverID) {
+            ChildMap* map = children_of(child);
+            if (replicas != 0) {
+                atomic_store(&child->storage_server, __builtin_ctz(replicas));
+            } else if (count_of(map) > 0) {
+                atomic_store(&child->storage_server, atomic_load(&child_at(map, 0)->storage_server));
+            } else {
+                atomic_store(&child->isEndOfWord, false);
+            }
+        }
+
+        collapse_child(node, i);
     }
+}
 
-    if(search_trie(*root, signedtext) == -1){
+/**
+ * @brief Drops every path of a storage server from the trie. The nodes of
+ * the server are given back by resetting its arena, so the cost depends
+ * only on the number of shared directories, not on the number of paths.
+ * 
+ * @param root: Pointer to the root of the trie.
+ * @param serverID: Storage server whose paths are released.
+ */
+void release_server_paths(trienode** root, int serverID) {
+    int owner = arena_of(serverID);
+    if (owner == SHARED_ARENA) {
         return;
     }
 
-    unsigned char* text = (unsigned char*)signedtext;
-    trienode* curr = *root;
-    int length = strlen(signedtext);
+    pthread_mutex_lock(&trie_lock);
+
+    if (*root != NULL) {
+        detach_server(*root, owner);
+    }
+    arena_reset(owner);
+
+    pthread_mutex_unlock(&trie_lock);
+}
+
+/**
+ * @brief First child of node whose first component sorts after text[0..len)
+ * (or equal to it, if inclusive). Children are found by key rather than by
+ * index, so a walk stepping through them with this is not thrown off by
+ * entries shifting underneath it.
+ * 
+ * @return The child, NULL if there is none.
+ */
+static trienode* seek_child(trienode* node, const char* text, int len, bool inclusive) {
+    ChildMap* map = children_of(node);
+    if (map == NULL) {
+        return NULL;
+    }
+
+    while (true) {
+        unsigned int seq = atomic_load_explicit(&map->seq, memory_order_acquire);
+        int lo = 0, count = count_of(map), hi = count;
+
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            int cmp = compare_component(child_at(map, mid), text, len);
+            if (cmp < 0 || (cmp == 0 && !inclusive)) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        trienode* child = (lo < count) ? child_at(map, lo) : NULL;
+
+        atomic_thread_fence(memory_order_acquire);
+        if ((seq & 1) == 0 && atomic_load_explicit(&map->seq, memory_order_relaxed) == seq) {
+            return child;
+        }
+    }
+}
+
+/**
+ * @brief Adds a path to a LIST_ALL page.
+ * 
+ * @return false if the page is full, in which case more is set.
+ */
+static bool list_append(PathList* list, trienode* node, const char* path, int len) {
+    int serverID = atomic_load(&node->storage_server);
+    if (list->servers != NULL && (serverID < 0 || serverID >= MAX_SERVERS || !list->servers[serverID].online)) {
+        return true;
+    }
+
+    if (list->count == list->limit) {
+        list->more = true;
+        return false;
+    }
+
+    if (list->size + len + 1 > list->capacity) {
+        size_t capacity = (list->capacity == 0) ? 4096 : 2 * list->capacity;
+        while (capacity < list->size + len + 1) {
+            capacity *= 2;
+        }
+        char* names = (char*) realloc(list->names, capacity);
+        if (names == NULL) {
+            LOG("Error allocating LIST_ALL page", false);
+            list->more = true;
+            return false;
+        }
+        list->names = names;
+        list->capacity = capacity;
+    }
+
+    memcpy(list->names + list->size, path, len);
+    list->names[list->size + len] = '\n';
+    list->size += len + 1;
+    list->count++;
+    return true;
+}
+
+/**
+ * @brief Lists the paths in the subtree of node in strcmp order, which is
+ * the order the children are kept in.
+ * 
+ * @param node: Root of the subtree.
+ * @param path: Buffer holding the path of the parent of node.
+ * @param path_len: Length of the path of the parent.
+ * @param after: Part of the cursor below the parent, only paths sorting
+ *               after it are listed. NULL to list everything.
+ * @param list: Page being filled.
+ * 
+ * @return false once the page is full.
+ */
+static bool list_subtree(trienode* node, char* path, int path_len, const char* after, PathList* list) {
+    int label_len = strlen(node->label);
+    if (path_len + label_len >= MAX_PATH_LEN) {
+        return true;
+    }
+    memcpy(path + path_len, node->label, label_len + 1);
+    path_len += label_len;
+
+    if (after != NULL) {
+        // node is a prefix of the cursor, so it was listed on an earlier page
+        if (strncmp(after, node->label, label_len) != 0) {
+            if (strcmp(node->label, after) < 0) {
+                return true;
+            }
+            after = NULL;
+        } else {
+            after += label_len;
+        }
+    }
 
-    for(int i=0 ; i<length ; i++){
-        if(curr->children[text[i]] == NULL){
+    if (after == NULL && atomic_load(&node->isEndOfWord)) {
+        if (!list_append(list, node, path, path_len)) {
+            return false;
+        }
+    }
+
+    // Jump straight to the cursor: every child before it was listed already,
+    // and only the one sharing its first component can straddle it
+    const char* from = "";
+    int from_len = 0;
+    bool inclusive = true;
+    if (after != NULL && after[0] != '\0') {
+        from = after;
+        from_len = component_len(after);
+        inclusive = false;
+
+        trienode* child = seek_child(node, from, from_len, true);
+        if (child != NULL && compare_component(child, from, from_len) == 0) {
+            if (!list_subtree(child, path, path_len, after, list)) {
+                return false;
+            }
+        }
+    }
+
+    trienode* child = seek_child(node, from, from_len, inclusive);
+    while (child != NULL) {
+        if (!list_subtree(child, path, path_len, NULL, list)) {
+            return false;
+        }
+        child = seek_child(node, child->label, component_len(child->label), false);
+    }
+    return true;
+}
+
+/**
+ * @brief Walks down to the nodes whose paths start with prefix and lists
+ * their subtrees. Only the part of the trie under the prefix is visited.
+ * 
+ * @param node: Node reached so far.
+ * @param path: Buffer holding the path of node.
+ * @param path_len: Length of the path of node.
+ * @param rest: Part of the prefix below node, not empty.
+ * @param cursor: Last path of the previous page, relative to node. It
+ *                always starts with rest, NULL for the first page.
+ * @param list: Page being filled.
+ * 
+ * @return false once the page is full.
+ */
+static bool list_prefix(trienode* node, char* path, int path_len, const char* rest, const char* cursor, PathList* list) {
+    int len = component_len(rest);
+    if (rest[len - 1] == '/') {
+        // A whole component, at most one child can match
+        trienode* child = find_child(node, rest, len, NULL);
+        if (child == NULL) {
+            return true;
+        }
+
+        int label_len = strlen(child->label);
+        if (strncmp(child->label, rest, label_len) == 0 && rest[label_len] != '\0') {
+            if (path_len + label_len >= MAX_PATH_LEN) {
+                return true;
+            }
+            memcpy(path + path_len, child->label, label_len + 1);
+            const char* below = (cursor != NULL) ? cursor + label_len : NULL;
+            return list_prefix(child, path, path_len + label_len, rest + label_len, below, list);
+        }
+        if (strncmp(child->label, rest, strlen(rest)) == 0) {
+            return list_subtree(child, path, path_len, cursor, list);
+        }
+        return true;
+    }
+
+    // The prefix ends halfway through a component, every child whose
+    // first component starts with it matches, and they are adjacent
+    // and the ones before the cursor were listed already
+    trienode* child = (cursor == NULL) ? seek_child(node, rest, len, true) : seek_child(node, cursor, component_len(cursor), true);
+    while (child != NULL && strncmp(child->label, rest, len) == 0) {
+        if (!list_subtree(child, path, path_len, cursor, list)) {
+            return false;
+        }
+        cursor = NULL;
+        child = seek_child(node, child->label, component_len(child->label), false);
+    }
+    return true;
+}
+
+/**
+ * @brief Collects one page of the paths starting with prefix, in strcmp
+ * order. The cost is proportional to the size of the page (and the depth
+ * of the prefix), not to the number of paths in the namespace.
+ * 
+ * @param root: Root of the trie.
+ * @param prefix: Prefix of the paths to list, matched byte by byte.
+ * @param cursor: Last path of the previous page, empty for the first page.
+ * @param list: Page to fill, with limit and servers set by the caller.
+ */
+void list_trie(trienode* root, const char* prefix, const char* cursor, PathList* list) {
+    if (root == NULL) {
+        return;
+    }
+    if (cursor[0] == '\0') {
+        cursor = NULL;
+    } else if (strncmp(cursor, prefix, strlen(prefix)) != 0) {
+        // A cursor outside the prefix either precedes or follows all of it
+        if (strcmp(cursor, prefix) > 0) {
             return;
         }
+        cursor = NULL;
+    }
+
+    char path[MAX_PATH_LEN];
+    path[0] = '\0';
+
+    epoch_enter();
+    if (prefix[0] == '\0') {
+        list_subtree(root, path, 0, cursor, list);
+    } else {
+        list_prefix(root, path, 0, prefix, cursor, list);
+    }
+    epoch_exit();
+}
+
+/**
+ * @brief Recursive helper for walk_trie.
+ */
+static void walk_subtree(trienode* node, char* path, int path_len, TrieVisitor visit, void* arg) {
+    int label_len = strlen(node->label);
+    if (path_len + label_len >= MAX_PATH_LEN) {
+        return;
+    }
+    memcpy(path + path_len, node->label, label_len + 1);
+    path_len += label_len;
+
+    if (atomic_load(&node->isEndOfWord)) {
+        visit(path, path_len, atomic_load(&node->storage_server), atomic_load(&node->replicas), arg);
+    }
 
-        curr = curr->children[text[i]];
+    trienode* child = seek_child(node, "", 0, true);
+    while (child != NULL) {
+        walk_subtree(child, path, path_len, visit, arg);
+        child = seek_child(node, child->label, component_len(child->label), false);
     }
-    // printf("Marking -1 for char %c\n", text[length-1]);
-    curr-> storage_server = -1;
+}
+
+/**
+ * @brief Calls visit on every path in the trie, in strcmp order. Like
+ * list_trie it takes no lock, updates made during the walk may or may
+ * not be seen.
+ * 
+ * @param root: Root of the trie.
+ * @param visit: Called with each path, its length, its primary storage
+ *               server and all of its replicas.
+ * @param arg: Passed on to visit.
+ */
+void walk_trie(trienode* root, TrieVisitor visit, void* arg) {
+    if (root == NULL) {
+        return;
+    }
+
+    char path[MAX_PATH_LEN];
+    path[0] = '\0';
+
+    epoch_enter();
+    walk_subtree(root, path, 0, visit, arg);
+    epoch_exit();
+}
+
+/**
+ * @brief Logs the live and garbage node counts of the namespace trie.
+ */
+void logNamespaceStats() {
+    NamespaceStats stats;
+
+    pthread_mutex_lock(&trie_lock);
+    getNamespaceStats(&stats);
+    pthread_mutex_unlock(&trie_lock);
+
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer),
+        "Namespace: %ld live nodes, %ld garbage nodes, %zu KB live, %zu KB garbage, %zu KB reserved, %zu KB pooled, %zu KB in limbo, %ld resets, %ld compactions",
+        stats.live_nodes, stats.garbage_nodes, stats.live_bytes / 1024, stats.garbage_bytes / 1024,
+        stats.reserved_bytes / 1024, stats.pooled_bytes / 1024, stats.limbo_bytes / 1024, stats.resets, stats.compactions);
+    LOG(buffer, true);
 }
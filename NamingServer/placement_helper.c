@@ -0,0 +1,267 @@
+#include "nm.h"
+
+#include "../utils/headers.h"
+#include "../utils/logging.h"
+#include "../utils/constants.h"
+#include "../utils/structs.h"
+
+/***************************************************/
+/*     Placement of replicas and choice of reads   */
+/***************************************************/
+
+static int replication_factor = DEFAULT_REPLICATION_FACTOR;       // Servers a new path is created on
+static ServerDetails* placement_servers = NULL;                    // Server table of the NM
+static atomic_int recent_picks[MAX_SERVERS];                       // Requests sent to a server since its last load report
+static atomic_llong picks_since[MAX_SERVERS];                      // Time of the report recent_picks counts from
+static atomic_uint next_start;                                     // Rotates the order ties are broken in
+
+/**
+ * @brief Sets up placement.
+ *
+ * @param servers : Pointer to an array of ServerDetails structs containing server details.
+ * @param replicationFactor : Storage servers every new path is created on, fewer if not that many can hold it.
+ */
+void initPlacement(ServerDetails* servers, int replicationFactor) {
+    placement_servers = servers;
+    replication_factor = replicationFactor;
+}
+
+/**
+ * @brief The servers of a replica set that are online.
+ */
+unsigned int liveReplicas(unsigned int replicas) {
+    unsigned int live = 0;
+    for (int i = 0; i < MAX_SERVERS; i++) {
+        if ((replicas & (1u << i)) && placement_servers[i].online) {
+            live |= (1u << i);
+        }
+    }
+    return live;
+}
+
+/**
+ * @brief Load of a server as placement sees it: the requests it reported
+ * in its last heartbeat, plus those sent its way since. Without the
+ * latter every request between two beats would go to the same server.
+ */
+static long long load_score(int serverID, ServerLoad* load) {
+    if (!getServerLoad(serverID, load)) {
+        memset(load, 0, sizeof(ServerLoad));
+    }
+
+    // A new report already counts the requests sent before it
+    long long since = atomic_load(&picks_since[serverID]);
+    if (load->updated_ms != since && atomic_compare_exchange_strong(&picks_since[serverID], &since, load->updated_ms)) {
+        atomic_store(&recent_picks[serverID], 0);
+    }
+    return (long long) load->queue_depth + atomic_load(&recent_picks[serverID]);
+}
+
+/**
+ * @brief Whether server a is a better choice than server b. Fewer
+ * requests wins, then a lower CPU load, then more free space.
+ */
+static bool less_loaded(long long score_a, ServerLoad* a, long long score_b, ServerLoad* b) {
+    if (score_a != score_b) {
+        return score_a < score_b;
+    }
+    if (a->cpu_load != b->cpu_load) {
+        return a->cpu_load < b->cpu_load;
+    }
+    return a->free_bytes > b->free_bytes;
+}
+
+/**
+ * @brief Picks the least loaded live server of a replica set, for a read.
+ * Servers that are equally loaded take turns.
+ *
+ * @param replicas : The replica set.
+ *
+ * @return The server, -1 if none of them is online.
+ */
+int pickReplica(unsigned int replicas) {
+    unsigned int live = liveReplicas(replicas);
+    unsigned int start = atomic_fetch_add(&next_start, 1);
+
+    int best = -1;
+    long long best_score = 0;
+    ServerLoad best_load;
+    for (int i = 0; i < MAX_SERVERS; i++) {
+        int serverID = (start + i) % MAX_SERVERS;
+        if (!(live & (1u << serverID))) {
+            continue;
+        }
+
+        ServerLoad load;
+        long long score = load_score(serverID, &load);
+        if (best < 0 || less_loaded(score, &load, best_score, &best_load)) {
+            best = serverID;
+            best_score = score;
+            best_load = load;
+        }
+    }
+
+    if (best >= 0) {
+        atomic_fetch_add(&recent_picks[best], 1);
+    }
+    return best;
+}
+
+/**
+ * @brief The directory holding a path, with its trailing '/'.
+ *
+ * @return Length of the directory, 0 for a path at the top.
+ */
+static int parent_directory(const char* path, char* parent) {
+    strncpy(parent, path, MAX_PATH_LEN - 1);
+    parent[MAX_PATH_LEN - 1] = '\0';
+    int end = strlen(parent) - 1;
+    if (end >= 0 && parent[end] == '/') {
+        end--;
+    }
+    while (end >= 0 && parent[end] != '/') {
+        end--;
+    }
+    parent[end + 1] = '\0';
+    return (end > 0) ? end + 1 : 0;
+}
+
+/**
+ * @brief Picks the servers a new path is created on: up to the
+ * replication factor of the least loaded live servers holding its parent
+ * directory, any live server for a path at the top.
+ *
+ * @param path : The new path.
+ * @param root : Root of the path trie.
+ * @param cache : Location cache in front of the trie.
+ * @param replicas : Set to the chosen servers.
+ *
+ * @return The server to be the primary, -1 if no server can hold the path.
+ */
+int placeNewPath(const char* path, trienode* root, LocationCache* cache, unsigned int* replicas) {
+    *replicas = 0;
+
+    char parent[MAX_PATH_LEN];
+    unsigned int candidates = (1u << MAX_SERVERS) - 1;
+    if (parent_directory(path, parent) > 0 && findStorageServer(parent, root, cache, &candidates) < 0) {
+        return -1;
+    }
+    unsigned int live = liveReplicas(candidates);
+
+    int primary = -1;
+    for (int chosen = 0; chosen < replication_factor && live != 0; chosen++) {
+        int serverID = pickReplica(live);
+        live &= ~(1u << serverID);
+        *replicas |= (1u << serverID);
+        if (primary < 0) {
+            primary = serverID;
+        }
+    }
+    return primary;
+}
+
+/**
+ * @brief Orders the live replicas of a path into the chain writes go
+ * down: the primary first if it is online, then the others by ID. Every
+ * write to the path takes the same route, so two writes can never wait
+ * on each other's replicas in opposite orders.
+ *
+ * @param replicas : The replica set.
+ * @param primary : The primary of the path.
+ * @param chain : Filled with the replicas, head first.
+ * @param head : Set to the server at the head, -1 if none is online.
+ *
+ * @return Number of replicas in the chain.
+ */
+int replicaChain(unsigned int replicas, int primary, ChainHop* chain, int* head) {
+    unsigned int live = liveReplicas(replicas);
+    int chain_len = 0;
+    *head = -1;
+
+    for (int i = -1; i < MAX_SERVERS; i++) {
+        int serverID = (i < 0) ? primary : i;
+        if (serverID < 0 || !(live & (1u << serverID))) {
+            continue;
+        }
+        live &= ~(1u << serverID);
+
+        if (*head < 0) {
+            *head = serverID;
+        }
+        memcpy(chain[chain_len].serverIP, placement_servers[serverID].serverIP, IP_LEN);
+        chain[chain_len].port_client = placement_servers[serverID].port_client;
+        chain_len++;
+    }
+    return chain_len;
+}
+
+/**
+ * @brief Gives a hot file one more replica, on the least loaded live
+ * server that holds its directory but not the file. The new server pulls
+ * the file from the least loaded replica, and only then lists it, so it
+ * gets reads only once it has the whole file.
+ *
+ * @param path : The hot file.
+ * @param root : Root of the path trie.
+ * @param cache : Location cache in front of the trie.
+ *
+ * @return true if the file got a new replica.
+ */
+bool replicateHotPath(const char* path, trienode* root, LocationCache* cache) {
+    char file[MAX_PATH_LEN];
+    strncpy(file, path, MAX_PATH_LEN - 1);
+    file[MAX_PATH_LEN - 1] = '\0';
+
+    unsigned int replicas;
+    int primary = findStorageServer(file, root, cache, &replicas);
+    if (primary < 0) {
+        return false;
+    }
+    replicas |= (1u << primary);
+    if (__builtin_popcount(replicas) >= HOT_MAX_REPLICAS) {
+        return false;
+    }
+
+    char parent[MAX_PATH_LEN];
+    unsigned int candidates = (1u << MAX_SERVERS) - 1;
+    if (parent_directory(file, parent) > 0 && findStorageServer(parent, root, cache, &candidates) < 0) {
+        return false;
+    }
+    int target = pickReplica(candidates & ~replicas);
+    int source = pickReplica(replicas);
+    if (target < 0 || source < 0) {
+        return false;
+    }
+
+    ClientRequest request;
+    memset(&request, 0, sizeof(ClientRequest));
+    request.requestType = REPLICATE_FILE;
+    request.num_args = 1;
+    request.traceID = newTraceID();
+    strcpy(request.arg1, file);
+    request.chain_len = 1;
+    memcpy(request.chain[0].serverIP, placement_servers[source].serverIP, IP_LEN);
+    request.chain[0].port_client = placement_servers[source].port_client;
+
+    // The server copies the file on a thread of its own and replies once
+    // it is done, which takes as long as the file is large, so the wait
+    // is not bound by MAX_NM_TO_SRV_TIMEOUT. The delta in the reply adds
+    // the new replica to the namespace.
+    PendingStorageRequest pending;
+    sendStorageRequest(target, &request, &pending);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += HOT_REPLICATE_TIMEOUT;
+
+    AckPacket ack;
+    char inform_log[MAX_PATH_LEN + 128];
+    if (!waitStorageReply(&pending, &deadline, &ack) || ack.ack != SUCCESS_ACK) {
+        snprintf(inform_log, sizeof(inform_log), "Could not replicate hot file %s to storage server %d", file, target);
+        LOG(inform_log, false);
+        return false;
+    }
+    snprintf(inform_log, sizeof(inform_log), "Replicated hot file %s from storage server %d to %d", file, source, target);
+    LOG(inform_log, true);
+    return true;
+}
@@ -0,0 +1,336 @@
+#include "nm.h"
+
+#include "../utils/headers.h"
+#include "../utils/logging.h"
+#include "../utils/constants.h"
+#include "../utils/structs.h"
+
+#include <netinet/tcp.h>
+
+/***************************************************/
+/*     Pooled connections to the storage servers   */
+/***************************************************/
+
+static StorageConnection storage_pool[MAX_SERVERS];     // One long-lived connection per storage server
+static ServerDetails* pool_servers = NULL;              // Server table of the NM
+static trienode** pool_root = NULL;                     // Namespace trie of the NM
+static LocationCache* pool_cache = NULL;                // Location cache of the NM
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Connection a reader thread is in charge of.
+ */
+typedef struct PoolReader {
+    int ss_num;
+    int socket;
+    long generation;
+} PoolReader;
+
+static void init_pool(void) {
+    for (int i = 0; i < MAX_SERVERS; i++) {
+        pthread_mutex_init(&storage_pool[i].lock, NULL);
+        pthread_mutex_init(&storage_pool[i].send_lock, NULL);
+        pthread_cond_init(&storage_pool[i].connect_done, NULL);
+        storage_pool[i].socket = -1;
+    }
+}
+
+/**
+ * @brief Sets up the pool. Replies are applied to the namespace by the
+ * pool itself, so it needs to know where the namespace is.
+ *
+ * @param servers : Pointer to an array of ServerDetails structs containing server details.
+ * @param root : Root of the path trie.
+ * @param cache : Location cache, invalidated for the paths the replies change.
+ */
+void initStoragePool(ServerDetails* servers, trienode** root, LocationCache* cache) {
+    pthread_once(&pool_once, init_pool);
+    pool_servers = servers;
+    pool_root = root;
+    pool_cache = cache;
+}
+
+/**
+ * @brief Unlinks a request from the list of requests in flight, if it is
+ * still there. The caller holds the lock of the connection.
+ */
+static void unlink_pending(StorageConnection* connection, PendingStorageRequest* pending) {
+    for (PendingStorageRequest** link = &connection->pending; *link != NULL; link = &(*link)->next) {
+        if (*link == pending) {
+            *link = pending->next;
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Tears down a connection that failed: every request still in
+ * flight on it fails, and the next request opens a new one.
+ */
+static void fail_connection(int ss_num, int socket, long generation) {
+    StorageConnection* connection = &storage_pool[ss_num];
+
+    // No request may be halfway through writing to the socket when it closes
+    pthread_mutex_lock(&connection->send_lock);
+    pthread_mutex_lock(&connection->lock);
+        if (connection->generation == generation && connection->socket == socket) {
+            connection->socket = -1;
+        }
+
+        PendingStorageRequest** link = &connection->pending;
+        while (*link != NULL) {
+            PendingStorageRequest* pending = *link;
+            if (pending->generation == generation) {
+                *link = pending->next;
+                pending->done = true;
+                pending->failed = true;
+                pthread_cond_signal(&pending->cond);
+            } else {
+                link = &pending->next;
+            }
+        }
+    pthread_mutex_unlock(&connection->lock);
+    close(socket);
+    pthread_mutex_unlock(&connection->send_lock);
+}
+
+/**
+ * @brief Receives the replies on a pooled connection until it fails. The
+ * deltas are applied here, in the order the server sent them, which is
+ * the order of their sequence numbers; only then is the waiting request
+ * woken up. Replies to requests that gave up waiting are applied too.
+ *
+ * @param arg : PoolReader of the connection, freed here.
+ */
+static void* pool_reader(void* arg) {
+    PoolReader reader = *(PoolReader*) arg;
+    free(arg);
+    StorageConnection* connection = &storage_pool[reader.ss_num];
+
+    StorageReply reply;
+    while (recvAll(reader.socket, &reply, sizeof(StorageReply))) {
+        if (!applyPathDelta(reader.ss_num, &reply.delta, pool_servers, pool_root, pool_cache)) {
+            resyncServer(reader.ss_num, pool_servers, pool_root, pool_cache);
+        }
+
+        pthread_mutex_lock(&connection->lock);
+            for (PendingStorageRequest* pending = connection->pending; pending != NULL; pending = pending->next) {
+                if (pending->requestID == reply.requestID && pending->generation == reader.generation) {
+                    unlink_pending(connection, pending);
+                    pending->ack = reply.ack;
+                    pending->done = true;
+                    pthread_cond_signal(&pending->cond);
+                    break;
+                }
+            }
+        pthread_mutex_unlock(&connection->lock);
+    }
+
+    LOG("Lost pooled connection to storage server", false);
+    fail_connection(reader.ss_num, reader.socket, reader.generation);
+    return NULL;
+}
+
+/**
+ * @brief Opens the pooled connection to a storage server and starts its
+ * reader. The connect can take up to CONNECT_TIMEOUT_MS for a server
+ * that is down, so it is made with the lock of the connection let go:
+ * replies, timeouts and drops on the connection go on meanwhile, and
+ * other senders wait on connect_done. The caller holds the lock of the
+ * connection, which is let go and taken again here.
+ */
+static bool pool_connect(int ss_num) {
+    StorageConnection* connection = &storage_pool[ss_num];
+    long generation = connection->generation;
+    connection->connecting = true;
+    pthread_mutex_unlock(&connection->lock);
+
+    int storage_fd;
+    bool connected = connectToStorageServer(&storage_fd, ss_num, pool_servers);
+    if (connected) {
+        // Requests and replies are small and latency bound
+        int nodelay = 1;
+        setsockopt(storage_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    }
+
+    pthread_mutex_lock(&connection->lock);
+    connection->connecting = false;
+    pthread_cond_broadcast(&connection->connect_done);
+    if (!connected) {
+        return false;
+    }
+
+    // Dropped while we connected, the server may have moved since
+    if (connection->generation != generation) {
+        LOG("Storage server registered again during connect", false);
+        close(storage_fd);
+        return false;
+    }
+
+    PoolReader* reader = (PoolReader*) malloc(sizeof(PoolReader));
+    if (reader == NULL) {
+        LOG("Error allocating pool reader", false);
+        close(storage_fd);
+        return false;
+    }
+    reader->ss_num = ss_num;
+    reader->socket = storage_fd;
+    reader->generation = ++connection->generation;
+
+    pthread_t readerThreadId;
+    if (pthread_create(&readerThreadId, NULL, pool_reader, reader) != 0) {
+        LOG("Error creating pool reader thread", false);
+        free(reader);
+        close(storage_fd);
+        return false;
+    }
+    pthread_detach(readerThreadId);
+
+    connection->socket = storage_fd;
+    LOG("Opened pooled connection to storage server", true);
+    return true;
+}
+
+/**
+ * @brief Sends a request to a storage server on its pooled connection,
+ * without waiting for the reply. Any number of requests can be in flight
+ * on the connection at once, each reply is matched to its request by ID.
+ * Every request started here must be finished with waitStorageReply.
+ *
+ * @param ss_num : Storage server number.
+ * @param request : The request.
+ * @param pending : Set up here for waitStorageReply, owned by the caller.
+ *
+ * @return false if the request could not be sent.
+ */
+bool sendStorageRequest(int ss_num, ClientRequest* request, PendingStorageRequest* pending) {
+    pthread_once(&pool_once, init_pool);
+    StorageConnection* connection = &storage_pool[ss_num];
+
+    memset(pending, 0, sizeof(PendingStorageRequest));
+    pthread_cond_init(&pending->cond, NULL);
+    pending->ss_num = ss_num;
+
+    pthread_mutex_lock(&connection->lock);
+        // Only one sender connects, the others wait for it and share its fate
+        bool waited = false;
+        while (connection->socket < 0 && connection->connecting) {
+            pthread_cond_wait(&connection->connect_done, &connection->lock);
+            waited = true;
+        }
+        if (connection->socket < 0 && (waited || !pool_connect(ss_num))) {
+            pthread_mutex_unlock(&connection->lock);
+            return false;
+        }
+        int storage_fd = connection->socket;
+        pending->requestID = connection->next_request_id++ & 0x7fffffff;
+        pending->generation = connection->generation;
+
+        // Listed before it is sent, the reply can be quick
+        pending->next = connection->pending;
+        connection->pending = pending;
+    pthread_mutex_unlock(&connection->lock);
+
+    StorageRequest message;
+    message.requestID = pending->requestID;
+    message.request = *request;
+
+    pthread_mutex_lock(&connection->send_lock);
+        pthread_mutex_lock(&connection->lock);
+            bool current = (connection->generation == pending->generation && connection->socket == storage_fd);
+        pthread_mutex_unlock(&connection->lock);
+        bool sent = current && sendAll(storage_fd, &message, sizeof(StorageRequest));
+    pthread_mutex_unlock(&connection->send_lock);
+
+    if (!sent) {
+        LOG("Can't send request to storage server", false);
+        pthread_mutex_lock(&connection->lock);
+            unlink_pending(connection, pending);
+
+            // Part of the request may be on the wire, the connection is of no more use
+            if (current) {
+                shutdown(storage_fd, SHUT_RDWR);
+            }
+        pthread_mutex_unlock(&connection->lock);
+        return false;
+    }
+
+    pending->sent = true;
+    return true;
+}
+
+/**
+ * @brief Waits for the reply to a request started with sendStorageRequest.
+ * The delta in the reply has been applied to the namespace by the time
+ * this returns.
+ *
+ * @param pending : The request.
+ * @param deadline : When to give up waiting, on CLOCK_REALTIME.
+ * @param ack : Set to the ack of the storage server.
+ *
+ * @return false if no reply came, because the request was never sent, the
+ *         connection broke or the deadline passed.
+ */
+bool waitStorageReply(PendingStorageRequest* pending, struct timespec* deadline, AckPacket* ack) {
+    StorageConnection* connection = &storage_pool[pending->ss_num];
+
+    pthread_mutex_lock(&connection->lock);
+        while (pending->sent && !pending->done) {
+            if (pthread_cond_timedwait(&pending->cond, &connection->lock, deadline) == ETIMEDOUT) {
+                LOG("Timed out waiting for storage server", false);
+                unlink_pending(connection, pending);
+                break;
+            }
+        }
+        bool replied = pending->done && !pending->failed;
+        if (replied) {
+            *ack = pending->ack;
+        }
+    pthread_mutex_unlock(&connection->lock);
+
+    pthread_cond_destroy(&pending->cond);
+    return replied;
+}
+
+/**
+ * @brief Sends a request to a storage server on its pooled connection and
+ * waits for the reply.
+ *
+ * @param ss_num : Storage server number.
+ * @param request : The request.
+ * @param ack : Set to the ack of the storage server.
+ *
+ * @return false if no reply came, because the server could not be
+ *         reached, the connection broke or MAX_NM_TO_SRV_TIMEOUT passed.
+ */
+bool callStorageServer(int ss_num, ClientRequest* request, AckPacket* ack) {
+    PendingStorageRequest pending;
+    sendStorageRequest(ss_num, request, &pending);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += MAX_NM_TO_SRV_TIMEOUT;
+    return waitStorageReply(&pending, &deadline, ack);
+}
+
+/**
+ * @brief Drops the pooled connection to a storage server, used when the
+ * server registers again and may have moved. Requests in flight on it fail.
+ *
+ * @param ss_num : Storage server number.
+ */
+void dropStorageConnection(int ss_num) {
+    pthread_once(&pool_once, init_pool);
+    StorageConnection* connection = &storage_pool[ss_num];
+
+    pthread_mutex_lock(&connection->lock);
+        // The reader sees the shutdown and closes the socket
+        if (connection->socket >= 0) {
+            shutdown(connection->socket, SHUT_RDWR);
+            connection->socket = -1;
+        }
+
+        // A connect in progress is to where the server was, it is not kept
+        connection->generation++;
+    pthread_mutex_unlock(&connection->lock);
+}
@@ -0,0 +1,481 @@
+#include "nm.h"
+
+#include "../utils/headers.h"
+#include "../utils/logging.h"
+#include "../utils/constants.h"
+#include "../utils/structs.h"
+
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+/***************************************************/
+/*      Event loop serving the clients of the NM   */
+/***************************************************/
+
+static int reactor_fds[NUM_REACTORS];                              // epoll instance of each reactor
+static ClientRequestHandler request_handler = NULL;                // Called with every complete request
+static ClientRequestFilter request_blocks = NULL;                  // Whether a request goes to a worker
+static ClientConnection* connections[MAX_CLIENTS];                 // Connection of each client slot in use
+static int free_slots[MAX_CLIENTS];                                // Stack of client slots not in use
+static int num_free_slots = 0;                                     // Entries in free_slots
+static pthread_mutex_t slot_lock = PTHREAD_MUTEX_INITIALIZER;      // Protects free_slots
+static ClientConnection* work_head = NULL;                         // Connections waiting for a worker, oldest first
+static ClientConnection* work_tail = NULL;                         // Last entry of the work queue
+static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;      // Protects the work queue
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;        // Signalled when work is queued
+
+/**
+ * @brief Takes a free client slot.
+ *
+ * @return The slot, -1 if MAX_CLIENTS clients are connected.
+ */
+static int take_slot() {
+    int slot = -1;
+    pthread_mutex_lock(&slot_lock);
+        if (num_free_slots > 0) {
+            slot = free_slots[--num_free_slots];
+        }
+    pthread_mutex_unlock(&slot_lock);
+    return slot;
+}
+
+/**
+ * @brief Gives a client slot back.
+ */
+static void release_slot(int slot) {
+    pthread_mutex_lock(&slot_lock);
+        free_slots[num_free_slots++] = slot;
+    pthread_mutex_unlock(&slot_lock);
+}
+
+/**
+ * @brief Drops a reference to a connection. The last one frees it, so a
+ * worker still serving a request of a client that left keeps its slot
+ * and socket from being reused under it.
+ */
+static void put_connection(ClientConnection* connection) {
+    pthread_mutex_lock(&connection->lock);
+        bool last = (--connection->refs == 0);
+    pthread_mutex_unlock(&connection->lock);
+    if (!last) {
+        return;
+    }
+
+    // Leases of the client die with its connection
+    unregisterLeaseClient(connection->slot);
+    connections[connection->slot] = NULL;
+    close(connection->socket);
+    release_slot(connection->slot);
+    pthread_mutex_destroy(&connection->lock);
+    free(connection->out.data);
+    free(connection);
+
+    LOG("Client connection closed", true);
+}
+
+/**
+ * @brief Closes a connection: the reactor stops watching it and drops its
+ * reference. Only the reactor owning the connection calls this.
+ */
+static void close_connection(ClientConnection* connection) {
+    pthread_mutex_lock(&connection->lock);
+        connection->closed = true;
+        epoll_ctl(connection->epollFd, EPOLL_CTL_DEL, connection->socket, NULL);
+    pthread_mutex_unlock(&connection->lock);
+    put_connection(connection);
+}
+
+/**
+ * @brief Sets what the reactor waits for on a connection: requests unless
+ * a worker is serving one, and room in the socket while replies are left
+ * to send. The caller holds the lock of the connection.
+ */
+static void watch_connection(ClientConnection* connection) {
+    unsigned int events = EPOLLRDHUP;
+    if (!connection->busy) {
+        events |= EPOLLIN;
+    }
+    if (connection->out_sent < connection->out.size) {
+        events |= EPOLLOUT;
+    }
+    if (connection->closed || events == connection->events) {
+        return;
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.ptr = connection;
+    if (epoll_ctl(connection->epollFd, EPOLL_CTL_MOD, connection->socket, &event) < 0) {
+        LOG("Error changing the events of a client", false);
+        return;
+    }
+    connection->events = events;
+}
+
+/**
+ * @brief Sends as much of the queued replies as the socket takes without
+ * blocking. The rest goes out when the reactor sees room for it. The
+ * caller holds the lock of the connection.
+ *
+ * @return false if the socket failed.
+ */
+static bool flush_replies(ClientConnection* connection) {
+    WireBuffer* out = &connection->out;
+    while (connection->out_sent < out->size) {
+        ssize_t sent = send(connection->socket, out->data + connection->out_sent, out->size - connection->out_sent, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        connection->out_sent += sent;
+    }
+
+    if (connection->out_sent == out->size) {
+        connection->out_sent = 0;
+        out->size = 0;
+
+        // A large reply does not pin its buffer for the life of the client
+        if (out->capacity > CLIENT_OUT_KEEP_BYTES) {
+            free(out->data);
+            memset(out, 0, sizeof(WireBuffer));
+        }
+    }
+    watch_connection(connection);
+    return true;
+}
+
+/**
+ * @brief Queues bytes for a client and sends what the socket takes right
+ * away. Never blocks: a client that does not read its replies has them
+ * pile up until CLIENT_OUT_MAX_BYTES, and is then dropped.
+ *
+ * @param clientID : Slot of the client.
+ * @param data : Bytes to send.
+ * @param len : Number of bytes.
+ *
+ * @return false if the client is gone or is being dropped.
+ */
+bool queueClientReply(int clientID, const void* data, size_t len) {
+    ClientConnection* connection = (clientID >= 0 && clientID < MAX_CLIENTS) ? connections[clientID] : NULL;
+    if (connection == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&connection->lock);
+        bool queued = !connection->closed && connection->out.size - connection->out_sent <= CLIENT_OUT_MAX_BYTES;
+        if (queued) {
+            appendBytes(&connection->out, data, len);
+            queued = !connection->out.failed && flush_replies(connection);
+        }
+
+        // Its reactor sees the hang up and closes the connection
+        if (!queued && !connection->closed) {
+            LOG("Error queueing reply to client", false);
+            shutdown(connection->socket, SHUT_RDWR);
+        }
+    pthread_mutex_unlock(&connection->lock);
+    return queued;
+}
+
+/**
+ * @brief Hands the request a connection just received to the workers.
+ * Nothing more is read from the client until it has been answered.
+ */
+static void queue_work(ClientConnection* connection) {
+    pthread_mutex_lock(&connection->lock);
+        connection->busy = true;
+        connection->refs++;
+        watch_connection(connection);
+    pthread_mutex_unlock(&connection->lock);
+
+    pthread_mutex_lock(&work_lock);
+        connection->next = NULL;
+        if (work_tail == NULL) {
+            work_head = connection;
+        } else {
+            work_tail->next = connection;
+        }
+        work_tail = connection;
+        pthread_cond_signal(&work_cond);
+    pthread_mutex_unlock(&work_lock);
+}
+
+/**
+ * @brief Runs one worker: serves the requests the reactors hand over, the
+ * ones that wait on the storage servers, and lets the reactor read from
+ * the client again once each one is answered.
+ *
+ * @param arg : Unused.
+ */
+static void* worker_thread(void* arg) {
+    while (1) {
+        pthread_mutex_lock(&work_lock);
+            while (work_head == NULL) {
+                pthread_cond_wait(&work_cond, &work_lock);
+            }
+            ClientConnection* connection = work_head;
+            work_head = connection->next;
+            if (work_head == NULL) {
+                work_tail = NULL;
+            }
+        pthread_mutex_unlock(&work_lock);
+
+        bool connected = request_handler(connection->slot, &connection->request);
+
+        pthread_mutex_lock(&connection->lock);
+            connection->busy = false;
+            if (!connected && !connection->closed) {
+                shutdown(connection->socket, SHUT_RDWR);
+            }
+            watch_connection(connection);
+        pthread_mutex_unlock(&connection->lock);
+        put_connection(connection);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Reads what a client sent and serves every request that is now
+ * complete, at most REACTOR_BATCH of them so the other clients of the
+ * reactor get their turn. A partial request is kept for the next event.
+ * A request that waits on the storage servers goes to a worker, and
+ * reading stops until it is answered, so replies keep their order.
+ *
+ * @param connection : The connection that became readable.
+ *
+ * @return false if the connection is to be closed: the client left, the
+ *         socket failed, or the reply could not be queued.
+ */
+static bool serve_connection(ClientConnection* connection) {
+    int served = 0;
+    while (served < REACTOR_BATCH) {
+        char* buffer = (char*) &connection->request;
+        ssize_t got = recv(connection->socket, buffer + connection->received, sizeof(ClientRequest) - connection->received, 0);
+        if (got == 0) {
+            return false;
+        }
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+
+        if (connection->received == 0) {
+            connection->arrived_us = traceClock();
+        }
+        connection->received += got;
+        if (connection->received < sizeof(ClientRequest)) {
+            continue;
+        }
+
+        // From the first bytes until the whole request was read
+        traceSpan(connection->request.traceID, "receive", connection->arrived_us, traceClock(), TRACE_FLOW_NONE);
+
+        connection->received = 0;
+        served++;
+        if (request_blocks(&connection->request)) {
+            queue_work(connection);
+            return true;
+        }
+        if (!request_handler(connection->slot, &connection->request)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Runs one reactor: waits for its connections to become readable,
+ * or writable while replies are left, and serves them.
+ *
+ * @param arg : Index of the reactor.
+ */
+static void* reactor_thread(void* arg) {
+    int epollFd = reactor_fds[(intptr_t) arg];
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    while (1) {
+        int ready = epoll_wait(epollFd, events, REACTOR_MAX_EVENTS, -1);
+        if (ready < 0) {
+            if (errno != EINTR) {
+                LOG("Error waiting for client events", false);
+            }
+            continue;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            ClientConnection* connection = (ClientConnection*) events[i].data.ptr;
+            unsigned int event = events[i].events;
+            bool open = !(event & (EPOLLHUP | EPOLLERR));
+
+            if (open && (event & EPOLLOUT)) {
+                pthread_mutex_lock(&connection->lock);
+                    open = flush_replies(connection);
+                pthread_mutex_unlock(&connection->lock);
+            }
+
+            // A client hanging up mid-request is picked up by recv, or
+            // here while a worker has its request
+            if (open && (event & (EPOLLIN | EPOLLRDHUP))) {
+                pthread_mutex_lock(&connection->lock);
+                    bool busy = connection->busy;
+                pthread_mutex_unlock(&connection->lock);
+                open = busy ? !(event & EPOLLRDHUP) : serve_connection(connection);
+            }
+
+            if (!open) {
+                close_connection(connection);
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Raises the limit on open files as far as allowed, every client
+ * holds a descriptor.
+ */
+static void raise_fd_limit() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) < 0) {
+            LOG("Error raising the open file limit", false);
+        }
+    }
+}
+
+/**
+ * @brief Hands a new client connection to a reactor.
+ *
+ * @param clientSocket : The accepted socket.
+ * @param reactor : Index of the reactor.
+ *
+ * @return false if the connection had to be refused.
+ */
+static bool add_connection(int clientSocket, int reactor) {
+    int slot = take_slot();
+    if (slot < 0) {
+        LOG("Too many clients, refusing connection", false);
+        return false;
+    }
+
+    int flags = fcntl(clientSocket, F_GETFL, 0);
+    ClientConnection* connection = (ClientConnection*) calloc(1, sizeof(ClientConnection));
+    if (flags < 0 || fcntl(clientSocket, F_SETFL, flags | O_NONBLOCK) < 0 || connection == NULL) {
+        LOG("Error setting up client connection", false);
+        free(connection);
+        release_slot(slot);
+        return false;
+    }
+
+    // A reply is often several small acks, which must not wait on each other
+    int nodelay = 1;
+    setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    connection->socket = clientSocket;
+    connection->slot = slot;
+    connection->epollFd = reactor_fds[reactor];
+    connection->events = EPOLLIN | EPOLLRDHUP;
+    connection->refs = 1;
+    pthread_mutex_init(&connection->lock, NULL);
+
+    // Lease invalidations are queued on the connection like replies
+    connections[slot] = connection;
+    registerLeaseClient(slot);
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = connection->events;
+    event.data.ptr = connection;
+    if (epoll_ctl(connection->epollFd, EPOLL_CTL_ADD, clientSocket, &event) < 0) {
+        LOG("Error adding client to its reactor", false);
+        unregisterLeaseClient(slot);
+        connections[slot] = NULL;
+        pthread_mutex_destroy(&connection->lock);
+        free(connection);
+        release_slot(slot);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Serves clients forever. Starts NUM_REACTORS reactor threads and
+ * NUM_NM_WORKERS workers, and then accepts connections on the calling
+ * thread, handing them out in turn. Sockets are non-blocking and only
+ * read when epoll says so, so a slow or idle client costs nothing but its
+ * connection state. Reactors only do I/O and the requests answered from
+ * memory; the ones that wait on storage servers go to the workers.
+ *
+ * @param listenSocket : Socket listening for clients.
+ * @param handler : Called with every complete request, queues the reply
+ *                  with queueClientReply. A reply that could not be
+ *                  queued closes the connection.
+ * @param blocking : Whether a request is handed to a worker.
+ */
+void serveClients(int listenSocket, ClientRequestHandler handler, ClientRequestFilter blocking) {
+    request_handler = handler;
+    request_blocks = blocking;
+    raise_fd_limit();
+
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        free_slots[i] = MAX_CLIENTS - 1 - i;
+    }
+    num_free_slots = MAX_CLIENTS;
+
+    for (int i = 0; i < NUM_REACTORS; i++) {
+        reactor_fds[i] = epoll_create1(0);
+        if (reactor_fds[i] < 0) {
+            LOG("Error creating reactor", false);
+            exit(EXIT_FAILURE);
+        }
+
+        pthread_t reactorThreadId;
+        if (pthread_create(&reactorThreadId, NULL, reactor_thread, (void*) (intptr_t) i) != 0) {
+            LOG("Error creating reactor thread", false);
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(reactorThreadId);
+    }
+
+    for (int i = 0; i < NUM_NM_WORKERS; i++) {
+        pthread_t workerThreadId;
+        if (pthread_create(&workerThreadId, NULL, worker_thread, NULL) != 0) {
+            LOG("Error creating worker thread", false);
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(workerThreadId);
+    }
+
+    int next_reactor = 0;
+    while (1) {
+        int clientSocket = accept(listenSocket, NULL, NULL);
+        if (clientSocket < 0) {
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                // Waits for clients to leave instead of spinning on accept
+                LOG("Out of file descriptors, pausing accepts", false);
+                usleep(ACCEPT_BACKOFF_MS * 1000);
+            } else if (errno != EINTR && errno != ECONNABORTED) {
+                LOG("Error accepting client connection", false);
+            }
+            continue;
+        }
+
+        if (!add_connection(clientSocket, next_reactor)) {
+            close(clientSocket);
+            continue;
+        }
+        LOG("Accepted client connection", true);
+        next_reactor = (next_reactor + 1) % NUM_REACTORS;
+    }
+}
@@ -0,0 +1,319 @@
+#include "nm.h"
+
+#include "../utils/headers.h"
+#include "../utils/logging.h"
+#include "../utils/constants.h"
+#include "../utils/structs.h"
+
+#include <limits.h>
+
+/***************************************************/
+/*     Access statistics and hot path detection    */
+/***************************************************/
+
+static atomic_uint sketch[SKETCH_DEPTH][SKETCH_WIDTH];             // Count-min sketch of path accesses
+static HotPath hot_heap[HOT_PATHS_K];                              // Hottest paths, a min-heap on count
+static int hot_size = 0;                                           // Entries in hot_heap
+static atomic_uint hot_floor;                                      // Count a path must beat to get in, 0 while there is room
+static pthread_mutex_t hot_lock = PTHREAD_MUTEX_INITIALIZER;       // Protects hot_heap and hot_size
+
+static char replicate_queue[HOT_REPLICATE_QUEUE][MAX_PATH_LEN];    // Hot files waiting for another replica
+static int queue_head = 0;                                         // Next file to replicate
+static int queue_size = 0;                                         // Files in replicate_queue
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;     // Protects the queue
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;       // Signalled when a file is queued
+
+static trienode** hot_root = NULL;                                 // Namespace trie of the NM
+static LocationCache* hot_cache = NULL;                            // Location cache of the NM
+
+/**
+ * @brief Adds an access to the sketch.
+ *
+ * @return The estimated accesses of the path, the smallest of its counters.
+ */
+static unsigned int sketch_add(unsigned long long hash) {
+    // Row i uses h1 + i * h2, the two halves of the hash
+    unsigned int h1 = (unsigned int) hash;
+    unsigned int h2 = (unsigned int) (hash >> 32) | 1;
+
+    unsigned int estimate = UINT_MAX;
+    for (int i = 0; i < SKETCH_DEPTH; i++) {
+        unsigned int count = atomic_fetch_add_explicit(&sketch[i][(h1 + i * h2) & (SKETCH_WIDTH - 1)], 1, memory_order_relaxed) + 1;
+        if (count < estimate) {
+            estimate = count;
+        }
+    }
+    return estimate;
+}
+
+static void heap_swap(int a, int b) {
+    HotPath tmp = hot_heap[a];
+    hot_heap[a] = hot_heap[b];
+    hot_heap[b] = tmp;
+}
+
+static void sift_up(int i) {
+    while (i > 0 && hot_heap[(i - 1) / 2].count > hot_heap[i].count) {
+        heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void sift_down(int i) {
+    while (1) {
+        int smallest = i;
+        for (int child = 2 * i + 1; child <= 2 * i + 2 && child < hot_size; child++) {
+            if (hot_heap[child].count < hot_heap[smallest].count) {
+                smallest = child;
+            }
+        }
+        if (smallest == i) {
+            return;
+        }
+        heap_swap(i, smallest);
+        i = smallest;
+    }
+}
+
+/**
+ * @brief Hands a hot file to the replicator, unless the queue is full.
+ * The caller holds hot_lock.
+ */
+static void queue_replication(HotPath* entry) {
+    pthread_mutex_lock(&queue_lock);
+        if (queue_size < HOT_REPLICATE_QUEUE) {
+            strcpy(replicate_queue[(queue_head + queue_size) % HOT_REPLICATE_QUEUE], entry->path);
+            queue_size++;
+            entry->queued = true;
+            pthread_cond_signal(&queue_cond);
+        }
+    pthread_mutex_unlock(&queue_lock);
+}
+
+/**
+ * @brief Offers a path with its estimated count to the top-k. Only paths
+ * that beat the coldest entry get as far as the lock, and once the top-k
+ * is full only every HOT_OFFER_EVERY accesses, so the hottest paths do
+ * not contend on it with every lookup.
+ */
+static void consider_path(const char* path, int len, unsigned long long hash, unsigned int estimate) {
+    unsigned int floor = atomic_load_explicit(&hot_floor, memory_order_relaxed);
+    if (estimate <= floor || (floor > 0 && (estimate & (HOT_OFFER_EVERY - 1)) != 0)) {
+        return;
+    }
+
+    pthread_mutex_lock(&hot_lock);
+        int i = 0;
+        while (i < hot_size && (hot_heap[i].hash != hash || strncmp(hot_heap[i].path, path, len) != 0 || hot_heap[i].path[len] != '\0')) {
+            i++;
+        }
+
+        if (i < hot_size) {
+            if (estimate > hot_heap[i].count) {
+                hot_heap[i].count = estimate;
+            }
+        } else if (hot_size < HOT_PATHS_K || estimate > hot_heap[0].count) {
+            if (hot_size < HOT_PATHS_K) {
+                i = hot_size++;
+            } else {
+                i = 0;
+            }
+            memcpy(hot_heap[i].path, path, len);
+            hot_heap[i].path[len] = '\0';
+            hot_heap[i].hash = hash;
+            hot_heap[i].count = estimate;
+            hot_heap[i].queued = false;
+        }
+
+        // A file hot enough gets another replica, directories are only counted
+        if (i < hot_size && estimate >= HOT_REPLICATE_HITS && !hot_heap[i].queued && path[len - 1] != '/') {
+            queue_replication(&hot_heap[i]);
+        }
+        if (i < hot_size) {
+            sift_up(i);
+            sift_down(i);
+        }
+        atomic_store_explicit(&hot_floor, (hot_size == HOT_PATHS_K) ? hot_heap[0].count : 0, memory_order_relaxed);
+    pthread_mutex_unlock(&hot_lock);
+}
+
+/**
+ * @brief Counts an access of a client to a path, and to the directory
+ * holding it. Costs a hash and a few relaxed atomic adds; the top-k is
+ * only locked for paths hot enough to be in it.
+ *
+ * @param path : The path the client asked for.
+ */
+void recordPathAccess(const char* path) {
+    int len = strnlen(path, MAX_PATH_LEN - 1);
+    if (len == 0) {
+        return;
+    }
+    unsigned long long hash = hash_bytes(path, len);
+    consider_path(path, len, hash, sketch_add(hash));
+
+    // The directory holding the path, with its trailing '/'
+    int end = len - 1;
+    if (path[end] == '/') {
+        end--;
+    }
+    while (end >= 0 && path[end] != '/') {
+        end--;
+    }
+    if (end > 0) {
+        hash = hash_bytes(path, end + 1);
+        consider_path(path, end + 1, hash, sketch_add(hash));
+    }
+}
+
+/**
+ * @brief Halves every count, so what was hot a while ago fades out. Adds
+ * that race with the halving may be lost, the counts are estimates anyway.
+ */
+static void decay_counts() {
+    for (int i = 0; i < SKETCH_DEPTH; i++) {
+        for (int j = 0; j < SKETCH_WIDTH; j++) {
+            atomic_store_explicit(&sketch[i][j], atomic_load_explicit(&sketch[i][j], memory_order_relaxed) / 2, memory_order_relaxed);
+        }
+    }
+
+    pthread_mutex_lock(&hot_lock);
+        for (int i = 0; i < hot_size; i++) {
+            hot_heap[i].count /= 2;
+            if (hot_heap[i].count < HOT_REPLICATE_HITS) {
+                hot_heap[i].queued = false;
+            }
+        }
+        atomic_store_explicit(&hot_floor, (hot_size == HOT_PATHS_K) ? hot_heap[0].count : 0, memory_order_relaxed);
+    pthread_mutex_unlock(&hot_lock);
+}
+
+/**
+ * @brief Decays the counts every HOT_DECAY_MS.
+ */
+static void* hot_decay_thread(void* arg) {
+    while (1) {
+        usleep(HOT_DECAY_MS * 1000);
+        decay_counts();
+    }
+    return NULL;
+}
+
+/**
+ * @brief Replicates the hot files queued, on a thread of its own so a
+ * long copy does not hold up the decay of the counts.
+ */
+static void* hot_path_thread(void* arg) {
+    while (1) {
+        char path[MAX_PATH_LEN];
+
+        pthread_mutex_lock(&queue_lock);
+            while (queue_size == 0) {
+                pthread_cond_wait(&queue_cond, &queue_lock);
+            }
+            strcpy(path, replicate_queue[queue_head]);
+            queue_head = (queue_head + 1) % HOT_REPLICATE_QUEUE;
+            queue_size--;
+        pthread_mutex_unlock(&queue_lock);
+
+        // One at a time, so two copies never wait on each other's servers
+        replicateHotPath(path, *hot_root, hot_cache);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Starts tracking hot paths, with a thread that decays the counts
+ * and one that gives hot files more replicas.
+ *
+ * @param root : Root of the path trie.
+ * @param cache : Location cache in front of the trie.
+ */
+void startHotPathTracking(trienode** root, LocationCache* cache) {
+    hot_root = root;
+    hot_cache = cache;
+
+    pthread_t hotPathThreadId;
+    if (pthread_create(&hotPathThreadId, NULL, hot_path_thread, NULL) != 0) {
+        LOG("Error creating hot path thread", false);
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(hotPathThreadId);
+
+    pthread_t hotDecayThreadId;
+    if (pthread_create(&hotDecayThreadId, NULL, hot_decay_thread, NULL) != 0) {
+        LOG("Error creating hot path decay thread", false);
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(hotDecayThreadId);
+}
+
+static int compare_hot(const void* a, const void* b) {
+    unsigned int x = ((const HotPath*) a)->count;
+    unsigned int y = ((const HotPath*) b)->count;
+    return (x < y) - (x > y);
+}
+
+/**
+ * @brief Answers a HOT_PATHS request with the hottest paths and
+ * directories, hottest first, one "count path" line each. The final
+ * SUCCESS_ACK carries the number sent in extraInfo[0].
+ *
+ * @param reply : Reply to the client.
+ * @param clientRequest : The request, limit is the number of paths wanted
+ *                        (0 for all HOT_PATHS_K).
+ *
+ * @return true on success, false on failure
+ */
+bool sendHotPaths(WireBuffer* reply, ClientRequest* clientRequest) {
+    LOG("Request Type : NON-PRIVILEDGED", true);
+
+    HotPath hot[HOT_PATHS_K];
+    int count;
+    pthread_mutex_lock(&hot_lock);
+        count = hot_size;
+        memcpy(hot, hot_heap, count * sizeof(HotPath));
+    pthread_mutex_unlock(&hot_lock);
+
+    qsort(hot, count, sizeof(HotPath), compare_hot);
+    if (clientRequest->limit > 0 && clientRequest->limit < count) {
+        count = clientRequest->limit;
+    }
+
+    if (!sendConnectionAcknowledgment(reply, INIT_ACK, SUCCESS)) {
+        LOG("Connection acknowledgement failed", false);
+        return false;
+    }
+
+    // Pack as many whole lines as fit into every packet
+    FilePacket packet;
+    int sent = 0;
+    do {
+        size_t len = 0;
+        while (sent < count) {
+            char line[MAX_PATH_LEN + 16];
+            int line_len = snprintf(line, sizeof(line), "%u %s\n", hot[sent].count, hot[sent].path);
+            if (line_len >= sizeof(line) || len + line_len > MAX_CHUNK_SIZE) {
+                break;
+            }
+            memcpy(packet.chunk + len, line, line_len);
+            len += line_len;
+            sent++;
+        }
+        packet.chunk[len] = '\0';
+        packet.lastChunk = (sent == count || len == 0);
+
+        appendBytes(reply, &packet, sizeof(FilePacket));
+    } while (!packet.lastChunk);
+    if (reply->failed) {
+        LOG("Error sending hot paths to client", false);
+        return false;
+    }
+
+    AckPacket ack;
+    memset(&ack, 0, sizeof(AckPacket));
+    ack.ack = SUCCESS_ACK;
+    ack.errorCode = SUCCESS;
+    ack.extraInfo[0] = sent;
+    return sendAckToClient(reply, &ack);
+}
@@ -4,6 +4,9 @@
 #include "../utils/constants.h"
 #include "../utils/structs.h"
 
+#include <fcntl.h>
+#include <netinet/tcp.h>
+
 /**
  * @brief Acquire readlock to allow concurrent file reading.
  * 
@@ -50,117 +53,308 @@ void release_writelock(rwlock* rw_lock) {
     sem_post(&rw_lock->writeLock);
 }
 
+static FileLock* file_locks[FILE_LOCK_BUCKETS];                 // Locks of the files in use, by hash of their path
+static pthread_mutex_t file_locks_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Find the lock of a file, made on its first use. The lock is the
+ * same for every request on the path for as long as one of them has it.
+ * Every lock got here is given back with putFileLock.
+ * 
+ * @param path: Path of the file, relative to the storage root.
+ * 
+ * @return The lock, NULL if it could not be made.
+ */
+FileLock* getFileLock(const char* path) {
+    unsigned long long hash = hash_path(path);
+    FileLock** bucket = &file_locks[hash % FILE_LOCK_BUCKETS];
+
+    pthread_mutex_lock(&file_locks_mutex);
+        FileLock* fileLock = *bucket;
+        while (fileLock != NULL && (fileLock->hash != hash || strcmp(fileLock->path, path) != 0)) {
+            fileLock = fileLock->next;
+        }
+
+        if (fileLock == NULL) {
+            fileLock = (FileLock*) malloc(sizeof(FileLock));
+            char* copy = strdup(path);
+            if (fileLock == NULL || copy == NULL) {
+                perror("Error allocating file lock");
+                pthread_mutex_unlock(&file_locks_mutex);
+                free(fileLock);
+                free(copy);
+                return NULL;
+            }
+            fileLock->path = copy;
+            fileLock->hash = hash;
+            fileLock->users = 0;
+            fileLock->lock.readers = 0;
+            sem_init(&fileLock->lock.lock, 0, 1);
+            sem_init(&fileLock->lock.writeLock, 0, 1);
+            fileLock->next = *bucket;
+            *bucket = fileLock;
+        }
+        fileLock->users++;
+    pthread_mutex_unlock(&file_locks_mutex);
+    return fileLock;
+}
+
 /**
- * @brief Read file present in ss and send it to client
+ * @brief Give back a lock got with getFileLock, after letting go of it.
+ * The last request to give it back frees it.
+ * 
+ * @param fileLock: The lock.
+ */
+void putFileLock(FileLock* fileLock) {
+    pthread_mutex_lock(&file_locks_mutex);
+        if (--fileLock->users > 0) {
+            pthread_mutex_unlock(&file_locks_mutex);
+            return;
+        }
+
+        for (FileLock** link = &file_locks[fileLock->hash % FILE_LOCK_BUCKETS]; *link != NULL; link = &(*link)->next) {
+            if (*link == fileLock) {
+                *link = fileLock->next;
+                break;
+            }
+        }
+    pthread_mutex_unlock(&file_locks_mutex);
+
+    sem_destroy(&fileLock->lock.lock);
+    sem_destroy(&fileLock->lock.writeLock);
+    free(fileLock->path);
+    free(fileLock);
+}
+
+/**
+ * @brief Read file present in ss and send it to client: the size of the
+ * range read, then its bytes with sendfile, straight from the page cache
+ * to the socket. A range past the end of the file is cut at the end. A
+ * file that cannot be opened is sent as size -1 and the read fails.
  *
  * @param path : path of the file to be read
  * @param cltSocket : client socket to be used for communication
+ * @param offset : first byte to read
+ * @param length : most bytes to read, 0 for up to the end of the file
  *
- * @returns
+ * @returns true if the whole range was sent, false otherwise
  */
-bool read_file_in_ss(char *path, int *cltSocket) {
-        FILE *file = fopen(path, "r");
-        if (file == NULL) {
+bool read_file_in_ss(char *path, int *cltSocket, long long offset, long long length) {
+        int fd = open(path, O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0) {
                 perror("Error opening file for reading");
+                if (fd >= 0) {
+                        close(fd);
+                }
+                sendFileHeader(*cltSocket, -1);
                 return false;
         }
 
-        FilePacket packet;
-        size_t bytesRead;
+        long long size = (offset < st.st_size) ? st.st_size - offset : 0;
+        if (length > 0 && length < size) {
+                size = length;
+        }
 
-        printf("Before entering the loop\n");
+        bool sent = sendFileHeader(*cltSocket, size) &&
+                    sendFileData(*cltSocket, fd, offset, size);
+        if (!sent) {
+                perror("Error sending file to client");
+        }
 
-        char buffer[MAX_CHUNK_SIZE + 1];
+        close(fd);
+        return sent;
+}
 
-        do {
-            // memset(0, buffer, MAX_CHUNK_SIZE + 1);
+/**
+ * @brief Opens a connection to the next replica of a chain write and
+ * sends it the request, with the chain moved on past it.
+ *
+ * @param clientRequest : The write request as it reached us.
+ *
+ * @returns The socket, -1 if the replica could not be reached.
+ */
+static int open_next_hop(ClientRequest *clientRequest) {
+        int hopSocket = socket(SOCKET_FAMILY, SOCKET_TYPE, SOCKET_PROTOCOL);
+        if (hopSocket < 0) {
+                perror("Error creating socket for the next replica");
+                return -1;
+        }
+
+        // Frames are passed on as they come, none should wait for the next
+        int nodelay = 1;
+        setsockopt(hopSocket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+        struct sockaddr_in hop_addr;
+        memset(&hop_addr, 0, sizeof(hop_addr));
+        hop_addr.sin_family = SOCKET_FAMILY;
+        hop_addr.sin_port = htons(clientRequest->chain[0].port_client);
+        hop_addr.sin_addr.s_addr = inet_addr(clientRequest->chain[0].serverIP);
+
+        ClientRequest forward = *clientRequest;
+        forward.chain_len = clientRequest->chain_len - 1;
+        memcpy(forward.chain, &clientRequest->chain[1], forward.chain_len * sizeof(ChainHop));
+
+        if (connect(hopSocket, (struct sockaddr*) &hop_addr, sizeof(hop_addr)) < 0 ||
+            !sendAll(hopSocket, &forward, sizeof(ClientRequest))) {
+                perror("Error passing write on to the next replica");
+                close(hopSocket);
+                return -1;
+        }
+        return hopSocket;
+}
 
-            bytesRead = fread(buffer, 1, MAX_CHUNK_SIZE, file);
+/**
+ * @brief Write file present in ss and send ack to client. The file comes
+ * as a stream of length-prefixed data frames. If the request carries a
+ * chain of further replicas, every frame is passed on to the next one
+ * before it is written here, so the replicas write in parallel and the
+ * sender only sends the file once. The ack of the next replica covers the
+ * rest of the chain.
+ *
+ * @param path : path of the file to be written to
+ * @param cltSocket : socket the file comes in on, from the client or the previous replica
+ * @param clientRequest : the request, with the replicas still to write to
+ *
+ * @returns true if the file was written here and on every later replica
+ */
+bool write_file_in_ss(char *path, int *cltSocket, ClientRequest *clientRequest) {
+        size_t frameSize;
+        if (!recvDataStart(*cltSocket, &frameSize)) {
+                printf("Bad start of the data stream\n");
+                return false;
+        }
+        char *frame = (char*) malloc(frameSize);
+        if (frame == NULL) {
+                perror("Error allocating the data frame");
+                return false;
+        }
 
-            // Fill the remaining part of the buffer with NULL
-            buffer[bytesRead] = '\0';
-            // memset(buffer + bytesRead, '\0', MAX_CHUNK_SIZE - bytesRead);
-            strcpy(packet.chunk, buffer);
+        int nextSocket = -1;
+        bool chained = true;
+        if (clientRequest->chain_len > 0) {
+                nextSocket = open_next_hop(clientRequest);
+                if (nextSocket >= 0 && !sendDataStart(nextSocket, frameSize)) {
+                        close(nextSocket);
+                        nextSocket = -1;
+                }
+                chained = (nextSocket >= 0);
+        }
 
-            // printf("%zu read bytes: ", bytesRead);
-            packet.lastChunk = (feof(file) != 0);
+        // The frames are still taken in on failure, so the sender is not
+        // left blocked halfway through the file
+        FILE *file = fopen(path, "w");
+        if (file == NULL) {
+                perror("Error opening file for writing");
+        }
 
-            if (send(*cltSocket, &packet, sizeof(FilePacket), 0) < 0) {
-                perror("Error sending file packet to client");
-                fclose(file);
+        bool written = (file != NULL);
+        size_t len;
+        do {
+            if (!recvDataFrame(*cltSocket, frame, frameSize, &len)) {
+                perror("Error receiving data frame");
+                if (file != NULL) {
+                        fclose(file);
+                }
+                if (nextSocket >= 0) {
+                        close(nextSocket);
+                }
+                free(frame);
                 return false;
             }
 
-            printf("Sending this: %s\n", packet.chunk);
+            if (nextSocket >= 0 && !sendDataFrame(nextSocket, frame, len)) {
+                perror("Error passing data frame to the next replica");
+                close(nextSocket);
+                nextSocket = -1;
+                chained = false;
+            }
 
-            if (packet.lastChunk) {
-                printf("This was the last chunk being sent\n");
-                break; // No need to continue if it's the last chunk
+            if (file != NULL && fwrite(frame, 1, len, file) != len) {
+                written = false;
             }
-        } while (bytesRead > 0);
+        } while (len > 0);
+        free(frame);
 
-        printf("Done sending\n");
+        printf("Done receiving\n");
 
-        fclose(file);
+        // Wait for the rest of the chain to have written it too
+        if (nextSocket >= 0) {
+                AckPacket ack;
+                if (!recvAll(nextSocket, &ack, sizeof(AckPacket)) || ack.ack != SUCCESS_ACK) {
+                        printf("Write failed further down the chain\n");
+                        chained = false;
+                }
+                close(nextSocket);
+        }
 
-        return true;
+        if (file != NULL && fclose(file) != 0) {
+                written = false;
+        }
+        return written && chained;
 }
 
 /**
- * @brief Write file present in ss and send ack to client
+ * @brief Copies a file here from another replica, by reading it from
+ * that replica the way a client would. The file is not listed yet, so
+ * nothing else touches it while it is written.
  *
- * @param path : path of the file to be written to
- * @param cltSocket : client socket to be used for communication
+ * @param clientRequest : The REPLICATE_FILE request, arg1 is the path and
+ *                        chain[0] the replica to copy from.
  *
- * @returns
+ * @returns true if the whole file was copied, false if nothing was kept.
  */
-bool write_file_in_ss(char *path, int *cltSocket) {
-        FILE *file = fopen(path, "r");
-        if (file == NULL) {
-                perror("Error opening file for reading");
+bool pullFileFromReplica(ClientRequest *clientRequest) {
+        if (clientRequest->chain_len < 1) {
                 return false;
         }
+        const char *path = (clientRequest->arg1[0] == '/') ? clientRequest->arg1 + 1 : clientRequest->arg1;
 
-        FilePacket packet;
-        size_t bytesRead;
+        int srcSocket = socket(SOCKET_FAMILY, SOCKET_TYPE, SOCKET_PROTOCOL);
+        if (srcSocket < 0) {
+                perror("Error creating socket for the source replica");
+                return false;
+        }
 
-        printf("Before entering the loop for write request\n");
+        struct sockaddr_in src_addr;
+        memset(&src_addr, 0, sizeof(src_addr));
+        src_addr.sin_family = SOCKET_FAMILY;
+        src_addr.sin_port = htons(clientRequest->chain[0].port_client);
+        src_addr.sin_addr.s_addr = inet_addr(clientRequest->chain[0].serverIP);
+
+        ClientRequest read;
+        memset(&read, 0, sizeof(ClientRequest));
+        read.requestType = READ_FILE;
+        read.num_args = 1;
+        strcpy(read.arg1, clientRequest->arg1);
+        read.traceID = clientRequest->traceID;
+
+        if (connect(srcSocket, (struct sockaddr*) &src_addr, sizeof(src_addr)) < 0 ||
+            !sendAll(srcSocket, &read, sizeof(ClientRequest))) {
+                perror("Error asking the source replica for the file");
+                close(srcSocket);
+                return false;
+        }
 
-        file = fopen(path, "w");
+        FILE *file = fopen(path, "w");
         if (file == NULL) {
                 perror("Error opening file for writing");
+                close(srcSocket);
                 return false;
         }
 
-        fclose(file);
-
-        file = fopen(path, "a");
-        printf("the path here is : %s\n", path);
+        long long size;
+        AckPacket ack;
+        bool copied = recvFileHeader(srcSocket, &size) && size >= 0 &&
+                      recvFileData(srcSocket, size, file) &&
+                      recvAll(srcSocket, &ack, sizeof(AckPacket)) && ack.ack == SUCCESS_ACK;
+        close(srcSocket);
 
-        char buffer[MAX_CHUNK_SIZE + 1];
-
-        // Keep receiving packets until the last packet is received
-        do {
-            if (recv(*cltSocket, &packet, sizeof(FilePacket), 0) < 0) {
-                perror("Error sending file packet to client");
-                fclose(file);
+        if (fclose(file) != 0 || !copied) {
+                perror("Error copying file from the source replica");
+                remove(path);
                 return false;
-            }
-
-            printf("Receiving this: %s\n", packet.chunk);
-
-            // Append to the file // GPT complete this ples
-            fwrite(packet.chunk, 1, strlen(packet.chunk), file);
-
-            if (packet.lastChunk) {
-                break; // No need to continue if it's the last chunk
-            }
-        } while (bytesRead > 0);
-
-        printf("Done receiving\n");
-
-        fclose(file);
-
+        }
         return true;
 }
 
@@ -286,6 +480,11 @@ void listFilesAndEmptyFolders(const char *path, ServerDetails *serverDetails) {
             char fullPath[MAX_PATH_LEN];
             snprintf(fullPath, MAX_PATH_LEN, "%s/%s", path, entry->d_name);
 
+            // The stats file is ours, not a path clients can use
+            if (strcmp(fullPath, SS_STATS_FILE) == 0) {
+                continue;
+            }
+
             if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
                 if (stat(fullPath, &fileStat) == -1) {
                     perror("Error in getting file status");
@@ -333,3 +532,144 @@ void listFilesAndEmptyFolders(const char *path, ServerDetails *serverDetails) {
         exit(EXIT_FAILURE);
     }
 }
+
+/**
+ * @brief Find a path in the list of accessible paths.
+ * 
+ * @param serverDetails : Pointer to the ServerDetails struct.
+ * @param path : Path to look for, as kept in accessible_paths.
+ * 
+ * @return Index of the path, -1 if it is not in the list.
+ */
+int findAccessiblePath(ServerDetails *serverDetails, const char *path) {
+    for (int i = 0; i < serverDetails->num_paths; i++) {
+        if (strcmp(serverDetails->accessible_paths[i], path) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Check whether a directory has nothing but "." and "..".
+ * 
+ * @param path : Path of the directory, relative to the storage root.
+ * 
+ * @return true if the directory exists and is empty.
+ */
+bool isEmptyDirectory(const char *path) {
+    DIR *dir = opendir((path[0] == '\0') ? "." : path);
+    if (dir == NULL) {
+        return false;
+    }
+
+    bool isEmpty = true;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+            isEmpty = false;
+            break;
+        }
+    }
+    closedir(dir);
+    return isEmpty;
+}
+
+/**
+ * @brief Record one change in a delta and apply it to the list of
+ * accessible paths. A removed path is swapped with the last one, so the
+ * cost does not depend on the number of paths after the lookup.
+ * 
+ * @param serverDetails : Pointer to the ServerDetails struct.
+ * @param delta : Delta being built.
+ * @param op : The change.
+ * @param path : Path that changed, as kept in accessible_paths.
+ */
+static void addDeltaChange(ServerDetails *serverDetails, PathDelta *delta, DeltaOp op, const char *path) {
+    if (op == DELTA_ADD) {
+        if (serverDetails->num_paths < MAX_PATHS) {
+            strcpy(serverDetails->accessible_paths[serverDetails->num_paths], path);
+            serverDetails->num_paths++;
+        } else {
+            printf("Too many paths, %s is only known to the NM\n", path);
+        }
+    } else {
+        int idx = findAccessiblePath(serverDetails, path);
+        if (idx >= 0) {
+            serverDetails->num_paths--;
+            if (idx != serverDetails->num_paths) {
+                strcpy(serverDetails->accessible_paths[idx], serverDetails->accessible_paths[serverDetails->num_paths]);
+            }
+        }
+    }
+
+    if (delta->num_changes < MAX_DELTA_CHANGES) {
+        delta->changes[delta->num_changes].op = op;
+        strcpy(delta->changes[delta->num_changes].path, path);
+        delta->num_changes++;
+    }
+}
+
+/**
+ * @brief Build the namespace delta of a privileged request that just
+ * succeeded, and update the list of accessible paths to match. Instead of
+ * walking the whole tree again, only the parent directory is read from
+ * disk, and only the changed paths are sent to the NM.
+ * 
+ * @param clientRequest : The request, with the leading "/" of arg1 removed.
+ * @param serverDetails : Pointer to the ServerDetails struct.
+ * @param delta : Filled with the changes, and the sequence number they get.
+ */
+void buildPathDelta(ClientRequest *clientRequest, ServerDetails *serverDetails, PathDelta *delta) {
+    memset(delta, 0, sizeof(PathDelta));
+    delta->serverID = serverDetails->serverID;
+
+    bool isDir = (clientRequest->requestType == CREATE_DIR || clientRequest->requestType == DELETE_DIR);
+    bool isCreate = (clientRequest->requestType == CREATE_DIR || clientRequest->requestType == CREATE_FILE ||
+                     clientRequest->requestType == REPLICATE_FILE);
+
+    // Paths are kept as "/dir/file" and "/empty_dir/"
+    char path[MAX_PATH_LEN];
+    snprintf(path, MAX_PATH_LEN - 1, "/%s", clientRequest->arg1);
+    if (isDir && path[strlen(path) - 1] != '/') {
+        strcat(path, "/");
+    }
+
+    // The directory holding the path, "/" for the storage root
+    char parent[MAX_PATH_LEN];
+    strcpy(parent, path);
+    int end = strlen(parent) - 1;
+    if (parent[end] == '/') {
+        end--;
+    }
+    while (end >= 0 && parent[end] != '/') {
+        end--;
+    }
+    parent[end + 1] = '\0';
+    bool hasParent = (strcmp(parent, "/") != 0);
+
+    if (isCreate) {
+        if (findAccessiblePath(serverDetails, path) < 0) {
+            addDeltaChange(serverDetails, delta, DELTA_ADD, path);
+        }
+
+        // The parent was listed as an empty directory until now
+        if (hasParent && findAccessiblePath(serverDetails, parent) >= 0) {
+            addDeltaChange(serverDetails, delta, DELTA_UNMARK, parent);
+        }
+    } else {
+        if (findAccessiblePath(serverDetails, path) >= 0) {
+            addDeltaChange(serverDetails, delta, DELTA_REMOVE, path);
+        }
+
+        // The parent may just have become an empty directory
+        if (hasParent && findAccessiblePath(serverDetails, parent) < 0 && isEmptyDirectory(parent + 1)) {
+            addDeltaChange(serverDetails, delta, DELTA_ADD, parent);
+        }
+    }
+
+    if (delta->num_changes > 0) {
+        serverDetails->seq++;
+    }
+    delta->seq = serverDetails->seq;
+}
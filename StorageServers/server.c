@@ -5,24 +5,256 @@
 #include "../utils/constants.h"
 #include "../utils/structs.h"
 
+#include <sys/statvfs.h>
+
 #define MY_SRV_IP "127.0.0.1"
 
 ServerDetails serverDetails;
 sem_t serverDetails_mutex;          // Binary semaphore to atomically carry out priviliedged instructions
-rwlock rw_locks[MAX_PATHS];         // Reader writer lock to protect each file
+atomic_int requests_in_flight;      // Requests being served, reported as the queue depth
+
+/**
+ * @brief Measures the load reported in a heartbeat.
+ * 
+ * @param load : Set to the load, -1 where it could not be measured.
+ */
+void measureServerLoad(ServerLoad* load) {
+    memset(load, 0, sizeof(ServerLoad));
+
+    double average;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    load->cpu_load = (getloadavg(&average, 1) == 1 && cores > 0) ? (int) (average * 100 / cores) : -1;
 
+    load->queue_depth = atomic_load(&requests_in_flight);
+
+    struct statvfs fs;
+    load->free_bytes = (statvfs(".", &fs) == 0) ? (long long) fs.f_bavail * fs.f_frsize : -1;
+}
+
+/**
+ * @brief Sends the NM a heartbeat with our load every HEARTBEAT_INTERVAL_MS,
+ * on the connection we registered on, until the NM goes away.
+ * 
+ * @param arg : The registration socket, cast to a pointer.
+ */
 void* aliveThreadReply(void* arg) {
-    // Placeholder implementation for aliveThread
+    int nmSocket = (int) (intptr_t) arg;
+
+    HeartbeatPacket packet;
+    memset(&packet, 0, sizeof(HeartbeatPacket));
+    packet.serverID = serverDetails.serverID;
+
     while (1) {
-        // Receive "CHECK" packet from the server
-        // Respond with "CHECK" packet + serverID
-        // Sleep for 10 seconds
-        // sleep(10);
-        break;
+        measureServerLoad(&packet.load);
+        if (!sendAll(nmSocket, &packet, sizeof(HeartbeatPacket))) {
+            perror("Error sending heartbeat to NM");
+            break;
+        }
+        packet.beat++;
+        usleep(HEARTBEAT_INTERVAL_MS * 1000);
     }
     return NULL;
 }
 
+/**
+ * @brief Drops a reference to a connection from the NM, the last one
+ * closes it.
+ * 
+ * @param connection : The connection.
+ */
+void releaseNMConnection(NMConnection* connection) {
+    if (atomic_fetch_sub(&connection->refs, 1) == 1) {
+        close(connection->socket);
+        pthread_mutex_destroy(&connection->send_lock);
+        free(connection);
+    }
+}
+
+/**
+ * @brief Serves one request from the NM on a thread of its own, and sends
+ * its reply on the connection it came in on.
+ * 
+ * @param arg : The NMTask, freed here.
+ */
+void* nmRequestThread(void* arg) {
+    NMTask* task = (NMTask*) arg;
+    NMConnection* connection = task->connection;
+    ClientRequest* clientRequest = &task->message.request;
+    long long started_ns = statsClock();
+    long long started_us = traceClock();
+
+    StorageReply reply;
+    memset(&reply, 0, sizeof(StorageReply));
+    reply.requestID = task->message.requestID;
+    reply.ack.errorCode = SUCCESS;
+    reply.ack.ack = SUCCESS_ACK;
+
+    // The NM lost track of our namespace, send all of it
+    if (clientRequest->requestType == RESYNC) {
+        sem_wait(&serverDetails_mutex);
+            serverDetails.num_paths = 0;
+            listFilesAndEmptyFolders(".", &serverDetails);
+            reply.delta.serverID = serverDetails.serverID;
+            reply.delta.seq = serverDetails.seq;
+
+            pthread_mutex_lock(&connection->send_lock);
+                bool sent = sendAll(connection->socket, &reply, sizeof(StorageReply)) &&
+                            sendServerDetails(connection->socket, &serverDetails);
+            pthread_mutex_unlock(&connection->send_lock);
+        sem_post(&serverDetails_mutex);
+        atomic_fetch_sub(&requests_in_flight, 1);
+        recordRequest(RESYNC, started_ns, sent);
+        traceSpan(clientRequest->traceID, "request", started_us, traceClock(), TRACE_FLOW_STEP);
+
+        if (!sent) {
+            perror("Error sending server details to NM");
+            shutdown(connection->socket, SHUT_RDWR);
+        }
+        releaseNMConnection(connection);
+        free(task);
+        return NULL;
+    }
+
+    // A hot file gets a replica here. It is copied before the
+    // namespace is locked, and listed only once it is complete.
+    bool pulled = (clientRequest->requestType != REPLICATE_FILE) || pullFileFromReplica(clientRequest);
+    long long locking_us = traceClock();
+    if (clientRequest->requestType == REPLICATE_FILE) {
+        traceSpan(clientRequest->traceID, "pull", started_us, locking_us, TRACE_FLOW_NONE);
+    }
+
+    // Remove the "/" at the beginning"
+    if (clientRequest->arg1[0] == '/') {
+        memmove(clientRequest->arg1, clientRequest->arg1 + 1, strlen(clientRequest->arg1));
+    }
+
+    // A file is deleted under its write lock, so no read or chain write of
+    // it is halfway through. The file lock is always taken before the
+    // namespace lock, never the other way around.
+    FileLock* fileLock = NULL;
+    if (clientRequest->requestType == DELETE_FILE) {
+        fileLock = getFileLock(clientRequest->arg1);
+        if (fileLock != NULL) {
+            acquire_writelock(&fileLock->lock);
+        }
+    }
+
+    // Process clientRequest
+    sem_wait(&serverDetails_mutex);
+        long long locked_us = traceClock();
+        traceSpan(clientRequest->traceID, "lock wait", locking_us, locked_us, TRACE_FLOW_NONE);
+
+        if (clientRequest->requestType == CREATE_DIR) {
+            if (!createDirectory(clientRequest->arg1)) {
+                reply.ack.errorCode = OTHER;
+                reply.ack.ack = FAILURE_ACK;
+            }
+        } else if (clientRequest->requestType == CREATE_FILE) {
+            if (!createFile(clientRequest->arg1))  {
+                reply.ack.errorCode = OTHER;
+                reply.ack.ack = FAILURE_ACK;
+            }
+        } else if (clientRequest->requestType == DELETE_DIR) {
+            if (!deleteDirectory(clientRequest->arg1))  {
+                reply.ack.errorCode = OTHER;
+                reply.ack.ack = FAILURE_ACK;
+            }
+        } else if (clientRequest->requestType == DELETE_FILE) {
+            if (fileLock == NULL || !deleteFile(clientRequest->arg1))  {
+                reply.ack.errorCode = OTHER;
+                reply.ack.ack = FAILURE_ACK;
+            }
+        } else if (clientRequest->requestType == REPLICATE_FILE) {
+            if (!pulled) {
+                reply.ack.errorCode = OTHER;
+                reply.ack.ack = FAILURE_ACK;
+            }
+        }
+
+        // Work out what changed in the namespace
+        if (reply.ack.ack == SUCCESS_ACK) {
+            buildPathDelta(clientRequest, &serverDetails, &reply.delta);
+        } else {
+            reply.delta.serverID = serverDetails.serverID;
+            reply.delta.seq = serverDetails.seq;
+        }
+        long long done_us = traceClock();
+        traceSpan(clientRequest->traceID, "disk", locked_us, done_us, TRACE_FLOW_NONE);
+
+        // Taken before the namespace is let go, so the replies go out in
+        // the order of their deltas
+        pthread_mutex_lock(&connection->send_lock);
+    sem_post(&serverDetails_mutex);
+    if (fileLock != NULL) {
+        release_writelock(&fileLock->lock);
+        putFileLock(fileLock);
+    }
+    atomic_fetch_sub(&requests_in_flight, 1);
+    recordRequest(clientRequest->requestType, started_ns, reply.ack.ack == SUCCESS_ACK);
+
+    // Send the ACK and the changes to NM
+    bool sent = sendAll(connection->socket, &reply, sizeof(StorageReply));
+    pthread_mutex_unlock(&connection->send_lock);
+    long long sent_us = traceClock();
+    traceSpan(clientRequest->traceID, "reply", done_us, sent_us, TRACE_FLOW_NONE);
+    traceSpan(clientRequest->traceID, "request", started_us, sent_us, TRACE_FLOW_STEP);
+    if (!sent) {
+        // Part of the reply may be on the wire, the connection is of no more use
+        perror("Error sending reply to NM");
+        shutdown(connection->socket, SHUT_RDWR);
+    }
+
+    releaseNMConnection(connection);
+    free(task);
+    return NULL;
+}
+
+/**
+ * @brief Serves one connection from the NM. The NM keeps it open and may
+ * send several requests without waiting, each tagged with an ID that the
+ * reply carries back. Every request is served on a thread of its own, so
+ * a slow one (a file being copied for a new replica) does not hold up
+ * the others. Their replies may come back in any order.
+ * 
+ * @param arg : The socket, cast to a pointer.
+ */
+void* nmConnectionThread(void* arg) {
+    NMConnection* connection = (NMConnection*) malloc(sizeof(NMConnection));
+    if (connection == NULL) {
+        perror("Error allocating NM connection");
+        close((int) (intptr_t) arg);
+        return NULL;
+    }
+    connection->socket = (int) (intptr_t) arg;
+    pthread_mutex_init(&connection->send_lock, NULL);
+    atomic_init(&connection->refs, 1);
+
+    while (1) {
+        NMTask* task = (NMTask*) malloc(sizeof(NMTask));
+        if (task == NULL || !recvAll(connection->socket, &task->message, sizeof(StorageRequest))) {
+            free(task);
+            break;
+        }
+        task->connection = connection;
+        atomic_fetch_add(&connection->refs, 1);
+        atomic_fetch_add(&requests_in_flight, 1);
+
+        pthread_t nmRequestThreadId;
+        if (pthread_create(&nmRequestThreadId, NULL, nmRequestThread, task) != 0) {
+            // The NM gets no reply for it, its request times out
+            perror("Error creating NM request thread");
+            atomic_fetch_sub(&requests_in_flight, 1);
+            releaseNMConnection(connection);
+            free(task);
+            continue;
+        }
+        pthread_detach(nmRequestThreadId);
+    }
+
+    releaseNMConnection(connection);
+    return NULL;
+}
+
 void* nmThread(void* arg) {
     // Create a socket
     int sock_fd = socket(SOCKET_FAMILY, SOCKET_TYPE, SOCKET_PROTOCOL);
@@ -58,63 +290,147 @@ void* nmThread(void* arg) {
             exit(EXIT_FAILURE);
         }
 
-        // Receive clientRequest
-        ClientRequest clientRequest;
-        if (recv(nmSocket, &clientRequest, sizeof(ClientRequest), 0) < 0) {
-            perror("Error receiving client request");
-            exit(EXIT_FAILURE);
+        // The NM keeps the connection, serve it on its own thread
+        pthread_t nmConnectionThreadId;
+        if (pthread_create(&nmConnectionThreadId, NULL, nmConnectionThread, (void*) (intptr_t) nmSocket) != 0) {
+            perror("Error creating NM connection thread");
+            close(nmSocket);
+            continue;
         }
+        pthread_detach(nmConnectionThreadId);
+    }
+    return NULL;
+}
 
-        // Remove the "/" at the beginning"
-        if (clientRequest.arg1[0] == '/') {
-            memmove(clientRequest.arg1, clientRequest.arg1 + 1, strlen(clientRequest.arg1));
+/**
+ * @brief Serves one request from a client, or from the previous replica of
+ * a chain write.
+ * 
+ * @param arg : The socket, cast to a pointer.
+ */
+void* clientConnectionThread(void* arg) {
+    int cltSocket = (int) (intptr_t) arg;
+
+    // Recv client request
+    ClientRequest clientRequest;
+    if (!recvAll(cltSocket, &clientRequest, sizeof(ClientRequest))) {
+        perror("Error recv client request");
+        close(cltSocket);
+        return NULL;
+    }
+    long long started_ns = statsClock();
+    long long started_us = traceClock();
+    atomic_fetch_add(&requests_in_flight, 1);
+
+    // Make the Ack bit ready
+    AckPacket ack;
+    ack.errorCode = SUCCESS;
+    ack.ack = SUCCESS_ACK;
+
+    // STATS is about this server, not about the path it was sent with
+    if (clientRequest.requestType == GET_STATS) {
+        if (!sendStats(cltSocket)) {
+            ack.errorCode = NETWORK_ERROR;
+            ack.ack = FAILURE_ACK;
+        } else if (send(cltSocket, &ack, sizeof(ack), 0) < 0) {
+            printf("Error sending ack to client\n");
         }
 
-        // Initialize the ACK packet
-        AckPacket nmAck;
-        nmAck.errorCode = SUCCESS;
-        nmAck.ack = SUCCESS_ACK;
-
-        // Process clientRequest
-        sem_wait(&serverDetails_mutex);
+        close(cltSocket);
+        atomic_fetch_sub(&requests_in_flight, 1);
+        recordRequest(GET_STATS, started_ns, ack.ack == SUCCESS_ACK);
+        traceSpan(clientRequest.traceID, "request", started_us, traceClock(), TRACE_FLOW_STEP);
+        return NULL;
+    }
 
-            if (clientRequest.requestType == CREATE_DIR) {
-                if (!createDirectory(clientRequest.arg1)) {
-                    nmAck.errorCode = OTHER;
-                    nmAck.ack = FAILURE_ACK;
-                }
-            } else if (clientRequest.requestType == CREATE_FILE) {
-                if (!createFile(clientRequest.arg1))  {
-                    nmAck.errorCode = OTHER;
-                    nmAck.ack = FAILURE_ACK;
-                }
-            } else if (clientRequest.requestType == DELETE_DIR) {
-                printf("Delete directory\n");
-            } else if (clientRequest.requestType == DELETE_FILE) {
-                if (!deleteFile(clientRequest.arg1))  {
-                    nmAck.errorCode = OTHER;
-                    nmAck.ack = FAILURE_ACK;
-                }
-            }
+    // Remove the "/" at the beginning", the request itself is passed on
+    // down the chain as it came
+    char* path = clientRequest.arg1;
+    if (path[0] == '/') {
+        path++;
+    }
 
-            // Add accessible paths again
-            serverDetails.num_paths = 0;
-            listFilesAndEmptyFolders(".", &serverDetails);
+    // The lock of the file is found by its path. While it is held the file
+    // cannot be deleted, so the path is looked up only once it is held.
+    // Only the file is locked while a chain write waits on the next
+    // replica. Holding serverDetails_mutex as well could deadlock two
+    // servers that are each waiting on the other for another file.
+    long long locking_us = traceClock();
+    bool writing = (clientRequest.requestType == WRITE_FILE);
+    FileLock* fileLock = getFileLock(path);
+    if (fileLock != NULL) {
+        if (writing) {
+            acquire_writelock(&fileLock->lock);
+        } else {
+            acquire_readlock(&fileLock->lock);
+        }
+    }
+    long long locked_us = traceClock();
 
+    bool listed = false;
+    if (fileLock != NULL) {
+        sem_wait(&serverDetails_mutex);
+            listed = (findAccessiblePath(&serverDetails, clientRequest.arg1) >= 0);
         sem_post(&serverDetails_mutex);
+    }
 
-        // Send SUCCESS ACK to NM
-        if (send(nmSocket, &nmAck, sizeof(AckPacket), 0) < 0) {
-            perror("Error sending ack packet to NM");
-            exit(EXIT_FAILURE);
+    // Print the response type. The file is read from disk and sent at
+    // once, so the transfer is one span of disk and network both.
+    if (!listed) {
+        ack.errorCode = INVALID_INPUT_ERROR;
+        ack.ack = FAILURE_ACK;
+
+        // A reader expects the size of the file ahead of the ack
+        if (clientRequest.requestType == READ_FILE) {
+            sendFileHeader(cltSocket, -1);
+        }
+    } else if (clientRequest.requestType == READ_FILE) {
+        printf("Read file: %s\n", path);
+        if (clientRequest.offset < 0 || clientRequest.length < 0) {
+            sendFileHeader(cltSocket, -1);
+            ack.errorCode = INVALID_INPUT_ERROR;
+            ack.ack = FAILURE_ACK;
+        } else if (!read_file_in_ss(path, &cltSocket, clientRequest.offset, clientRequest.length)) {
+            ack.errorCode = OTHER;
+            ack.ack = FAILURE_ACK;
+        }
+    } else if (clientRequest.requestType == WRITE_FILE) {
+        printf("Write file: %s\n", path);
+        if (!write_file_in_ss(path, &cltSocket, &clientRequest)) {
+            ack.errorCode = OTHER;
+            ack.ack = FAILURE_ACK;
         }
+    } else if (clientRequest.requestType == GET_FILE_INFO) {
+        printf("Get file info of : %s\n", path);
+        if (!sendFileInformation(path, &cltSocket)) {
+            ack.errorCode = OTHER;
+            ack.ack = FAILURE_ACK;
+        }
+    }
 
-        // Send new serverDetails to NM
-        if (send(nmSocket, &serverDetails, sizeof(ServerDetails), 0) < 0) {
-            perror("Error sending server details to NM");
-            exit(EXIT_FAILURE);
+    if (fileLock != NULL) {
+        if (writing) {
+            release_writelock(&fileLock->lock);
+        } else {
+            release_readlock(&fileLock->lock);
         }
+        putFileLock(fileLock);
     }
+    long long done_us = traceClock();
+    traceSpan(clientRequest.traceID, "lock wait", locking_us, locked_us, TRACE_FLOW_NONE);
+    traceSpan(clientRequest.traceID, "transfer", locked_us, done_us, TRACE_FLOW_NONE);
+
+    // Send the ack bit to client
+    if (send(cltSocket, &ack, sizeof(ack), 0) < 0) {
+        printf("Error sending ack to client\n");
+    } else {
+        printf("Sent the ack bit to client\n");
+    }
+
+    close(cltSocket);
+    atomic_fetch_sub(&requests_in_flight, 1);
+    recordRequest(clientRequest.requestType, started_ns, ack.ack == SUCCESS_ACK);
+    traceSpan(clientRequest.traceID, "request", started_us, traceClock(), TRACE_FLOW_STEP);
     return NULL;
 }
 
@@ -154,91 +470,15 @@ void* clientThread(void* arg) {
             exit(EXIT_FAILURE);
         }
 
-        // Recv client request
-        ClientRequest clientRequest;
-        if (recv(cltSocket, &clientRequest, sizeof(ClientRequest), 0) < 0) {
-            perror("Error recv client request");
-            exit(EXIT_FAILURE);
-        }
-
-        // Make the Ack bit ready
-        AckPacket ack;
-        ack.errorCode = SUCCESS;
-        ack.ack = SUCCESS_ACK;
-
-        // Find the index of the path in the list of accessible paths
-        int pathIndex = -1;
-        for (int i = 0; i < serverDetails.num_paths; i++) {
-            if (strcmp(serverDetails.accessible_paths[i], clientRequest.arg1) == 0) {
-                pathIndex = i;
-                break;
-            }
-        }
-
-        if (pathIndex == -1) {
-            ack.errorCode = INVALID_INPUT_ERROR;
-            ack.ack = FAILURE_ACK;
-
-            // Send the ack bit to client
-            if (send(cltSocket, &ack, sizeof(ack), 0) < 0) {
-                printf("Error sending ack to client\n");
-                exit(-1);
-            } else {
-                printf("Sent the ack bit to client\n");
-            }
-
+        // A chain write keeps its connection busy until the last replica
+        // has the file, so every connection is served on its own thread
+        pthread_t clientConnectionThreadId;
+        if (pthread_create(&clientConnectionThreadId, NULL, clientConnectionThread, (void*) (intptr_t) cltSocket) != 0) {
+            perror("Error creating client connection thread");
             close(cltSocket);
-
             continue;
         }
-
-        // Remove the "/" at the beginning"
-        if (clientRequest.arg1[0] == '/') {
-            memmove(clientRequest.arg1, clientRequest.arg1 + 1, strlen(clientRequest.arg1));
-        }
-
-        // Print the response type
-        if (clientRequest.requestType == READ_FILE) {
-            sem_wait(&serverDetails_mutex);
-                acquire_readlock(&rw_locks[pathIndex]);
-                    printf("Read file: %s\n", clientRequest.arg1);
-                    if (!read_file_in_ss(clientRequest.arg1, &cltSocket)) {
-                        ack.errorCode = OTHER;
-                        ack.ack = FAILURE_ACK;
-                    }
-                release_readlock(&rw_locks[pathIndex]);
-            sem_post(&serverDetails_mutex);
-        } else if (clientRequest.requestType == WRITE_FILE) {
-            sem_wait(&serverDetails_mutex);
-                acquire_writelock(&rw_locks[pathIndex]);
-                    printf("Write file: %s\n", clientRequest.arg1);
-                    if (!write_file_in_ss(clientRequest.arg1, &cltSocket)) {
-                        ack.errorCode = OTHER;
-                        ack.ack = FAILURE_ACK;
-                    }
-                release_writelock(&rw_locks[pathIndex]);
-            sem_post(&serverDetails_mutex);
-        } else if (clientRequest.requestType == GET_FILE_INFO) {
-            sem_wait(&serverDetails_mutex);
-                acquire_readlock(&rw_locks[pathIndex]);
-                    printf("Get file info of : %s\n", clientRequest.arg1);
-                    if (!sendFileInformation(clientRequest.arg1, &cltSocket)) {
-                        ack.errorCode = OTHER;
-                        ack.ack = FAILURE_ACK;
-                    }
-                release_readlock(&rw_locks[pathIndex]);
-            sem_post(&serverDetails_mutex);
-        }
-
-        // Send the ack bit to client
-        if (send(cltSocket, &ack, sizeof(ack), 0) < 0) {
-            printf("Error sending ack to client\n");
-            exit(-1);
-        } else {
-            printf("Sent the ack bit to client\n");
-        }
-
-        close(cltSocket);
+        pthread_detach(clientConnectionThreadId);
     }
     return NULL;
 }
@@ -249,13 +489,15 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    // Initialize the semaphores and locks
+    // A client may hang up halfway through a reply, for one when it
+    // cancels a hedged read. The send fails instead of killing us.
+    signal(SIGPIPE, SIG_IGN);
+
+    // Count what we serve, and append it to our stats file now and then
+    startStats(SS_STATS_FILE);
+
+    // Initialize the semaphores, the locks of the files are made as they are used
     sem_init(&serverDetails_mutex, 0, 1);
-    for (int i = 0; i < MAX_PATHS; i++) {
-        rw_locks[i].readers = 0;
-        sem_init(&rw_locks[i].lock, 0, 1);
-        sem_init(&rw_locks[i].writeLock, 0, 1);
-    }
 
     // Make a ServerDetails with the given serverID
     sem_wait(&serverDetails_mutex);
@@ -266,6 +508,11 @@ int main(int argc, char *argv[]) {
         serverDetails.online = 1;
     sem_post(&serverDetails_mutex);
 
+    // Trace our spans under our ID, if tracing is on
+    char process[32];
+    snprintf(process, sizeof(process), "storage server %d", serverDetails.serverID);
+    initTracing(process);
+
     printf("ONLINE : %s\n", ((serverDetails.online) ? "YES" : "NO"));
 
     // Create a socket
@@ -279,8 +526,8 @@ int main(int argc, char *argv[]) {
     struct sockaddr_in server_addr;
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = SOCKET_FAMILY;
-    server_addr.sin_port = htons(NM_NEW_SRV_PORT);
-    server_addr.sin_addr.s_addr = inet_addr(NM_IP);
+    server_addr.sin_port = htons(nmServerPort());
+    server_addr.sin_addr.s_addr = inet_addr(nmIP());
 
     // Add accessible paths
     serverDetails.num_paths = 0;
@@ -297,8 +544,9 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    // Send the server details to the NM
-    if (send(sock_fd, &serverDetails, sizeof(ServerDetails), 0) < 0) {
+    // Say hello to the NM. A NM that still knows our paths from its
+    // journal only checks their fingerprint, otherwise it asks for them
+    if (!sendServerHello(sock_fd, &serverDetails)) {
         perror("Error sending server details to NM");
         exit(EXIT_FAILURE);
     }
@@ -309,24 +557,32 @@ int main(int argc, char *argv[]) {
     AckPacket nmAck;
     
     // Receive the ack packet
-    if (recv(sock_fd, &nmAck, sizeof(AckPacket), 0) < 0) {
+    if (recv(sock_fd, &nmAck, sizeof(AckPacket), MSG_WAITALL) != sizeof(AckPacket)) {
         perror("Error receiving ack packet");
         exit(EXIT_FAILURE);
     }
 
+    // Send the paths themselves if the NM asked for them
+    if (nmAck.ack == UPLOAD_ACK) {
+        if (!sendServerDetails(sock_fd, &serverDetails) ||
+            recv(sock_fd, &nmAck, sizeof(AckPacket), MSG_WAITALL) != sizeof(AckPacket)) {
+            perror("Error sending server details to NM");
+            exit(EXIT_FAILURE);
+        }
+    }
+
     // If this is a FAILURE_ACK, just die
     if (nmAck.ack == FAILURE_ACK) {
         printf("Error: NM returned FAILURE_ACK\n");
         exit(EXIT_FAILURE);
     }
 
-    // Now, spawn an aliveThread. This thread 
-    // receives a "CHECK" packet from
-    // the server, and replies with a "CHECK"
-    // packet + serverID. Sleep for 10 seconds.
+    // Now, spawn an aliveThread. It keeps
+    // beating on the registration connection,
+    // the NM declares us offline if it stops.
     // Don't wait for this thread to join
     pthread_t aliveThreadId;
-    if (pthread_create(&aliveThreadId, NULL, aliveThreadReply, NULL) != 0) {
+    if (pthread_create(&aliveThreadId, NULL, aliveThreadReply, (void*) (intptr_t) sock_fd) != 0) {
         perror("Error creating aliveThread");
         exit(EXIT_FAILURE);
     }
@@ -7,6 +7,11 @@
 #include "../utils/logging.h"
 #include "../utils/constants.h"
 #include "../utils/structs.h"
+#include "../utils/wire.h"
+#include "../utils/stats.h"
+#include "../utils/trace.h"
+#include "../utils/endpoints.h"
+#include "../utils/hash.h"
 
 // Reader write lock helper functions
 void acquire_readlock(rwlock* rw_lock);
@@ -14,13 +19,23 @@ void release_readlock(rwlock* rw_lock);
 void acquire_writelock(rwlock* rw_lock);
 void release_writelock(rwlock* rw_lock);
 
+// Locks of the files, by path
+FileLock* getFileLock(const char* path);
+void putFileLock(FileLock* fileLock);
+
 // Read and write calls from the user interface
-bool read_file_in_ss(char *path, int *cltSocket);
-bool write_file_in_ss(char *path, int *cltSocket);
+bool read_file_in_ss(char *path, int *cltSocket, long long offset, long long length);
+bool write_file_in_ss(char *path, int *cltSocket, ClientRequest *clientRequest);
 bool sendFileInformation(const char *path, int* clientSocket);
+bool pullFileFromReplica(ClientRequest *clientRequest);
 
 void listFilesAndEmptyFolders(const char *path, ServerDetails *serverDetails);
 
+// Helper functions to keep the accessible paths up to date incrementally
+int findAccessiblePath(ServerDetails *serverDetails, const char *path);
+bool isEmptyDirectory(const char *path);
+void buildPathDelta(ClientRequest *clientRequest, ServerDetails *serverDetails, PathDelta *delta);
+
 // Helper function to create a directory
 bool createDirectory(const char* path);
 
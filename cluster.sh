@@ -0,0 +1,197 @@
+#!/bin/bash
+
+# Runs a whole cluster on this machine for one benchmark: a naming server
+# and storage servers on free ports, each in a temporary directory, the
+# servers filled with a generated file tree. Runs dfsbench against it,
+# then reports the CPU time, peak RSS and request stats of every process
+# and shuts everything down.
+#
+# Usage: ./cluster.sh [-n servers] [-r replication_factor] [-d depth] [-f fanout]
+#                     [-s file_size] [-k] [-- dfsbench options]
+
+repo=$(cd "$(dirname "$0")" && pwd)
+servers=3
+replication=1
+depth=1
+fanout=8
+file_size=1024
+keep=0
+
+usage() {
+    echo "Usage: $0 [-n servers] [-r replication_factor] [-d depth] [-f fanout] [-s file_size] [-k] [-- dfsbench options]"
+    echo "  -n  storage servers (default $servers)"
+    echo "  -r  storage servers each new path is created on (default $replication)"
+    echo "  -d  directory levels of the tree each server starts with (default $depth)"
+    echo "  -f  entries per directory of that tree, fanout^(depth + 1) files (default $fanout)"
+    echo "  -s  bytes per file of the tree (default $file_size)"
+    echo "  -k  keep the directory of the run, with the logs of every process"
+    exit 1
+}
+
+while getopts "n:r:d:f:s:k" option; do
+    case $option in
+        n) servers=$OPTARG ;;
+        r) replication=$OPTARG ;;
+        d) depth=$OPTARG ;;
+        f) fanout=$OPTARG ;;
+        s) file_size=$OPTARG ;;
+        k) keep=1 ;;
+        *) usage ;;
+    esac
+done
+shift $((OPTIND - 1))
+bench_args=("$@")
+
+# A storage server holds at most MAX_PATHS paths, and dfsbench needs room too
+tree_files=$((fanout ** (depth + 1)))
+if ((servers < 1 || replication < 1 || replication > servers || tree_files > 500)); then
+    usage
+fi
+
+# Build
+make -C "$repo" -s nm server dfsbench || exit 1
+
+run=$(mktemp -d /tmp/nfs-cluster.XXXXXX)
+names=()
+pids=()
+inputs=()
+
+# Stops every process still running, and removes the run unless kept
+cleanup() {
+    for pid in "${pids[@]}"; do
+        kill "$pid" 2> /dev/null
+    done
+    if ((keep)); then
+        echo "Logs kept in $run"
+    else
+        rm -rf "$run"
+    fi
+}
+trap cleanup EXIT
+trap "exit 1" INT TERM
+
+# Picks a port nothing uses, not even a connection in TIME_WAIT
+used_ports=" "
+free_port() {
+    while true; do
+        port=$((20000 + RANDOM % 30000))
+        if [[ $used_ports != *" $port "* ]] && ! ss -Htan | awk '{print $4}' | grep -q ":$port\$"; then
+            used_ports+="$port "
+            return
+        fi
+    done
+}
+
+# Waits until a process listens on a port, or has died
+wait_listening() {
+    local attempt
+    for ((attempt = 0; attempt < 100; attempt++)); do
+        if ss -Hltn "sport = :$1" | grep -q .; then
+            return 0
+        fi
+        if ! kill -0 "$2" 2> /dev/null; then
+            return 1
+        fi
+        sleep 0.1
+    done
+    return 1
+}
+
+# Fills a directory with the generated tree
+make_tree() {
+    local dir=$1 level=$2 j
+    for ((j = 0; j < fanout; j++)); do
+        if ((level == depth)); then
+            head -c "$file_size" < /dev/urandom | base64 -w 0 | head -c "$file_size" > "$dir/file_$j.txt"
+        else
+            mkdir "$dir/dir${level}_$j"
+            make_tree "$dir/dir${level}_$j" $((level + 1))
+        fi
+    done
+}
+
+# Starts a process in its own directory. It exits when a line is written
+# to its standard input, which stays open until then.
+start() {
+    local name=$1 dir=$2
+    shift 2
+    mkfifo "$dir/stdin"
+    (cd "$dir" && exec "$@" < stdin > out.log 2>&1) &
+    pids+=($!)
+    names+=("$name")
+    exec {input}> "$dir/stdin"
+    inputs+=($input)
+}
+
+# Every process finds the NM through the environment
+free_port
+export NFS_NM_CLT_PORT=$port
+free_port
+export NFS_NM_SRV_PORT=$port
+
+mkdir "$run/nm"
+start "naming server" "$run/nm" "$repo/nm" 32768 3 "$replication"
+if ! wait_listening "$NFS_NM_SRV_PORT" "${pids[0]}"; then
+    echo "The naming server did not start, see $run/nm/out.log"
+    keep=1
+    exit 1
+fi
+
+for ((i = 0; i < servers; i++)); do
+    mkdir -p "$run/ss$i/ss$i"
+    make_tree "$run/ss$i/ss$i" 0
+    free_port
+    client_port=$port
+    free_port
+    start "storage server $i" "$run/ss$i" "$repo/server" "$i" "$client_port" "$port"
+
+    # A server listens for clients once the NM registered it
+    if ! wait_listening "$client_port" "${pids[-1]}"; then
+        echo "Storage server $i did not start, see $run/ss$i/out.log"
+        keep=1
+        exit 1
+    fi
+done
+if ! wait_listening "$NFS_NM_CLT_PORT" "${pids[0]}"; then
+    echo "The naming server does not listen for clients, see $run/nm/out.log"
+    keep=1
+    exit 1
+fi
+echo "Cluster: naming server on ports $NFS_NM_CLT_PORT and $NFS_NM_SRV_PORT, $servers storage servers with $tree_files files each"
+
+(cd "$run" && "$repo/dfsbench" "${bench_args[@]}") | tee "$run/dfsbench.log"
+
+# CPU time and peak RSS, read before the processes exit
+ticks=$(getconf CLK_TCK)
+usage_lines=()
+for ((i = 0; i < ${#pids[@]}; i++)); do
+    cpu=$(awk -v ticks="$ticks" '{printf "%.2f", ($14 + $15) / ticks}' "/proc/${pids[i]}/stat" 2> /dev/null)
+    rss=$(awk '/^VmHWM:/ {print $2}' "/proc/${pids[i]}/status" 2> /dev/null)
+    usage_lines+=("$(printf "%-18s %8s %8s %12s" "${names[i]}" "${pids[i]}" "${cpu:--}" "${rss:--}")")
+done
+
+# Storage servers first, so the NM sees them go
+for ((i = ${#pids[@]} - 1; i >= 0; i--)); do
+    echo >&"${inputs[i]}"
+    attempt=0
+    while kill -0 "${pids[i]}" 2> /dev/null && ((attempt++ < 50)); do
+        sleep 0.1
+    done
+done
+wait 2> /dev/null
+
+echo
+printf "%-18s %8s %8s %12s\n" "process" "pid" "cpu_s" "peak_rss_kb"
+printf "%s\n" "${usage_lines[@]}"
+
+# Every process appends its stats since the start when it exits
+for ((i = 0; i < ${#pids[@]}; i++)); do
+    if ((i == 0)); then
+        stats="$run/nm/nm_stats.log"
+    else
+        stats="$run/ss$((i - 1))/ss_stats.log"
+    fi
+    echo
+    echo "${names[i]}, latencies in us:"
+    awk '/at exit/ {found = 1; text = ""; next} /^#/ {found = 0} found {text = text $0 "\n"} END {printf "%s", text}' "$stats" 2> /dev/null
+done
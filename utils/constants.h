@@ -4,8 +4,8 @@
 #define CONSTANTS_H
 
 // Define your constants here
-#define MAX_CLIENTS 100
-#define MAX_SERVERS 10
+#define MAX_CLIENTS 32768
+#define MAX_SERVERS 10 // At most 32, replica sets are bitmasks of server IDs
 #define SOCKET_FAMILY AF_INET
 #define SOCKET_TYPE SOCK_STREAM
 #define SOCKET_PROTOCOL 0
@@ -15,13 +15,63 @@
 #define MAX_LISTEN_BACKLOG 20
 #define MAX_PATH_LEN 1024
 #define MAX_PATHS 1000
+#define HASH_SEED 14695981039346656037ULL // FNV-1a offset basis
+#define HASH_PRIME 1099511628211ULL // FNV-1a prime
+#define FILE_LOCK_BUCKETS 256 // Buckets of a storage server's table of file locks
 #define MAX_ACK_EXTRA_INFO 100
 #define NUM_INIT_SERVERS 1
 #define MAX_CHUNK_SIZE 1024
-#define NUM_CHARS 256
-#define MAX_CACHE_SIZE 5
-#define ROLLING_PRIME 31
-#define ROLLING_MODULO 1000000007
+#define DEFAULT_CACHE_CAPACITY 32768
+#define CACHE_SHARDS 16
+#define ARENA_BLOCK_SIZE 65536
+#define ARENA_COMPACT_MIN_GARBAGE (1 << 20)
+#define SHARED_ARENA MAX_SERVERS
+#define SCRATCH_ARENA (MAX_SERVERS + 1)
+#define NUM_ARENAS (MAX_SERVERS + 2)
+#define EPOCH_MAX_THREADS 1024
+#define LIST_PAGE_SIZE 1000
+#define LIST_MAX_PAGE_SIZE 100000
+#define MAX_DELTA_CHANGES 4
+#define LEASE_DURATION_MS 30000
+#define LEASE_BUCKETS 4096
+#define MAX_LEASES 65536
+#define CLIENT_LEASE_CACHE_SIZE 256
+#define JOURNAL_BUFFER_SIZE 65536
+#define JOURNAL_COMPACT_BYTES (64 << 20)
+#define JOURNAL_FSYNC false // fdatasync every batch, to also survive a machine crash
+#define NUM_REACTORS 4 // epoll threads serving the clients of the NM
+#define REACTOR_MAX_EVENTS 256
+#define REACTOR_BATCH 16 // Requests served from one client before the others get a turn
+#define NUM_NM_WORKERS 16 // Threads serving the client requests that wait on storage servers
+#define CLIENT_OUT_MAX_BYTES (16 << 20) // Unsent replies a client may leave behind before it is dropped
+#define CLIENT_OUT_KEEP_BYTES 65536 // Reply buffer a connection keeps once it is drained
+#define CLIENT_LISTEN_BACKLOG 1024
+#define ACCEPT_BACKOFF_MS 10 // Pause when out of file descriptors
+#define WIRE_SEND_TIMEOUT_MS 5000 // How long a send waits for a full socket buffer to drain
+#define FILE_RECV_BUFFER_SIZE 65536 // Bytes of a file a reader takes off the socket at once
+#define DATA_FRAME_SIZE (256 << 10) // Largest data frame a writer sends by default
+#define DATA_FRAME_MIN_SIZE (64 << 10) // Range of frame sizes a receiver accepts
+#define DATA_FRAME_MAX_SIZE (4 << 20)
+#define HEARTBEAT_INTERVAL_MS 1000 // Storage servers beat this often
+#define HEARTBEAT_MISS_THRESHOLD 3 // Beats missed in a row before a server is offline
+#define HEARTBEAT_TICK_MS 100 // Resolution of the NM timing wheel
+#define HEARTBEAT_WHEEL_SLOTS 256 // Power of two
+#define CONNECT_TIMEOUT_MS 2000 // How long the NM waits to reach a storage server
+#define DEFAULT_REPLICATION_FACTOR 1 // Storage servers a new path is created on
+#define DEFAULT_HEDGE_PERCENTILE 95 // Read latency percentile after which a client also asks another replica
+#define HEDGE_SAMPLES 128 // Recent read latencies a client keeps
+#define HEDGE_MIN_SAMPLES 16 // Reads seen before the percentile is trusted
+#define HEDGE_DEFAULT_DELAY_MS 50 // Hedge delay until then
+#define HEDGE_MIN_DELAY_US 1000 // Reads faster than this are never hedged
+#define SKETCH_DEPTH 4 // Rows of the count-min sketch of path accesses
+#define SKETCH_WIDTH 4096 // Counters per row, power of two
+#define HOT_PATHS_K 32 // Hottest paths and directories the NM keeps
+#define HOT_DECAY_MS 10000 // Access counts are halved this often
+#define HOT_OFFER_EVERY 8 // Accesses between two updates of a path in the top-k, power of two
+#define HOT_REPLICATE_HITS 1000 // Decayed accesses after which a file gets another replica
+#define HOT_MAX_REPLICAS 3 // Replicas a hot file is grown to
+#define HOT_REPLICATE_QUEUE 16 // Hot files waiting to be replicated
+#define HOT_REPLICATE_TIMEOUT 600 // Seconds the copy of a hot file to a new replica may take
 
 // Timeout intervals
 #define MAX_NM_TO_CLT_TIMEOUT 30
@@ -40,6 +90,8 @@
 #define DELETEDIR "DELETE_DIR"
 #define GETINFO "GET_INFO"
 #define LISTALL "LIST_ALL"
+#define HOTPATHS "HOT_PATHS"
+#define GETSTATS "STATS"
 
 // Enum for Request type
 typedef enum {
@@ -53,9 +105,24 @@ typedef enum {
     GET_FILE_INFO,
     READ_FILE,
     WRITE_FILE,
-    LIST_ALL
+    LIST_ALL,
+    HOT_PATHS,
+    GET_STATS,
+
+    /* Naming server to storage server only */
+    RESYNC,
+    REPLICATE_FILE
 } RequestType;
 
+#define NUM_REQUEST_TYPES (REPLICATE_FILE + 1)
+
+// Enum for the changes in a namespace delta
+typedef enum {
+    DELTA_ADD = 0,      // Path was created
+    DELTA_REMOVE,       // Path, and everything below it, was deleted
+    DELTA_UNMARK        // Directory is no longer empty, it stays as a prefix only
+} DeltaOp;
+
 // Enum for error codes
 typedef enum {
     SUCCESS = 0,
@@ -75,10 +142,114 @@ typedef enum {
     CHECK_ACK,
     INIT_ACK,
     CNNCT_TO_SRV_ACK, // Send this to client, to get them ready for server connection
-    STOP_ACK
+    STOP_ACK,
+    INVALIDATE_ACK, // Pushed to a client, extraInfo[0] lease IDs follow that are no longer valid
+    UPLOAD_ACK // Send this to a registering server, the NM has no state of its own to confirm
 } AckBit;
 
+// Compact wire encoding
+#define WIRE_VERSION 5
+#define WIRE_HEADER_SIZE 6 // version, type, 32-bit payload length
+
+// Enum for the messages with a compact wire encoding
+typedef enum {
+    WIRE_SERVER_DETAILS = 1,
+    WIRE_SERVER_ENDPOINT,
+    WIRE_SERVER_HELLO,
+    WIRE_FILE_HEADER,
+    WIRE_DATA_STREAM
+} WireType;
+
+// Journal and snapshot of the NM namespace, in the directory the NM runs in
+#define JOURNAL_FILE "./nm.journal" // Suffixed with the generation of the journal
+#define SNAPSHOT_FILE "./nm.snapshot"
+#define SNAPSHOT_MAGIC 0x4e4d5348 // "NMSH"
+#define SNAPSHOT_VERSION 1
+
+// Enum for the records of the NM journal
+typedef enum {
+    JOURNAL_ADD = 1,
+    JOURNAL_REMOVE,
+    JOURNAL_UNMARK,
+    JOURNAL_RELEASE, // Every path of the server is dropped
+    JOURNAL_SERVER, // The server registered, path holds its IP
+    JOURNAL_SEQ // The server's deltas are applied up to seq
+} JournalOp;
+
 #define NM_LOG_FILE "./naming_server.log"
+#define LOG_LEVEL_ENV "NFS_LOG_LEVEL" // Environment variable the log level is read from
+#define LOG_RING_RECORDS 1024 // Records a thread can have waiting to be written, power of two
+#define LOG_RECORD_TEXT 240 // Longest message a record holds, longer ones are cut
+#define MAX_LOG_RINGS 128 // Threads that can log at once
+#define LOG_FLUSH_INTERVAL_MS 20 // How often the log flusher wakes up
+#define LOG_FLUSH_BUFFER 65536 // Bytes the flusher writes at a time
+
+// Enum for the log levels, a record is kept if its level is at most the current one
+typedef enum {
+    LOG_LEVEL_ERROR = 0,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG
+} LogLevel;
+
+// Enum for the states of a thread's log ring
+typedef enum {
+    LOG_RING_FREE = 0, // Any thread may take it
+    LOG_RING_OWNED, // A live thread logs into it
+    LOG_RING_ORPHANED // Its thread exited, it is free once written out
+} LogRingState;
+
+// Latency histograms and request counters
+#define STATS_SUB_BUCKET_BITS 4 // 2^this buckets per power of two, about 6% apart
+#define STATS_MAX_EXPONENT 36 // Latencies up to 2^36 ns, about 68 s, land in their own bucket
+#define STATS_BUCKETS ((STATS_MAX_EXPONENT - STATS_SUB_BUCKET_BITS + 2) << STATS_SUB_BUCKET_BITS)
+#define STATS_DUMP_INTERVAL_MS 10000 // How often the stats are appended to the stats file
+#define NM_STATS_FILE "./nm_stats.log"
+#define SS_STATS_FILE "./ss_stats.log" // In the directory the storage server runs in
+
+// Request tracing, in the Chrome trace event format
+#define TRACE_FILE_ENV "NFS_TRACE_FILE" // Environment variable naming the trace file, tracing is off without it
+#define TRACE_BUFFER_SIZE 65536 // Bytes of spans a process gathers before writing them out
+#define TRACE_FLUSH_INTERVAL_MS 1000 // Spans are written out at least this often
+#define TRACE_SPAN_LEN 320 // Longest span event
+
+// Enum for how a span takes part in the flow of its request across processes
+typedef enum {
+    TRACE_FLOW_NONE = 0,
+    TRACE_FLOW_ORIGIN, // The client's span of the request, the flow starts and ends in it
+    TRACE_FLOW_STEP // The span of a server that served a part of it
+} TraceFlow;
+
+// Load generator (dfsbench)
+#define BENCH_CLIENTS 8 // Synthetic clients, each with its own NM connection
+#define BENCH_DURATION_S 10
+#define BENCH_FILES 100 // Files read and written by popularity
+#define BENCH_ZIPF_THETA 0.99 // Skew of their popularity, 0 for uniform
+#define BENCH_DIR "/dfsbench/" // Directory the files are created in
+#define BENCH_MIX "read=70,write=20,create=4,delete=4,list=2"
+#define BENCH_SIZES "fixed:4096"
+#define BENCH_MAX_CHURN 16 // Files a client keeps created for the CREATE and DELETE of the mix
+
+// Microbenchmarks of the NM and storage server internals (microbench)
+#define MICRO_DEPTH 3 // Directory levels of the synthetic namespace
+#define MICRO_FANOUT 16 // Entries per directory, paths are MICRO_FANOUT^(MICRO_DEPTH + 1)
+#define MICRO_LOOKUPS 1000000 // Lookups per lookup benchmark
+#define MICRO_MAX_PATHS (1 << 22) // Largest synthetic namespace
+#define MICRO_SCAN_DEPTH 2 // The same for the directory tree a storage server scans,
+#define MICRO_SCAN_FANOUT 8 // at most MAX_PATHS paths
+#define MICRO_SCANS 200 // Scans of that tree
+#define MICRO_NAME_LEN 32
+
+// Comparison of the radix tree with the old per-character trie
+#define TRIECMP_OLD_CHARS 256 // Child pointers in a node of the old trie
+#define TRIECMP_OLD_MAX_PATHS 20000 // The old trie takes about 41 KB a path, past this only the radix tree is built
+#define TRIECMP_EMPTY_EVERY 50 // One synthetic path in this many is an empty directory
+
+// Enum for the file size distributions of the load generator
+typedef enum {
+    BENCH_SIZE_FIXED = 0, // size_a bytes
+    BENCH_SIZE_UNIFORM, // Between size_a and size_b bytes
+    BENCH_SIZE_EXP // Exponential with a mean of size_a bytes
+} BenchSizeDist;
 
 // NM IP address
 #define NM_IP "127.0.0.1"
@@ -88,4 +259,9 @@ typedef enum {
 #define NM_NEW_SRV_PORT 5049 // NM listens for new servers
 #define NM_COMM_SRV_PORT 4050 // NM communicates for servers
 
+// Environment variables overriding the NM endpoint, for every process
+#define NM_IP_ENV "NFS_NM_IP"
+#define NM_CLT_PORT_ENV "NFS_NM_CLT_PORT"
+#define NM_NEW_SRV_PORT_ENV "NFS_NM_SRV_PORT"
+
 #endif // CONSTANTS_H
@@ -0,0 +1,51 @@
+#include "endpoints.h"
+#include "logging.h"
+
+/***************************************************/
+/*        NM endpoint, from the environment        */
+/***************************************************/
+
+/**
+ * @brief A port from an environment variable.
+ *
+ * @param env : The variable.
+ * @param port : Port to use if it is not set or not a port.
+ */
+static int env_port(const char* env, int port) {
+    const char* value = getenv(env);
+    if (value == NULL || value[0] == '\0') {
+        return port;
+    }
+
+    char* end;
+    long parsed = strtol(value, &end, 10);
+    if (*end != '\0' || parsed <= 0 || parsed > 65535) {
+        LOG("Invalid port in the environment, using the standard one", false);
+        return port;
+    }
+    return (int) parsed;
+}
+
+/**
+ * @brief IP address of the NM, NM_IP unless NM_IP_ENV is set.
+ */
+const char* nmIP() {
+    const char* ip = getenv(NM_IP_ENV);
+    return (ip != NULL && ip[0] != '\0') ? ip : NM_IP;
+}
+
+/**
+ * @brief Port the NM listens for clients on, NM_CLT_PORT unless
+ * NM_CLT_PORT_ENV is set.
+ */
+int nmClientPort() {
+    return env_port(NM_CLT_PORT_ENV, NM_CLT_PORT);
+}
+
+/**
+ * @brief Port the NM listens for storage servers on, NM_NEW_SRV_PORT
+ * unless NM_NEW_SRV_PORT_ENV is set.
+ */
+int nmServerPort() {
+    return env_port(NM_NEW_SRV_PORT_ENV, NM_NEW_SRV_PORT);
+}
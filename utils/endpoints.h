@@ -0,0 +1,14 @@
+// endpoints.h
+#ifndef ENDPOINTS_H
+#define ENDPOINTS_H
+
+#include "headers.h"
+#include "constants.h"
+
+// Where the NM is reached, NM_IP and its standard ports unless the
+// environment says otherwise, see utils/endpoints.c
+const char* nmIP();
+int nmClientPort();
+int nmServerPort();
+
+#endif // ENDPOINTS_H
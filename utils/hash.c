@@ -0,0 +1,47 @@
+#include "hash.h"
+
+/***************************************************/
+/*         FNV-1a, shared by every process         */
+/***************************************************/
+
+/**
+ * @brief Folds bytes into a 64-bit FNV-1a hash. Start from HASH_SEED.
+ *
+ * @param hash : Hash of the bytes so far.
+ * @param data : The bytes.
+ * @param len : Number of bytes.
+ *
+ * @return The hash with the bytes folded in.
+ */
+unsigned long long hash_update(unsigned long long hash, const void* data, size_t len) {
+    const unsigned char* bytes = (const unsigned char*) data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= HASH_PRIME;
+    }
+    return hash;
+}
+
+/**
+ * @brief 64-bit FNV-1a hash of some bytes, the first len of a path for one.
+ *
+ * @param data : The bytes.
+ * @param len : Number of bytes.
+ *
+ * @return The hash.
+ */
+unsigned long long hash_bytes(const void* data, size_t len) {
+    return hash_update(HASH_SEED, data, len);
+}
+
+/**
+ * @brief 64-bit FNV-1a hash of a path. The NM and the storage servers
+ * must agree on it, the fingerprint of a server's paths is a sum of them.
+ *
+ * @param path : The path to hash.
+ *
+ * @return The hash.
+ */
+unsigned long long hash_path(const char* path) {
+    return hash_bytes(path, strlen(path));
+}
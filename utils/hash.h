@@ -0,0 +1,14 @@
+// hash.h
+#ifndef HASH_H
+#define HASH_H
+
+#include "headers.h"
+#include "constants.h"
+
+// 64-bit FNV-1a, the one hash of paths and records shared by every
+// process, see utils/hash.c
+unsigned long long hash_update(unsigned long long hash, const void* data, size_t len);
+unsigned long long hash_bytes(const void* data, size_t len);
+unsigned long long hash_path(const char* path);
+
+#endif // HASH_H
@@ -17,8 +17,12 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <semaphore.h>
 #include <dirent.h>
 #include <ctype.h>
+#include <poll.h>
+#include <errno.h>
 
 #endif // HEADERS_H
\ No newline at end of file
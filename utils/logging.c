@@ -0,0 +1,289 @@
+#include "logging.h"
+
+#include <stdarg.h>
+
+/***************************************************/
+/*       Asynchronous logging through rings        */
+/***************************************************/
+
+atomic_int log_level = LOG_LEVEL_INFO;                             // Records above this level are not kept
+
+static LogRing* log_rings[MAX_LOG_RINGS];                          // Rings handed out so far
+static atomic_int num_log_rings;                                   // Entries in log_rings
+static atomic_long unringed_drops;                                 // Records of threads that got no ring
+static pthread_mutex_t ring_alloc_lock = PTHREAD_MUTEX_INITIALIZER; // Serializes growing log_rings
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;     // One flush at a time
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;                                     // Gives up the ring of an exiting thread
+static __thread LogRing* my_ring = NULL;                           // Ring of the calling thread
+static FILE* log_file = NULL;                                      // NM_LOG_FILE, kept open
+
+/**
+ * @brief Called when a thread that logged exits. Its ring is written out
+ * by the flusher and then handed to another thread.
+ */
+static void release_ring(void* ring) {
+    atomic_store_explicit(&((LogRing*) ring)->state, LOG_RING_ORPHANED, memory_order_release);
+}
+
+static void* log_flusher(void* arg) {
+    while (1) {
+        usleep(LOG_FLUSH_INTERVAL_MS * 1000);
+        flushLogs();
+    }
+    return NULL;
+}
+
+/**
+ * @brief Opens the log file, reads the level from LOG_LEVEL_ENV and starts
+ * the flusher. Records still in the rings are written when the process
+ * exits normally.
+ */
+static void init_logging(void) {
+    const char* level = getenv(LOG_LEVEL_ENV);
+    if (level != NULL) {
+        setLogLevel(atoi(level));
+    }
+
+    pthread_key_create(&ring_key, release_ring);
+    log_file = fopen(NM_LOG_FILE, "a");
+
+    pthread_t flusherThreadId;
+    if (pthread_create(&flusherThreadId, NULL, log_flusher, NULL) == 0) {
+        pthread_detach(flusherThreadId);
+    }
+    atexit(flushLogs);
+}
+
+/**
+ * @brief Gives the calling thread a ring, reusing one given up by a
+ * thread that exited if there is one.
+ *
+ * @return The ring, NULL if MAX_LOG_RINGS threads hold one.
+ */
+static LogRing* claim_ring() {
+    pthread_once(&log_once, init_logging);
+
+    int count = atomic_load(&num_log_rings);
+    for (int i = 0; i < count; i++) {
+        int expected = LOG_RING_FREE;
+        if (atomic_compare_exchange_strong(&log_rings[i]->state, &expected, LOG_RING_OWNED)) {
+            my_ring = log_rings[i];
+        }
+        if (my_ring != NULL) {
+            break;
+        }
+    }
+
+    if (my_ring == NULL) {
+        pthread_mutex_lock(&ring_alloc_lock);
+            count = atomic_load(&num_log_rings);
+            LogRing* ring = (count < MAX_LOG_RINGS) ? (LogRing*) calloc(1, sizeof(LogRing)) : NULL;
+            if (ring != NULL) {
+                atomic_store(&ring->state, LOG_RING_OWNED);
+                log_rings[count] = ring;
+                atomic_store(&num_log_rings, count + 1);
+                my_ring = ring;
+            }
+        pthread_mutex_unlock(&ring_alloc_lock);
+    }
+
+    if (my_ring != NULL) {
+        pthread_setspecific(ring_key, my_ring);
+    }
+    return my_ring;
+}
+
+/**
+ * @brief Takes the next free record of the calling thread's ring.
+ *
+ * @return The record, to be published with publish_record. NULL if the
+ *         ring is full, in which case the drop is counted.
+ */
+static LogRecord* reserve_record(LogLevel level) {
+    LogRing* ring = (my_ring != NULL) ? my_ring : claim_ring();
+    if (ring == NULL) {
+        atomic_fetch_add_explicit(&unringed_drops, 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= LOG_RING_RECORDS) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    // The coarse clock costs a few ns instead of tens; records of one
+    // thread keep their order, across threads it is to within a tick
+    LogRecord* record = &ring->records[head & (LOG_RING_RECORDS - 1)];
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    record->time_ns = (long long) now.tv_sec * 1000000000 + now.tv_nsec;
+    record->level = level;
+    return record;
+}
+
+static void publish_record() {
+    atomic_fetch_add_explicit(&my_ring->head, 1, memory_order_release);
+}
+
+/**
+ * @brief Logs a message. The calling thread only copies it into its own
+ * ring, the file and terminal are written by the flusher.
+ *
+ * @param level : Level of the record, LOG_LEVEL_ERROR also keeps errno.
+ * @param message : The message, cut to LOG_RECORD_TEXT - 1 bytes.
+ */
+void logMessage(LogLevel level, const char* message) {
+    int error = errno;
+    LogRecord* record = reserve_record(level);
+    if (record == NULL) {
+        return;
+    }
+    record->error = error;
+
+    size_t len = strnlen(message, LOG_RECORD_TEXT - 1);
+    memcpy(record->text, message, len);
+    record->text[len] = '\0';
+    publish_record();
+}
+
+/**
+ * @brief Logs a formatted message, formatted straight into the ring.
+ *
+ * @param level : Level of the record, LOG_LEVEL_ERROR also keeps errno.
+ * @param format : printf format of the message.
+ */
+void logPrintf(LogLevel level, const char* format, ...) {
+    int error = errno;
+    LogRecord* record = reserve_record(level);
+    if (record == NULL) {
+        return;
+    }
+    record->error = error;
+
+    va_list args;
+    va_start(args, format);
+    vsnprintf(record->text, LOG_RECORD_TEXT, format, args);
+    va_end(args);
+    publish_record();
+}
+
+/**
+ * @brief Changes which records are kept from now on.
+ */
+void setLogLevel(LogLevel level) {
+    if (level < LOG_LEVEL_ERROR) {
+        level = LOG_LEVEL_ERROR;
+    } else if (level > LOG_LEVEL_DEBUG) {
+        level = LOG_LEVEL_DEBUG;
+    }
+    atomic_store(&log_level, level);
+}
+
+/**
+ * @brief Writes one record to the log file, and to the terminal the way
+ * LOG always did: successes to stdout, errors to stderr with errno.
+ */
+static void write_record(LogRecord* record, char* buffer, size_t* used) {
+    if (*used + LOG_RECORD_TEXT + 16 >= LOG_FLUSH_BUFFER) {
+        if (log_file != NULL) {
+            fwrite(buffer, 1, *used, log_file);
+        }
+        *used = 0;
+    }
+
+    bool plus = (record->level != LOG_LEVEL_ERROR);
+    int len = snprintf(buffer + *used, LOG_FLUSH_BUFFER - *used, "[%s]: %s\n", plus ? "+" : "-", record->text);
+    if (len > 0 && *used + len < LOG_FLUSH_BUFFER) {
+        *used += len;
+    }
+
+#if LOGGING == 1
+    if (plus) {
+        printf("[%s\e[0m]: %s\n", GREENCOLOR("+"), record->text);
+    }
+#endif
+    if (!plus && record->error != 0) {
+        fprintf(stderr, "[%s]: %s: %s\n", REDCOLOR("-"), record->text, strerror(record->error));
+    } else if (!plus) {
+        fprintf(stderr, "[%s]: %s\n", REDCOLOR("-"), record->text);
+    }
+}
+
+static void write_line(const char* text, char* buffer, size_t* used) {
+    LogRecord record;
+    memset(&record, 0, sizeof(LogRecord));
+    record.level = LOG_LEVEL_ERROR;
+    snprintf(record.text, LOG_RECORD_TEXT, "%s", text);
+    write_record(&record, buffer, used);
+}
+
+/**
+ * @brief Writes out every record logged so far, oldest first across all
+ * threads, and reports the records that had to be dropped. Rings of
+ * threads that exited are handed back once they are empty.
+ */
+void flushLogs() {
+    static char buffer[LOG_FLUSH_BUFFER];
+
+    pthread_mutex_lock(&flush_lock);
+        int count = atomic_load(&num_log_rings);
+        unsigned int cursor[MAX_LOG_RINGS];
+        unsigned int end[MAX_LOG_RINGS];
+        int state[MAX_LOG_RINGS];
+        for (int i = 0; i < count; i++) {
+            // The state is read first, an orphan logs nothing after it
+            state[i] = atomic_load_explicit(&log_rings[i]->state, memory_order_acquire);
+            cursor[i] = atomic_load_explicit(&log_rings[i]->tail, memory_order_relaxed);
+            end[i] = atomic_load_explicit(&log_rings[i]->head, memory_order_acquire);
+        }
+
+        size_t used = 0;
+        while (1) {
+            // Every ring is in order, so the oldest record is at the front of one
+            int oldest = -1;
+            for (int i = 0; i < count; i++) {
+                if (cursor[i] != end[i] && (oldest < 0 ||
+                    log_rings[i]->records[cursor[i] & (LOG_RING_RECORDS - 1)].time_ns <
+                    log_rings[oldest]->records[cursor[oldest] & (LOG_RING_RECORDS - 1)].time_ns)) {
+                    oldest = i;
+                }
+            }
+            if (oldest < 0) {
+                break;
+            }
+
+            write_record(&log_rings[oldest]->records[cursor[oldest] & (LOG_RING_RECORDS - 1)], buffer, &used);
+            cursor[oldest]++;
+        }
+
+        for (int i = 0; i < count; i++) {
+            atomic_store_explicit(&log_rings[i]->tail, cursor[i], memory_order_release);
+
+            long dropped = atomic_exchange_explicit(&log_rings[i]->dropped, 0, memory_order_relaxed);
+            if (dropped > 0) {
+                char line[64];
+                snprintf(line, sizeof(line), "%ld log records dropped, the ring was full", dropped);
+                write_line(line, buffer, &used);
+            }
+
+            if (state[i] == LOG_RING_ORPHANED) {
+                atomic_store_explicit(&log_rings[i]->state, LOG_RING_FREE, memory_order_release);
+            }
+        }
+
+        long unringed = atomic_exchange_explicit(&unringed_drops, 0, memory_order_relaxed);
+        if (unringed > 0) {
+            char line[64];
+            snprintf(line, sizeof(line), "%ld log records dropped, no ring was free", unringed);
+            write_line(line, buffer, &used);
+        }
+
+        if (log_file != NULL) {
+            fwrite(buffer, 1, used, log_file);
+            fflush(log_file);
+        }
+        fflush(stdout);
+    pthread_mutex_unlock(&flush_lock);
+}
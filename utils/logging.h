@@ -7,86 +7,52 @@
 #define LOGGING 1
 
 #include "headers.h"
+#include "constants.h"
 #include "structs.h"
 
 // Custom color macros
 #define REDCOLOR(text) "\e[0;31m" text "\e[0m"
 #define GREENCOLOR(text) "\e[0;32m" text "\e[0m"
 
-// Check if logging is enabled
-#if LOGGING == 1
-    // Define log function for enabled logging
-    #define LOG(message, plus) do { \
-        FILE *fptr = fopen(NM_LOG_FILE, "a"); \
-        if (fptr) { \
-            fprintf(fptr, "[%s]: %s\n", ((plus) ? ("+") : ("-")), message); \
-            fclose(fptr); \
-        } \
-        if (plus) { \
-            printf("[%s\e[0m]: %s\n", GREENCOLOR("+"), message); \
-        } else { \
-            fprintf(stderr, "[%s]: ", REDCOLOR("-")); \
-            perror(message); \
-        } \
-    } while (0)
-
-    // Define log function for logging server details
-    #define LOG_SERVER_DETAILS(server) do { \
-        FILE *fptr = fopen(NM_LOG_FILE, "a"); \
-        if (fptr) { \
-            fprintf(fptr, "[%s]: Server ID: %d, Server port_nm: %d, Server port_client: %d, Server online: %s, Num Paths accessible by server: %d\n", \
-                GREENCOLOR("+"), server->serverID, server->port_nm, server->port_client, (server->online ? GREENCOLOR("online") : REDCOLOR("offline")), server->num_paths); \
-            fclose(fptr); \
-        } \
-        printf("[%s\e[0m]: Server ID: %d\n     Server port_nm: %d\n     Server port_client: %d\n     Server online: %s\n     Paths accessible by server: %d\n", \
-            GREENCOLOR("+"), server->serverID, server->port_nm, server->port_client, (server->online ? GREENCOLOR("online") : REDCOLOR("offline")), server->num_paths); \
+// Records are put in a ring of the calling thread and written out by a
+// background flusher, see utils/logging.c
+void logMessage(LogLevel level, const char* message);
+void logPrintf(LogLevel level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+void setLogLevel(LogLevel level);
+void flushLogs();
+extern atomic_int log_level;
+
+// Whether records of a level are kept, checked before any work is done
+#define LOG_ENABLED(level) ((int) (level) <= atomic_load_explicit(&log_level, memory_order_relaxed))
+
+// Define log function
+#define LOG(message, plus) do { \
+    LogLevel log_lvl = (plus) ? LOG_LEVEL_INFO : LOG_LEVEL_ERROR; \
+    if (LOG_ENABLED(log_lvl)) { \
+        logMessage(log_lvl, message); \
+    } \
+} while (0)
+
+// Define log function for logging server details, the paths only at debug level
+#define LOG_SERVER_DETAILS(server) do { \
+    if (LOG_ENABLED(LOG_LEVEL_INFO)) { \
+        logPrintf(LOG_LEVEL_INFO, "Server ID: %d, Server port_nm: %d, Server port_client: %d, Server online: %s, Num Paths accessible by server: %d", \
+            server->serverID, server->port_nm, server->port_client, (server->online ? GREENCOLOR("online") : REDCOLOR("offline")), server->num_paths); \
+    } \
+    if (LOG_ENABLED(LOG_LEVEL_DEBUG)) { \
         for (int i = 0; i < server->num_paths; i++) { \
-            printf("     %s\n", server->accessible_paths[i]); \
-        }\
-    } while (0)
-
-    // Define log function for logging client request
-    #define LOG_CLIENT_REQUEST(clientRequest) do { \
-        FILE *fptr = fopen(NM_LOG_FILE, "a"); \
-        if (fptr) { \
-            fprintf(fptr, "[%s]: Client ID: %d, Request Type: %d, Num Args: %d, Arg1: %s, Arg2: %s\n", \
-                GREENCOLOR("+"), clientRequest->clientDetails.clientID, clientRequest->requestType, \
-                clientRequest->num_args, clientRequest->arg1, clientRequest->arg2); \
-            fclose(fptr); \
+            logPrintf(LOG_LEVEL_DEBUG, "     %s", server->accessible_paths[i]); \
         } \
-        printf("[%s\e[0m]: Client ID: %d\n     Request Type: %d\n      Num Args: %d\n      Arg1: %s\n      Arg2: %s\n", \
-            GREENCOLOR("+"), clientRequest->clientDetails.clientID, clientRequest->requestType, \
+    } \
+} while (0)
+
+// Define log function for logging client request
+#define LOG_CLIENT_REQUEST(clientRequest) do { \
+    if (LOG_ENABLED(LOG_LEVEL_INFO)) { \
+        logPrintf(LOG_LEVEL_INFO, "Client ID: %d, Request Type: %d, Num Args: %d, Arg1: %s, Arg2: %s", \
+            clientRequest->clientDetails.clientID, clientRequest->requestType, \
             clientRequest->num_args, clientRequest->arg1, clientRequest->arg2); \
-    } while (0)
-
-#else
-
-    // Define log function for disabled logging
-    #define LOG(message, plus) do { \
-        FILE *fptr = fopen(NM_LOG_FILE, "a"); \
-        if (fptr) { \
-            fprintf(fptr, "[%s]: %s\n", ((plus) ? ("+") : ("-")), message); \
-            fclose(fptr); \
-        } \
-        if (!plus) { \
-            fprintf(stderr, "[%s]: ", REDCOLOR("-")); \
-            perror(message); \
-        } \
-    } while (0)
-
-    // Define log function for logging server details when logging is disabled
-    #define LOG_SERVER_DETAILS(server) do { \
-        FILE *fptr = fopen(NM_LOG_FILE, "a"); \
-        if (fptr) { \
-            fprintf(fptr, "[%s]: Server ID: %d, Server port_nm: %d, Server port_client: %d, Server online: %s\n", \
-                REDCOLOR("-"), server->serverID, server->port_nm, server->port_client, (server->online ? GREENCOLOR("online") : REDCOLOR("offline"))); \
-            fclose(fptr); \
-        } \
-    } while (0)
-
-    // Define log function for logging client request when logging is disabled
-    #define LOG_CLIENT_REQUEST(clientRequest) do {} while (0)
-
-#endif
+    } \
+} while (0)
 
 #endif // LOGGING_H
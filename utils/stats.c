@@ -0,0 +1,346 @@
+#include "stats.h"
+#include "logging.h"
+#include "wire.h"
+
+/***************************************************/
+/*     Latency histograms and request counters     */
+/***************************************************/
+
+static RequestStats request_stats[NUM_REQUEST_TYPES];             // What was served, by request type
+static long long stats_started_ns = 0;                             // When the process started counting
+static const char* stats_file = NULL;                              // Where the stats are appended, if anywhere
+
+static const char* request_names[NUM_REQUEST_TYPES] = {
+    [CREATE_DIR] = CREATEDIR,
+    [CREATE_FILE] = CREATEFILE,
+    [DELETE_DIR] = DELETEDIR,
+    [DELETE_FILE] = DELETEFILE,
+    [GET_FILE_INFO] = GETINFO,
+    [READ_FILE] = READFILE,
+    [WRITE_FILE] = WRITEFILE,
+    [LIST_ALL] = LISTALL,
+    [HOT_PATHS] = HOTPATHS,
+    [GET_STATS] = GETSTATS,
+    [RESYNC] = "RESYNC",
+    [REPLICATE_FILE] = "REPLICATE_FILE",
+};
+
+/**
+ * @brief Monotonic time in ns, what a request's start is taken with.
+ */
+long long statsClock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * @brief Bucket of a latency. Below 2^STATS_SUB_BUCKET_BITS ns every ns
+ * has its own bucket. Above, every power of two is split into
+ * 2^STATS_SUB_BUCKET_BITS buckets of equal width, so a bucket is never
+ * wider than about 6% of the latencies in it.
+ */
+static int stats_bucket(long long ns) {
+    const int sub = 1 << STATS_SUB_BUCKET_BITS;
+    if (ns < sub) {
+        return (ns < 0) ? 0 : (int) ns;
+    }
+
+    int exponent = 63 - __builtin_clzll((unsigned long long) ns);
+    if (exponent >= STATS_MAX_EXPONENT) {
+        return STATS_BUCKETS - 1;
+    }
+    int shift = exponent - STATS_SUB_BUCKET_BITS;
+    return ((shift + 1) << STATS_SUB_BUCKET_BITS) + (int) ((ns >> shift) & (sub - 1));
+}
+
+/**
+ * @brief Largest latency that falls in a bucket.
+ */
+static long long stats_bucket_top(int bucket) {
+    const int sub = 1 << STATS_SUB_BUCKET_BITS;
+    if (bucket < sub) {
+        return bucket;
+    }
+    int shift = (bucket >> STATS_SUB_BUCKET_BITS) - 1;
+    return ((long long) (sub + (bucket & (sub - 1)) + 1) << shift) - 1;
+}
+
+/**
+ * @brief Counts a request that was served. Only relaxed atomic adds, so
+ * threads recording at once never wait on each other.
+ *
+ * @param type : The request type.
+ * @param started_ns : statsClock when the request arrived.
+ * @param ok : Whether it succeeded.
+ */
+void recordRequest(RequestType type, long long started_ns, bool ok) {
+    if ((int) type < 0 || type >= NUM_REQUEST_TYPES) {
+        return;
+    }
+    RequestStats* stats = &request_stats[type];
+    long long ns = statsClock() - started_ns;
+
+    atomic_fetch_add_explicit(&stats->count, 1, memory_order_relaxed);
+    if (!ok) {
+        atomic_fetch_add_explicit(&stats->errors, 1, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&stats->total_ns, ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->buckets[stats_bucket(ns)], 1, memory_order_relaxed);
+
+    long long max = atomic_load_explicit(&stats->max_ns, memory_order_relaxed);
+    while (ns > max && !atomic_compare_exchange_weak_explicit(&stats->max_ns, &max, ns, memory_order_relaxed, memory_order_relaxed));
+}
+
+/**
+ * @brief Copies the stats of every request type. The copy of a type may
+ * be a few requests off between its fields, it is not taken atomically.
+ */
+static void snapshot_stats(RequestStats* copy) {
+    for (int type = 0; type < NUM_REQUEST_TYPES; type++) {
+        RequestStats* stats = &request_stats[type];
+        atomic_init(&copy[type].count, atomic_load_explicit(&stats->count, memory_order_relaxed));
+        atomic_init(&copy[type].errors, atomic_load_explicit(&stats->errors, memory_order_relaxed));
+        atomic_init(&copy[type].total_ns, atomic_load_explicit(&stats->total_ns, memory_order_relaxed));
+        atomic_init(&copy[type].max_ns, atomic_load_explicit(&stats->max_ns, memory_order_relaxed));
+        for (int i = 0; i < STATS_BUCKETS; i++) {
+            atomic_init(&copy[type].buckets[i], atomic_load_explicit(&stats->buckets[i], memory_order_relaxed));
+        }
+    }
+}
+
+/**
+ * @brief Latency below which a fraction of the requests in a histogram
+ * were served, to within a bucket.
+ */
+static long long stats_percentile(const long long* buckets, long long count, double fraction) {
+    long long rank = (long long) (fraction * count + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    long long seen = 0;
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            return stats_bucket_top(i);
+        }
+    }
+    return stats_bucket_top(STATS_BUCKETS - 1);
+}
+
+/**
+ * @brief Formats a line of stats for every request type that was served
+ * between two snapshots, latencies in us.
+ *
+ * @param now : The later snapshot.
+ * @param before : The earlier one, NULL for everything since the start.
+ * @param seconds : Time between the two, for the throughput.
+ * @param out : Filled with the lines.
+ * @param size : Size of out.
+ *
+ * @return Length of the text in out.
+ */
+static size_t format_stats(RequestStats* now, RequestStats* before, double seconds, char* out, size_t size) {
+    size_t len = snprintf(out, size, "%-14s %9s %7s %9s %9s %9s %9s %9s %9s %9s\n",
+                          "request", "count", "errors", "req/s", "mean", "p50", "p90", "p99", "p99.9", "max");
+
+    long long buckets[STATS_BUCKETS];
+    for (int type = 0; type < NUM_REQUEST_TYPES && len < size; type++) {
+        long long count = atomic_load(&now[type].count);
+        long long errors = atomic_load(&now[type].errors);
+        long long total_ns = atomic_load(&now[type].total_ns);
+        for (int i = 0; i < STATS_BUCKETS; i++) {
+            buckets[i] = atomic_load(&now[type].buckets[i]);
+        }
+        if (before != NULL) {
+            count -= atomic_load(&before[type].count);
+            errors -= atomic_load(&before[type].errors);
+            total_ns -= atomic_load(&before[type].total_ns);
+            for (int i = 0; i < STATS_BUCKETS; i++) {
+                buckets[i] -= atomic_load(&before[type].buckets[i]);
+            }
+        }
+        if (count <= 0) {
+            continue;
+        }
+
+        // The exact maximum is only kept since the start
+        long long max_ns = atomic_load(&now[type].max_ns);
+        if (before != NULL) {
+            max_ns = stats_percentile(buckets, count, 1.0);
+        }
+
+        // A bucket's top may lie above the slowest request in it
+        double percentiles[4];
+        const double fractions[4] = {0.5, 0.9, 0.99, 0.999};
+        for (int i = 0; i < 4; i++) {
+            long long ns = stats_percentile(buckets, count, fractions[i]);
+            percentiles[i] = ((ns < max_ns) ? ns : max_ns) / 1000.0;
+        }
+
+        len += snprintf(out + len, size - len, "%-14s %9lld %7lld %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+                        request_names[type], count, errors, (seconds > 0) ? count / seconds : 0.0,
+                        total_ns / 1000.0 / count, percentiles[0], percentiles[1], percentiles[2], percentiles[3],
+                        max_ns / 1000.0);
+    }
+    return (len < size) ? len : size - 1;
+}
+
+/**
+ * @brief Appends the stats of the last STATS_DUMP_INTERVAL_MS to the stats
+ * file, forever.
+ */
+static void* stats_dump_thread(void* arg) {
+    const char* file = (const char*) arg;
+    static RequestStats snapshots[2][NUM_REQUEST_TYPES];
+    static char text[16384];
+
+    int last = 0;
+    long long last_ns = statsClock();
+    snapshot_stats(snapshots[last]);
+
+    while (1) {
+        usleep(STATS_DUMP_INTERVAL_MS * 1000);
+
+        long long now_ns = statsClock();
+        snapshot_stats(snapshots[!last]);
+        size_t len = format_stats(snapshots[!last], snapshots[last], (now_ns - last_ns) / 1e9, text, sizeof(text));
+        last = !last;
+        last_ns = now_ns;
+
+        FILE* fp = fopen(file, "a");
+        if (fp == NULL) {
+            LOG("Error opening the stats file", false);
+            continue;
+        }
+        fprintf(fp, "# %ld, up %.0f s, last %d ms\n", (long) time(NULL), (now_ns - stats_started_ns) / 1e9, STATS_DUMP_INTERVAL_MS);
+        fwrite(text, 1, len, fp);
+        fclose(fp);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Appends the stats since the start to the stats file, when the
+ * process exits normally.
+ */
+static void stats_dump_final() {
+    static RequestStats snapshot[NUM_REQUEST_TYPES];
+    static char text[16384];
+
+    long long now_ns = statsClock();
+    snapshot_stats(snapshot);
+    size_t len = format_stats(snapshot, NULL, (now_ns - stats_started_ns) / 1e9, text, sizeof(text));
+
+    FILE* fp = fopen(stats_file, "a");
+    if (fp == NULL) {
+        return;
+    }
+    fprintf(fp, "# %ld, up %.0f s, at exit, since the start\n", (long) time(NULL), (now_ns - stats_started_ns) / 1e9);
+    fwrite(text, 1, len, fp);
+    fclose(fp);
+}
+
+/**
+ * @brief Starts counting from now, and appends the stats to a file every
+ * STATS_DUMP_INTERVAL_MS and at exit.
+ *
+ * @param file : The stats file, NULL to only count.
+ */
+void startStats(const char* file) {
+    stats_started_ns = statsClock();
+    if (file == NULL) {
+        return;
+    }
+    stats_file = file;
+    atexit(stats_dump_final);
+
+    pthread_t statsThreadId;
+    if (pthread_create(&statsThreadId, NULL, stats_dump_thread, (void*) file) != 0) {
+        LOG("Error creating stats thread", false);
+        return;
+    }
+    pthread_detach(statsThreadId);
+}
+
+/**
+ * @brief Formats the stats since the start.
+ *
+ * @return Length of the text in out.
+ */
+static size_t stats_since_start(char* out, size_t size) {
+    static RequestStats snapshot[NUM_REQUEST_TYPES];
+    static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+    size_t len;
+    pthread_mutex_lock(&snapshot_lock);
+        long long now_ns = statsClock();
+        snapshot_stats(snapshot);
+        len = format_stats(snapshot, NULL, (now_ns - stats_started_ns) / 1e9, out, size);
+    pthread_mutex_unlock(&snapshot_lock);
+    return len;
+}
+
+/**
+ * @brief Prints the stats since the start, for tools that count their own
+ * requests.
+ *
+ * @param fp : Where to print them.
+ */
+void printStats(FILE* fp) {
+    char text[4096];
+    size_t len = stats_since_start(text, sizeof(text));
+    fwrite(text, 1, len, fp);
+}
+
+/**
+ * @brief Adds the stats since the start to a reply as packets of text
+ * lines, the way the NM sends a listing: as many whole lines as fit in a
+ * packet.
+ *
+ * @param reply : Reply the packets are added to.
+ *
+ * @return false if the reply could not grow
+ */
+bool appendStats(WireBuffer* reply) {
+    char text[4096];
+    size_t total = stats_since_start(text, sizeof(text));
+
+    FilePacket packet;
+    size_t sent = 0;
+    do {
+        size_t len = 0;
+        while (sent + len < total) {
+            char* end = memchr(text + sent + len, '\n', total - sent - len);
+            size_t line_len = (end == NULL) ? total - sent - len : (size_t) (end - (text + sent + len)) + 1;
+            if (len + line_len > MAX_CHUNK_SIZE) {
+                break;
+            }
+            len += line_len;
+        }
+        memcpy(packet.chunk, text + sent, len);
+        packet.chunk[len] = '\0';
+        sent += len;
+        packet.lastChunk = (sent == total || len == 0);
+
+        appendBytes(reply, &packet, sizeof(FilePacket));
+    } while (!packet.lastChunk);
+    return !reply->failed;
+}
+
+/**
+ * @brief Sends the stats since the start, as appendStats puts them.
+ *
+ * @param fd : Socket to send on.
+ *
+ * @return true on success, false on failure
+ */
+bool sendStats(int fd) {
+    WireBuffer reply = {0};
+    bool sent = appendStats(&reply) && sendAll(fd, reply.data, reply.size);
+    free(reply.data);
+    if (!sent) {
+        LOG("Error sending stats", false);
+    }
+    return sent;
+}
@@ -0,0 +1,17 @@
+// stats.h
+#ifndef STATS_H
+#define STATS_H
+
+#include "headers.h"
+#include "constants.h"
+#include "structs.h"
+
+// Latency histograms and counters of the requests served, see utils/stats.c
+void startStats(const char* file);
+long long statsClock();
+void recordRequest(RequestType type, long long started_ns, bool ok);
+bool appendStats(WireBuffer* reply);
+bool sendStats(int fd);
+void printStats(FILE* fp);
+
+#endif // STATS_H
@@ -20,6 +20,18 @@ typedef struct ClientDetails {
     int clientID;
 } ClientDetails;
 
+/**
+ * @brief A storage server in a replica chain, as a client reaches it
+ * 
+ * @param serverIP : server IP address
+ * @param port_client : port for communication with client
+ * 
+ */
+typedef struct ChainHop {
+    char serverIP[IP_LEN];
+    int port_client;
+} ChainHop;
+
 /**
  * @brief ClientRequest struct to store client request
  * 
@@ -28,6 +40,13 @@ typedef struct ClientDetails {
  * @param num_args : number of arguments
  * @param arg1 : first argument
  * @param arg2 : second argument
+ * @param limit : LIST_ALL only, most paths to return (0 for LIST_PAGE_SIZE)
+ * @param cursor : LIST_ALL only, last path of the previous page (empty for the first page)
+ * @param offset : READ_FILE only, first byte to read
+ * @param length : READ_FILE only, most bytes to read (0 for up to the end of the file)
+ * @param chain_len : WRITE_FILE to a storage server only, number of replicas the write is passed on to
+ * @param chain : those replicas, in the order the write goes down the chain
+ * @param traceID : chosen by the client, every process the request goes through traces its spans under it
  * 
  */
 typedef struct ClientRequest {
@@ -36,6 +55,13 @@ typedef struct ClientRequest {
     int num_args;
     char arg1[MAX_ARG_LEN];
     char arg2[MAX_ARG_LEN];
+    int limit;
+    char cursor[MAX_PATH_LEN];
+    long long offset;
+    long long length;
+    int chain_len;
+    ChainHop chain[MAX_SERVERS];
+    unsigned long long traceID;
 } ClientRequest;
 
 /**
@@ -47,6 +73,7 @@ typedef struct ClientRequest {
  * @param port_client : port for communication with client
  * @param accessible_paths : list of accessible paths for this storage server
  * @param online : whether the server is online or not
+ * @param seq : sequence number of the last namespace delta reflected in the paths
  * 
  */
 typedef struct ServerDetails {
@@ -57,8 +84,249 @@ typedef struct ServerDetails {
     int num_paths;
     char accessible_paths[MAX_PATHS][MAX_PATH_LEN];
     bool online;
+    long seq;
 } ServerDetails;
 
+/**
+ * @brief ServerEndpoint struct, the part of ServerDetails a client needs
+ * to reach a storage server
+ * 
+ * @param serverID : server ID (unique)
+ * @param serverIP : server IP address
+ * @param port_client : port for communication with client
+ * @param online : whether the server is online or not
+ * @param lease_id : lease on the path the endpoint was looked up for, -1 if none was granted
+ * @param lease_ms : how long the client may use the endpoint without asking the NM again
+ * @param chain_len : number of live replicas of the path
+ * @param chain : the live replicas, head first; writes go to the head
+ * 
+ */
+typedef struct ServerEndpoint {
+    int serverID;
+    char serverIP[IP_LEN];
+    int port_client;
+    bool online;
+    int lease_id;
+    int lease_ms;
+    int chain_len;
+    ChainHop chain[MAX_SERVERS];
+} ServerEndpoint;
+
+/**
+ * @brief Lease the NM granted a client on the location of a path
+ * 
+ * @param path : the path
+ * @param hash : hash of the path
+ * @param serverID : storage server the client was sent to
+ * @param clientID : client holding the lease
+ * @param leaseID : ID the client knows the lease by
+ * @param expiry_ms : monotonic time the lease runs out at
+ * @param next : next lease in the same bucket
+ * 
+ */
+typedef struct Lease {
+    char *path;
+    unsigned long long hash;
+    int serverID;
+    int clientID;
+    int leaseID;
+    long long expiry_ms;
+    struct Lease *next;
+} Lease;
+
+/**
+ * @brief Client connection as seen by the lease notifier
+ * 
+ * @param send_lock : held while the notifier queues invalidations for the client
+ * @param replying : a request of the client is being answered, its
+ *                   invalidations wait until the whole reply is queued
+ * @param connected : whether the client is still connected
+ * @param pending : lease IDs waiting to be pushed
+ * @param num_pending : number of entries in pending
+ * @param pending_capacity : number of entries allocated for pending
+ * 
+ */
+typedef struct LeaseClient {
+    pthread_mutex_t send_lock;
+    bool replying;
+    bool connected;
+    int *pending;
+    int num_pending;
+    int pending_capacity;
+} LeaseClient;
+
+/**
+ * @brief Growable buffer a message or a reply is put together in
+ *
+ * @param data : the bytes
+ * @param size : number of bytes in use
+ * @param capacity : number of bytes allocated
+ * @param failed : set once growing the buffer failed, the bytes are incomplete
+ *
+ */
+typedef struct WireBuffer {
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+    bool failed;
+} WireBuffer;
+
+/**
+ * @brief Client connection served by an NM reactor
+ *
+ * @param socket : client socket, non-blocking
+ * @param slot : client slot, also the client ID leases are granted to
+ * @param epollFd : epoll instance of the reactor owning the connection
+ * @param received : bytes of request received so far
+ * @param arrived_us : traceClock when the first bytes of the request arrived
+ * @param request : request being received, or served by a worker
+ * @param lock : protects everything below
+ * @param out : replies queued for the client
+ * @param out_sent : bytes of out already sent
+ * @param events : events the reactor waits for on the socket
+ * @param refs : the reactor's reference, and the worker's while it serves a request
+ * @param busy : a worker is serving a request, nothing more is read until it is done
+ * @param closed : the reactor gave the connection up, replies are dropped
+ * @param next : next connection waiting for a worker
+ *
+ */
+typedef struct ClientConnection {
+    int socket;
+    int slot;
+    int epollFd;
+    size_t received;
+    long long arrived_us;
+    ClientRequest request;
+    pthread_mutex_t lock;
+    WireBuffer out;
+    size_t out_sent;
+    unsigned int events;
+    int refs;
+    bool busy;
+    bool closed;
+    struct ClientConnection *next;
+} ClientConnection;
+
+/**
+ * @brief Location the client cached under a lease
+ * 
+ * @param path : the path
+ * @param endpoint : storage server holding it, with the lease
+ * @param expiry_ms : monotonic time the lease runs out at
+ * @param used : whether the entry holds a path
+ * 
+ */
+typedef struct LeaseEntry {
+    char path[MAX_ARG_LEN];
+    ServerEndpoint endpoint;
+    long long expiry_ms;
+    bool used;
+} LeaseEntry;
+
+/**
+ * @brief One change in a namespace delta
+ * 
+ * @param op : what happened to the path
+ * @param path : the path, with a trailing '/' for directories
+ * 
+ */
+typedef struct DeltaChange {
+    DeltaOp op;
+    char path[MAX_PATH_LEN];
+} DeltaChange;
+
+/**
+ * @brief Changes a storage server made to its namespace in one operation,
+ * sent to the NM instead of the whole ServerDetails
+ * 
+ * @param serverID : storage server that made the changes
+ * @param seq : sequence number of the delta, one more than the previous
+ *              delta of the server. Unchanged if num_changes is 0.
+ * @param num_changes : number of entries in changes
+ * @param changes : the changes, to be applied in order
+ * 
+ */
+typedef struct PathDelta {
+    int serverID;
+    long seq;
+    int num_changes;
+    DeltaChange changes[MAX_DELTA_CHANGES];
+} PathDelta;
+
+/**
+ * @brief Header of a record in the NM journal, followed by length bytes of path
+ * 
+ * @param seq : sequence number, for JOURNAL_SEQ and JOURNAL_SERVER
+ * @param checksum : FNV-1a of the record with checksum set to 0, a torn write at the tail fails it
+ * @param serverID : storage server the record is about
+ * @param port_nm, port_client : ports of the server, for JOURNAL_SERVER
+ * @param length : length of the path (no '\0' is stored)
+ * @param op : a JournalOp
+ * 
+ */
+typedef struct JournalRecord {
+    long long seq;
+    unsigned int checksum;
+    int serverID;
+    int port_nm;
+    int port_client;
+    unsigned short length;
+    unsigned char op;
+    unsigned char pad[5]; // Zero, so no byte of the record is left undefined
+} JournalRecord;
+
+/**
+ * @brief Header of the NM snapshot. It is followed by num_servers
+ * SnapshotServer entries, then num_paths SnapshotPath entries in strcmp
+ * order. The file is mapped and read in place.
+ * 
+ * @param magic, version : SNAPSHOT_MAGIC and SNAPSHOT_VERSION
+ * @param generation : first journal generation not covered by the snapshot
+ * @param num_servers : servers known when the snapshot was taken
+ * @param num_paths : paths in the snapshot
+ * @param size : size of the whole file
+ * @param checksum : FNV-1a of everything after the header
+ * 
+ */
+typedef struct SnapshotHeader {
+    unsigned int magic;
+    unsigned int version;
+    long long generation;
+    int num_servers;
+    long long num_paths;
+    unsigned long long size;
+    unsigned long long checksum;
+} SnapshotHeader;
+
+/**
+ * @brief A storage server in the NM snapshot
+ * 
+ * @param serverID : server ID (unique)
+ * @param serverIP : server IP address
+ * @param port_nm, port_client : ports of the server
+ * @param seq : last delta applied
+ * 
+ */
+typedef struct SnapshotServer {
+    int serverID;
+    char serverIP[IP_LEN];
+    int port_nm;
+    int port_client;
+    long long seq;
+} SnapshotServer;
+
+/**
+ * @brief A path in the NM snapshot, followed by length bytes of path
+ * 
+ * @param length : length of the path
+ * @param serverID : storage server holding it
+ * 
+ */
+typedef struct SnapshotPath {
+    unsigned short length;
+    short serverID;
+} SnapshotPath;
+
 /**
  * @brief AckPacket struct to send details
  * 
@@ -72,6 +340,179 @@ typedef struct AckPacket {
     int extraInfo[MAX_ACK_EXTRA_INFO];
 } AckPacket;
 
+/**
+ * @brief Request the NM sends a storage server on its pooled connection
+ *
+ * @param requestID : tag the reply is matched to the request by
+ * @param request : the privileged request (or RESYNC)
+ *
+ */
+typedef struct StorageRequest {
+    int requestID;
+    ClientRequest request;
+} StorageRequest;
+
+/**
+ * @brief Reply of a storage server to a StorageRequest. A RESYNC reply is
+ * followed by the full server details.
+ *
+ * @param requestID : tag of the request answered
+ * @param ack : outcome of the request
+ * @param delta : what the request changed in the namespace of the server
+ *
+ */
+typedef struct StorageReply {
+    int requestID;
+    AckPacket ack;
+    PathDelta delta;
+} StorageReply;
+
+/**
+ * @brief Connection from the NM as a storage server sees it, shared by
+ * the requests being served on it
+ *
+ * @param socket : the socket
+ * @param send_lock : held while a reply is written to the socket
+ * @param refs : the reader's reference, and one for each request being served
+ *
+ */
+typedef struct NMConnection {
+    int socket;
+    pthread_mutex_t send_lock;
+    atomic_int refs;
+} NMConnection;
+
+/**
+ * @brief Request from the NM handed to a thread of its own
+ *
+ * @param connection : connection the reply goes back on
+ * @param message : the request
+ *
+ */
+typedef struct NMTask {
+    NMConnection *connection;
+    StorageRequest message;
+} NMTask;
+
+/**
+ * @brief Request in flight on a pooled storage server connection, owned
+ * by the thread waiting for it
+ *
+ * @param requestID : tag of the request
+ * @param ss_num : storage server the request went to
+ * @param generation : connection the request was sent on
+ * @param sent : whether the request made it onto the connection
+ * @param done : set once the reply arrived, or the connection failed
+ * @param failed : whether the connection failed before the reply arrived
+ * @param ack : the reply
+ * @param cond : signalled when done is set
+ * @param next : next request in flight on the same server
+ *
+ */
+typedef struct PendingStorageRequest {
+    int requestID;
+    int ss_num;
+    long generation;
+    bool sent;
+    bool done;
+    bool failed;
+    AckPacket ack;
+    pthread_cond_t cond;
+    struct PendingStorageRequest *next;
+} PendingStorageRequest;
+
+/**
+ * @brief Long-lived connection from the NM to a storage server
+ *
+ * @param lock : protects everything but the socket writes
+ * @param send_lock : held while a request is written to the socket
+ * @param connect_done : signalled when a connect in progress ends
+ * @param socket : the connection, -1 when there is none
+ * @param connecting : a sender is connecting, without the lock held
+ * @param generation : bumped on every new connection, and on every drop
+ * @param next_request_id : tag of the next request
+ * @param pending : requests waiting for their reply
+ *
+ */
+typedef struct StorageConnection {
+    pthread_mutex_t lock;
+    pthread_mutex_t send_lock;
+    pthread_cond_t connect_done;
+    int socket;
+    bool connecting;
+    long generation;
+    int next_request_id;
+    PendingStorageRequest *pending;
+} StorageConnection;
+
+/**
+ * @brief Load of a storage server, reported in every heartbeat
+ *
+ * @param cpu_load : 1 minute load average, in percent of all cores
+ * @param queue_depth : requests being served when the beat was sent
+ * @param free_bytes : space left to non-root users where the server runs
+ * @param updated_ms : when the NM received the report, on CLOCK_MONOTONIC
+ *
+ */
+typedef struct ServerLoad {
+    int cpu_load;
+    int queue_depth;
+    long long free_bytes;
+    long long updated_ms;
+} ServerLoad;
+
+/**
+ * @brief Heartbeat a storage server sends the NM on its registration connection
+ *
+ * @param serverID : the sender
+ * @param beat : counts up from 0 with every beat
+ * @param load : load of the sender
+ *
+ */
+typedef struct HeartbeatPacket {
+    int serverID;
+    long beat;
+    ServerLoad load;
+} HeartbeatPacket;
+
+/**
+ * @brief Storage server watched by the NM heartbeat monitor, and its timer
+ * on the timing wheel
+ *
+ * @param serverID : the watched server
+ * @param socket : registration connection the beats arrive on, non-blocking
+ * @param received : bytes of packet received so far
+ * @param packet : heartbeat being received
+ * @param expire_tick : wheel tick at which the server is declared offline
+ * @param prev, next : neighbours in the wheel slot of expire_tick
+ *
+ */
+typedef struct HeartbeatWatch {
+    int serverID;
+    int socket;
+    size_t received;
+    HeartbeatPacket packet;
+    long expire_tick;
+    struct HeartbeatWatch *prev;
+    struct HeartbeatWatch *next;
+} HeartbeatWatch;
+
+/**
+ * @brief A path among the hottest the NM has seen
+ * 
+ * @param path : the path, with a trailing '/' for directories
+ * @param hash : hash of the path, compared before the path itself
+ * @param count : its decayed access count, as the sketch estimates it
+ * @param queued : whether it was handed to the replicator since it became hot
+ * 
+ */
+typedef struct HotPath {
+    char path[MAX_PATH_LEN];
+    unsigned long long hash;
+    unsigned int count;
+    bool queued;
+} HotPath;
+
 /**
  * @brief FilePacket struct to send details
  * 
@@ -84,35 +525,403 @@ typedef struct FilePacket {
     bool lastChunk;
 } FilePacket;
 
+struct trienode;
+
+/**
+ * @brief Sorted child map of a trie node. Readers search it without locks;
+ * the writer shifts entries in place under seq, and readers that miss
+ * while seq changed search again.
+ * 
+ * @param seq: Odd while the writer is shifting entries.
+ * @param count: Number of children in use.
+ * @param capacity: Number of slots in nodes.
+ * @param nodes: Child nodes, sorted by the first component of their label.
+ * 
+ */
+typedef struct ChildMap {
+    atomic_uint seq;
+    atomic_int count;
+    int capacity;
+    _Atomic(struct trienode *) nodes[];
+} ChildMap;
+
 /**
- * @brief Structure representing a node in a trie data structure.
+ * @brief Structure representing a node in the path trie. The trie is a
+ * radix tree keyed on '/'-separated components: a node's label holds one
+ * or more whole components and chains without branches share one node.
+ * Labels never change once a node is in the trie, nodes are replaced instead.
  * 
- * @param children: Array of pointers to child nodes, each corresponding to a character.
- * @param storage_server: Storage server ID for the node.
+ * @param children: Map of child nodes, NULL for a leaf.
+ * @param storage_server: Storage server ID for the node, the primary of its replicas.
+ * @param replicas: Bitmask of the storage servers holding the path, for a
+ *                  directory those holding anything below it.
+ * @param owner: Arena the node lives in, a storage server ID or SHARED_ARENA.
  * @param isFile: Boolean indicating whether the node represents a file.
  * @param isEndOfWord: Boolean indicating whether the node marks the end of a word (path).
+ * @param label: Components on the edge leading into this node, stored inline.
  * 
  */
 typedef struct trienode{
-    struct trienode *children[NUM_CHARS];
-    int storage_server;
+    _Atomic(ChildMap *) children;
+    atomic_int storage_server;
+    atomic_uint replicas;
+    int owner;
     bool isFile;
-    bool isEndOfWord;
+    atomic_bool isEndOfWord;
+    char label[];
 } trienode;
 
 /**
- * @brief LRU caching for storing recent requests.
+ * @brief Cursor for inserting paths that come in strcmp order. It keeps
+ * the nodes on the route of the previous path, so the next one starts
+ * from the deepest node the two share instead of from the root.
+ * 
+ * @param nodes: Nodes on the route of the previous path, from the top.
+ * @param ends: Length of the previous path up to the end of each node.
+ * @param depth: Number of nodes kept.
+ * @param prev: The previous path.
+ * 
+ */
+typedef struct TrieLoader {
+    trienode* nodes[MAX_PATH_LEN];
+    int ends[MAX_PATH_LEN];
+    int depth;
+    char prev[MAX_PATH_LEN];
+} TrieLoader;
+
+/**
+ * @brief Reader slot for epoch based reclamation, one cache line each.
+ * 
+ * @param epoch: Epoch the reader entered the trie in, 0 when outside.
+ * @param in_use: Whether a thread owns the slot.
+ * 
+ */
+typedef struct EpochSlot {
+    atomic_ulong epoch;
+    atomic_bool in_use;
+    char padding[64 - sizeof(atomic_ulong) - sizeof(atomic_bool)];
+} EpochSlot;
+
+/**
+ * @brief Block of memory that an arena hands out allocations from.
+ * 
+ * @param next: Next block of the same arena (or of the free pool).
+ * @param size: Usable bytes in data.
+ * @param used: Bytes of data already handed out.
+ * @param data: The memory itself.
+ * 
+ */
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaBlock;
+
+/**
+ * @brief Bump allocator for trie nodes. Every storage server gets one, so
+ * all of its paths can be released with one reset.
+ * 
+ * @param head: Block currently being allocated from.
+ * @param tail: Oldest block, kept so a reset can splice the whole chain.
+ * @param large: Oversized blocks holding a single allocation each.
+ * @param reserved_bytes: Bytes held in blocks.
+ * @param live_bytes: Bytes in allocations still in use.
+ * @param garbage_bytes: Bytes in allocations released but not reclaimed.
+ * @param live_nodes: Trie nodes still in use.
+ * @param garbage_nodes: Trie nodes released but not reclaimed.
+ * 
+ */
+typedef struct Arena {
+    ArenaBlock *head;
+    ArenaBlock *tail;
+    ArenaBlock *large;
+    size_t reserved_bytes;
+    size_t live_bytes;
+    size_t garbage_bytes;
+    long live_nodes;
+    long garbage_nodes;
+} Arena;
+
+/**
+ * @brief Blocks of a reset arena, waiting for the readers that might still
+ * be inside them to leave the trie.
+ * 
+ * @param head, tail: Chain of standard blocks.
+ * @param large: Oversized blocks.
+ * @param bytes: Bytes held by all the blocks.
+ * @param epoch: Epoch the blocks were retired in.
+ * @param next: Next entry waiting.
+ * 
+ */
+typedef struct ArenaLimbo {
+    ArenaBlock *head;
+    ArenaBlock *tail;
+    ArenaBlock *large;
+    size_t bytes;
+    unsigned long epoch;
+    struct ArenaLimbo *next;
+} ArenaLimbo;
+
+/**
+ * @brief Memory statistics of the namespace trie, summed over all arenas.
+ * 
+ * @param live_nodes: Trie nodes still in use.
+ * @param garbage_nodes: Trie nodes released but not reclaimed yet.
+ * @param live_bytes: Bytes still in use.
+ * @param garbage_bytes: Bytes released but not reclaimed yet.
+ * @param reserved_bytes: Bytes held by arena blocks.
+ * @param pooled_bytes: Bytes of free blocks waiting to be reused.
+ * @param limbo_bytes: Bytes of reset blocks waiting for readers to leave.
+ * @param resets: Number of arena resets.
+ * @param compactions: Number of arena compactions.
+ * 
+ */
+typedef struct NamespaceStats {
+    long live_nodes;
+    long garbage_nodes;
+    size_t live_bytes;
+    size_t garbage_bytes;
+    size_t reserved_bytes;
+    size_t pooled_bytes;
+    size_t limbo_bytes;
+    long resets;
+    long compactions;
+} NamespaceStats;
+
+/**
+ * @brief One page of a LIST_ALL, collected from the trie before it is sent.
+ * 
+ * @param names: Newline separated paths, in strcmp order.
+ * @param size: Bytes used in names.
+ * @param capacity: Bytes allocated for names.
+ * @param count: Number of paths in names.
+ * @param limit: Most paths the page may hold.
+ * @param more: Whether paths are left after the page.
+ * @param servers: Storage servers, paths of offline ones are left out.
+ * 
+ */
+typedef struct PathList {
+    char *names;
+    size_t size;
+    size_t capacity;
+    int count;
+    int limit;
+    bool more;
+    struct ServerDetails *servers;
+} PathList;
+
+/**
+ * @brief Entry of the path location cache.
  * 
- * @param pathHash: Hash of the accessed path.
+ * @param path: Full path, compared on every hit so hash collisions can't misroute.
+ * @param hash: Hash of the path.
  * @param serverID: Storage server ID.
- * @param rank: Rank of the request.
+ * @param replicas: Bitmask of the storage servers holding the path.
+ * @param next: Next entry in the same bucket (or on the free list), -1 ends the chain.
+ * @param referenced: CLOCK reference bit, set on every hit.
+ * @param used: Whether the entry holds a path.
+ * 
+ */
+typedef struct CacheEntry {
+    char *path;
+    unsigned long long hash;
+    int serverID;
+    unsigned int replicas;
+    int next;
+    bool referenced;
+    bool used;
+} CacheEntry;
+
+/**
+ * @brief One shard of the path location cache, with its own lock.
+ * 
+ * @param lock: Protects everything in the shard.
+ * @param entries: Fixed pool of entries, swept by the CLOCK hand.
+ * @param buckets: Hash buckets, heads of chains of entry indices.
+ * @param capacity: Number of entries.
+ * @param num_buckets: Number of buckets, a power of two.
+ * @param free_head: First unused entry, -1 when the shard is full.
+ * @param hand: Position of the CLOCK hand.
+ * @param size: Number of entries in use.
+ * @param generation: Bumped by every invalidation, so lookups racing with one don't cache stale results.
+ * @param hits, misses, evictions, invalidations: Counters.
+ * 
+ */
+typedef struct CacheShard {
+    pthread_mutex_t lock;
+    CacheEntry *entries;
+    int *buckets;
+    int capacity;
+    int num_buckets;
+    int free_head;
+    int hand;
+    int size;
+    long generation;
+    long hits;
+    long misses;
+    long evictions;
+    long invalidations;
+} CacheShard;
+
+/**
+ * @brief Sharded CLOCK cache of path to storage server lookups.
+ * 
+ * @param shards: The shards, picked by the top bits of the path hash.
+ * 
+ */
+typedef struct LocationCache {
+    CacheShard shards[CACHE_SHARDS];
+} LocationCache;
+
+/**
+ * @brief Counters of the location cache, summed over all shards.
+ * 
+ * @param hits, misses, evictions, invalidations: Counters.
+ * @param size: Paths currently cached.
+ * @param capacity: Paths that can be cached.
+ * 
+ */
+typedef struct CacheStats {
+    long hits;
+    long misses;
+    long evictions;
+    long invalidations;
+    int size;
+    int capacity;
+} CacheStats;
+
+/**
+ * @brief One log record, formatted by the thread that logged it
+ * 
+ * @param time_ns : monotonic time it was logged at, records are written in this order
+ * @param level : its LogLevel
+ * @param error : errno when it was logged, for errors
+ * @param text : the message
  * 
  */
-typedef struct LRU {
-    unsigned long long pathHash;  ///< Hash of the accessed path.
-    int serverID;                 ///< Storage server ID.
-    int rank;                     ///< Rank of athe 
-} LRU;
+typedef struct LogRecord {
+    long long time_ns;
+    int level;
+    int error;
+    char text[LOG_RECORD_TEXT];
+} LogRecord;
+
+/**
+ * @brief Log records of one thread, waiting for the flusher. Only the
+ * owning thread moves head and only the flusher moves tail.
+ * 
+ * @param head : records logged so far
+ * @param tail : records written so far
+ * @param state : LOG_RING_FREE, LOG_RING_OWNED or LOG_RING_ORPHANED
+ * @param dropped : records lost because the ring was full
+ * @param records : the ring itself
+ * 
+ */
+typedef struct LogRing {
+    atomic_uint head;
+    atomic_uint tail;
+    atomic_int state;
+    atomic_long dropped;
+    LogRecord records[LOG_RING_RECORDS];
+} LogRing;
+
+/**
+ * @brief Counters and latency histogram of one request type, updated
+ * with relaxed atomic adds only
+ * 
+ * @param count : requests served
+ * @param errors : those of them that failed
+ * @param total_ns : time spent serving them
+ * @param max_ns : the slowest of them
+ * @param buckets : requests by latency, see utils/stats.c for the bucket bounds
+ * 
+ */
+typedef struct RequestStats {
+    atomic_llong count;
+    atomic_llong errors;
+    atomic_llong total_ns;
+    atomic_llong max_ns;
+    atomic_llong buckets[STATS_BUCKETS];
+} RequestStats;
+
+/**
+ * @brief What the load generator runs
+ * 
+ * @param clients : synthetic clients
+ * @param duration_s : how long the measured run lasts
+ * @param rate : requests per second over all clients, 0 to run closed loop
+ * @param files : files read and written, ranked by popularity
+ * @param zipf_theta : skew of their popularity
+ * @param weights : share of each request type in the mix
+ * @param total_weight : sum of weights
+ * @param size_dist : distribution of the sizes written
+ * @param size_a : its first parameter
+ * @param size_b : its second parameter
+ * @param frame_size : largest data frame of a write
+ * @param read_length : bytes each read asks for at a random offset, 0 for whole files
+ * @param dir : directory the files are created in, ending in '/'
+ * @param keep : leave the files behind after the run
+ * 
+ */
+typedef struct BenchConfig {
+    int clients;
+    int duration_s;
+    double rate;
+    int files;
+    double zipf_theta;
+    int weights[NUM_REQUEST_TYPES];
+    int total_weight;
+    BenchSizeDist size_dist;
+    long size_a;
+    long size_b;
+    size_t frame_size;
+    long read_length;
+    char dir[MAX_ARG_LEN];
+    bool keep;
+} BenchConfig;
+
+/**
+ * @brief A synthetic client of the load generator
+ * 
+ * @param id : client number
+ * @param nmSocket : its connection to the NM
+ * @param rng : state of its random numbers
+ * @param created : files it created for the mix so far
+ * @param deleted : those of them it deleted again, the oldest first
+ * @param bytes_read : bytes read in the measured run
+ * @param bytes_written : bytes written in the measured run
+ * 
+ */
+typedef struct BenchClient {
+    int id;
+    int nmSocket;
+    unsigned long long rng;
+    int created;
+    int deleted;
+    long long bytes_read;
+    long long bytes_written;
+} BenchClient;
+
+/**
+ * @brief Result of a microbenchmark
+ * 
+ * @param name : what was measured
+ * @param ops : operations run
+ * @param ns : time they took
+ * @param allocs : heap allocations they made
+ * @param bytes : bytes those asked for
+ * @param peak_rss_kb : highest resident set size of the process while they ran
+ * 
+ */
+typedef struct MicroResult {
+    char name[MICRO_NAME_LEN];
+    long long ops;
+    long long ns;
+    long long allocs;
+    long long bytes;
+    long peak_rss_kb;
+} MicroResult;
 
 /**
  * @brief Reader-Writer lock to allow concurrent file reading. But only 
@@ -128,4 +937,23 @@ typedef struct rwlock {
     sem_t writeLock;
 } rwlock;
 
+/**
+ * @brief Lock of one file on a storage server, found by the path of the
+ * file, so it is the same lock however the accessible paths are
+ * reordered. It lives as long as some request holds or waits on it.
+ * 
+ * @param path: Path of the file, relative to the storage root.
+ * @param hash: Hash of the path, compared before the path itself.
+ * @param users: Requests holding or waiting on the lock.
+ * @param lock: Reader-writer lock of the file.
+ * @param next: Next lock in the same bucket.
+ */
+typedef struct FileLock {
+    char* path;
+    unsigned long long hash;
+    int users;
+    rwlock lock;
+    struct FileLock* next;
+} FileLock;
+
 #endif // STRUCTS_H
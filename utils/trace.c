@@ -0,0 +1,192 @@
+#include "trace.h"
+#include "logging.h"
+
+#include <fcntl.h>
+#include <sys/syscall.h>
+
+/***************************************************/
+/*        Request spans as Chrome trace events     */
+/***************************************************/
+
+static int trace_fd = -1;                                          // Trace file, -1 while tracing is off
+static int trace_pid = 0;                                          // Process the spans are shown under
+static char trace_process[32];                                     // Name of that process in the viewer
+static char trace_buffer[TRACE_BUFFER_SIZE];                       // Spans not written out yet
+static size_t trace_used = 0;                                      // Bytes in trace_buffer
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;     // Protects trace_buffer
+static atomic_ullong trace_counter;                                // Trace IDs handed out by this process
+static __thread int trace_tid = 0;                                 // Thread the spans are shown under
+
+/**
+ * @brief Time of a span boundary in us. Wall clock, so the spans of
+ * different processes on the machine line up.
+ */
+long long traceClock() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * @brief A trace ID for a new request, unique across processes with high
+ * probability: a mix of the time, the process and a counter.
+ */
+unsigned long long newTraceID() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    unsigned long long x = ((unsigned long long) now.tv_sec * 1000000000 + now.tv_nsec) ^
+                           ((unsigned long long) getpid() << 40) ^
+                           atomic_fetch_add_explicit(&trace_counter, 1, memory_order_relaxed);
+
+    // splitmix64 finalizer
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return (x != 0) ? x : 1;
+}
+
+/**
+ * @brief Writes out the spans gathered so far. The caller holds trace_lock.
+ * The file is opened to append, so the one write of a flush never
+ * interleaves with those of other processes.
+ */
+static void flush_spans() {
+    size_t written = 0;
+    while (written < trace_used) {
+        ssize_t n = write(trace_fd, trace_buffer + written, trace_used - written);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        written += n;
+    }
+    trace_used = 0;
+}
+
+static void flush_trace() {
+    pthread_mutex_lock(&trace_lock);
+        flush_spans();
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void* trace_flusher(void* arg) {
+    while (1) {
+        usleep(TRACE_FLUSH_INTERVAL_MS * 1000);
+        flush_trace();
+    }
+    return NULL;
+}
+
+/**
+ * @brief Adds one event to the buffer, writing the buffer out first if it
+ * would not fit.
+ */
+static void add_event(const char* event, int len) {
+    if (len <= 0 || len > TRACE_BUFFER_SIZE) {
+        return;
+    }
+    pthread_mutex_lock(&trace_lock);
+        if (trace_used + len > TRACE_BUFFER_SIZE) {
+            flush_spans();
+        }
+        memcpy(trace_buffer + trace_used, event, len);
+        trace_used += len;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/**
+ * @brief Turns tracing on if TRACE_FILE_ENV names a trace file. Every
+ * process appends its spans to the same file, the first one to create it
+ * opens the JSON array. Viewers accept the array without its closing
+ * bracket, so the processes never have to agree on who closes it.
+ *
+ * @param process : Name the spans of this process are shown under.
+ */
+void initTracing(const char* process) {
+    const char* file = getenv(TRACE_FILE_ENV);
+    if (file == NULL || file[0] == '\0') {
+        return;
+    }
+
+    bool created = true;
+    int fd = open(file, O_WRONLY | O_APPEND | O_CREAT | O_EXCL, 0644);
+    if (fd < 0 && errno == EEXIST) {
+        created = false;
+        fd = open(file, O_WRONLY | O_APPEND);
+    }
+    if (fd < 0) {
+        LOG("Error opening the trace file", false);
+        return;
+    }
+    if (created && write(fd, "[\n", 2) != 2) {
+        LOG("Error writing the trace file", false);
+    }
+
+    trace_fd = fd;
+    trace_pid = getpid();
+    snprintf(trace_process, sizeof(trace_process), "%s", process);
+
+    char event[TRACE_SPAN_LEN];
+    int len = snprintf(event, sizeof(event), "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}},\n",
+                       trace_pid, trace_process);
+    add_event(event, len);
+
+    pthread_t flusherThreadId;
+    if (pthread_create(&flusherThreadId, NULL, trace_flusher, NULL) == 0) {
+        pthread_detach(flusherThreadId);
+    }
+    atexit(flush_trace);
+}
+
+/**
+ * @brief Formats a flow event of a request, on the calling thread.
+ *
+ * @return Its length, 0 if it did not fit in TRACE_SPAN_LEN.
+ */
+static int trace_flow(char* event, const char* phase, unsigned long long traceID, long long ts) {
+    int len = snprintf(event, TRACE_SPAN_LEN,
+                       "{\"name\":\"request\",\"cat\":\"trace\",\"ph\":\"%s\",\"bp\":\"e\",\"id\":\"0x%llx\",\"ts\":%lld,\"pid\":%d,\"tid\":%d},\n",
+                       phase, traceID, ts, trace_pid, trace_tid);
+    return (len > 0 && len < TRACE_SPAN_LEN) ? len : 0;
+}
+
+/**
+ * @brief Traces one stage of a request: a complete event, tagged with the
+ * request's trace ID. The span a process serves a request in also carries
+ * a flow event, which the viewer draws as an arrow from the client's span
+ * through every process the request went through and back.
+ *
+ * @param traceID : Trace ID of the request.
+ * @param name : The stage, a string literal.
+ * @param start_us : traceClock when it started.
+ * @param end_us : traceClock when it ended.
+ * @param flow : How the span takes part in the flow of the request.
+ */
+void traceSpan(unsigned long long traceID, const char* name, long long start_us, long long end_us, TraceFlow flow) {
+    if (trace_fd < 0) {
+        return;
+    }
+    if (trace_tid == 0) {
+        trace_tid = (int) syscall(SYS_gettid);
+    }
+
+    char event[3 * TRACE_SPAN_LEN];
+    int len = snprintf(event, TRACE_SPAN_LEN,
+                       "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%d,\"args\":{\"trace\":\"%016llx\"}},\n",
+                       name, trace_process, start_us, end_us - start_us, trace_pid, trace_tid, traceID);
+    if (len <= 0 || len >= TRACE_SPAN_LEN) {
+        return;
+    }
+
+    // A flow event binds to the span around it, so it has to lie inside
+    if (flow == TRACE_FLOW_ORIGIN) {
+        len += trace_flow(event + len, "s", traceID, start_us);
+        len += trace_flow(event + len, "f", traceID, (end_us > start_us) ? end_us - 1 : start_us);
+    } else if (flow == TRACE_FLOW_STEP) {
+        len += trace_flow(event + len, "t", traceID, start_us);
+    }
+    add_event(event, len);
+}
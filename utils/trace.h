@@ -0,0 +1,15 @@
+// trace.h
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "headers.h"
+#include "constants.h"
+#include "structs.h"
+
+// Spans of the requests, written as Chrome trace events, see utils/trace.c
+void initTracing(const char* process);
+unsigned long long newTraceID();
+long long traceClock();
+void traceSpan(unsigned long long traceID, const char* name, long long start_us, long long end_us, TraceFlow flow);
+
+#endif // TRACE_H
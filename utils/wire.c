@@ -0,0 +1,675 @@
+#include "wire.h"
+
+#include <limits.h>
+#include <sys/sendfile.h>
+
+/***************************************************/
+/*          Compact encoding of the messages       */
+/***************************************************/
+
+/**
+ * @brief Sends all of buf, looping over short writes. On a non-blocking
+ * socket it waits up to WIRE_SEND_TIMEOUT_MS for a full buffer to drain.
+ *
+ * @param fd : Socket to send on.
+ * @param buf : Bytes to send.
+ * @param len : Number of bytes.
+ *
+ * @return true on success, false on failure
+ */
+bool sendAll(int fd, const void* buf, size_t len) {
+    const char* p = (const char*) buf;
+    while (len > 0) {
+        ssize_t sent = send(fd, p, len, MSG_NOSIGNAL);
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+            if (poll(&pfd, 1, WIRE_SEND_TIMEOUT_MS) <= 0) {
+                return false;
+            }
+            continue;
+        }
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        p += sent;
+        len -= sent;
+    }
+    return true;
+}
+
+/**
+ * @brief Receives exactly len bytes, looping over short reads.
+ *
+ * @param fd : Socket to receive on.
+ * @param buf : Filled with the bytes.
+ * @param len : Number of bytes.
+ *
+ * @return true on success, false on failure or if the peer closed the connection
+ */
+bool recvAll(int fd, void* buf, size_t len) {
+    char* p = (char*) buf;
+    while (len > 0) {
+        ssize_t got = recv(fd, p, len, 0);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        p += got;
+        len -= got;
+    }
+    return true;
+}
+
+static void put_bytes(WireBuffer* buf, const void* bytes, size_t len) {
+    if (buf->failed) {
+        return;
+    }
+    if (buf->size + len > buf->capacity) {
+        size_t capacity = (buf->capacity == 0) ? 256 : buf->capacity;
+        while (capacity < buf->size + len) {
+            capacity *= 2;
+        }
+        unsigned char* data = (unsigned char*) realloc(buf->data, capacity);
+        if (data == NULL) {
+            buf->failed = true;
+            return;
+        }
+        buf->data = data;
+        buf->capacity = capacity;
+    }
+    memcpy(buf->data + buf->size, bytes, len);
+    buf->size += len;
+}
+
+/**
+ * @brief Appends bytes to a buffer, growing it as needed. A buffer that
+ * could not grow is marked failed and takes nothing more.
+ *
+ * @param buf : The buffer.
+ * @param bytes : Bytes to append.
+ * @param len : Number of bytes.
+ */
+void appendBytes(WireBuffer* buf, const void* bytes, size_t len) {
+    put_bytes(buf, bytes, len);
+}
+
+/**
+ * @brief Appends an unsigned integer as a LEB128 varint, 7 bits per byte.
+ */
+static void put_varint(WireBuffer* buf, uint64_t value) {
+    unsigned char bytes[10];
+    int len = 0;
+    do {
+        bytes[len] = value & 0x7f;
+        value >>= 7;
+        if (value != 0) {
+            bytes[len] |= 0x80;
+        }
+        len++;
+    } while (value != 0);
+    put_bytes(buf, bytes, len);
+}
+
+/**
+ * @brief Appends a string as its length followed by its bytes.
+ */
+static void put_string(WireBuffer* buf, const char* str, size_t max) {
+    size_t len = strnlen(str, max);
+    put_varint(buf, len);
+    put_bytes(buf, str, len);
+}
+
+/**
+ * @brief Reads a varint, failing past the end of the payload.
+ */
+static bool get_varint(const unsigned char** p, const unsigned char* end, uint64_t* value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (*p == end) {
+            return false;
+        }
+        unsigned char byte = *(*p)++;
+        *value |= (uint64_t) (byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Reads a string into a buffer of max bytes (terminator included).
+ */
+static bool get_string(const unsigned char** p, const unsigned char* end, char* str, size_t max) {
+    uint64_t len;
+    if (!get_varint(p, end, &len) || len >= max || len > (uint64_t) (end - *p)) {
+        return false;
+    }
+    memcpy(str, *p, len);
+    str[len] = '\0';
+    *p += len;
+    return true;
+}
+
+/**
+ * @brief Sends a message: version, type and payload length, then the payload.
+ */
+static bool send_message(int fd, WireType type, WireBuffer* payload) {
+    if (payload->failed) {
+        return false;
+    }
+
+    unsigned char header[WIRE_HEADER_SIZE];
+    uint32_t len = htonl((uint32_t) payload->size);
+    header[0] = WIRE_VERSION;
+    header[1] = type;
+    memcpy(header + 2, &len, sizeof(len));
+
+    return sendAll(fd, header, WIRE_HEADER_SIZE) && sendAll(fd, payload->data, payload->size);
+}
+
+/**
+ * @brief Appends a message, header and payload, to a buffer.
+ */
+static void put_message(WireBuffer* out, WireType type, WireBuffer* payload) {
+    if (payload->failed) {
+        out->failed = true;
+        return;
+    }
+
+    unsigned char header[WIRE_HEADER_SIZE];
+    uint32_t len = htonl((uint32_t) payload->size);
+    header[0] = WIRE_VERSION;
+    header[1] = type;
+    memcpy(header + 2, &len, sizeof(len));
+
+    put_bytes(out, header, WIRE_HEADER_SIZE);
+    put_bytes(out, payload->data, payload->size);
+}
+
+/**
+ * @brief Receives a message of the given type.
+ *
+ * @return The payload (to be freed by the caller), NULL on failure.
+ */
+static unsigned char* recv_message(int fd, WireType type, size_t* size) {
+    unsigned char header[WIRE_HEADER_SIZE];
+    if (!recvAll(fd, header, WIRE_HEADER_SIZE)) {
+        return NULL;
+    }
+
+    uint32_t len;
+    memcpy(&len, header + 2, sizeof(len));
+    len = ntohl(len);
+    if (header[0] != WIRE_VERSION || header[1] != type || len > sizeof(ServerDetails)) {
+        return NULL;
+    }
+
+    unsigned char* payload = (unsigned char*) malloc((len == 0) ? 1 : len);
+    if (payload == NULL || !recvAll(fd, payload, len)) {
+        free(payload);
+        return NULL;
+    }
+    *size = len;
+    return payload;
+}
+
+static int compare_paths(const void* a, const void* b) {
+    return strcmp(*(const char* const*) a, *(const char* const*) b);
+}
+
+/**
+ * @brief Sends the details of a storage server. Only the paths in use are
+ * sent, sorted and front-coded: each one as the number of leading bytes it
+ * shares with the previous one, followed by the rest. Sibling paths of a
+ * deep directory then cost little more than their file names.
+ *
+ * @param fd : Socket to send on.
+ * @param details : The server details.
+ *
+ * @return true on success, false on failure
+ */
+bool sendServerDetails(int fd, const ServerDetails* details) {
+    int num_paths = (details->num_paths < 0) ? 0 : (details->num_paths > MAX_PATHS) ? MAX_PATHS : details->num_paths;
+
+    const char** paths = (const char**) malloc((num_paths + 1) * sizeof(char*));
+    if (paths == NULL) {
+        return false;
+    }
+    for (int i = 0; i < num_paths; i++) {
+        paths[i] = details->accessible_paths[i];
+    }
+    qsort(paths, num_paths, sizeof(char*), compare_paths);
+
+    WireBuffer buf = {0};
+    put_varint(&buf, (uint32_t) details->serverID);
+    put_string(&buf, details->serverIP, IP_LEN - 1);
+    put_varint(&buf, details->port_nm);
+    put_varint(&buf, details->port_client);
+    put_varint(&buf, details->online);
+    put_varint(&buf, details->seq);
+    put_varint(&buf, num_paths);
+
+    const char* prev = "";
+    for (int i = 0; i < num_paths; i++) {
+        size_t len = strnlen(paths[i], MAX_PATH_LEN - 1);
+        size_t shared = 0;
+        while (shared < len && prev[shared] == paths[i][shared]) {
+            shared++;
+        }
+        put_varint(&buf, shared);
+        put_varint(&buf, len - shared);
+        put_bytes(&buf, paths[i] + shared, len - shared);
+        prev = paths[i];
+    }
+    free(paths);
+
+    bool sent = send_message(fd, WIRE_SERVER_DETAILS, &buf);
+    free(buf.data);
+    return sent;
+}
+
+/**
+ * @brief Receives the details of a storage server sent by sendServerDetails.
+ *
+ * @param fd : Socket to receive on.
+ * @param details : Filled with the server details.
+ *
+ * @return true on success, false on failure or a malformed message
+ */
+bool recvServerDetails(int fd, ServerDetails* details) {
+    size_t size;
+    unsigned char* payload = recv_message(fd, WIRE_SERVER_DETAILS, &size);
+    if (payload == NULL) {
+        return false;
+    }
+
+    const unsigned char* p = payload;
+    const unsigned char* end = payload + size;
+    uint64_t serverID, port_nm, port_client, online, seq, num_paths;
+    bool ok = get_varint(&p, end, &serverID) &&
+              get_string(&p, end, details->serverIP, IP_LEN) &&
+              get_varint(&p, end, &port_nm) &&
+              get_varint(&p, end, &port_client) &&
+              get_varint(&p, end, &online) &&
+              get_varint(&p, end, &seq) &&
+              get_varint(&p, end, &num_paths) &&
+              num_paths <= MAX_PATHS;
+
+    details->serverID = (int) (uint32_t) serverID;
+    details->port_nm = (int) port_nm;
+    details->port_client = (int) port_client;
+    details->online = (online != 0);
+    details->seq = (long) seq;
+    details->num_paths = 0;
+
+    for (uint64_t i = 0; ok && i < num_paths; i++) {
+        uint64_t shared, len;
+        size_t prev_len = (i == 0) ? 0 : strlen(details->accessible_paths[i - 1]);
+        ok = get_varint(&p, end, &shared) && get_varint(&p, end, &len) &&
+             shared <= prev_len && shared + len < MAX_PATH_LEN && len <= (uint64_t) (end - p);
+        if (ok) {
+            char* path = details->accessible_paths[i];
+            if (i > 0) {
+                memcpy(path, details->accessible_paths[i - 1], shared);
+            }
+            memcpy(path + shared, p, len);
+            path[shared + len] = '\0';
+            p += len;
+            details->num_paths++;
+        }
+    }
+
+    free(payload);
+    return ok;
+}
+
+/**
+ * @brief Appends only what a client needs to reach a storage server to
+ * a reply.
+ *
+ * @param reply : Reply the message is added to.
+ * @param details : The server details.
+ * @param lease_id : Lease granted on the path, -1 for none.
+ * @param lease_ms : Duration of the lease.
+ * @param chain : Live replicas of the path, head first.
+ * @param chain_len : Number of replicas in chain.
+ *
+ * @return false if the reply could not grow
+ */
+bool appendServerEndpoint(WireBuffer* reply, const ServerDetails* details, int lease_id, int lease_ms, const ChainHop* chain, int chain_len) {
+    WireBuffer buf = {0};
+    put_varint(&buf, (uint32_t) details->serverID);
+    put_string(&buf, details->serverIP, IP_LEN - 1);
+    put_varint(&buf, details->port_client);
+    put_varint(&buf, details->online);
+    put_varint(&buf, (uint32_t) lease_id);
+    put_varint(&buf, (lease_id < 0) ? 0 : lease_ms);
+    put_varint(&buf, chain_len);
+    for (int i = 0; i < chain_len; i++) {
+        put_string(&buf, chain[i].serverIP, IP_LEN - 1);
+        put_varint(&buf, chain[i].port_client);
+    }
+
+    put_message(reply, WIRE_SERVER_ENDPOINT, &buf);
+    free(buf.data);
+    return !reply->failed;
+}
+
+/**
+ * @brief Receives the endpoint added by appendServerEndpoint.
+ *
+ * @param fd : Socket to receive on.
+ * @param endpoint : Filled with the endpoint.
+ *
+ * @return true on success, false on failure or a malformed message
+ */
+bool recvServerEndpoint(int fd, ServerEndpoint* endpoint) {
+    size_t size;
+    unsigned char* payload = recv_message(fd, WIRE_SERVER_ENDPOINT, &size);
+    if (payload == NULL) {
+        return false;
+    }
+
+    const unsigned char* p = payload;
+    const unsigned char* end = payload + size;
+    uint64_t serverID, port_client, online, lease_id, lease_ms, chain_len;
+    bool ok = get_varint(&p, end, &serverID) &&
+              get_string(&p, end, endpoint->serverIP, IP_LEN) &&
+              get_varint(&p, end, &port_client) &&
+              get_varint(&p, end, &online) &&
+              get_varint(&p, end, &lease_id) &&
+              get_varint(&p, end, &lease_ms) &&
+              get_varint(&p, end, &chain_len) &&
+              chain_len <= MAX_SERVERS;
+
+    endpoint->chain_len = ok ? (int) chain_len : 0;
+    for (int i = 0; ok && i < endpoint->chain_len; i++) {
+        uint64_t port;
+        ok = get_string(&p, end, endpoint->chain[i].serverIP, IP_LEN) &&
+             get_varint(&p, end, &port);
+        endpoint->chain[i].port_client = (int) port;
+    }
+
+    endpoint->serverID = (int) (uint32_t) serverID;
+    endpoint->port_client = (int) port_client;
+    endpoint->online = (online != 0);
+    endpoint->lease_id = (int) (uint32_t) lease_id;
+    endpoint->lease_ms = (int) lease_ms;
+
+    free(payload);
+    return ok;
+}
+
+/**
+ * @brief Fingerprint of the set of paths of a storage server: the sum of
+ * the hash_path of every path. The sum does not depend on the order of
+ * the paths, so the NM can compute the same value from its trie.
+ *
+ * @param details : The server details.
+ *
+ * @return The fingerprint.
+ */
+unsigned long long pathsFingerprint(const ServerDetails* details) {
+    unsigned long long fingerprint = 0;
+    for (int i = 0; i < details->num_paths && i < MAX_PATHS; i++) {
+        fingerprint += hash_path(details->accessible_paths[i]);
+    }
+    return fingerprint;
+}
+
+/**
+ * @brief Sends the details of a storage server without its paths, only
+ * how many there are and their fingerprint. A NM that recovered the
+ * paths from its journal can confirm them from this alone.
+ *
+ * @param fd : Socket to send on.
+ * @param details : The server details.
+ *
+ * @return true on success, false on failure
+ */
+bool sendServerHello(int fd, const ServerDetails* details) {
+    WireBuffer buf = {0};
+    put_varint(&buf, (uint32_t) details->serverID);
+    put_string(&buf, details->serverIP, IP_LEN - 1);
+    put_varint(&buf, details->port_nm);
+    put_varint(&buf, details->port_client);
+    put_varint(&buf, details->seq);
+    put_varint(&buf, details->num_paths);
+    put_varint(&buf, pathsFingerprint(details));
+
+    bool sent = send_message(fd, WIRE_SERVER_HELLO, &buf);
+    free(buf.data);
+    return sent;
+}
+
+/**
+ * @brief Receives the hello sent by sendServerHello.
+ *
+ * @param fd : Socket to receive on.
+ * @param details : Filled with the server details, without paths.
+ * @param fingerprint : Set to the fingerprint of the server's paths.
+ *
+ * @return true on success, false on failure or a malformed message
+ */
+bool recvServerHello(int fd, ServerDetails* details, unsigned long long* fingerprint) {
+    size_t size;
+    unsigned char* payload = recv_message(fd, WIRE_SERVER_HELLO, &size);
+    if (payload == NULL) {
+        return false;
+    }
+
+    const unsigned char* p = payload;
+    const unsigned char* end = payload + size;
+    uint64_t serverID, port_nm, port_client, seq, num_paths, sum;
+    bool ok = get_varint(&p, end, &serverID) &&
+              get_string(&p, end, details->serverIP, IP_LEN) &&
+              get_varint(&p, end, &port_nm) &&
+              get_varint(&p, end, &port_client) &&
+              get_varint(&p, end, &seq) &&
+              get_varint(&p, end, &num_paths) &&
+              get_varint(&p, end, &sum) &&
+              num_paths <= MAX_PATHS;
+
+    details->serverID = (int) (uint32_t) serverID;
+    details->port_nm = (int) port_nm;
+    details->port_client = (int) port_client;
+    details->online = true;
+    details->seq = (long) seq;
+    details->num_paths = (int) num_paths;
+    *fingerprint = sum;
+
+    free(payload);
+    return ok;
+}
+
+/**
+ * @brief Sends the size of a file, ahead of its bytes.
+ *
+ * @param fd : Socket to send on.
+ * @param size : Size of the file in bytes, -1 if it could not be opened.
+ *
+ * @return true on success, false on failure
+ */
+bool sendFileHeader(int fd, long long size) {
+    WireBuffer buf = {0};
+    put_varint(&buf, size >= 0);
+    put_varint(&buf, (size >= 0) ? (uint64_t) size : 0);
+
+    bool sent = send_message(fd, WIRE_FILE_HEADER, &buf);
+    free(buf.data);
+    return sent;
+}
+
+/**
+ * @brief Receives the size sent by sendFileHeader.
+ *
+ * @param fd : Socket to receive on.
+ * @param size : Filled with the size, -1 if the file could not be opened.
+ *
+ * @return true on success, false on failure or a malformed message
+ */
+bool recvFileHeader(int fd, long long* size) {
+    size_t len;
+    unsigned char* payload = recv_message(fd, WIRE_FILE_HEADER, &len);
+    if (payload == NULL) {
+        return false;
+    }
+
+    const unsigned char* p = payload;
+    const unsigned char* end = payload + len;
+    uint64_t found, bytes;
+    bool ok = get_varint(&p, end, &found) &&
+              get_varint(&p, end, &bytes) &&
+              bytes <= (uint64_t) LLONG_MAX;
+    *size = found ? (long long) bytes : -1;
+
+    free(payload);
+    return ok;
+}
+
+/**
+ * @brief Sends size bytes of an open file with sendfile, from the page
+ * cache straight to the socket. On a non-blocking socket it waits up to
+ * WIRE_SEND_TIMEOUT_MS for a full buffer to drain.
+ *
+ * @param fd : Socket to send on.
+ * @param file : File to send. Its own offset is left as it is.
+ * @param offset : First byte of the file to send.
+ * @param size : Number of bytes.
+ *
+ * @return true on success, false on failure or if the file is shorter
+ */
+bool sendFileData(int fd, int file, long long offset, long long size) {
+    off_t pos = (off_t) offset;
+    while (size > 0) {
+        ssize_t sent = sendfile(fd, file, &pos, (size > SSIZE_MAX) ? SSIZE_MAX : (size_t) size);
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+            if (poll(&pfd, 1, WIRE_SEND_TIMEOUT_MS) <= 0) {
+                return false;
+            }
+            continue;
+        }
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        size -= sent;
+    }
+    return true;
+}
+
+/**
+ * @brief Receives size bytes of a file.
+ *
+ * @param fd : Socket to receive on.
+ * @param size : Number of bytes, from the header of the file.
+ * @param out : Stream the bytes are written to, NULL to drop them.
+ *
+ * @return true on success, false on failure or if the peer closed the connection
+ */
+bool recvFileData(int fd, long long size, FILE* out) {
+    char* buf = (char*) malloc(FILE_RECV_BUFFER_SIZE);
+    if (buf == NULL) {
+        return false;
+    }
+
+    bool ok = true;
+    while (ok && size > 0) {
+        size_t want = (size < FILE_RECV_BUFFER_SIZE) ? (size_t) size : FILE_RECV_BUFFER_SIZE;
+        ssize_t got = recv(fd, buf, want, 0);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        ok = (got > 0) && (out == NULL || fwrite(buf, 1, got, out) == (size_t) got);
+        size -= got;
+    }
+
+    free(buf);
+    return ok;
+}
+
+/**
+ * @brief Starts a stream of data frames by announcing the largest frame
+ * the sender will use, so the receiver can size its buffer once.
+ *
+ * @param fd : Socket to send on.
+ * @param frame_size : Largest frame, between DATA_FRAME_MIN_SIZE and DATA_FRAME_MAX_SIZE.
+ *
+ * @return true on success, false on failure
+ */
+bool sendDataStart(int fd, size_t frame_size) {
+    WireBuffer buf = {0};
+    put_varint(&buf, frame_size);
+
+    bool sent = send_message(fd, WIRE_DATA_STREAM, &buf);
+    free(buf.data);
+    return sent;
+}
+
+/**
+ * @brief Receives the start of a stream sent by sendDataStart.
+ *
+ * @param fd : Socket to receive on.
+ * @param frame_size : Filled with the largest frame of the stream.
+ *
+ * @return true on success, false on failure or a frame size out of range
+ */
+bool recvDataStart(int fd, size_t* frame_size) {
+    size_t len;
+    unsigned char* payload = recv_message(fd, WIRE_DATA_STREAM, &len);
+    if (payload == NULL) {
+        return false;
+    }
+
+    const unsigned char* p = payload;
+    uint64_t size;
+    bool ok = get_varint(&p, payload + len, &size) &&
+              size >= DATA_FRAME_MIN_SIZE && size <= DATA_FRAME_MAX_SIZE;
+    *frame_size = (size_t) size;
+
+    free(payload);
+    return ok;
+}
+
+/**
+ * @brief Sends a data frame: its 32-bit length, then its bytes. A frame of
+ * length 0 ends the stream.
+ *
+ * @param fd : Socket to send on.
+ * @param buf : Bytes of the frame, any content.
+ * @param len : Number of bytes, at most the announced frame size.
+ *
+ * @return true on success, false on failure
+ */
+bool sendDataFrame(int fd, const void* buf, size_t len) {
+    uint32_t header = htonl((uint32_t) len);
+    return sendAll(fd, &header, sizeof(header)) && sendAll(fd, buf, len);
+}
+
+/**
+ * @brief Receives a data frame sent by sendDataFrame.
+ *
+ * @param fd : Socket to receive on.
+ * @param buf : Filled with the bytes of the frame, frame_size bytes long.
+ * @param frame_size : Largest frame of the stream.
+ * @param len : Filled with the length of the frame, 0 at the end of the stream.
+ *
+ * @return true on success, false on failure or a frame larger than frame_size
+ */
+bool recvDataFrame(int fd, void* buf, size_t frame_size, size_t* len) {
+    uint32_t header;
+    if (!recvAll(fd, &header, sizeof(header))) {
+        return false;
+    }
+    *len = ntohl(header);
+    return *len <= frame_size && recvAll(fd, buf, *len);
+}
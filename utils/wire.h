@@ -0,0 +1,42 @@
+// wire.h
+#ifndef WIRE_H
+#define WIRE_H
+
+#include "headers.h"
+#include "constants.h"
+#include "structs.h"
+#include "hash.h"
+
+// Send and receive exactly len bytes
+bool sendAll(int fd, const void* buf, size_t len);
+bool recvAll(int fd, void* buf, size_t len);
+
+// Versioned, length-prefixed encoding of ServerDetails
+bool sendServerDetails(int fd, const ServerDetails* details);
+bool recvServerDetails(int fd, ServerDetails* details);
+
+// Registration without the paths, and the fingerprint it carries
+unsigned long long pathsFingerprint(const ServerDetails* details);
+bool sendServerHello(int fd, const ServerDetails* details);
+bool recvServerHello(int fd, ServerDetails* details, unsigned long long* fingerprint);
+
+// Replies put together in a buffer before they are sent
+void appendBytes(WireBuffer* buf, const void* bytes, size_t len);
+
+// Endpoint-only reply for client redirects
+bool appendServerEndpoint(WireBuffer* reply, const ServerDetails* details, int lease_id, int lease_ms, const ChainHop* chain, int chain_len);
+bool recvServerEndpoint(int fd, ServerEndpoint* endpoint);
+
+// Size of a file ahead of its bytes, and the bytes themselves
+bool sendFileHeader(int fd, long long size);
+bool recvFileHeader(int fd, long long* size);
+bool sendFileData(int fd, int file, long long offset, long long size);
+bool recvFileData(int fd, long long size, FILE* out);
+
+// Data sent as length-prefixed frames, after the frame size is announced
+bool sendDataStart(int fd, size_t frame_size);
+bool recvDataStart(int fd, size_t* frame_size);
+bool sendDataFrame(int fd, const void* buf, size_t len);
+bool recvDataFrame(int fd, void* buf, size_t frame_size, size_t* len);
+
+#endif // WIRE_H